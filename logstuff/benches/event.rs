@@ -0,0 +1,103 @@
+use criterion::{black_box, criterion_group, criterion_main, BatchSize, Criterion, Throughput};
+use serde_json::json;
+use time::macros::datetime;
+use time::Duration;
+
+use logstuff::event::{Event, RsyslogdEvent};
+use logstuff::synthetic::Generator;
+
+const EVENTS: usize = 1000;
+
+fn lines() -> Vec<String> {
+    Generator::new(42, datetime!(2021-10-21 10:00 UTC), Duration::seconds(1))
+        .take(EVENTS)
+        .collect()
+}
+
+fn events(lines: &[String]) -> Vec<Event> {
+    lines
+        .iter()
+        .map(|line| Event::from(serde_json::from_str::<RsyslogdEvent>(line).unwrap()))
+        .collect()
+}
+
+pub fn import_events(c: &mut Criterion) {
+    let lines = lines();
+    let mut group = c.benchmark_group("import");
+    group.throughput(Throughput::Elements(EVENTS as u64));
+    group.bench_function("deserialize_rsyslogd_event", |b| {
+        b.iter(|| {
+            for line in &lines {
+                black_box(serde_json::from_str::<RsyslogdEvent>(black_box(line)).unwrap());
+            }
+        })
+    });
+    group.bench_function("event_from_rsyslogd_event", |b| {
+        b.iter_batched(
+            || {
+                lines
+                    .iter()
+                    .map(|line| serde_json::from_str::<RsyslogdEvent>(line).unwrap())
+                    .collect::<Vec<_>>()
+            },
+            |parsed| {
+                for event in parsed {
+                    black_box(Event::from(event));
+                }
+            },
+            BatchSize::SmallInput,
+        )
+    });
+    group.bench_function("search_string", |b| {
+        let events = events(&lines);
+        let mut search = String::new();
+        b.iter(|| {
+            for event in &events {
+                search.clear();
+                event.search_string_into(&mut search);
+                black_box(&search);
+            }
+        })
+    });
+    group.finish();
+}
+
+pub fn printable_fields(c: &mut Criterion) {
+    let lines = lines();
+    let events = events(&lines);
+    let mut group = c.benchmark_group("printable");
+    group.throughput(Throughput::Elements(EVENTS as u64));
+    for field in ["hostname", "syslogseverity", "vars.http.status"] {
+        group.bench_function(field, |b| {
+            b.iter(|| {
+                for event in &events {
+                    black_box(event.get_printable(black_box(field)));
+                }
+            })
+        });
+    }
+    group.finish();
+
+    // documents stored before variables were flattened on import still nest them, printing those
+    // flattens them on the fly (flatten_value)
+    let event = Event {
+        timestamp: datetime!(2021-10-21 10:00 UTC),
+        doc: json!({
+            "vars": {
+                "http": {
+                    "method": "GET",
+                    "path": "/api/v1/items",
+                    "status": 200,
+                    "client": {"ip": "10.1.2.3", "agent": "curl/7.79.1"},
+                },
+                "tags": ["web", "frontend"],
+            }
+        }),
+    };
+    c.bench_function("printable/nested_vars", |b| {
+        b.iter(|| black_box(event.get_printable(black_box("vars"))))
+    });
+}
+
+criterion_group!(benches, import_events, printable_fields);
+criterion_main!(benches);
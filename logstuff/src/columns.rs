@@ -0,0 +1,277 @@
+//! Event fields stored in dedicated table columns besides the JSON document
+//!
+//! stuffimport extracts the configured fields into typed columns of the root table. Queries on
+//! these fields use the columns instead of looking into `doc`, which allows plain comparisons
+//! and indexes.
+use serde_derive::{Deserialize, Serialize};
+use serde_json::Value;
+use std::convert::TryFrom;
+use std::fmt;
+
+/// Columns of the root table itself (see schema.sql), promoted columns can't use their names
+pub const TABLE_COLUMNS: [&str; 4] = ["id", "tstamp", "doc", "search"];
+
+/// Longest identifier postgres keeps, longer ones are truncated
+const MAX_NAME_LEN: usize = 63;
+
+#[derive(Clone, Copy, Debug, Deserialize, Serialize, PartialEq)]
+#[serde(rename_all = "lowercase")]
+pub enum ColumnType {
+    Smallint,
+    Integer,
+    Bigint,
+    Double,
+    Text,
+}
+
+impl ColumnType {
+    pub fn sql_type(&self) -> &'static str {
+        match self {
+            ColumnType::Smallint => "smallint",
+            ColumnType::Integer => "integer",
+            ColumnType::Bigint => "bigint",
+            ColumnType::Double => "double precision",
+            ColumnType::Text => "text",
+        }
+    }
+
+    pub fn is_numeric(&self) -> bool {
+        *self != ColumnType::Text
+    }
+}
+
+/// A promoted event field
+#[derive(Clone, Debug, Deserialize, Serialize)]
+#[serde(deny_unknown_fields)]
+pub struct Column {
+    /// Name of the field within events (logstuff query identifier), e.g. `vars.duration`
+    pub field: String,
+
+    #[serde(rename = "type")]
+    pub kind: ColumnType,
+
+    /// Name of the table column, defaults to the field name with non-alphanumeric characters
+    /// replaced by `_`
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub name: Option<String>,
+
+    /// Create an index on this column (default false)
+    #[serde(default)]
+    pub index: bool,
+}
+
+/// Value of a promoted field, `None` if an event does not have it or it does not fit the column
+#[derive(Debug, PartialEq)]
+pub enum ColumnValue {
+    Smallint(Option<i16>),
+    Integer(Option<i32>),
+    Bigint(Option<i64>),
+    Double(Option<f64>),
+    Text(Option<String>),
+}
+
+/// Promoted column settings that would not get a column of their own
+#[derive(Debug)]
+pub struct InvalidColumn(String);
+
+impl fmt::Display for InvalidColumn {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        write!(f, "invalid promoted column: {}", self.0)
+    }
+}
+
+impl std::error::Error for InvalidColumn {}
+
+/// Check that the columns' names are plain SQL identifiers (`[a-z_][a-z0-9_]*`, they are not
+/// quoted), distinct and none of the root table's own columns
+///
+/// `alter table ... add column if not exists` silently keeps an existing column, stuffimport
+/// would then write into a column of another type or meaning.
+pub fn check(columns: &[Column]) -> Result<(), InvalidColumn> {
+    let mut names = Vec::with_capacity(columns.len());
+    for column in columns {
+        let name = column.column_name();
+        let mut chars = name.chars();
+        let plain = chars
+            .next()
+            .map_or(false, |c| c.is_ascii_lowercase() || c == '_')
+            && chars.all(|c| c.is_ascii_lowercase() || c.is_ascii_digit() || c == '_');
+        if !plain || name.len() > MAX_NAME_LEN {
+            return Err(InvalidColumn(format!(
+                "{:?} of field {} is no lowercase SQL identifier",
+                name, column.field
+            )));
+        }
+        if TABLE_COLUMNS.contains(&name.as_str()) || names.contains(&name) {
+            return Err(InvalidColumn(format!(
+                "{} of field {} is taken",
+                name, column.field
+            )));
+        }
+        names.push(name);
+    }
+    Ok(())
+}
+
+fn integer(value: &Value) -> Option<i64> {
+    match value {
+        Value::Number(number) => number.as_i64().or_else(|| {
+            number
+                .as_f64()
+                .filter(|f| f.fract() == 0.0 && i64::MIN as f64 <= *f && *f <= i64::MAX as f64)
+                .map(|f| f as i64)
+        }),
+        Value::String(s) => s.trim().parse().ok(),
+        _ => None,
+    }
+}
+
+fn double(value: &Value) -> Option<f64> {
+    match value {
+        Value::Number(number) => number.as_f64(),
+        Value::String(s) => s.trim().parse().ok(),
+        _ => None,
+    }
+}
+
+/// JSON text in postgres' jsonb output format (`[1, 2]`, `{"a": 1}`), as `->>` returns it for
+/// arrays and objects
+///
+/// jsonb orders object keys by length first, then bytewise.
+pub fn jsonb_text(value: &Value) -> String {
+    match value {
+        Value::Array(values) => format!(
+            "[{}]",
+            values.iter().map(jsonb_text).collect::<Vec<_>>().join(", ")
+        ),
+        Value::Object(map) => {
+            let mut entries: Vec<_> = map.iter().collect();
+            entries.sort_by(|(a, _), (b, _)| a.len().cmp(&b.len()).then_with(|| a.cmp(b)));
+            format!(
+                "{{{}}}",
+                entries
+                    .into_iter()
+                    .map(|(key, value)| format!(
+                        "{}: {}",
+                        Value::from(key.as_str()),
+                        jsonb_text(value)
+                    ))
+                    .collect::<Vec<_>>()
+                    .join(", ")
+            )
+        }
+        other => other.to_string(),
+    }
+}
+
+impl Column {
+    pub fn column_name(&self) -> String {
+        match &self.name {
+            Some(name) => name.to_owned(),
+            None => self
+                .field
+                .chars()
+                .map(|c| {
+                    if c.is_ascii_alphanumeric() {
+                        c.to_ascii_lowercase()
+                    } else {
+                        '_'
+                    }
+                })
+                .collect(),
+        }
+    }
+
+    /// Get this column's value from an event's document
+    ///
+    /// Text columns get the same value as `doc ->> field`, numeric columns take numbers and
+    /// strings containing numbers, like `to_number_or_null` does for comparisons on the document.
+    /// Equalities on promoted fields compare the document, so `= 42` still doesn't match `"42"`.
+    pub fn extract(&self, doc: &Value) -> ColumnValue {
+        let value = doc.get(&self.field).filter(|value| !value.is_null());
+        match self.kind {
+            ColumnType::Smallint => {
+                ColumnValue::Smallint(value.and_then(integer).and_then(|i| i16::try_from(i).ok()))
+            }
+            ColumnType::Integer => {
+                ColumnValue::Integer(value.and_then(integer).and_then(|i| i32::try_from(i).ok()))
+            }
+            ColumnType::Bigint => ColumnValue::Bigint(value.and_then(integer)),
+            ColumnType::Double => ColumnValue::Double(value.and_then(double)),
+            ColumnType::Text => ColumnValue::Text(value.map(|value| match value {
+                Value::String(s) => s.to_owned(),
+                other => jsonb_text(other),
+            })),
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use serde_json::json;
+
+    fn column(field: &str, kind: ColumnType) -> Column {
+        Column {
+            field: field.into(),
+            kind,
+            name: None,
+            index: false,
+        }
+    }
+
+    #[test]
+    fn extract() {
+        let doc = json!({"a": 3, "b": "42", "c": 70000, "d": 2.5, "e": "text", "f": null});
+        let smallint = |field| column(field, ColumnType::Smallint).extract(&doc);
+        assert_eq!(smallint("a"), ColumnValue::Smallint(Some(3)));
+        assert_eq!(smallint("b"), ColumnValue::Smallint(Some(42)));
+        assert_eq!(smallint("c"), ColumnValue::Smallint(None));
+        assert_eq!(smallint("d"), ColumnValue::Smallint(None));
+        assert_eq!(smallint("e"), ColumnValue::Smallint(None));
+        assert_eq!(smallint("missing"), ColumnValue::Smallint(None));
+
+        let double = column("d", ColumnType::Double);
+        assert_eq!(double.extract(&doc), ColumnValue::Double(Some(2.5)));
+        let text = |field| column(field, ColumnType::Text).extract(&doc);
+        assert_eq!(text("e"), ColumnValue::Text(Some("text".into())));
+        assert_eq!(text("a"), ColumnValue::Text(Some("3".into())));
+        assert_eq!(text("f"), ColumnValue::Text(None));
+        let doc = json!({"a": [1, {"bb": true, "c": null}]});
+        assert_eq!(
+            column("a", ColumnType::Text).extract(&doc),
+            ColumnValue::Text(Some(r#"[1, {"c": null, "bb": true}]"#.into()))
+        );
+    }
+
+    #[test]
+    fn check_names() {
+        let named = |field: &str, name: Option<&str>| Column {
+            name: name.map(str::to_owned),
+            ..column(field, ColumnType::Text)
+        };
+        assert!(check(&[named("hostname", None), named("vars.x", Some("x_1"))]).is_ok());
+        for invalid in [
+            vec![named("id", None)],
+            vec![named("hostname", Some("doc"))],
+            vec![named("vars.search", Some("search"))],
+            vec![named("tstamp", None)],
+            vec![named("a.b", None), named("a_b", None)],
+            vec![named("1x", None)],
+            vec![named("a", Some("Host"))],
+            vec![named("a", Some("a; drop table logs"))],
+            vec![named("a", Some(""))],
+            vec![named(&"a".repeat(64), None)],
+        ] {
+            assert!(check(&invalid).is_err(), "{:?}", invalid);
+        }
+    }
+
+    #[test]
+    fn column_name() {
+        assert_eq!(
+            column("vars.net.Port", ColumnType::Integer).column_name(),
+            "vars_net_port"
+        );
+    }
+}
@@ -0,0 +1,177 @@
+//! Position of a live tail among event ids, which don't become visible in order
+//!
+//! Writers take ids from the table's sequence while inserting, but commit whenever they are done:
+//! after a tail saw id 10000, a slower writer may still commit ids 1-5000. The cursor remembers
+//! the ranges of ids skipped so far as gaps, which tails query again until their events arrived
+//! or the gaps are older than a timeout (ids of rolled back transactions never show up).
+use std::time::{Duration, Instant};
+
+/// Gaps are given up after this long unless configured otherwise
+pub const DEFAULT_GAP_TIMEOUT: Duration = Duration::from_secs(30);
+
+/// Ids from `first` to `last` (inclusive) not seen yet
+#[derive(Debug, PartialEq)]
+struct Gap {
+    first: i64,
+    last: i64,
+    since: Instant,
+}
+
+#[derive(Debug)]
+pub struct Cursor {
+    /// Highest id seen, none before the first one
+    last: Option<i64>,
+    /// Ordered by their ids, not overlapping
+    gaps: Vec<Gap>,
+    timeout: Duration,
+}
+
+impl Cursor {
+    pub fn new(timeout: Duration) -> Self {
+        Self {
+            last: None,
+            gaps: Vec::new(),
+            timeout,
+        }
+    }
+
+    /// New events have ids above this one
+    pub fn last(&self) -> i64 {
+        self.last.unwrap_or(0)
+    }
+
+    pub fn has_gaps(&self) -> bool {
+        !self.gaps.is_empty()
+    }
+
+    /// First and last ids of the gaps, for `id between first and last`
+    pub fn gaps(&self) -> (Vec<i64>, Vec<i64>) {
+        self.gaps.iter().map(|gap| (gap.first, gap.last)).unzip()
+    }
+
+    /// Record the id of a fetched event, returns false if it was seen already
+    pub fn fetched(&mut self, id: i64, now: Instant) -> bool {
+        match self.last {
+            Some(last) if id <= last => (),
+            last => {
+                if let Some(last) = last.filter(|last| id > last + 1) {
+                    self.gaps.push(Gap {
+                        first: last + 1,
+                        last: id - 1,
+                        since: now,
+                    });
+                }
+                self.last = Some(id);
+                return true;
+            }
+        }
+
+        let index = match self
+            .gaps
+            .binary_search_by(|gap| gap.last.cmp(&id))
+            .unwrap_or_else(|index| index)
+        {
+            index if index < self.gaps.len() && self.gaps[index].first <= id => index,
+            _ => return false,
+        };
+        let gap = &mut self.gaps[index];
+        match (gap.first == id, gap.last == id) {
+            (true, true) => {
+                self.gaps.remove(index);
+            }
+            (true, false) => gap.first += 1,
+            (false, true) => gap.last -= 1,
+            (false, false) => {
+                let upper = Gap {
+                    first: id + 1,
+                    last: gap.last,
+                    since: gap.since,
+                };
+                gap.last = id - 1;
+                self.gaps.insert(index + 1, upper);
+            }
+        }
+        true
+    }
+
+    /// Move past the ids up to `id` without recording them as gaps, for tails that show only the
+    /// newest events of a page and drop the older ones
+    pub fn skip_to(&mut self, id: i64) {
+        if self.last.map_or(true, |last| id > last) {
+            self.last = Some(id);
+        }
+    }
+
+    /// Give up gaps older than the timeout
+    pub fn expire(&mut self, now: Instant) {
+        let timeout = self.timeout;
+        self.gaps
+            .retain(|gap| now.saturating_duration_since(gap.since) < timeout);
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn interleaved_commits() {
+        let start = Instant::now();
+        let mut cursor = Cursor::new(Duration::from_secs(10));
+        assert!(cursor.fetched(1, start));
+        // writer B commits 5001-10000 before writer A commits 2-5000
+        for id in 5001..=10000 {
+            assert!(cursor.fetched(id, start));
+        }
+        assert_eq!(cursor.last(), 10000);
+        assert_eq!(cursor.gaps(), (vec![2], vec![5000]));
+
+        // A's events were not seen yet, an event seen twice is
+        assert!(cursor.fetched(3, start));
+        assert!(!cursor.fetched(3, start));
+        assert!(!cursor.fetched(7000, start));
+        assert_eq!(cursor.gaps(), (vec![2, 4], vec![2, 5000]));
+        for id in (2..=5000).filter(|id| *id != 3) {
+            assert!(cursor.fetched(id, start));
+        }
+        assert!(!cursor.has_gaps());
+    }
+
+    #[test]
+    fn skip_dropped_events() {
+        let start = Instant::now();
+        let mut cursor = Cursor::new(Duration::from_secs(10));
+        cursor.fetched(10, start);
+        cursor.fetched(12, start);
+        // a full page of the newest events 91-100, 13-90 were dropped
+        cursor.skip_to(90);
+        for id in 91..=100 {
+            assert!(cursor.fetched(id, start));
+        }
+        assert_eq!(cursor.gaps(), (vec![11], vec![11]));
+        cursor.skip_to(50);
+        assert_eq!(cursor.last(), 100);
+
+        let mut cursor = Cursor::new(Duration::from_secs(10));
+        cursor.skip_to(90);
+        assert!(cursor.fetched(91, start));
+        assert!(!cursor.has_gaps());
+    }
+
+    #[test]
+    fn expire_gaps() {
+        let start = Instant::now();
+        let mut cursor = Cursor::new(Duration::from_secs(10));
+        // no gap before the first event
+        cursor.fetched(100, start);
+        cursor.fetched(102, start);
+        cursor.fetched(110, start + Duration::from_secs(5));
+        assert_eq!(cursor.gaps(), (vec![101, 103], vec![101, 109]));
+
+        cursor.expire(start + Duration::from_secs(12));
+        assert_eq!(cursor.gaps(), (vec![103], vec![109]));
+        assert!(!cursor.fetched(101, start + Duration::from_secs(12)));
+        cursor.expire(start + Duration::from_secs(15));
+        assert!(!cursor.has_gaps());
+    }
+}
@@ -1,5 +1,8 @@
+use serde::de::{self, Deserialize, DeserializeSeed, Deserializer, MapAccess, SeqAccess, Visitor};
+use serde_json::value::RawValue;
 use serde_json::{json, Map, Value};
-use std::fmt;
+use std::borrow::Cow;
+use std::fmt::{self, Write as _};
 use time::{macros::format_description, OffsetDateTime};
 
 use crate::serde::de::rfc3339;
@@ -102,75 +105,107 @@ impl fmt::Display for SyslogFacility {
     }
 }
 
+/// Deserialize a string without allocating and convert it using `convert`
+fn map_str<'de, D, T>(d: D, convert: fn(&str) -> Option<T>) -> Result<T, D::Error>
+where
+    D: Deserializer<'de>,
+{
+    struct MapStr<T>(fn(&str) -> Option<T>);
+
+    impl<'de, T> Visitor<'de> for MapStr<T> {
+        type Value = T;
+
+        fn expecting(&self, f: &mut fmt::Formatter) -> fmt::Result {
+            f.write_str("a string")
+        }
+
+        fn visit_str<E: de::Error>(self, value: &str) -> Result<T, E> {
+            (self.0)(value).ok_or_else(|| E::custom(format_args!("Invalid value {}", value)))
+        }
+    }
+
+    d.deserialize_str(MapStr(convert))
+}
+
 mod severity_serde {
     use super::*;
-    use serde::{de::Error, Deserialize, Deserializer};
 
     pub fn deserialize<'de, D>(d: D) -> Result<SyslogSeverity, D::Error>
     where
         D: Deserializer<'de>,
     {
         use SyslogSeverity::*;
-        let value = String::deserialize(d)?;
-        match value.as_ref() {
-            "0" => Ok(Emergency),
-            "1" => Ok(Alert),
-            "2" => Ok(Critical),
-            "3" => Ok(Error),
-            "4" => Ok(Warning),
-            "5" => Ok(Notice),
-            "6" => Ok(Info),
-            "7" => Ok(Debug),
-            o => Err(D::Error::custom(format_args!("Invalid value {}", o))),
-        }
+        map_str(d, |value| match value {
+            "0" => Some(Emergency),
+            "1" => Some(Alert),
+            "2" => Some(Critical),
+            "3" => Some(Error),
+            "4" => Some(Warning),
+            "5" => Some(Notice),
+            "6" => Some(Info),
+            "7" => Some(Debug),
+            _ => None,
+        })
     }
 }
 
 mod facility_serde {
     use super::*;
-    use serde::{de::Error, Deserialize, Deserializer};
 
     pub fn deserialize<'de, D>(d: D) -> Result<SyslogFacility, D::Error>
     where
         D: Deserializer<'de>,
     {
         use SyslogFacility::*;
-        let value = String::deserialize(d)?;
-        match value.as_ref() {
-            "0" => Ok(Kern),
-            "1" => Ok(User),
-            "2" => Ok(Mail),
-            "3" => Ok(Daemon),
-            "4" => Ok(Auth),
-            "5" => Ok(Syslog),
-            "6" => Ok(Lpr),
-            "7" => Ok(News),
-            "8" => Ok(Uucp),
-            "9" => Ok(Cron),
-            "10" => Ok(Authpriv),
-            "11" => Ok(Ftp),
-            "12" => Ok(Ntp),
-            "13" => Ok(Security),
-            "14" => Ok(Console),
-            "15" => Ok(SolarisCron),
-            "16" => Ok(Local0),
-            "17" => Ok(Local1),
-            "18" => Ok(Local2),
-            "19" => Ok(Local3),
-            "20" => Ok(Local4),
-            "21" => Ok(Local5),
-            "22" => Ok(Local6),
-            "23" => Ok(Local7),
-            o => Err(D::Error::custom(format_args!("Invalid value {}", o))),
-        }
+        map_str(d, |value| match value {
+            "0" => Some(Kern),
+            "1" => Some(User),
+            "2" => Some(Mail),
+            "3" => Some(Daemon),
+            "4" => Some(Auth),
+            "5" => Some(Syslog),
+            "6" => Some(Lpr),
+            "7" => Some(News),
+            "8" => Some(Uucp),
+            "9" => Some(Cron),
+            "10" => Some(Authpriv),
+            "11" => Some(Ftp),
+            "12" => Some(Ntp),
+            "13" => Some(Security),
+            "14" => Some(Console),
+            "15" => Some(SolarisCron),
+            "16" => Some(Local0),
+            "17" => Some(Local1),
+            "18" => Some(Local2),
+            "19" => Some(Local3),
+            "20" => Some(Local4),
+            "21" => Some(Local5),
+            "22" => Some(Local6),
+            "23" => Some(Local7),
+            _ => None,
+        })
     }
 }
 
+/// Like `Option<Cow<str>>`, but borrowing from the input if possible
+fn borrowed_opt<'de: 'a, 'a, D>(d: D) -> Result<Option<Cow<'a, str>>, D::Error>
+where
+    D: Deserializer<'de>,
+{
+    #[derive(serde_derive::Deserialize)]
+    struct Borrowed<'a>(#[serde(borrow)] Cow<'a, str>);
+
+    Ok(Option::<Borrowed>::deserialize(d)?.map(|b| b.0))
+}
+
 /// log event formatted by rsyslog's "jsonmesg" property
+///
+/// Strings are borrowed from the input unless they contain escape sequences.
 #[derive(serde_derive::Deserialize, Debug)]
-pub struct RsyslogdEvent {
+pub struct RsyslogdEvent<'a> {
     /// log message string
-    msg: String,
+    #[serde(borrow)]
+    msg: Cow<'a, str>,
 
     /// complete raw syslog message
     /// currently unused
@@ -185,21 +220,25 @@ pub struct RsyslogdEvent {
     timegenerated: OffsetDateTime,
 
     /// host name from the message
-    hostname: String,
+    #[serde(borrow)]
+    hostname: Cow<'a, str>,
 
     /// tag of this message
-    syslogtag: String,
+    #[serde(borrow)]
+    syslogtag: Cow<'a, str>,
 
     /// rsyslog input module which received this message
-    inputname: String,
+    #[serde(borrow)]
+    inputname: Cow<'a, str>,
 
     /// host name of the sender that this message was received from (last hop before "our" rsyslog
     /// instance
-    fromhost: String,
+    #[serde(borrow)]
+    fromhost: Cow<'a, str>,
 
     /// IP address of "fromhost"
-    #[serde(rename = "fromhost-ip")]
-    fromhost_ip: String,
+    #[serde(rename = "fromhost-ip", borrow)]
+    fromhost_ip: Cow<'a, str>,
 
     /// raw "PRI" of this message
     /// currently unused
@@ -214,11 +253,12 @@ pub struct RsyslogdEvent {
     syslogfacility: SyslogFacility,
 
     /// part of the tag before the optional pid
-    programname: String,
+    #[serde(borrow)]
+    programname: Cow<'a, str>,
 
     /// syslog "PROTOCOL-VERSION"
-    #[serde(rename = "protocol-version")]
-    protocol_version: String, // <-- TODO: parse::<u8>()
+    #[serde(rename = "protocol-version", borrow)]
+    protocol_version: Cow<'a, str>, // <-- TODO: parse::<u8>()
 
     /// syslog "STRUCTURED-DATA"
     /// currently unused
@@ -226,24 +266,39 @@ pub struct RsyslogdEvent {
     // structured_data: String, // <-- TODO: Value?
 
     /// syslog "APP-NAME"
-    #[serde(rename = "app-name")]
-    app_name: String,
+    #[serde(rename = "app-name", borrow)]
+    app_name: Cow<'a, str>,
 
     /// syslog "PROCID"
-    #[serde(skip_serializing_if = "Option::is_none")]
-    procid: Option<String>,
+    #[serde(
+        skip_serializing_if = "Option::is_none",
+        default,
+        deserialize_with = "borrowed_opt",
+        borrow
+    )]
+    procid: Option<Cow<'a, str>>,
 
     /// syslog "MSGID"
-    #[serde(skip_serializing_if = "Option::is_none")]
-    msgid: Option<String>,
+    #[serde(
+        skip_serializing_if = "Option::is_none",
+        default,
+        deserialize_with = "borrowed_opt",
+        borrow
+    )]
+    msgid: Option<Cow<'a, str>>,
 
     /// ???
-    #[serde(skip_serializing_if = "Option::is_none")]
-    uuid: Option<String>,
-
-    /// rsyslog message variables
-    #[serde(rename = "$!", skip_serializing_if = "Option::is_none")]
-    message_variables: Option<Value>,
+    #[serde(
+        skip_serializing_if = "Option::is_none",
+        default,
+        deserialize_with = "borrowed_opt",
+        borrow
+    )]
+    uuid: Option<Cow<'a, str>>,
+
+    /// rsyslog message variables, flattened into the event's document only
+    #[serde(rename = "$!", skip_serializing_if = "Option::is_none", borrow)]
+    message_variables: Option<&'a RawValue>,
 }
 
 #[derive(Debug, Clone)]
@@ -256,98 +311,269 @@ const FTS_FIELDS: &[&str] = &["hostname", "syslogtag", "msg"];
 
 impl Event {
     pub fn search_string(&self) -> String {
-        let mut parts = Vec::new();
+        let mut search = String::new();
+        self.search_string_into(&mut search);
+        search
+    }
+
+    /// Append the search string to `target`, allows reusing its buffer
+    pub fn search_string_into(&self, target: &mut String) {
+        let begin = target.len();
         self.doc.as_object().unwrap().iter().for_each(|pair| {
-            if FTS_FIELDS.contains(&&pair.0[..]) {
-                parts.push(pair.1.to_string());
-            } else if pair.0.starts_with("vars.") {
-                parts.push(format!("{}={}", pair.0, pair.1));
+            let is_fts = FTS_FIELDS.contains(&&pair.0[..]);
+            if !is_fts && !pair.0.starts_with("vars.") {
+                return;
+            }
+            if target.len() > begin {
+                target.push(' ');
+            }
+            if is_fts {
+                write!(target, "{}", pair.1).unwrap();
+            } else {
+                write!(target, "{}={}", pair.0, pair.1).unwrap();
             }
         });
-        parts.join(" ")
     }
 
     pub fn get_printable(&self, index: &str) -> Option<String> {
-        if let Some(value) = self.doc.get(index) {
-            match value {
-                Value::String(s) => Some(s.as_str().to_string()),
-                Value::Array(_) => Some(flatten(value)),
-                Value::Bool(true) => Some("true".to_string()),
-                Value::Bool(false) => Some("false".to_string()),
-                Value::Null => Some("null".to_string()),
-                Value::Number(n) => Some(format!("{}", n)),
-                Value::Object(_) => Some(flatten(value)),
-            }
-        } else {
-            None
-        }
+        self.doc.get(index).map(printable)
+    }
+
+    /// Exchange the values of two fields in place, converting both to printable strings
+    ///
+    /// Nothing happens unless both fields exist.
+    pub fn swap_printable(&mut self, a: &str, b: &str) {
+        let doc = match self.doc.as_object_mut() {
+            Some(doc) if doc.contains_key(a) && doc.contains_key(b) => doc,
+            _ => return,
+        };
+        let first = into_printable(doc.get_mut(a).unwrap().take());
+        let second = std::mem::replace(doc.get_mut(b).unwrap(), first);
+        *doc.get_mut(a).unwrap() = into_printable(second);
+    }
+}
+
+fn printable(value: &Value) -> String {
+    match value {
+        Value::String(s) => s.as_str().to_string(),
+        Value::Array(_) => flatten(value),
+        Value::Bool(true) => "true".to_string(),
+        Value::Bool(false) => "false".to_string(),
+        Value::Null => "null".to_string(),
+        Value::Number(n) => format!("{}", n),
+        Value::Object(_) => flatten(value),
+    }
+}
+
+fn into_printable(value: Value) -> Value {
+    match value {
+        Value::String(_) => value,
+        other => Value::String(printable(&other)),
     }
 }
 
 fn flatten(value: &Value) -> String {
-    let mut unnested = Value::Object(Map::new());
-    flatten_value(value, &mut unnested, "".to_string(), ".");
+    let mut unnested = Map::new();
+    flatten_value(value, &mut unnested, &mut String::new(), ".");
     unnested
-        .as_object()
-        .unwrap()
         .iter()
         .map(|pair| format!("{}={}", pair.0, pair.1))
         .collect::<Vec<String>>()
         .join(" ")
 }
 
-fn flatten_value(value: &Value, target: &mut Value, prefix: String, separator: &str) {
+fn push_key(prefix: &mut String, separator: &str, key: &str) {
+    if !prefix.is_empty() {
+        prefix.push_str(separator);
+    }
+    prefix.push_str(key);
+}
+
+fn flatten_value(
+    value: &Value,
+    target: &mut Map<String, Value>,
+    prefix: &mut String,
+    separator: &str,
+) {
     match value {
-        Value::Null => target[prefix] = Value::Null,
         Value::Object(map) => {
+            let len = prefix.len();
             map.iter().for_each(|pair| {
-                let subprefix = if prefix.is_empty() {
-                    pair.0.to_string()
-                } else {
-                    format!("{}{}{}", prefix, separator, pair.0)
-                };
-                flatten_value(pair.1, target, subprefix, separator);
+                push_key(prefix, separator, pair.0);
+                flatten_value(pair.1, target, prefix, separator);
+                prefix.truncate(len);
             });
         }
-        scalar => target[prefix] = scalar.to_owned(),
+        scalar => {
+            target.insert(prefix.to_owned(), scalar.to_owned());
+        }
     };
 }
 
-impl From<RsyslogdEvent> for Event {
+/// Deserializes a JSON value directly into its flattened form, see `flatten_value`
+struct Flatten<'t> {
+    target: &'t mut Map<String, Value>,
+    prefix: &'t mut String,
+    separator: &'t str,
+}
+
+impl<'t> Flatten<'t> {
+    fn insert(self, value: Value) {
+        self.target.insert(self.prefix.to_owned(), value);
+    }
+}
+
+/// Appends a map's key to the prefix
+struct PrefixKey<'t> {
+    prefix: &'t mut String,
+    separator: &'t str,
+}
+
+impl<'de, 't> DeserializeSeed<'de> for PrefixKey<'t> {
+    type Value = ();
+
+    fn deserialize<D: Deserializer<'de>>(self, d: D) -> Result<(), D::Error> {
+        d.deserialize_str(self)
+    }
+}
+
+impl<'de, 't> Visitor<'de> for PrefixKey<'t> {
+    type Value = ();
+
+    fn expecting(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.write_str("a string key")
+    }
+
+    fn visit_str<E: de::Error>(self, key: &str) -> Result<(), E> {
+        push_key(self.prefix, self.separator, key);
+        Ok(())
+    }
+}
+
+impl<'de, 't> DeserializeSeed<'de> for Flatten<'t> {
+    type Value = ();
+
+    fn deserialize<D: Deserializer<'de>>(self, d: D) -> Result<(), D::Error> {
+        d.deserialize_any(self)
+    }
+}
+
+impl<'de, 't> Visitor<'de> for Flatten<'t> {
+    type Value = ();
+
+    fn expecting(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.write_str("any JSON value")
+    }
+
+    fn visit_bool<E: de::Error>(self, value: bool) -> Result<(), E> {
+        self.insert(Value::Bool(value));
+        Ok(())
+    }
+
+    fn visit_i64<E: de::Error>(self, value: i64) -> Result<(), E> {
+        self.insert(Value::from(value));
+        Ok(())
+    }
+
+    fn visit_u64<E: de::Error>(self, value: u64) -> Result<(), E> {
+        self.insert(Value::from(value));
+        Ok(())
+    }
+
+    fn visit_f64<E: de::Error>(self, value: f64) -> Result<(), E> {
+        self.insert(Value::from(value));
+        Ok(())
+    }
+
+    fn visit_str<E: de::Error>(self, value: &str) -> Result<(), E> {
+        self.insert(Value::from(value));
+        Ok(())
+    }
+
+    fn visit_string<E: de::Error>(self, value: String) -> Result<(), E> {
+        self.insert(Value::from(value));
+        Ok(())
+    }
+
+    fn visit_unit<E: de::Error>(self) -> Result<(), E> {
+        self.insert(Value::Null);
+        Ok(())
+    }
+
+    fn visit_seq<A: SeqAccess<'de>>(self, mut seq: A) -> Result<(), A::Error> {
+        let mut values = Vec::new();
+        while let Some(value) = seq.next_element::<Value>()? {
+            values.push(value);
+        }
+        self.insert(Value::Array(values));
+        Ok(())
+    }
+
+    fn visit_map<A: MapAccess<'de>>(self, mut map: A) -> Result<(), A::Error> {
+        let len = self.prefix.len();
+        while let Some(()) = map.next_key_seed(PrefixKey {
+            prefix: self.prefix,
+            separator: self.separator,
+        })? {
+            map.next_value_seed(Flatten {
+                target: self.target,
+                prefix: self.prefix,
+                separator: self.separator,
+            })?;
+            self.prefix.truncate(len);
+        }
+        Ok(())
+    }
+}
+
+impl From<RsyslogdEvent<'_>> for Event {
     fn from(event: RsyslogdEvent) -> Self {
-        let mut doc = json!({
-            "msg": event.msg,
-            "timereported": event.timereported,
-            "timegenerated": event.timegenerated,
-            "hostname": event.hostname,
-            "inputname": event.inputname,
-            "syslogtag": event.syslogtag,
-            "fromhost": event.fromhost,
-            "fromhost_ip": event.fromhost_ip,
-            "syslogfacility": event.syslogfacility.to_string(),
-            "syslogseverity": event.syslogseverity.to_string(),
-            "programname": event.programname,
-            "procid": event.procid,
-            "protocol_version": event.protocol_version,
-            "app_name": event.app_name,
-        });
+        let mut doc = Map::new();
+        doc.insert("msg".into(), event.msg.into());
+        doc.insert("timereported".into(), json!(event.timereported));
+        doc.insert("timegenerated".into(), json!(event.timegenerated));
+        doc.insert("hostname".into(), event.hostname.into());
+        doc.insert("inputname".into(), event.inputname.into());
+        doc.insert("syslogtag".into(), event.syslogtag.into());
+        doc.insert("fromhost".into(), event.fromhost.into());
+        doc.insert("fromhost_ip".into(), event.fromhost_ip.into());
+        doc.insert(
+            "syslogfacility".into(),
+            event.syslogfacility.to_string().into(),
+        );
+        doc.insert(
+            "syslogseverity".into(),
+            event.syslogseverity.to_string().into(),
+        );
+        doc.insert("programname".into(), event.programname.into());
+        doc.insert("procid".into(), event.procid.into());
+        doc.insert("protocol_version".into(), event.protocol_version.into());
+        doc.insert("app_name".into(), event.app_name.into());
         // Some field were left out do reduce duplication:
         // * rawmsg
         // * pri
         // * structured_data
         if let Some(vars) = event.message_variables {
-            flatten_value(&vars, &mut doc, "vars".to_string(), ".");
+            let mut prefix = String::from("vars");
+            // the raw value was validated while parsing the event
+            Flatten {
+                target: &mut doc,
+                prefix: &mut prefix,
+                separator: ".",
+            }
+            .deserialize(&mut serde_json::Deserializer::from_str(vars.get()))
+            .unwrap();
         }
         if let Some(msgid) = event.msgid {
-            doc["msgid"] = msgid.into();
+            doc.insert("msgid".into(), msgid.into());
         }
         if let Some(uuid) = event.uuid {
-            doc["uuid"] = uuid.into();
+            doc.insert("uuid".into(), uuid.into());
         }
 
         Event {
             timestamp: event.timereported,
-            doc,
+            doc: Value::Object(doc),
         }
     }
 }
@@ -371,3 +597,92 @@ impl fmt::Display for Event {
         Ok(())
     }
 }
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    const LINE: &str = r#"{"msg":"Failed password for root","rawmsg":"<38>...","timereported":"2021-10-21T10:12:13.123456+02:00","hostname":"host1","syslogtag":"sshd[123]:","inputname":"imudp","fromhost":"gw","fromhost-ip":"10.0.0.1","pri":"38","syslogfacility":"4","syslogseverity":"6","timegenerated":"2021-10-21T10:12:13.5+02:00","programname":"sshd","protocol-version":"0","structured-data":"-","app-name":"sshd","procid":"123","msgid":"-","$!":{"user":"root","port":22,"net":{"src":"10.1.1.1","tags":["a","b"],"none":null},"msg":"rewritten \"quoted\""}}"#;
+
+    #[test]
+    fn from_rsyslogd_event() {
+        let rsyslog_event = serde_json::from_str::<RsyslogdEvent>(LINE).unwrap();
+        assert!(matches!(rsyslog_event.hostname, Cow::Borrowed(_)));
+        assert!(matches!(rsyslog_event.procid, Some(Cow::Borrowed(_))));
+
+        let event = Event::from(rsyslog_event);
+        assert_eq!(event.get_printable("hostname").unwrap(), "host1");
+        assert_eq!(event.get_printable("syslogseverity").unwrap(), "info");
+        assert_eq!(event.get_printable("syslogfacility").unwrap(), "auth");
+        assert_eq!(event.doc["vars.user"], "root");
+        assert_eq!(event.doc["vars.port"], 22);
+        assert_eq!(event.doc["vars.net.src"], "10.1.1.1");
+        assert_eq!(event.doc["vars.net.tags"], json!(["a", "b"]));
+        assert_eq!(event.doc["vars.net.none"], Value::Null);
+        assert_eq!(event.doc["vars.msg"], "rewritten \"quoted\"");
+        assert_eq!(event.doc["procid"], "123");
+        assert_eq!(event.doc["msgid"], "-");
+        assert!(event.doc.get("uuid").is_none());
+        assert_eq!(event.doc["timereported"], json!(event.timestamp));
+    }
+
+    #[test]
+    fn message_variables() {
+        let vars = |value: &str| {
+            let (line, _) = LINE.split_once(r#","$!":"#).unwrap();
+            let line = format!(r#"{},"$!":{}}}"#, line, value);
+            let event = Event::from(serde_json::from_str::<RsyslogdEvent>(&line).unwrap());
+            event
+                .doc
+                .as_object()
+                .unwrap()
+                .iter()
+                .filter(|(key, _)| key.starts_with("vars"))
+                .map(|(key, value)| (key.clone(), value.clone()))
+                .collect::<Vec<_>>()
+        };
+        // same documents as from a parsed `Value`: null and empty objects add no keys
+        assert_eq!(vars("null"), []);
+        assert_eq!(vars("{}"), []);
+        assert_eq!(vars(r#""text""#), [("vars".to_owned(), json!("text"))]);
+        assert_eq!(vars(r#"{"a":null}"#), [("vars.a".to_owned(), Value::Null)]);
+    }
+
+    #[test]
+    fn swap_printable() {
+        let mut event = Event::from(serde_json::from_str::<RsyslogdEvent>(LINE).unwrap());
+        event.swap_printable("vars.msg", "msg");
+        assert_eq!(event.doc["msg"], "rewritten \"quoted\"");
+        assert_eq!(event.doc["vars.msg"], "Failed password for root");
+
+        event.swap_printable("vars.port", "vars.missing");
+        assert_eq!(event.doc["vars.port"], 22);
+        event.swap_printable("vars.port", "hostname");
+        assert_eq!(event.doc["vars.port"], "host1");
+        assert_eq!(event.doc["hostname"], "22");
+    }
+
+    #[test]
+    fn search_string() {
+        let event = Event {
+            timestamp: OffsetDateTime::UNIX_EPOCH,
+            doc: json!({"msg": "text", "hostname": "host", "vars.a": 1, "other": "x"}),
+        };
+        assert_eq!(event.search_string(), r#""host" "text" vars.a=1"#);
+
+        let mut buffer = String::from("stale");
+        buffer.clear();
+        event.search_string_into(&mut buffer);
+        assert_eq!(buffer, event.search_string());
+    }
+
+    #[test]
+    fn printable() {
+        let event = Event {
+            timestamp: OffsetDateTime::UNIX_EPOCH,
+            doc: json!({"obj": {"a": {"b": 1}, "c": "d"}, "list": [1, 2]}),
+        };
+        assert_eq!(event.get_printable("obj").unwrap(), r#"a.b=1 c="d""#);
+        assert_eq!(event.get_printable("list").unwrap(), "=[1,2]");
+    }
+}
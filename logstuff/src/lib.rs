@@ -1,3 +1,11 @@
+pub mod columns;
+pub mod cursor;
 pub mod event;
+pub mod metrics;
+pub mod notify;
+pub mod rollup;
 pub mod serde;
+pub mod sketch;
+#[cfg(feature = "synthetic")]
+pub mod synthetic;
 pub mod tls;
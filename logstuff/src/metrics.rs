@@ -0,0 +1,281 @@
+//! Counters and latency histograms, exported in Prometheus' text format
+//!
+//! stuffimport and stuffstream keep their own metrics and render them with `Exposition` on
+//! request. Everything is lock free except for creating new series of a `HistogramVec`.
+//!
+//! Timers also log their durations at trace level (target "timing"), e.g. for following a single
+//! slow request through its stages: `RUST_LOG=timing=trace`.
+use log::trace;
+use std::collections::BTreeMap;
+use std::fmt::{Display, Write as _};
+use std::ops::Deref;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+
+/// Upper bounds of the histogram buckets in seconds, the last bucket (+Inf) is implied
+pub const BUCKETS: [f64; 16] = [
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5,
+    5.0, 10.0,
+];
+
+/// Label value of the series shared by all label sets beyond a `HistogramVec`'s limit
+pub const OTHER: &str = "other";
+
+#[derive(Debug, Default)]
+pub struct Counter(AtomicU64);
+
+impl Counter {
+    pub const fn new() -> Self {
+        Self(AtomicU64::new(0))
+    }
+
+    pub fn inc(&self) {
+        self.add(1);
+    }
+
+    pub fn add(&self, n: u64) {
+        self.0.fetch_add(n, Ordering::Relaxed);
+    }
+
+    pub fn get(&self) -> u64 {
+        self.0.load(Ordering::Relaxed)
+    }
+}
+
+#[derive(Debug, Default)]
+pub struct Histogram {
+    /// Observations per bucket (not cumulative), the last one above all `BUCKETS`
+    counts: [AtomicU64; BUCKETS.len() + 1],
+    sum_ns: AtomicU64,
+}
+
+impl Histogram {
+    pub const fn new() -> Self {
+        #[allow(clippy::declare_interior_mutable_const)]
+        const ZERO: AtomicU64 = AtomicU64::new(0);
+        Self {
+            counts: [ZERO; BUCKETS.len() + 1],
+            sum_ns: ZERO,
+        }
+    }
+
+    pub fn observe(&self, duration: Duration) {
+        let seconds = duration.as_secs_f64();
+        let bucket = BUCKETS
+            .iter()
+            .position(|bound| seconds <= *bound)
+            .unwrap_or(BUCKETS.len());
+        self.counts[bucket].fetch_add(1, Ordering::Relaxed);
+        self.sum_ns
+            .fetch_add(duration.as_nanos() as u64, Ordering::Relaxed);
+    }
+
+    /// Time until the returned timer drops, `span` names it in trace logs
+    pub fn start(&self, span: &'static str) -> Timer<&Self> {
+        Timer::new(self, span)
+    }
+
+    pub fn count(&self) -> u64 {
+        self.counts
+            .iter()
+            .map(|count| count.load(Ordering::Relaxed))
+            .sum()
+    }
+}
+
+/// Observes the time between its creation and drop
+pub struct Timer<H: Deref<Target = Histogram>> {
+    histogram: H,
+    span: &'static str,
+    started: Instant,
+}
+
+impl<H: Deref<Target = Histogram>> Timer<H> {
+    pub fn new(histogram: H, span: &'static str) -> Self {
+        Self {
+            histogram,
+            span,
+            started: Instant::now(),
+        }
+    }
+}
+
+impl<H: Deref<Target = Histogram>> Drop for Timer<H> {
+    fn drop(&mut self) {
+        let elapsed = self.started.elapsed();
+        self.histogram.observe(elapsed);
+        trace!(target: "timing", "{}: {:.3} ms", self.span, elapsed.as_secs_f64() * 1000.0);
+    }
+}
+
+/// Histograms by label values, at most `max_series` of them
+#[derive(Debug)]
+pub struct HistogramVec {
+    max_series: usize,
+    series: Mutex<BTreeMap<Vec<String>, Arc<Histogram>>>,
+}
+
+impl HistogramVec {
+    pub const fn new(max_series: usize) -> Self {
+        Self {
+            max_series,
+            series: Mutex::new(BTreeMap::new()),
+        }
+    }
+
+    /// Series of `labels`, or the one labelled `OTHER` if there are too many
+    pub fn with(&self, labels: &[&str]) -> Arc<Histogram> {
+        let mut series = self.series.lock().unwrap();
+        let key: Vec<String> = labels.iter().map(|label| label.to_string()).collect();
+        if let Some(histogram) = series.get(&key) {
+            return histogram.clone();
+        }
+        let key = if series.len() < self.max_series {
+            key
+        } else {
+            vec![OTHER.to_string(); labels.len()]
+        };
+        series.entry(key).or_default().clone()
+    }
+
+    pub fn series(&self) -> Vec<(Vec<String>, Arc<Histogram>)> {
+        self.series
+            .lock()
+            .unwrap()
+            .iter()
+            .map(|(labels, histogram)| (labels.clone(), histogram.clone()))
+            .collect()
+    }
+}
+
+/// Metrics in Prometheus' text format
+#[derive(Default)]
+pub struct Exposition {
+    text: String,
+}
+
+fn escape(value: &str) -> String {
+    value
+        .replace('\\', "\\\\")
+        .replace('"', "\\\"")
+        .replace('\n', "\\n")
+}
+
+impl Exposition {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Start metric `name`, `kind` is counter, gauge or histogram
+    pub fn header(&mut self, name: &str, help: &str, kind: &str) {
+        writeln!(self.text, "# HELP {} {}", name, help).unwrap();
+        writeln!(self.text, "# TYPE {} {}", name, kind).unwrap();
+    }
+
+    pub fn sample(&mut self, name: &str, labels: &[(&str, &str)], value: impl Display) {
+        self.text.push_str(name);
+        if !labels.is_empty() {
+            let labels: Vec<_> = labels
+                .iter()
+                .map(|(label, value)| format!("{}=\"{}\"", label, escape(value)))
+                .collect();
+            write!(self.text, "{{{}}}", labels.join(",")).unwrap();
+        }
+        writeln!(self.text, " {}", value).unwrap();
+    }
+
+    /// Header and single sample of an unlabelled counter
+    pub fn counter(&mut self, name: &str, help: &str, value: u64) {
+        self.header(name, help, "counter");
+        self.sample(name, &[], value);
+    }
+
+    /// Header and single sample of an unlabelled gauge
+    pub fn gauge(&mut self, name: &str, help: &str, value: impl Display) {
+        self.header(name, help, "gauge");
+        self.sample(name, &[], value);
+    }
+
+    /// Samples (buckets, sum and count) of a single histogram series
+    pub fn histogram(&mut self, name: &str, labels: &[(&str, &str)], histogram: &Histogram) {
+        let bucket_name = format!("{}_bucket", name);
+        let mut cumulative = 0;
+        let bounds = BUCKETS.iter().map(|bound| bound.to_string());
+        for (count, bound) in histogram
+            .counts
+            .iter()
+            .zip(bounds.chain(std::iter::once("+Inf".to_string())))
+        {
+            cumulative += count.load(Ordering::Relaxed);
+            let mut bucket_labels = labels.to_vec();
+            bucket_labels.push(("le", &bound));
+            self.sample(&bucket_name, &bucket_labels, cumulative);
+        }
+        let sum = histogram.sum_ns.load(Ordering::Relaxed) as f64 / 1e9;
+        self.sample(&format!("{}_sum", name), labels, sum);
+        self.sample(&format!("{}_count", name), labels, cumulative);
+    }
+
+    /// Header and all series of `histograms`, labelled with `label_names`
+    pub fn histograms(
+        &mut self,
+        name: &str,
+        help: &str,
+        label_names: &[&str],
+        histograms: &HistogramVec,
+    ) {
+        self.header(name, help, "histogram");
+        for (values, histogram) in histograms.series() {
+            let labels: Vec<_> = label_names
+                .iter()
+                .copied()
+                .zip(values.iter().map(String::as_str))
+                .collect();
+            self.histogram(name, &labels, &histogram);
+        }
+    }
+
+    pub fn finish(self) -> String {
+        self.text
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn exposition() {
+        let histogram = Histogram::new();
+        histogram.observe(Duration::from_micros(200));
+        histogram.observe(Duration::from_millis(3));
+        histogram.observe(Duration::from_secs(60));
+        drop(histogram.start("test"));
+        assert_eq!(histogram.count(), 4);
+
+        let routes = HistogramVec::new(1);
+        routes.with(&["events"]).observe(Duration::from_millis(1));
+        routes.with(&["counts"]).observe(Duration::from_millis(2));
+        assert_eq!(routes.with(&["events"]).count(), 1);
+        assert_eq!(routes.with(&[OTHER]).count(), 1);
+
+        let mut exposition = Exposition::new();
+        exposition.counter("events_total", "Events", 3);
+        exposition.header("stage_seconds", "Stages", "histogram");
+        exposition.histogram("stage_seconds", &[("stage", "a\"b")], &histogram);
+        exposition.histograms("route_seconds", "Routes", &["route"], &routes);
+        let text = exposition.finish();
+
+        assert!(text.starts_with(
+            "# HELP events_total Events\n# TYPE events_total counter\nevents_total 3\n"
+        ));
+        assert!(text.contains("stage_seconds_bucket{stage=\"a\\\"b\",le=\"0.00025\"} 2\n"));
+        assert!(text.contains("stage_seconds_bucket{stage=\"a\\\"b\",le=\"0.005\"} 3\n"));
+        assert!(text.contains("stage_seconds_bucket{stage=\"a\\\"b\",le=\"10\"} 3\n"));
+        assert!(text.contains("stage_seconds_bucket{stage=\"a\\\"b\",le=\"+Inf\"} 4\n"));
+        assert!(text.contains("stage_seconds_count{stage=\"a\\\"b\"} 4\n"));
+        assert!(text.contains("route_seconds_count{route=\"events\"} 1\n"));
+        assert!(text.contains("route_seconds_count{route=\"other\"} 1\n"));
+    }
+}
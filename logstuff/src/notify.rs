@@ -0,0 +1,16 @@
+//! Notifications stuffimport sends after committing events, for live tails such as stufftail
+//!
+//! Sent with `pg_notify` within the writing transaction, postgres delivers them to the channel's
+//! listeners once the events are visible. The payload is a JSON encoded `Notification`.
+use serde_derive::{Deserialize, Serialize};
+
+/// Channel used if none is configured
+pub const DEFAULT_CHANNEL: &str = "logstuff_events";
+
+#[derive(Clone, Debug, Deserialize, Serialize, PartialEq)]
+pub struct Notification {
+    /// Table the events were inserted into, a leaf partition for batches
+    pub partition: String,
+    /// Highest id among the committed events
+    pub max_id: i64,
+}
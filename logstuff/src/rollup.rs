@@ -0,0 +1,107 @@
+//! Event counts per minute and hour, maintained by stuffimport and read by stuffstream
+//!
+//! Rows of the rollup tables are keyed by bucket, field and the field's value. Total counts use
+//! the empty field name, events without a split field are counted as "(null)", the same value
+//! stuffstream's split queries use for them.
+use serde::de::{Deserialize as _, Deserializer, Error as _};
+use serde_derive::{Deserialize, Serialize};
+
+/// Value counted for events missing a split field
+pub const MISSING: &str = "(null)";
+
+/// Bucket sizes in seconds with their `date_trunc` field, also the suffix of their table name
+pub const GRANULARITIES: &[(i64, &str)] = &[(60, "minute"), (3600, "hour")];
+
+/// Count rollup tables `<table>_minute` and `<table>_hour`
+#[derive(Clone, Debug, Deserialize, Serialize)]
+#[serde(deny_unknown_fields, default)]
+pub struct RollupSettings {
+    /// Prefix of the rollup table names
+    pub table: String,
+
+    /// Fields (logstuff query identifiers) events are counted by, besides the total count
+    ///
+    /// Like the identifiers of queries, these are top-level keys of the event document, whose
+    /// values are counted by their text (`doc ->> 'field'`). Other names are refused, queries
+    /// could never split by them.
+    #[serde(deserialize_with = "split_fields")]
+    pub split_fields: Vec<String>,
+
+    /// Keep top values and distinct counts of all top-level fields per hour in `<table>_fields`
+    pub field_sketches: bool,
+}
+
+impl Default for RollupSettings {
+    fn default() -> Self {
+        Self {
+            table: "logs_counts".into(),
+            split_fields: Vec::new(),
+            field_sketches: false,
+        }
+    }
+}
+
+/// Whether `field` is an identifier of the query language, `[a-zA-Z_][a-zA-Z0-9._-]*` except for
+/// keywords
+fn is_identifier(field: &str) -> bool {
+    let mut chars = field.chars();
+    chars
+        .next()
+        .map_or(false, |c| c.is_ascii_alphabetic() || c == '_')
+        && chars.all(|c| c.is_ascii_alphanumeric() || "._-".contains(c))
+        && !["like", "in", "and", "or", "not"].contains(&field)
+}
+
+fn split_fields<'de, D: Deserializer<'de>>(deserializer: D) -> Result<Vec<String>, D::Error> {
+    let fields = Vec::<String>::deserialize(deserializer)?;
+    match fields.iter().find(|field| !is_identifier(field)) {
+        Some(field) => Err(D::Error::custom(format!(
+            "split field {:?} is not a logstuff query identifier",
+            field
+        ))),
+        None => Ok(fields),
+    }
+}
+
+impl RollupSettings {
+    /// Name of the table holding buckets of `granularity` (see `GRANULARITIES`)
+    pub fn table_name(&self, granularity: &str) -> String {
+        format!("{}_{}", self.table, granularity)
+    }
+
+    /// Name of the table holding hourly field sketches (see `logstuff::sketch`)
+    pub fn fields_table(&self) -> String {
+        format!("{}_fields", self.table)
+    }
+
+    /// Name of the single row table holding `since`, when stuffimport started maintaining the
+    /// rollups
+    ///
+    /// Only buckets starting at or after `since` hold all of their events, earlier ones lack the
+    /// events imported before.
+    pub fn coverage_table(&self) -> String {
+        format!("{}_coverage", self.table)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn refuse_split_fields() {
+        let settings = |fields: &[&str]| {
+            serde_json::from_value::<RollupSettings>(serde_json::json!({ "split_fields": fields }))
+        };
+        assert_eq!(
+            settings(&["hostname", "vars.net.src", "_a-b"])
+                .unwrap()
+                .split_fields,
+            ["hostname", "vars.net.src", "_a-b"]
+        );
+        assert!(settings(&["host name"]).is_err());
+        assert!(settings(&[".hostname"]).is_err());
+        assert!(settings(&["and"]).is_err());
+        assert!(settings(&[""]).is_err());
+    }
+}
@@ -1,13 +1,56 @@
 pub mod de {
-    use serde::de::Deserialize as _;
-    use serde::de::Error as _;
+    use serde::de::{Error, Visitor};
+    use std::fmt;
     use time::format_description::well_known::Rfc3339;
     use time::OffsetDateTime;
 
+    struct Rfc3339Visitor;
+
+    impl<'de> Visitor<'de> for Rfc3339Visitor {
+        type Value = OffsetDateTime;
+
+        fn expecting(&self, f: &mut fmt::Formatter) -> fmt::Result {
+            f.write_str("an RFC 3339 time stamp")
+        }
+
+        fn visit_str<E: Error>(self, value: &str) -> Result<OffsetDateTime, E> {
+            OffsetDateTime::parse(value, &Rfc3339).map_err(E::custom)
+        }
+    }
+
     pub fn rfc3339<'de, D>(d: D) -> Result<OffsetDateTime, D::Error>
     where
         D: serde::de::Deserializer<'de>,
     {
-        return OffsetDateTime::parse(&String::deserialize(d)?, &Rfc3339).map_err(D::Error::custom);
+        d.deserialize_str(Rfc3339Visitor)
+    }
+
+    struct OptionalRfc3339Visitor;
+
+    impl<'de> Visitor<'de> for OptionalRfc3339Visitor {
+        type Value = Option<OffsetDateTime>;
+
+        fn expecting(&self, f: &mut fmt::Formatter) -> fmt::Result {
+            f.write_str("an optional RFC 3339 time stamp")
+        }
+
+        fn visit_none<E: Error>(self) -> Result<Self::Value, E> {
+            Ok(None)
+        }
+
+        fn visit_some<D>(self, d: D) -> Result<Self::Value, D::Error>
+        where
+            D: serde::de::Deserializer<'de>,
+        {
+            rfc3339(d).map(Some)
+        }
+    }
+
+    /// Like `rfc3339`, for optional fields (use with `#[serde(default)]`)
+    pub fn rfc3339_option<'de, D>(d: D) -> Result<Option<OffsetDateTime>, D::Error>
+    where
+        D: serde::de::Deserializer<'de>,
+    {
+        d.deserialize_option(OptionalRfc3339Visitor)
     }
 }
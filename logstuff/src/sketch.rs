@@ -0,0 +1,300 @@
+//! Mergeable summaries of field values: most frequent values and number of distinct values
+//!
+//! stuffimport keeps one of each per field and hour, stuffstream merges the ones of a requested
+//! time range. Both are approximations with bounded size, independent of the number of events.
+use serde_derive::{Deserialize, Serialize};
+
+/// Registers of `Hll` are addressed by this many bits of a value's hash
+const HLL_PRECISION: u32 = 10;
+const HLL_REGISTERS: usize = 1 << HLL_PRECISION;
+
+/// FNV-1a followed by splitmix64's finalizer, FNV alone mixes the high bits poorly
+fn hash64(value: &str) -> u64 {
+    let hash = value.bytes().fold(0xcbf2_9ce4_8422_2325_u64, |hash, byte| {
+        (hash ^ u64::from(byte)).wrapping_mul(0x0100_0000_01b3)
+    });
+    let hash = (hash ^ (hash >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+    let hash = (hash ^ (hash >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+    hash ^ (hash >> 31)
+}
+
+#[derive(Clone, Debug, Deserialize, Serialize, PartialEq)]
+pub struct Counter {
+    pub value: String,
+    /// Estimated number of occurrences, at most `error` more than the true one
+    pub count: u64,
+    pub error: u64,
+}
+
+/// Space-Saving summary of the most frequent values
+///
+/// Keeps at most `capacity` counters, a new value replaces the one with the lowest count and
+/// inherits it as its error. Merged summaries keep this guarantee. Summaries of exact counts
+/// (`from_counts`) keep only the most frequent values instead, with the count of the next one
+/// as bound of all values left out.
+#[derive(Clone, Debug, Deserialize, Serialize, PartialEq)]
+pub struct TopK {
+    capacity: usize,
+    /// Ordered by descending count
+    counters: Vec<Counter>,
+    /// Most occurrences of a value without counter, the lowest count of a full summary if unknown
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    bound: Option<u64>,
+}
+
+impl TopK {
+    pub fn new(capacity: usize) -> Self {
+        Self {
+            capacity: capacity.max(1),
+            counters: Vec::new(),
+            bound: None,
+        }
+    }
+
+    /// Summary of exactly counted values, keeping the `capacity` most frequent ones
+    pub fn from_counts(capacity: usize, counts: impl IntoIterator<Item = (String, u64)>) -> Self {
+        let mut top = Self::new(capacity);
+        let mut counts = counts.into_iter().collect::<Vec<_>>();
+        counts.sort_by(|a, b| b.1.cmp(&a.1).then_with(|| a.0.cmp(&b.0)));
+        top.bound = Some(counts.get(top.capacity).map_or(0, |(_, count)| *count));
+        counts.truncate(top.capacity);
+        top.counters = counts
+            .into_iter()
+            .map(|(value, count)| Counter {
+                value,
+                count,
+                error: 0,
+            })
+            .collect();
+        top
+    }
+
+    /// Most occurrences of a value without counter
+    fn missing(&self) -> u64 {
+        match self.bound {
+            Some(bound) => bound,
+            None if self.is_full() => self.min_count(),
+            None => 0,
+        }
+    }
+
+    fn is_full(&self) -> bool {
+        self.counters.len() >= self.capacity
+    }
+
+    fn min_count(&self) -> u64 {
+        self.counters.last().map_or(0, |counter| counter.count)
+    }
+
+    fn sort(&mut self) {
+        self.counters
+            .sort_by(|a, b| b.count.cmp(&a.count).then_with(|| a.value.cmp(&b.value)));
+    }
+
+    /// Count `count` more occurrences of `value`
+    pub fn offer(&mut self, value: &str, count: u64) {
+        if let Some(counter) = self.counters.iter_mut().find(|c| c.value == value) {
+            counter.count += count;
+        } else if !self.is_full() {
+            self.counters.push(Counter {
+                value: value.to_owned(),
+                count,
+                error: 0,
+            });
+        } else {
+            let min = self.counters.last_mut().unwrap();
+            // the replaced value joins those without counter
+            self.bound = self.bound.map(|bound| bound.max(min.count));
+            *min = Counter {
+                value: value.to_owned(),
+                count: min.count + count,
+                error: min.count,
+            };
+        }
+        self.sort();
+    }
+
+    /// Add the counts of `other`
+    ///
+    /// Values missing from a summary may have occurred as often as its bound.
+    pub fn merge(&mut self, other: &TopK) {
+        let own_min = self.missing();
+        let other_min = other.missing();
+        let mut merged = Vec::with_capacity(self.counters.len() + other.counters.len());
+        for counter in &self.counters {
+            let (count, error) = match other.counters.iter().find(|c| c.value == counter.value) {
+                Some(theirs) => (theirs.count, theirs.error),
+                None => (other_min, other_min),
+            };
+            merged.push(Counter {
+                value: counter.value.clone(),
+                count: counter.count + count,
+                error: counter.error + error,
+            });
+        }
+        for counter in &other.counters {
+            if !self.counters.iter().any(|c| c.value == counter.value) {
+                merged.push(Counter {
+                    value: counter.value.clone(),
+                    count: counter.count + own_min,
+                    error: counter.error + own_min,
+                });
+            }
+        }
+
+        self.capacity = self.capacity.max(other.capacity);
+        self.counters = merged;
+        self.sort();
+        let dropped = self.counters.get(self.capacity).map_or(0, |c| c.count);
+        self.bound = Some((own_min + other_min).max(dropped));
+        self.counters.truncate(self.capacity);
+    }
+
+    /// Up to `n` most frequent values with their estimated counts
+    pub fn top(&self, n: usize) -> impl Iterator<Item = &Counter> {
+        self.counters.iter().take(n)
+    }
+
+    /// Up to `n` values with the most guaranteed occurrences (count - error) and these, leaving
+    /// out values not guaranteed to occur at all
+    pub fn guaranteed(&self, n: usize) -> Vec<(&str, u64)> {
+        let mut values = self
+            .counters
+            .iter()
+            .map(|c| (c.value.as_str(), c.count - c.error))
+            .filter(|(_, count)| *count > 0)
+            .collect::<Vec<_>>();
+        values.sort_by(|a, b| b.1.cmp(&a.1).then_with(|| a.0.cmp(b.0)));
+        values.truncate(n);
+        values
+    }
+}
+
+/// HyperLogLog estimate of the number of distinct values (about 3% standard error)
+#[derive(Clone, Debug, PartialEq)]
+pub struct Hll {
+    registers: Vec<u8>,
+}
+
+impl Default for Hll {
+    fn default() -> Self {
+        Self {
+            registers: vec![0; HLL_REGISTERS],
+        }
+    }
+}
+
+impl Hll {
+    /// Registers as returned by `as_bytes`, empty if they don't fit
+    pub fn from_bytes(registers: Vec<u8>) -> Self {
+        if registers.len() == HLL_REGISTERS {
+            Self { registers }
+        } else {
+            Self::default()
+        }
+    }
+
+    pub fn as_bytes(&self) -> &[u8] {
+        &self.registers
+    }
+
+    pub fn add(&mut self, value: &str) {
+        let hash = hash64(value);
+        let index = (hash >> (64 - HLL_PRECISION)) as usize;
+        let rank = ((hash << HLL_PRECISION).leading_zeros() + 1).min(64 - HLL_PRECISION + 1) as u8;
+        if self.registers[index] < rank {
+            self.registers[index] = rank;
+        }
+    }
+
+    pub fn merge(&mut self, other: &Hll) {
+        for (own, theirs) in self.registers.iter_mut().zip(&other.registers) {
+            *own = (*own).max(*theirs);
+        }
+    }
+
+    pub fn estimate(&self) -> u64 {
+        let m = HLL_REGISTERS as f64;
+        let alpha = 0.7213 / (1.0 + 1.079 / m);
+        let sum: f64 = self
+            .registers
+            .iter()
+            .map(|rank| 2f64.powi(-i32::from(*rank)))
+            .sum();
+        let estimate = alpha * m * m / sum;
+        let zeros = self.registers.iter().filter(|rank| **rank == 0).count();
+        if estimate <= 2.5 * m && zeros > 0 {
+            // linear counting is more accurate for small cardinalities
+            (m * (m / zeros as f64).ln()).round() as u64
+        } else {
+            estimate.round() as u64
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn top_values() {
+        let mut top = TopK::new(2);
+        top.offer("a", 5);
+        top.offer("b", 3);
+        top.offer("c", 1);
+        let counters: Vec<_> = top.top(5).map(|c| (c.value.as_str(), c.count)).collect();
+        assert_eq!(counters, vec![("a", 5), ("c", 4)]);
+
+        let mut other = TopK::new(2);
+        other.offer("b", 10);
+        top.merge(&other);
+        let counters: Vec<_> = top.top(1).map(|c| (c.value.as_str(), c.count)).collect();
+        // "b" might have been among those replaced by "c"
+        assert_eq!(counters, vec![("b", 14)]);
+        assert!(top.top(5).all(|c| c.count >= c.error));
+    }
+
+    #[test]
+    fn many_distinct_values() {
+        // one frequent value among thousands occurring once, counted in two batches
+        let batch = |name: &str| {
+            let mut counts = (0..5000)
+                .map(|i| (format!("{} {}", name, i), 1))
+                .collect::<Vec<_>>();
+            counts.push(("frequent".to_owned(), 50));
+            TopK::from_counts(32, counts)
+        };
+        let mut top = batch("a");
+        assert_eq!(top.guaranteed(2), vec![("frequent", 50), ("a 0", 1)]);
+        top.merge(&batch("b"));
+        let guaranteed = top.guaranteed(5);
+        assert_eq!(guaranteed[0], ("frequent", 100));
+        assert!(guaranteed[1..].iter().all(|(_, count)| *count <= 1));
+
+        // summaries stored before bounds existed
+        let old: TopK = serde_json::from_str(
+            r#"{"capacity":1,"counters":[{"value":"x","count":3,"error":1}]}"#,
+        )
+        .unwrap();
+        assert_eq!(old.missing(), 3);
+    }
+
+    #[test]
+    fn distinct_values() {
+        let mut hll = Hll::default();
+        for i in 0..10000 {
+            hll.add(&format!("value {}", i % 5000));
+        }
+        let estimate = hll.estimate() as f64;
+        assert!((estimate - 5000.0).abs() < 5000.0 * 0.1, "{}", estimate);
+
+        let mut small = Hll::default();
+        small.add("a");
+        small.add("b");
+        small.add("a");
+        assert_eq!(small.estimate(), 2);
+
+        hll.merge(&small);
+        assert_eq!(Hll::from_bytes(hll.as_bytes().to_vec()), hll);
+    }
+}
@@ -0,0 +1,249 @@
+//! Synthetic events in rsyslog's "jsonmesg" format, for benchmarks
+//!
+//! Events come from a handful of hosts and programs, each program with message variables (`$!`)
+//! nested like the ones produced by rsyslog's parsers (mmjsonparse, mmnormalize): web requests
+//! with client details, authentication results, database statements, some events without
+//! variables. The sequence only depends on the seed, so runs are comparable.
+//!
+//! Only built with the `synthetic` feature, production binaries don't need it.
+use serde_json::{json, Value};
+use time::{format_description::well_known::Rfc3339, Duration, OffsetDateTime};
+
+const HOSTS: &[&str] = &[
+    "web01", "web02", "web03", "web04", "db01", "db02", "gw", "mail",
+];
+
+const SEVERITIES: &[&str] = &["3", "4", "5", "6", "6", "6", "6", "7"];
+
+const PATHS: &[&str] = &[
+    "/",
+    "/api/v1/items",
+    "/api/v1/search",
+    "/login",
+    "/static/app.js",
+];
+
+const USERS: &[&str] = &["root", "admin", "deploy", "backup", "alice", "bob"];
+
+pub struct Generator {
+    state: u64,
+    timestamp: OffsetDateTime,
+    step: Duration,
+}
+
+impl Generator {
+    /// Events starting at `start`, `step` apart
+    pub fn new(seed: u64, start: OffsetDateTime, step: Duration) -> Self {
+        Self {
+            // xorshift gets stuck at zero
+            state: seed | 1,
+            timestamp: start,
+            step,
+        }
+    }
+
+    fn random(&mut self) -> u64 {
+        // xorshift64*
+        self.state ^= self.state >> 12;
+        self.state ^= self.state << 25;
+        self.state ^= self.state >> 27;
+        self.state.wrapping_mul(0x2545_f491_4f6c_dd1d)
+    }
+
+    fn below(&mut self, n: usize) -> usize {
+        (self.random() % n as u64) as usize
+    }
+
+    fn pick<'a>(&mut self, values: &[&'a str]) -> &'a str {
+        values[self.below(values.len())]
+    }
+
+    fn address(&mut self) -> String {
+        format!(
+            "10.{}.{}.{}",
+            self.below(4),
+            self.below(256),
+            self.below(254) + 1
+        )
+    }
+
+    /// Program name, facility, message and message variables
+    fn message(&mut self) -> (&'static str, &'static str, String, Option<Value>) {
+        match self.below(10) {
+            0..=3 => {
+                let method = if self.below(4) == 0 { "POST" } else { "GET" };
+                let path = self.pick(PATHS);
+                let status = [200, 200, 200, 200, 304, 404, 500][self.below(7)];
+                let client = self.address();
+                let duration = self.below(2000);
+                (
+                    "nginx",
+                    "16",
+                    format!(
+                        "{} - - \"{} {} HTTP/1.1\" {} {}",
+                        client,
+                        method,
+                        path,
+                        status,
+                        self.below(65536)
+                    ),
+                    Some(json!({
+                        "http": {
+                            "method": method,
+                            "path": path,
+                            "status": status,
+                            "duration": duration,
+                            "client": {
+                                "ip": client,
+                                "agent": "Mozilla/5.0 (X11; Linux x86_64; rv:93.0) Gecko/20100101 Firefox/93.0",
+                            },
+                        },
+                        "tags": ["web", "frontend"],
+                    })),
+                )
+            }
+            4 | 5 => {
+                let user = self.pick(USERS);
+                let source = self.address();
+                let port = 1024 + self.below(64000);
+                let accepted = self.below(3) == 0;
+                let result = if accepted { "Accepted" } else { "Failed" };
+                (
+                    "sshd",
+                    "4",
+                    format!(
+                        "{} password for {} from {} port {} ssh2",
+                        result, user, source, port
+                    ),
+                    Some(json!({
+                        "user": user,
+                        "auth": {
+                            "method": "password",
+                            "result": result.to_lowercase(),
+                        },
+                        "net": {
+                            "src": source,
+                            "port": port,
+                            "proto": "ssh2",
+                        },
+                    })),
+                )
+            }
+            6 | 7 => {
+                let duration = self.below(50000) as f64 / 100.0;
+                let rows = self.below(5000);
+                (
+                    "postgres",
+                    "16",
+                    format!(
+                        "duration: {:.3} ms  statement: insert into logs (tstamp, doc) values ($1, $2)",
+                        duration
+                    ),
+                    Some(json!({
+                        "db": {
+                            "name": "log",
+                            "user": "stuffimport",
+                            "duration_ms": duration,
+                            "statement": {
+                                "kind": "insert",
+                                "rows": rows,
+                                "text": "insert into \"logs\" (tstamp, doc)\n\tvalues ($1, $2)",
+                            },
+                        },
+                        "session": {"pid": 1000 + self.below(30000), "application": null},
+                    })),
+                )
+            }
+            _ => (
+                "kernel",
+                "0",
+                format!(
+                    "[{}.{:06}] eth0: link up, 1000Mbps, full-duplex",
+                    self.below(100000),
+                    self.below(1000000)
+                ),
+                None,
+            ),
+        }
+    }
+
+    /// Next event, a single line of JSON
+    pub fn next_line(&mut self) -> String {
+        let hostname = self.pick(HOSTS);
+        let severity = self.pick(SEVERITIES);
+        let procid = (100 + self.below(30000)).to_string();
+        let (programname, facility, msg, vars) = self.message();
+        let pri = 8 * facility.parse::<u8>().unwrap() + severity.parse::<u8>().unwrap();
+        let timestamp = self.timestamp.format(&Rfc3339).unwrap();
+        self.timestamp += self.step;
+
+        let mut event = json!({
+            "msg": msg,
+            "rawmsg": format!("<{}>{}[{}]: {}", pri, programname, procid, msg),
+            "timereported": timestamp,
+            "hostname": hostname,
+            "syslogtag": format!("{}[{}]:", programname, procid),
+            "inputname": "imudp",
+            "fromhost": hostname,
+            "fromhost-ip": format!("192.168.0.{}", 1 + HOSTS.iter().position(|h| *h == hostname).unwrap()),
+            "pri": pri.to_string(),
+            "syslogfacility": facility,
+            "syslogseverity": severity,
+            "timegenerated": timestamp,
+            "programname": programname,
+            "protocol-version": "0",
+            "structured-data": "-",
+            "app-name": programname,
+            "procid": procid,
+            "msgid": "-",
+        });
+        if let Some(vars) = vars {
+            event["$!"] = vars;
+        }
+        event.to_string()
+    }
+}
+
+impl Iterator for Generator {
+    type Item = String;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        Some(self.next_line())
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::event::{Event, RsyslogdEvent};
+    use time::macros::datetime;
+
+    #[test]
+    fn generated_events() {
+        let start = datetime!(2021-10-21 10:00 UTC);
+        let lines: Vec<_> = Generator::new(42, start, Duration::seconds(1))
+            .take(200)
+            .collect();
+        assert_eq!(
+            lines,
+            Generator::new(42, start, Duration::seconds(1))
+                .take(200)
+                .collect::<Vec<_>>()
+        );
+
+        let events: Vec<_> = lines
+            .iter()
+            .map(|line| Event::from(serde_json::from_str::<RsyslogdEvent>(line).unwrap()))
+            .collect();
+        assert_eq!(events[1].timestamp, start + Duration::seconds(1));
+        assert!(events
+            .iter()
+            .any(|event| event.doc.get("vars.http.client.ip").is_some()));
+        assert!(events
+            .iter()
+            .any(|event| event.doc.get("vars.db.statement.rows").is_some()));
+        assert!(events
+            .iter()
+            .any(|event| event.get_printable("programname").unwrap() == "kernel"));
+    }
+}
@@ -0,0 +1,54 @@
+use criterion::{black_box, criterion_group, criterion_main, Criterion};
+use logstuff_query::{Column, ColumnKind, Columns, ExpressionParser};
+
+const QUERIES: &[(&str, &str)] = &[
+    ("search", r#""Failed password""#),
+    ("compare", r#"hostname = "web01""#),
+    (
+        "dashboard",
+        r#"programname = "nginx" and vars.http.status >= 500 and not vars.http.path like "/static/%""#,
+    ),
+    (
+        "long",
+        r#"(hostname in ("web01", "web02", "web03") or fromhost_ip like "10.1.%") and (syslogseverity in ("err", "warning") or "timeout" or "refused") and not (programname = "CRON" or vars.user in ("backup", "deploy")) and vars.duration > 1000"#,
+    ),
+];
+
+fn columns() -> Columns {
+    let mut columns = Columns::new();
+    columns.insert(
+        "hostname".into(),
+        Column {
+            name: "hostname".into(),
+            kind: ColumnKind::Text,
+            sql_type: "text".into(),
+        },
+    );
+    columns.insert(
+        "vars.duration".into(),
+        Column {
+            name: "duration".into(),
+            kind: ColumnKind::Integer,
+            sql_type: "integer".into(),
+        },
+    );
+    columns
+}
+
+pub fn to_sql(c: &mut Criterion) {
+    let document = ExpressionParser::default();
+    let promoted = ExpressionParser::default()
+        .with_columns(columns())
+        .with_partition_keys(vec!["programname".into()]);
+    for (name, query) in QUERIES {
+        c.bench_function(&format!("to_sql/{}", name), |b| {
+            b.iter(|| document.to_sql(black_box(query), 1))
+        });
+        c.bench_function(&format!("to_sql_columns/{}", name), |b| {
+            b.iter(|| promoted.to_sql(black_box(query), 1))
+        });
+    }
+}
+
+criterion_group!(benches, to_sql);
+criterion_main!(benches);
@@ -1,149 +1,364 @@
-use serde_json::json;
+//! Syntax tree of the query language and its SQL
+//!
+//! Trees borrow identifiers and strings from the query text where possible. SQL is written into a
+//! single buffer for the whole query, `params` holds the query parameters from `param_offset` on.
+use std::borrow::Cow;
+use std::collections::HashMap;
+use std::fmt::Write;
 
-#[derive(Debug, PartialEq)]
-pub struct Identifier(String);
+/// SQL and parameters written by `write` into new buffers
+pub(crate) fn emit(write: impl FnOnce(&mut String, &mut QueryParams)) -> (String, QueryParams) {
+    let mut sql = String::new();
+    let mut params = QueryParams::new();
+    write(&mut sql, &mut params);
+    (sql, params)
+}
+
+/// Placeholder of the next parameter, `value`
+fn push_param(
+    sql: &mut String,
+    params: &mut QueryParams,
+    param_offset: usize,
+    value: serde_json::Value,
+) {
+    write!(sql, "${}", param_offset + params.len()).unwrap();
+    params.push(value);
+}
+
+#[derive(Clone, Debug, PartialEq)]
+pub struct Identifier<'a>(Cow<'a, str>);
+
+impl Identifier<'_> {
+    pub fn name(&self) -> &str {
+        &self.0
+    }
+
+    /// Whether it is a valid identifier of the grammar and thus needs no escaping as SQL literal
+    ///
+    /// Literal keys allow postgres to use expression indexes like `((doc ->> 'hostname'))`.
+    fn is_literal(&self) -> bool {
+        let mut chars = self.0.chars();
+        chars
+            .next()
+            .map_or(false, |c| c.is_ascii_alphabetic() || c == '_')
+            && chars.all(|c| c.is_ascii_alphanumeric() || "._-".contains(c))
+    }
+
+    fn write_key(&self, sql: &mut String, params: &mut QueryParams, param_offset: usize) {
+        if self.is_literal() {
+            write!(sql, "'{}'", self.0).unwrap();
+        } else {
+            sql.push('(');
+            push_param(sql, params, param_offset, self.name().into());
+            sql.push_str("::jsonb #>> '{}')");
+        }
+    }
+
+    pub(crate) fn write_string_getter(
+        &self,
+        sql: &mut String,
+        params: &mut QueryParams,
+        param_offset: usize,
+    ) {
+        sql.push_str("doc ->> ");
+        self.write_key(sql, params, param_offset);
+    }
+
+    pub(crate) fn write_json_getter(
+        &self,
+        sql: &mut String,
+        params: &mut QueryParams,
+        param_offset: usize,
+    ) {
+        sql.push_str("doc -> ");
+        self.write_key(sql, params, param_offset);
+    }
+
+    pub(crate) fn write_numeric_getter(
+        &self,
+        sql: &mut String,
+        params: &mut QueryParams,
+        param_offset: usize,
+    ) {
+        sql.push_str("to_number_or_null(");
+        self.write_string_getter(sql, params, param_offset);
+        sql.push(')');
+    }
 
-impl Identifier {
     pub fn string_getter(&self, param_offset: usize) -> (String, QueryParams) {
-        (
-            format!("doc ->> (${}::jsonb #>> '{{}}')", param_offset),
-            vec![serde_json::Value::from(self.0.to_owned())],
-        )
+        emit(|sql, params| self.write_string_getter(sql, params, param_offset))
     }
 
     pub fn json_getter(&self, param_offset: usize) -> (String, QueryParams) {
-        (
-            format!("doc -> (${}::jsonb #>> '{{}}')", param_offset),
-            vec![serde_json::Value::from(self.0.to_owned())],
-        )
+        emit(|sql, params| self.write_json_getter(sql, params, param_offset))
     }
 
     pub fn numeric_getter(&self, param_offset: usize) -> (String, QueryParams) {
-        let (expr, params) = self.string_getter(param_offset);
-        (format!("to_number_or_null({})", expr), params)
+        emit(|sql, params| self.write_numeric_getter(sql, params, param_offset))
     }
 }
 
-impl From<String> for Identifier {
+impl From<String> for Identifier<'_> {
     fn from(s: String) -> Self {
-        Self(s)
+        Self(Cow::Owned(s))
     }
 }
 
-impl From<&str> for Identifier {
-    fn from(s: &str) -> Self {
-        Self(s.to_string())
+impl<'a> From<&'a str> for Identifier<'a> {
+    fn from(s: &'a str) -> Self {
+        Self(Cow::Borrowed(s))
     }
 }
 
-#[derive(Debug, PartialEq)]
-pub enum Scalar {
+#[derive(Clone, Debug, PartialEq)]
+pub enum Scalar<'a> {
     Int(i64),
     Float(f64),
-    Text(String),
+    Text(Cow<'a, str>),
 }
 
-impl From<i64> for Scalar {
+impl From<i64> for Scalar<'_> {
     fn from(value: i64) -> Self {
         Self::Int(value)
     }
 }
 
-impl From<f64> for Scalar {
+impl From<f64> for Scalar<'_> {
     fn from(value: f64) -> Self {
         Self::Float(value)
     }
 }
 
-impl From<&str> for Scalar {
-    fn from(value: &str) -> Self {
-        Self::Text(value.into())
+impl<'a> From<&'a str> for Scalar<'a> {
+    fn from(value: &'a str) -> Self {
+        Self::Text(Cow::Borrowed(value))
     }
 }
 
-impl From<String> for Scalar {
+impl From<String> for Scalar<'_> {
     fn from(value: String) -> Self {
+        Self::Text(Cow::Owned(value))
+    }
+}
+
+impl<'a> From<Cow<'a, str>> for Scalar<'a> {
+    fn from(value: Cow<'a, str>) -> Self {
         Self::Text(value)
     }
 }
 
-impl Scalar {
-    fn as_json(&self) -> serde_json::Value {
+impl Scalar<'_> {
+    pub(crate) fn as_json(&self) -> serde_json::Value {
         match self {
             Scalar::Int(i) => serde_json::Value::from(*i),
             Scalar::Float(f) => serde_json::Value::from(*f),
-            Scalar::Text(s) => serde_json::Value::from(s.to_owned()),
+            Scalar::Text(s) => serde_json::Value::from(s.as_ref()),
         }
     }
+
+    /// `$n::jsonb #>> '{}'`, the value as text
+    pub(crate) fn write_primitive_param(
+        &self,
+        sql: &mut String,
+        params: &mut QueryParams,
+        param_offset: usize,
+    ) {
+        push_param(sql, params, param_offset, self.as_json());
+        sql.push_str("::jsonb #>> '{}'");
+    }
 }
 
-type List = Vec<Scalar>;
+type List<'a> = Vec<Scalar<'a>>;
 
-#[derive(Debug, PartialEq)]
-pub enum Value {
-    Scalar(Scalar),
-    List(List),
+#[derive(Clone, Debug, PartialEq)]
+pub enum Value<'a> {
+    Scalar(Scalar<'a>),
+    List(List<'a>),
 }
 
-impl Value {
-    pub fn to_sql_primitive_param(&self, param_offset: usize) -> (String, QueryParams) {
+impl Value<'_> {
+    fn list_json(list: &[Scalar]) -> serde_json::Value {
+        list.iter().map(Scalar::as_json).collect()
+    }
+
+    pub(crate) fn write_primitive_param(
+        &self,
+        sql: &mut String,
+        params: &mut QueryParams,
+        param_offset: usize,
+    ) {
         match self {
-            Value::Scalar(value) => (
-                format!("${}::jsonb #>> '{{}}'", param_offset),
-                vec![value.as_json()],
-            ),
-            Value::List(list) => (
-                format!(
-                    "(select jsonb_array_elements(${}::jsonb) #>> '{{}}')",
-                    param_offset
-                ),
-                vec![json!(list
-                    .iter()
-                    .map(|e| e.as_json())
-                    .collect::<Vec<serde_json::Value>>())],
-            ),
+            Value::Scalar(value) => value.write_primitive_param(sql, params, param_offset),
+            Value::List(list) => {
+                sql.push_str("(select jsonb_array_elements(");
+                push_param(sql, params, param_offset, Self::list_json(list));
+                sql.push_str("::jsonb) #>> '{}')");
+            }
         }
     }
 
-    pub fn to_sql_json_param(&self, param_offset: usize) -> (String, QueryParams) {
+    pub(crate) fn write_json_param(
+        &self,
+        sql: &mut String,
+        params: &mut QueryParams,
+        param_offset: usize,
+    ) {
         match self {
-            Value::Scalar(value) => (format!("${}", param_offset), vec![value.as_json()]),
-            Value::List(list) => (
-                format!("${}::jsonb", param_offset),
-                vec![json!(list
-                    .iter()
-                    .map(|e| e.as_json())
-                    .collect::<Vec<serde_json::Value>>())],
-            ),
+            Value::Scalar(value) => push_param(sql, params, param_offset, value.as_json()),
+            Value::List(list) => {
+                push_param(sql, params, param_offset, Self::list_json(list));
+                sql.push_str("::jsonb");
+            }
         }
     }
 
-    pub fn to_sql_numeric_param(&self, param_offset: usize) -> (String, QueryParams) {
+    pub(crate) fn write_numeric_param(
+        &self,
+        sql: &mut String,
+        params: &mut QueryParams,
+        param_offset: usize,
+    ) {
         match self {
-            Value::Scalar(value) => (
-                format!("(${}::jsonb #>> '{{}}')::numeric", param_offset),
-                vec![value.as_json()],
-            ),
+            Value::Scalar(value) => {
+                sql.push('(');
+                push_param(sql, params, param_offset, value.as_json());
+                sql.push_str("::jsonb #>> '{}')::numeric");
+            }
             Value::List(_) => unreachable!(),
         }
     }
+
+    pub fn to_sql_primitive_param(&self, param_offset: usize) -> (String, QueryParams) {
+        emit(|sql, params| self.write_primitive_param(sql, params, param_offset))
+    }
+
+    pub fn to_sql_json_param(&self, param_offset: usize) -> (String, QueryParams) {
+        emit(|sql, params| self.write_json_param(sql, params, param_offset))
+    }
+
+    pub fn to_sql_numeric_param(&self, param_offset: usize) -> (String, QueryParams) {
+        emit(|sql, params| self.write_numeric_param(sql, params, param_offset))
+    }
 }
 
-impl<T> From<T> for Value
+impl<'a, T> From<T> for Value<'a>
 where
-    T: Into<Scalar>,
+    T: Into<Scalar<'a>>,
 {
     fn from(scalar: T) -> Self {
         Self::Scalar(scalar.into())
     }
 }
 
-impl From<List> for Value {
-    fn from(list: List) -> Self {
+impl<'a> From<List<'a>> for Value<'a> {
+    fn from(list: List<'a>) -> Self {
         Self::List(list)
     }
 }
 
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum ColumnKind {
+    Integer,
+    Float,
+    Text,
+}
+
+/// Table column holding the values of an identifier
+///
+/// Text columns are expected to contain `doc ->> identifier`, numeric ones the identifier's
+/// numeric value (or NULL), also of strings containing numbers (see `logstuff::columns`).
+/// Equalities need the JSON document for arrays and the difference between `42` and `"42"`, so
+/// the columns only serve `like` and `in` (text columns) and `<` and friends (numeric ones).
+///
+/// Rows stored before the column was added hold NULL in it, as do rows whose value doesn't fit
+/// a numeric column. Those compare the document instead, so the column's predicate is written
+/// as `((col IS NOT NULL AND col < x) OR (col IS NULL AND to_number_or_null(doc ->> 'key') < x))`.
+/// An index on the column serves both branches.
+#[derive(Clone, Debug, PartialEq)]
+pub struct Column {
+    pub name: String,
+    pub kind: ColumnKind,
+    /// SQL type of the column, e.g. `smallint`
+    pub sql_type: String,
+}
+
+/// Promoted columns by identifier
+pub type Columns = HashMap<String, Column>;
+
+impl Column {
+    /// Whether `value` fits the column's SQL type, false for types not known here
+    pub(crate) fn holds(&self, value: i64) -> bool {
+        match self.sql_type.as_str() {
+            "smallint" | "int2" => i16::try_from(value).is_ok(),
+            "integer" | "int" | "int4" => i32::try_from(value).is_ok(),
+            "bigint" | "int8" => true,
+            _ => false,
+        }
+    }
+
+    /// Write `<column> <predicate>` for rows holding a value in the column and
+    /// `<getter> <predicate>` on the document of the others
+    pub(crate) fn write_or_document(
+        &self,
+        id: &Identifier,
+        predicate: &str,
+        sql: &mut String,
+        params: &mut QueryParams,
+        param_offset: usize,
+    ) {
+        write!(
+            sql,
+            "(({name} IS NOT NULL AND {name} {predicate}) OR ({name} IS NULL AND ",
+            name = self.name,
+            predicate = predicate
+        )
+        .unwrap();
+        match self.kind {
+            ColumnKind::Text => id.write_string_getter(sql, params, param_offset),
+            _ => id.write_numeric_getter(sql, params, param_offset),
+        }
+        write!(sql, " {}))", predicate).unwrap();
+    }
+
+    /// Write the comparison on this column, `false` (writing nothing) if it needs the JSON
+    /// document to give the same results
+    fn write_compare(
+        &self,
+        id: &Identifier,
+        op: &Operator,
+        value: &Value,
+        sql: &mut String,
+        params: &mut QueryParams,
+        param_offset: usize,
+    ) -> bool {
+        let mut predicate = format!("{} ", op.sql_symbol());
+        match (self.kind, op.wanted_operands(), value) {
+            (_, WantedOperandType::Json, _) => return false,
+            (ColumnKind::Text, WantedOperandType::String, value) => {
+                value.write_primitive_param(&mut predicate, params, param_offset);
+            }
+            (ColumnKind::Text, _, _) | (_, WantedOperandType::String, _) => return false,
+            (kind, _, Value::Scalar(scalar)) => {
+                // casting the parameter to the column's type keeps indexes usable, literals the
+                // type can't hold are compared as numeric instead of failing the query
+                let cast = match (kind, scalar) {
+                    (ColumnKind::Integer, Scalar::Int(value)) if self.holds(*value) => {
+                        self.sql_type.as_str()
+                    }
+                    (ColumnKind::Float, _) => self.sql_type.as_str(),
+                    _ => "numeric",
+                };
+                predicate.push('(');
+                push_param(&mut predicate, params, param_offset, scalar.as_json());
+                write!(predicate, "::jsonb #>> '{{}}')::{}", cast).unwrap();
+            }
+            (_, _, Value::List(_)) => return false,
+        }
+        self.write_or_document(id, &predicate, sql, params, param_offset);
+        true
+    }
+}
+
 #[derive(Debug, PartialEq)]
 pub enum WantedOperandType {
     Json,
@@ -151,7 +366,7 @@ pub enum WantedOperandType {
     String,
 }
 
-#[derive(Debug, PartialEq)]
+#[derive(Clone, Debug, PartialEq)]
 pub enum Operator {
     Eq,
     Lt,
@@ -185,79 +400,91 @@ impl Operator {
 }
 
 #[derive(Debug, PartialEq)]
-pub struct Comparison {
-    pub(crate) identifier: Identifier,
+pub struct Comparison<'a> {
+    pub(crate) identifier: Identifier<'a>,
     pub(crate) operator: Operator,
-    pub(crate) value: Value,
+    pub(crate) value: Value<'a>,
 }
 
-#[derive(Debug, PartialEq)]
-pub enum Expression {
-    Compare(Identifier, Operator, Value),
-    And(Box<Expression>, Box<Expression>),
-    Or(Box<Expression>, Box<Expression>),
-    Not(Box<Expression>),
-    FullTextSearch(String),
+#[derive(Clone, Debug, PartialEq)]
+pub enum Expression<'a> {
+    Compare(Identifier<'a>, Operator, Value<'a>),
+    And(Box<Expression<'a>>, Box<Expression<'a>>),
+    Or(Box<Expression<'a>>, Box<Expression<'a>>),
+    Not(Box<Expression<'a>>),
+    FullTextSearch(Cow<'a, str>),
 }
 
 pub type QueryParams = Vec<serde_json::Value>;
 
-impl Expression {
+impl Expression<'_> {
     pub fn to_sql_query(&self, param_offset: usize) -> (String, QueryParams) {
+        self.to_sql_query_with(&Columns::new(), param_offset)
+    }
+
+    /// Like `to_sql_query`, using `columns` instead of the JSON document where possible
+    pub fn to_sql_query_with(
+        &self,
+        columns: &Columns,
+        param_offset: usize,
+    ) -> (String, QueryParams) {
+        emit(|sql, params| self.write_sql(columns, sql, params, param_offset))
+    }
+
+    pub(crate) fn write_sql(
+        &self,
+        columns: &Columns,
+        sql: &mut String,
+        params: &mut QueryParams,
+        param_offset: usize,
+    ) {
         match self {
-            Expression::And(lhs, rhs) => {
-                let (left_expr, left_params) = lhs.to_sql_query(param_offset);
-                let (right_expr, right_params) = rhs.to_sql_query(param_offset + left_params.len());
-                let mut params = left_params;
-                params.extend(right_params);
-                (format!("({} AND {})", left_expr, right_expr), params)
-            }
-            Expression::Or(lhs, rhs) => {
-                let (left_expr, left_params) = lhs.to_sql_query(param_offset);
-                let (right_expr, right_params) = rhs.to_sql_query(param_offset + left_params.len());
-                let mut params = left_params;
-                params.extend(right_params);
-                (format!("({} OR {})", left_expr, right_expr), params)
+            Expression::And(lhs, rhs) | Expression::Or(lhs, rhs) => {
+                let separator = match self {
+                    Expression::And(_, _) => " AND ",
+                    _ => " OR ",
+                };
+                sql.push('(');
+                lhs.write_sql(columns, sql, params, param_offset);
+                sql.push_str(separator);
+                rhs.write_sql(columns, sql, params, param_offset);
+                sql.push(')');
             }
             Expression::Not(expr) => {
-                let (expr, params) = expr.to_sql_query(param_offset);
-                (format!("(NOT {})", expr), params)
+                sql.push_str("(NOT ");
+                expr.write_sql(columns, sql, params, param_offset);
+                sql.push(')');
+            }
+            Expression::FullTextSearch(s) => {
+                sql.push_str("search @@ websearch_to_tsquery(");
+                push_param(sql, params, param_offset, s.as_ref().into());
+                sql.push_str("::jsonb #>> '{}')");
             }
-            Expression::FullTextSearch(s) => (
-                format!(
-                    "search @@ websearch_to_tsquery(${}::jsonb #>> '{{}}')",
-                    param_offset
-                ),
-                vec![serde_json::Value::from(s.to_owned())],
-            ),
             Expression::Compare(id, op, value) => {
-                let (id_expr, value_expr, params) = match op.wanted_operands() {
-                    WantedOperandType::String => {
-                        let (id_expr, mut id_params) = id.string_getter(param_offset);
-                        let (value_expr, value_params) =
-                            value.to_sql_primitive_param(param_offset + id_params.len());
-                        id_params.extend(value_params);
-                        (id_expr, value_expr, id_params)
+                let compiled = columns.get(id.name()).map_or(false, |column| {
+                    column.write_compare(id, op, value, sql, params, param_offset)
+                });
+                if compiled {
+                    return;
+                }
+                let wanted = op.wanted_operands();
+                match wanted {
+                    WantedOperandType::String => id.write_string_getter(sql, params, param_offset),
+                    WantedOperandType::Json => id.write_json_getter(sql, params, param_offset),
+                    WantedOperandType::Numeric => {
+                        id.write_numeric_getter(sql, params, param_offset)
                     }
-                    WantedOperandType::Json => {
-                        let (id_expr, mut id_params) = id.json_getter(param_offset);
-                        let (value_expr, value_params) =
-                            value.to_sql_json_param(param_offset + id_params.len());
-                        id_params.extend(value_params);
-                        (id_expr, value_expr, id_params)
+                }
+                write!(sql, " {} ", op.sql_symbol()).unwrap();
+                match wanted {
+                    WantedOperandType::String => {
+                        value.write_primitive_param(sql, params, param_offset)
                     }
+                    WantedOperandType::Json => value.write_json_param(sql, params, param_offset),
                     WantedOperandType::Numeric => {
-                        let (id_expr, mut id_params) = id.numeric_getter(param_offset);
-                        let (value_expr, value_params) =
-                            value.to_sql_numeric_param(param_offset + id_params.len());
-                        id_params.extend(value_params);
-                        (id_expr, value_expr, id_params)
+                        value.write_numeric_param(sql, params, param_offset)
                     }
-                };
-                (
-                    format!("{} {} {}", id_expr, op.sql_symbol(), value_expr),
-                    params,
-                )
+                }
             }
         }
     }
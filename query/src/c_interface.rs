@@ -1,10 +1,23 @@
+//! C interface for validating and compiling queries, e.g. while they are typed
+//!
+//! The `test_parse_*` functions take NUL terminated strings and return the error location or -1.
+//! The other functions take UTF-8 text as pointer and length, nothing is copied for validation.
+//! Compiled queries are kept in a handle, their SQL, parameters (JSON array) and the tokens
+//! expected at the error location are read from it into buffers of the caller: the functions
+//! return the length of the text and write it NUL terminated if it fits (length < buffer size),
+//! otherwise call again with a larger buffer. Handles are reused for the next query.
+//!
+//! Queries compile to the same SQL as stuffstream's once the parsers know its promoted columns
+//! and partition keys, see `add_column` and `add_partition_key`.
 use lalrpop_util::ParseError;
 use std::ffi::CStr;
 use std::os::raw::c_char;
+use std::{ptr, slice, str};
 
-use crate::query;
+use crate::lexer::{LexError, Lexer};
+use crate::{query, Column, ColumnKind, ExpressionParser, QueryParams};
 
-fn location_from_error<T, E>(err: ParseError<usize, T, E>) -> i32 {
+fn location_from_error<T>(err: ParseError<usize, T, LexError>) -> i32 {
     use lalrpop_util::ParseError::*;
     let location = match err {
         InvalidToken { location } => location,
@@ -14,13 +27,14 @@ fn location_from_error<T, E>(err: ParseError<usize, T, E>) -> i32 {
         } => location,
         UnrecognizedToken { token, expected: _ } => token.0,
         ExtraToken { token } => token.0,
-        _ => 0,
+        User { error } => error.location,
     };
     location.try_into().unwrap_or(0)
 }
 
 pub struct Parsers {
     pub(crate) query: query::ExpressionParser,
+    pub(crate) compiler: ExpressionParser,
     pub(crate) identifier: query::IdentifierParser,
     pub(crate) scalar: query::ScalarParser,
     pub(crate) list: query::ListParser,
@@ -31,6 +45,7 @@ impl Parsers {
     fn new() -> Self {
         Self {
             query: query::ExpressionParser::new(),
+            compiler: ExpressionParser::default(),
             identifier: query::IdentifierParser::new(),
             scalar: query::ScalarParser::new(),
             list: query::ListParser::new(),
@@ -51,12 +66,71 @@ pub unsafe extern "C" fn delete_parsers(parsers: *mut Parsers) {
     Box::from_raw(parsers);
 }
 
+/// # Safety
+/// C interface only. Do not use this in rust code.
+///
+/// Compile `like`, `in` and ordering comparisons on `identifier` to predicates on the column
+/// `name` of SQL type `sql_type`, `kind` is 0 for integer, 1 for float and 2 for text columns.
+/// Returns false for other kinds and texts that aren't UTF-8.
+#[no_mangle]
+pub unsafe extern "C" fn add_column(
+    parsers: *mut Parsers,
+    identifier: *const c_char,
+    name: *const c_char,
+    kind: i32,
+    sql_type: *const c_char,
+) -> bool {
+    let kind = match kind {
+        0 => ColumnKind::Integer,
+        1 => ColumnKind::Float,
+        2 => ColumnKind::Text,
+        _ => return false,
+    };
+    let text = |text| CStr::from_ptr(text).to_str().map(str::to_owned);
+    match (text(identifier), text(name), text(sql_type)) {
+        (Ok(identifier), Ok(name), Ok(sql_type)) => {
+            (*parsers).compiler.columns.insert(
+                identifier,
+                Column {
+                    name,
+                    kind,
+                    sql_type,
+                },
+            );
+            true
+        }
+        _ => false,
+    }
+}
+
+/// # Safety
+/// C interface only. Do not use this in rust code.
+///
+/// Compare equalities on `identifier` by the partition key expression, a field the log table has
+/// list or hash partitions for. Returns false if it isn't UTF-8.
+#[no_mangle]
+pub unsafe extern "C" fn add_partition_key(
+    parsers: *mut Parsers,
+    identifier: *const c_char,
+) -> bool {
+    match CStr::from_ptr(identifier).to_str() {
+        Ok(identifier) => {
+            (*parsers)
+                .compiler
+                .partition_keys
+                .push(identifier.to_owned());
+            true
+        }
+        Err(_) => false,
+    }
+}
+
 /// # Safety
 /// C interface only. Do not use this in rust code.
 #[no_mangle]
 pub unsafe extern "C" fn test_parse_query(parsers: *mut Parsers, text: *const c_char) -> i32 {
-    let s = CStr::from_ptr(text).to_string_lossy().into_owned();
-    match (*parsers).query.parse(&s) {
+    let s = CStr::from_ptr(text).to_string_lossy();
+    match (*parsers).query.parse(&s, Lexer::new(&s)) {
         Ok(_) => -1,
         Err(err) => location_from_error(err),
     }
@@ -66,8 +140,8 @@ pub unsafe extern "C" fn test_parse_query(parsers: *mut Parsers, text: *const c_
 /// C interface only. Do not use this in rust code.
 #[no_mangle]
 pub unsafe extern "C" fn test_parse_identifier(parsers: *mut Parsers, text: *const c_char) -> i32 {
-    let s = CStr::from_ptr(text).to_string_lossy().into_owned();
-    match (*parsers).identifier.parse(&s) {
+    let s = CStr::from_ptr(text).to_string_lossy();
+    match (*parsers).identifier.parse(&s, Lexer::new(&s)) {
         Ok(_) => -1,
         Err(err) => location_from_error(err),
     }
@@ -77,8 +151,8 @@ pub unsafe extern "C" fn test_parse_identifier(parsers: *mut Parsers, text: *con
 /// C interface only. Do not use this in rust code.
 #[no_mangle]
 pub unsafe extern "C" fn test_parse_scalar(parsers: *mut Parsers, text: *const c_char) -> i32 {
-    let s = CStr::from_ptr(text).to_string_lossy().into_owned();
-    match (*parsers).scalar.parse(&s) {
+    let s = CStr::from_ptr(text).to_string_lossy();
+    match (*parsers).scalar.parse(&s, Lexer::new(&s)) {
         Ok(_) => -1,
         Err(err) => location_from_error(err),
     }
@@ -88,8 +162,8 @@ pub unsafe extern "C" fn test_parse_scalar(parsers: *mut Parsers, text: *const c
 /// C interface only. Do not use this in rust code.
 #[no_mangle]
 pub unsafe extern "C" fn test_parse_list(parsers: *mut Parsers, text: *const c_char) -> i32 {
-    let s = CStr::from_ptr(text).to_string_lossy().into_owned();
-    match (*parsers).list.parse(&s) {
+    let s = CStr::from_ptr(text).to_string_lossy();
+    match (*parsers).list.parse(&s, Lexer::new(&s)) {
         Ok(_) => -1,
         Err(err) => location_from_error(err),
     }
@@ -99,13 +173,189 @@ pub unsafe extern "C" fn test_parse_list(parsers: *mut Parsers, text: *const c_c
 /// C interface only. Do not use this in rust code.
 #[no_mangle]
 pub unsafe extern "C" fn test_parse_term(parsers: *mut Parsers, text: *const c_char) -> i32 {
-    let s = CStr::from_ptr(text).to_string_lossy().into_owned();
-    match (*parsers).term.parse(&s) {
+    let s = CStr::from_ptr(text).to_string_lossy();
+    match (*parsers).term.parse(&s, Lexer::new(&s)) {
         Ok(_) => -1,
         Err(err) => location_from_error(err),
     }
 }
 
+/// Text of `text` and `length`, the location of invalid UTF-8 otherwise
+unsafe fn from_raw<'a>(text: *const c_char, length: usize) -> Result<&'a str, usize> {
+    if length == 0 {
+        return Ok("");
+    }
+    str::from_utf8(slice::from_raw_parts(text.cast(), length)).map_err(|err| err.valid_up_to())
+}
+
+/// Copy `text` to `buffer` if it fits with its terminating NUL, returns the length of `text`
+unsafe fn to_buffer(text: &[u8], buffer: *mut c_char, buffer_size: usize) -> usize {
+    if !buffer.is_null() && text.len() < buffer_size {
+        ptr::copy_nonoverlapping(text.as_ptr(), buffer.cast(), text.len());
+        *buffer.add(text.len()) = 0;
+    }
+    text.len()
+}
+
+/// Like `test_parse_query`, an empty query is valid (it matches all events)
+fn validate(parsers: &Parsers, text: Result<&str, usize>) -> i32 {
+    match text {
+        Ok("") => -1,
+        Ok(text) => parsers
+            .query
+            .parse(text, Lexer::new(text))
+            .map_or_else(location_from_error, |_| -1),
+        Err(location) => location.try_into().unwrap_or(0),
+    }
+}
+
+/// # Safety
+/// C interface only. Do not use this in rust code.
+///
+/// Error location of the query `text` of `length` bytes, or -1 if it is valid.
+#[no_mangle]
+pub unsafe extern "C" fn validate_query(
+    parsers: *const Parsers,
+    text: *const c_char,
+    length: usize,
+) -> i32 {
+    validate(&*parsers, from_raw(text, length))
+}
+
+/// # Safety
+/// C interface only. Do not use this in rust code.
+///
+/// Validate `count` queries (`texts[i]` of `lengths[i]` bytes), writing their error locations (or
+/// -1) to `locations`.
+#[no_mangle]
+pub unsafe extern "C" fn validate_queries(
+    parsers: *const Parsers,
+    texts: *const *const c_char,
+    lengths: *const usize,
+    count: usize,
+    locations: *mut i32,
+) {
+    if count == 0 {
+        return;
+    }
+    let texts = slice::from_raw_parts(texts, count);
+    let lengths = slice::from_raw_parts(lengths, count);
+    let locations = slice::from_raw_parts_mut(locations, count);
+    for ((text, length), location) in texts.iter().zip(lengths).zip(locations) {
+        *location = validate(&*parsers, from_raw(*text, *length));
+    }
+}
+
+/// Compiled query, read by the `compiled_*` functions
+#[derive(Default)]
+pub struct Compiled {
+    sql: String,
+    params: QueryParams,
+    params_json: Vec<u8>,
+    error_location: Option<usize>,
+    /// Tokens expected at the error location, one per line
+    expected: String,
+}
+
+#[no_mangle]
+pub extern "C" fn init_compiled() -> *mut Compiled {
+    Box::into_raw(Box::default())
+}
+
+/// # Safety
+/// C interface only. Do not use this in rust code.
+#[no_mangle]
+pub unsafe extern "C" fn delete_compiled(compiled: *mut Compiled) {
+    drop(Box::from_raw(compiled));
+}
+
+impl Compiled {
+    fn compile(&mut self, compiler: &ExpressionParser, text: Result<&str, usize>, offset: usize) {
+        self.params_json.clear();
+        self.expected.clear();
+        self.error_location = None;
+        let result = text
+            .map_err(|location| crate::ParseError {
+                location,
+                expected: Vec::new(),
+            })
+            .and_then(|text| compiler.to_sql_into(text, offset, &mut self.sql, &mut self.params));
+        match result {
+            Ok(()) => serde_json::to_writer(&mut self.params_json, &self.params).unwrap(),
+            Err(err) => {
+                self.sql.clear();
+                self.params.clear();
+                self.error_location = Some(err.location);
+                for token in &err.expected {
+                    // terminals are quoted, e.g. "\"and\""
+                    self.expected.push_str(token.trim_matches('"'));
+                    self.expected.push('\n');
+                }
+            }
+        }
+    }
+}
+
+/// # Safety
+/// C interface only. Do not use this in rust code.
+///
+/// Compile the query `text` of `length` bytes into `compiled`, numbering its parameters from
+/// `param_offset` on (`$1` for 1). Returns its error location, or -1 if it is valid.
+#[no_mangle]
+pub unsafe extern "C" fn compile_query(
+    parsers: *const Parsers,
+    compiled: *mut Compiled,
+    text: *const c_char,
+    length: usize,
+    param_offset: usize,
+) -> i32 {
+    let compiled = &mut *compiled;
+    compiled.compile(&(*parsers).compiler, from_raw(text, length), param_offset);
+    compiled
+        .error_location
+        .map_or(-1, |location| location.try_into().unwrap_or(0))
+}
+
+/// # Safety
+/// C interface only. Do not use this in rust code.
+///
+/// SQL expression of the compiled query, empty if it is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn compiled_sql(
+    compiled: *const Compiled,
+    buffer: *mut c_char,
+    buffer_size: usize,
+) -> usize {
+    to_buffer((*compiled).sql.as_bytes(), buffer, buffer_size)
+}
+
+/// # Safety
+/// C interface only. Do not use this in rust code.
+///
+/// Query parameters of the compiled query as JSON array, empty if it is invalid.
+#[no_mangle]
+pub unsafe extern "C" fn compiled_params(
+    compiled: *const Compiled,
+    buffer: *mut c_char,
+    buffer_size: usize,
+) -> usize {
+    to_buffer(&(*compiled).params_json, buffer, buffer_size)
+}
+
+/// # Safety
+/// C interface only. Do not use this in rust code.
+///
+/// Tokens expected at the error location of the compiled query, each one followed by a newline.
+/// Empty for valid queries and for errors within a token.
+#[no_mangle]
+pub unsafe extern "C" fn compiled_expected(
+    compiled: *const Compiled,
+    buffer: *mut c_char,
+    buffer_size: usize,
+) -> usize {
+    to_buffer((*compiled).expected.as_bytes(), buffer, buffer_size)
+}
+
 #[cfg(test)]
 mod test {
     use super::*;
@@ -123,4 +373,127 @@ mod test {
             delete_parsers(p);
         }
     }
+
+    fn read(
+        compiled: *const Compiled,
+        read: unsafe extern "C" fn(*const Compiled, *mut c_char, usize) -> usize,
+    ) -> String {
+        unsafe {
+            let length = read(compiled, ptr::null_mut(), 0);
+            let mut buffer = vec![0u8; length + 1];
+            assert_eq!(
+                read(compiled, buffer.as_mut_ptr().cast(), buffer.len()),
+                length
+            );
+            assert_eq!(buffer.pop(), Some(0));
+            String::from_utf8(buffer).unwrap()
+        }
+    }
+
+    #[test]
+    fn validate_and_compile() {
+        let p = init_parsers();
+        let queries = ["a = 1", "", "a = ", "x = \"\\q\"", "\"ok\" and"];
+        let texts: Vec<*const c_char> = queries.iter().map(|q| q.as_ptr().cast()).collect();
+        let lengths: Vec<_> = queries.iter().map(|q| q.len()).collect();
+        let mut locations = vec![0; queries.len()];
+        let invalid = [b'a', b' ', 0xff];
+        unsafe {
+            validate_queries(
+                p,
+                texts.as_ptr(),
+                lengths.as_ptr(),
+                queries.len(),
+                locations.as_mut_ptr(),
+            );
+            assert_eq!(locations, [-1, -1, 3, 4, 8]);
+            // not NUL terminated, only `length` bytes count
+            assert_eq!(validate_query(p, "a = 1 and".as_ptr().cast(), 5), -1);
+            assert_eq!(validate_query(p, invalid.as_ptr().cast(), invalid.len()), 2);
+
+            let c = init_compiled();
+            let text = "hostname = \"web\" or hostname = \"db\"";
+            assert_eq!(compile_query(p, c, text.as_ptr().cast(), text.len(), 3), -1);
+            assert_eq!(
+                read(c, compiled_sql),
+                "(doc @> $3::jsonb OR doc @> $4::jsonb OR doc @> $5::jsonb OR doc @> $6::jsonb)"
+            );
+            assert_eq!(
+                read(c, compiled_params),
+                r#"[{"hostname":"web"},{"hostname":["web"]},{"hostname":"db"},{"hostname":["db"]}]"#
+            );
+            assert_eq!(read(c, compiled_expected), "");
+            let mut small = [1 as c_char; 4];
+            assert_eq!(compiled_params(c, small.as_mut_ptr(), small.len()), 79);
+            assert_eq!(small, [1; 4]);
+
+            // the handle is reused
+            let text = "a = 1 or";
+            assert_eq!(compile_query(p, c, text.as_ptr().cast(), text.len(), 1), 8);
+            assert_eq!(read(c, compiled_sql), "");
+            assert_eq!(read(c, compiled_params), "");
+            let expected = read(c, compiled_expected);
+            assert!(expected.lines().any(|token| token == "not"));
+            assert!(expected.lines().any(|token| token == "identifier"));
+            assert!(expected.ends_with('\n'));
+            delete_compiled(c);
+            delete_parsers(p);
+        }
+    }
+
+    #[test]
+    fn compile_with_columns() {
+        let p = init_parsers();
+        let c = init_compiled();
+        let text = |text: &[u8]| CStr::from_bytes_with_nul(text).unwrap().as_ptr();
+        unsafe {
+            assert!(add_column(
+                p,
+                text(b"hostname\0"),
+                text(b"hostname\0"),
+                2,
+                text(b"text\0")
+            ));
+            assert!(!add_column(
+                p,
+                text(b"a\0"),
+                text(b"a\0"),
+                3,
+                text(b"text\0")
+            ));
+            assert!(add_partition_key(p, text(b"programname\0")));
+
+            let query = "hostname in (\"web\", \"db\")";
+            assert_eq!(
+                compile_query(p, c, query.as_ptr().cast(), query.len(), 1),
+                -1
+            );
+            assert_eq!(
+                read(c, compiled_sql),
+                "((hostname IS NOT NULL AND hostname IN (select jsonb_array_elements($1::jsonb) #>> '{}')) \
+                 OR (hostname IS NULL AND doc ->> 'hostname' IN (select jsonb_array_elements($1::jsonb) #>> '{}')))"
+            );
+            assert_eq!(read(c, compiled_params), r#"[["web","db"]]"#);
+
+            let query = "programname = \"sshd\"";
+            assert_eq!(
+                compile_query(p, c, query.as_ptr().cast(), query.len(), 1),
+                -1
+            );
+            assert_eq!(
+                read(c, compiled_sql),
+                "doc ->> 'programname' = $1::jsonb #>> '{}'"
+            );
+            assert_eq!(read(c, compiled_params), r#"["sshd"]"#);
+
+            let query = "programname in ()";
+            assert_eq!(
+                compile_query(p, c, query.as_ptr().cast(), query.len(), 1),
+                -1
+            );
+            assert_eq!(read(c, compiled_sql), "false");
+            delete_compiled(c);
+            delete_parsers(p);
+        }
+    }
 }
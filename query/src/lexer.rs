@@ -0,0 +1,289 @@
+//! Tokens of the query language, fed to the parsers generated from `query.lalrpop`
+//!
+//! String literals are decoded in a single pass while scanning them. Without escapes they borrow
+//! from the query text, as identifiers always do.
+use std::borrow::Cow;
+
+#[derive(Clone, Debug, PartialEq)]
+pub enum Token<'input> {
+    Identifier(&'input str),
+    Integer(i64),
+    Float(f64),
+    /// Quoted string, unescaped
+    Text(Cow<'input, str>),
+    Eq,
+    Lt,
+    Le,
+    Gt,
+    Ge,
+    Like,
+    In,
+    And,
+    Or,
+    Not,
+    LParen,
+    RParen,
+    /// `()` without whitespace in between, the empty list
+    EmptyList,
+    Comma,
+}
+
+/// No token starts at `location`, or the one starting there is malformed
+#[derive(Clone, Debug, PartialEq)]
+pub struct LexError {
+    pub location: usize,
+}
+
+pub type Spanned<'input> = Result<(usize, Token<'input>, usize), LexError>;
+
+pub struct Lexer<'input> {
+    input: &'input str,
+    position: usize,
+}
+
+fn is_identifier_start(c: u8) -> bool {
+    c.is_ascii_alphabetic() || c == b'_'
+}
+
+fn is_identifier_char(c: u8) -> bool {
+    c.is_ascii_alphanumeric() || b"._-".contains(&c)
+}
+
+impl<'input> Lexer<'input> {
+    pub fn new(input: &'input str) -> Self {
+        Self { input, position: 0 }
+    }
+
+    /// Length of the ASCII digits at `start`
+    fn digits(&self, start: usize) -> usize {
+        self.input.as_bytes()[start..]
+            .iter()
+            .take_while(|c| c.is_ascii_digit())
+            .count()
+    }
+
+    /// `[a-zA-Z_][a-zA-Z0-9._-]*`, keywords are identifiers of their own
+    fn identifier(&mut self, start: usize) -> Token<'input> {
+        let length = self.input.as_bytes()[start..]
+            .iter()
+            .take_while(|c| is_identifier_char(**c))
+            .count();
+        self.position = start + length;
+        match &self.input[start..self.position] {
+            "like" => Token::Like,
+            "in" => Token::In,
+            "and" => Token::And,
+            "or" => Token::Or,
+            "not" => Token::Not,
+            identifier => Token::Identifier(identifier),
+        }
+    }
+
+    /// `0|-?[1-9][0-9]*` or `-?(0|[1-9][0-9]*)\.[0-9]+`, no leading zeros and no `-0`
+    fn number(&mut self, start: usize) -> Result<Token<'input>, LexError> {
+        let error = LexError { location: start };
+        let bytes = self.input.as_bytes();
+        let negative = bytes[start] == b'-';
+        let integer_start = start + usize::from(negative);
+        let integer_length = self.digits(integer_start);
+        let leading_zero = bytes.get(integer_start) == Some(&b'0');
+        if integer_length == 0 || (leading_zero && integer_length > 1) {
+            return Err(error);
+        }
+
+        let mut end = integer_start + integer_length;
+        let fraction = bytes.get(end) == Some(&b'.') && self.digits(end + 1) > 0;
+        if fraction {
+            end += 1 + self.digits(end + 1);
+        }
+        let text = &self.input[start..end];
+        self.position = end;
+        if fraction {
+            text.parse().map(Token::Float).map_err(|_| error)
+        } else if negative && leading_zero {
+            Err(error)
+        } else {
+            text.parse().map(Token::Integer).map_err(|_| error)
+        }
+    }
+
+    /// String quoted with `quote`, which may be escaped like `\t`, `\n`, `\r` and `\\`
+    fn string(&mut self, start: usize, quote: u8) -> Result<Token<'input>, LexError> {
+        let error = LexError { location: start };
+        let bytes = self.input.as_bytes();
+        let mut decoded: Option<String> = None;
+        // start of the text not yet copied to `decoded`
+        let mut run = start + 1;
+        let mut position = run;
+        while let Some(&c) = bytes.get(position) {
+            if c == quote {
+                let text = &self.input[run..position];
+                self.position = position + 1;
+                return Ok(Token::Text(match decoded {
+                    None => Cow::Borrowed(text),
+                    Some(mut decoded) => {
+                        decoded.push_str(text);
+                        Cow::Owned(decoded)
+                    }
+                }));
+            }
+            if c != b'\\' {
+                position += 1;
+                continue;
+            }
+            let unescaped = match bytes.get(position + 1) {
+                Some(b't') => '\t',
+                Some(b'n') => '\n',
+                Some(b'r') => '\r',
+                Some(b'\\') => '\\',
+                Some(&c) if c == quote => char::from(c),
+                _ => return Err(error),
+            };
+            let decoded = decoded.get_or_insert_with(String::new);
+            decoded.push_str(&self.input[run..position]);
+            decoded.push(unescaped);
+            position += 2;
+            run = position;
+        }
+        Err(error)
+    }
+
+    fn token(&mut self, start: usize) -> Result<Token<'input>, LexError> {
+        let bytes = self.input.as_bytes();
+        let next = bytes.get(start + 1).copied();
+        self.position = start + 1;
+        Ok(match bytes[start] {
+            c if is_identifier_start(c) => self.identifier(start),
+            c if c.is_ascii_digit() || c == b'-' => return self.number(start),
+            c @ (b'"' | b'\'') => return self.string(start, c),
+            b'=' => Token::Eq,
+            b'<' | b'>' if next == Some(b'=') => {
+                self.position += 1;
+                if bytes[start] == b'<' {
+                    Token::Le
+                } else {
+                    Token::Ge
+                }
+            }
+            b'<' => Token::Lt,
+            b'>' => Token::Gt,
+            b'(' if next == Some(b')') => {
+                self.position += 1;
+                Token::EmptyList
+            }
+            b'(' => Token::LParen,
+            b')' => Token::RParen,
+            b',' => Token::Comma,
+            _ => return Err(LexError { location: start }),
+        })
+    }
+}
+
+impl<'input> Iterator for Lexer<'input> {
+    type Item = Spanned<'input>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        let rest = &self.input[self.position..];
+        let start = self.position + rest.len() - rest.trim_start().len();
+        if start == self.input.len() {
+            self.position = start;
+            return None;
+        }
+        Some(match self.token(start) {
+            Ok(token) => Ok((start, token, self.position)),
+            Err(err) => {
+                // nothing sensible follows
+                self.position = self.input.len();
+                Err(err)
+            }
+        })
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn tokens(text: &str) -> Result<Vec<Token<'_>>, LexError> {
+        Lexer::new(text)
+            .map(|spanned| spanned.map(|(_, token, _)| token))
+            .collect()
+    }
+
+    #[test]
+    fn lex_query() {
+        assert_eq!(
+            tokens(" not(vars.a_b-c<=-1.5 or x in () and y>=0)").unwrap(),
+            vec![
+                Token::Not,
+                Token::LParen,
+                Token::Identifier("vars.a_b-c"),
+                Token::Le,
+                Token::Float(-1.5),
+                Token::Or,
+                Token::Identifier("x"),
+                Token::In,
+                Token::EmptyList,
+                Token::And,
+                Token::Identifier("y"),
+                Token::Ge,
+                Token::Integer(0),
+                Token::RParen,
+            ]
+        );
+        assert_eq!(
+            tokens("andy = 'a' ,( )").unwrap(),
+            vec![
+                Token::Identifier("andy"),
+                Token::Eq,
+                Token::Text("a".into()),
+                Token::Comma,
+                Token::LParen,
+                Token::RParen,
+            ]
+        );
+        let spans: Vec<_> = Lexer::new("a < 10")
+            .map(|spanned| {
+                let (start, _, end) = spanned.unwrap();
+                (start, end)
+            })
+            .collect();
+        assert_eq!(spans, vec![(0, 1), (2, 3), (4, 6)]);
+    }
+
+    #[test]
+    fn lex_numbers() {
+        assert_eq!(
+            tokens("-12 0.25").unwrap(),
+            [Token::Integer(-12), Token::Float(0.25)]
+        );
+        assert_eq!(tokens("-0.5").unwrap(), [Token::Float(-0.5)]);
+        assert_eq!(tokens("1.").unwrap_err(), LexError { location: 1 });
+        assert_eq!(tokens("a 01").unwrap_err(), LexError { location: 2 });
+        assert!(tokens("-0").is_err());
+        assert!(tokens("00.1").is_err());
+        assert!(tokens("- 1").is_err());
+        assert!(tokens("99999999999999999999").is_err());
+    }
+
+    #[test]
+    fn lex_strings() {
+        let text = |query| match tokens(query).unwrap().pop() {
+            Some(Token::Text(text)) => text,
+            other => panic!("no string: {:?}", other),
+        };
+        assert!(matches!(text(r#""plain ü""#), Cow::Borrowed("plain ü")));
+        assert!(matches!(text(r#""""#), Cow::Borrowed("")));
+        assert_eq!(text(r#""a\"b\\c\td""#), "a\"b\\c\td");
+        assert_eq!(text(r#"'it\'s'"#), "it's");
+        assert_eq!(text(r#""'\n\r""#), "'\n\r");
+        // an escaped backslash doesn't escape what follows
+        assert_eq!(text(r#""\\n""#), "\\n");
+        assert_eq!(tokens(r#"a = "\'""#).unwrap_err(), LexError { location: 4 });
+        assert!(tokens(r#"'\"'"#).is_err());
+        assert!(tokens(r#""\x""#).is_err());
+        assert!(tokens(r#""open"#).is_err());
+        assert!(tokens(r#""ends with \""#).is_err());
+        assert!(tokens("#").is_err());
+    }
+}
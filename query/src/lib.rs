@@ -4,8 +4,13 @@ use std::fmt;
 
 pub mod ast;
 pub mod c_interface;
+pub mod lexer;
+pub mod matcher;
+pub mod optimizer;
 
-pub use ast::QueryParams;
+pub use ast::{Column, ColumnKind, Columns, QueryParams};
+use lexer::{LexError, Lexer};
+pub use matcher::Matcher;
 
 lalrpop_mod!(
     #[allow(clippy::all)]
@@ -30,7 +35,7 @@ impl IdentifierParser {
         text: &str,
         param_offset: usize,
     ) -> Result<(String, QueryParams), ParseError> {
-        let id = self.parser.parse(text)?;
+        let id = self.parser.parse(text, Lexer::new(text))?;
         Ok(id.string_getter(param_offset))
     }
 
@@ -39,34 +44,88 @@ impl IdentifierParser {
         text: &str,
         param_offset: usize,
     ) -> Result<(String, QueryParams), ParseError> {
-        let id = self.parser.parse(text)?;
+        let id = self.parser.parse(text, Lexer::new(text))?;
         Ok(id.json_getter(param_offset))
     }
 }
 
 pub struct ExpressionParser {
     parser: query::ExpressionParser,
+    columns: Columns,
+    partition_keys: Vec<String>,
 }
 
 impl Default for ExpressionParser {
     fn default() -> Self {
         Self {
             parser: query::ExpressionParser::new(),
+            columns: Columns::new(),
+            partition_keys: Vec::new(),
         }
     }
 }
 
 impl ExpressionParser {
+    /// Compile `like`, `in` and ordering comparisons on promoted identifiers to predicates on their
+    /// columns
+    pub fn with_columns(mut self, columns: Columns) -> Self {
+        self.columns = columns;
+        self
+    }
+
+    /// Compare equalities on these identifiers by the partition key expression, fields the log
+    /// table has list or hash partitions for
+    pub fn with_partition_keys(mut self, partition_keys: Vec<String>) -> Self {
+        self.partition_keys = partition_keys;
+        self
+    }
+
     pub fn to_sql(
         &self,
         text: &str,
         param_offset: usize,
     ) -> Result<(String, QueryParams), ParseError> {
+        let mut sql = String::new();
+        let mut params = QueryParams::new();
+        self.to_sql_into(text, param_offset, &mut sql, &mut params)?;
+        Ok((sql, params))
+    }
+
+    /// Like `to_sql`, replacing the contents of `sql` and `params`, which keep their capacity
+    pub fn to_sql_into(
+        &self,
+        text: &str,
+        param_offset: usize,
+        sql: &mut String,
+        params: &mut QueryParams,
+    ) -> Result<(), ParseError> {
+        sql.clear();
+        params.clear();
         if text.is_empty() {
-            Ok(("1 = 1".into(), QueryParams::new()))
+            sql.push_str("1 = 1");
         } else {
-            let tree = self.parser.parse(&text.to_owned())?;
-            Ok(tree.to_sql_query(param_offset))
+            let tree = self.parser.parse(text, Lexer::new(text))?;
+            optimizer::optimize(&tree, &self.columns, &self.partition_keys).write_sql(
+                &self.columns,
+                sql,
+                params,
+                param_offset,
+            );
+        }
+        Ok(())
+    }
+
+    /// Compile to a `Matcher` evaluating the query on events directly, instead of SQL
+    pub fn to_matcher(&self, text: &str) -> Result<Matcher, ParseError> {
+        if text.is_empty() {
+            Ok(Matcher::all())
+        } else {
+            let tree = self.parser.parse(text, Lexer::new(text))?;
+            Ok(Matcher::with_fields(
+                &tree,
+                &self.columns,
+                &self.partition_keys,
+            ))
         }
     }
 }
@@ -89,8 +148,8 @@ impl fmt::Display for ParseError {
     }
 }
 
-impl<T, E> From<lalrpop_util::ParseError<usize, T, E>> for ParseError {
-    fn from(err: lalrpop_util::ParseError<usize, T, E>) -> Self {
+impl<T> From<lalrpop_util::ParseError<usize, T, LexError>> for ParseError {
+    fn from(err: lalrpop_util::ParseError<usize, T, LexError>) -> Self {
         match err {
             lalrpop_util::ParseError::InvalidToken { location } => Self {
                 location,
@@ -108,8 +167,8 @@ impl<T, E> From<lalrpop_util::ParseError<usize, T, E>> for ParseError {
                 location: token.0,
                 expected: Vec::new(),
             },
-            _ => Self {
-                location: 0,
+            lalrpop_util::ParseError::User { error } => Self {
+                location: error.location,
                 expected: Vec::new(),
             },
         }
@@ -118,20 +177,30 @@ impl<T, E> From<lalrpop_util::ParseError<usize, T, E>> for ParseError {
 
 #[cfg(test)]
 mod test {
-    use super::query;
-    use crate::ast::{Expression, Identifier, Operator, Scalar, Value};
+    use super::{query, ExpressionParser, Lexer};
+    use crate::ast::{
+        Column, ColumnKind, Columns, Expression, Identifier, Operator, Scalar, Value,
+    };
     use serde_json::json;
+    use std::borrow::Cow;
+
+    macro_rules! parse {
+        ($parser:expr, $text:expr) => {{
+            let text = $text;
+            $parser.parse(text, Lexer::new(text))
+        }};
+    }
 
     #[test]
     fn parse_expression() {
         let p = query::ExpressionParser::new();
         assert_eq!(
-            *p.parse(r#"not "fts""#).unwrap(),
+            *parse!(p, r#"not "fts""#).unwrap(),
             Expression::Not(Box::new(Expression::FullTextSearch("fts".into())))
         );
 
         assert_eq!(
-            *p.parse(r#"not "fts1" and "fts2""#).unwrap(),
+            *parse!(p, r#"not "fts1" and "fts2""#).unwrap(),
             Expression::And(
                 Box::new(Expression::Not(Box::new(Expression::FullTextSearch(
                     "fts1".into()
@@ -140,7 +209,7 @@ mod test {
             )
         );
         assert_eq!(
-            *p.parse(r#""fts1" or not "fts2" and "fts3""#).unwrap(),
+            *parse!(p, r#""fts1" or not "fts2" and "fts3""#).unwrap(),
             Expression::Or(
                 Box::new(Expression::FullTextSearch("fts1".into())),
                 Box::new(Expression::And(
@@ -152,7 +221,7 @@ mod test {
             )
         );
         assert_eq!(
-            *p.parse(r#"("a" or "b") and "c""#).unwrap(),
+            *parse!(p, r#"("a" or "b") and "c""#).unwrap(),
             Expression::And(
                 Box::new(Expression::Or(
                     Box::new(Expression::FullTextSearch("a".into())),
@@ -167,11 +236,11 @@ mod test {
     fn parse_term() {
         let p = query::TermParser::new();
         assert_eq!(
-            *p.parse(r#""asdf""#).unwrap(),
+            *parse!(p, r#""asdf""#).unwrap(),
             Expression::FullTextSearch("asdf".into())
         );
         assert_eq!(
-            *p.parse(r#"ident = "value""#).unwrap(),
+            *parse!(p, r#"ident = "value""#).unwrap(),
             Expression::Compare("ident".into(), Operator::Eq, Value::from("value"))
         );
     }
@@ -179,73 +248,85 @@ mod test {
     #[test]
     fn parse_int() {
         let p = query::ScalarParser::new();
-        assert_eq!(p.parse("0").unwrap(), Scalar::from(0));
-        assert_eq!(p.parse("5").unwrap(), Scalar::from(5));
-        assert_eq!(p.parse("12340").unwrap(), Scalar::from(12340));
-        assert!(p.parse("01").is_err());
+        assert_eq!(parse!(p, "0").unwrap(), Scalar::from(0));
+        assert_eq!(parse!(p, "5").unwrap(), Scalar::from(5));
+        assert_eq!(parse!(p, "12340").unwrap(), Scalar::from(12340));
+        assert!(parse!(p, "01").is_err());
     }
 
     #[test]
     fn parse_float() {
         let p = query::ScalarParser::new();
-        assert_eq!(p.parse("0.1").unwrap(), Scalar::from(0.1));
-        assert_eq!(p.parse("5.0").unwrap(), Scalar::from(5.0));
-        assert_eq!(p.parse("12340.321").unwrap(), Scalar::from(12340.321));
-        assert!(p.parse("1.").is_err());
-        assert!(p.parse("00.1").is_err());
+        assert_eq!(parse!(p, "0.1").unwrap(), Scalar::from(0.1));
+        assert_eq!(parse!(p, "5.0").unwrap(), Scalar::from(5.0));
+        assert_eq!(parse!(p, "12340.321").unwrap(), Scalar::from(12340.321));
+        assert!(parse!(p, "1.").is_err());
+        assert!(parse!(p, "00.1").is_err());
     }
 
     #[test]
     fn parse_string() {
         let p = query::ScalarParser::new();
-        assert_eq!(p.parse(r#""asd""#).unwrap(), Scalar::from("asd"));
-        assert_eq!(p.parse(r#""""#).unwrap(), Scalar::from(""));
-        assert_eq!(p.parse(r#""a\"b""#).unwrap(), Scalar::from("a\"b"));
-        assert_eq!(p.parse(r#""a\\b""#).unwrap(), Scalar::from("a\\b"));
-        assert_eq!(p.parse(r#""a\t\n\rb""#).unwrap(), Scalar::from("a\t\n\rb"));
-        assert!(p.parse(r#"" unescaped " quote ""#).is_err());
-        assert!(p.parse(r#""\ ""#).is_err());
-        assert!(p.parse(r#""\x""#).is_err());
+        assert_eq!(parse!(p, r#""asd""#).unwrap(), Scalar::from("asd"));
+        assert_eq!(parse!(p, r#""""#).unwrap(), Scalar::from(""));
+        assert_eq!(parse!(p, r#""a\"b""#).unwrap(), Scalar::from("a\"b"));
+        assert_eq!(parse!(p, r#""a\\b""#).unwrap(), Scalar::from("a\\b"));
+        assert_eq!(
+            parse!(p, r#""a\t\n\rb""#).unwrap(),
+            Scalar::from("a\t\n\rb")
+        );
+        assert!(parse!(p, r#"" unescaped " quote ""#).is_err());
+        assert!(parse!(p, r#""\ ""#).is_err());
+        assert!(parse!(p, r#""\x""#).is_err());
+        // decoded in one pass, an escaped backslash doesn't escape the next character
+        assert_eq!(parse!(p, r#""a\\nb""#).unwrap(), Scalar::from("a\\nb"));
+        assert!(matches!(
+            parse!(p, r#"'plain'"#).unwrap(),
+            Scalar::Text(Cow::Borrowed("plain"))
+        ));
+    }
+
+    #[test]
+    fn parse_error_location() {
+        let p = ExpressionParser::default();
+        assert_eq!(p.to_sql(r#"a = "\x""#, 1).unwrap_err().location, 4);
+        assert_eq!(p.to_sql("a = 1 and", 1).unwrap_err().location, 9);
+        assert_eq!(p.to_sql("a = = 1", 1).unwrap_err().location, 4);
+        assert!(p.to_matcher("a = #").is_err());
     }
 
     #[test]
     fn parse_list() {
         let p = query::ListParser::new();
-        assert_eq!(p.parse("()").unwrap(), Vec::new());
-        assert_eq!(p.parse("(1)").unwrap(), vec![Scalar::from(1)]);
+        assert_eq!(parse!(p, "()").unwrap(), Vec::new());
+        assert_eq!(parse!(p, "(1)").unwrap(), vec![Scalar::from(1)]);
         assert_eq!(
-            p.parse("(1, 2.2, \"three\")").unwrap(),
+            parse!(p, "(1, 2.2, \"three\")").unwrap(),
             vec![Scalar::from(1), Scalar::from(2.2), Scalar::from("three")]
         );
-        assert!(p.parse("(1,)").is_err());
+        assert!(parse!(p, "(1,)").is_err());
     }
 
     #[test]
     fn parse_identifier() {
         let p = query::IdentifierParser::new();
         assert_eq!(
-            p.parse("abc_def-ghi.123").unwrap(),
+            parse!(p, "abc_def-ghi.123").unwrap(),
             Identifier::from("abc_def-ghi.123")
         );
-        assert!(p.parse("0asd").is_err());
-        assert!(p.parse(".asd").is_err());
-        assert!(p.parse("-asd").is_err());
-        assert!(p.parse("").is_err());
+        assert!(parse!(p, "0asd").is_err());
+        assert!(parse!(p, ".asd").is_err());
+        assert!(parse!(p, "-asd").is_err());
+        assert!(parse!(p, "").is_err());
     }
 
     #[test]
     fn to_sql() {
         let (query, params) =
             Expression::Compare("id".into(), Operator::Eq, Value::from(123)).to_sql_query(5);
-        let expected_query = format!(
-            "doc -> ($5::jsonb #>> '{{}}') {} $6",
-            Operator::Eq.sql_symbol()
-        );
+        let expected_query = format!("doc -> 'id' {} $5", Operator::Eq.sql_symbol());
         assert_eq!(query, expected_query);
-        assert_eq!(
-            params,
-            vec![serde_json::Value::from("id"), serde_json::Value::from(123)]
-        );
+        assert_eq!(params, vec![serde_json::Value::from(123)]);
 
         let (query, params) = Expression::FullTextSearch("asdf".into()).to_sql_query(1);
         assert_eq!(query, "search @@ websearch_to_tsquery($1::jsonb #>> '{}')");
@@ -265,6 +346,229 @@ mod test {
         assert_eq!(params, vec!["a", "b"]);
     }
 
+    #[test]
+    fn to_sql_columns() {
+        let columns = [
+            ("hostname", ColumnKind::Text, "text"),
+            ("syslogseverity", ColumnKind::Integer, "smallint"),
+        ]
+        .iter()
+        .map(|(name, kind, sql_type)| {
+            (
+                name.to_string(),
+                Column {
+                    name: name.to_string(),
+                    kind: *kind,
+                    sql_type: sql_type.to_string(),
+                },
+            )
+        })
+        .collect::<Columns>();
+        let compare = |id: &str, op, value: Value| {
+            Expression::Compare(id.into(), op, value)
+                .to_sql_query_with(&columns, 1)
+                .0
+        };
+
+        // rows without a value in the column (e.g. stored before it was added) compare the
+        // document
+        let or_document = |column: &str, getter: &str, predicate: &str| {
+            format!(
+                "(({column} IS NOT NULL AND {column} {predicate}) OR ({column} IS NULL AND {getter} {predicate}))",
+                column = column,
+                getter = getter,
+                predicate = predicate
+            )
+        };
+        let hostname = |predicate| or_document("hostname", "doc ->> 'hostname'", predicate);
+        let severity = |predicate| {
+            or_document(
+                "syslogseverity",
+                "to_number_or_null(doc ->> 'syslogseverity')",
+                predicate,
+            )
+        };
+        assert_eq!(
+            compare(
+                "hostname",
+                Operator::In,
+                Value::from(vec![Scalar::from("h")])
+            ),
+            hostname("IN (select jsonb_array_elements($1::jsonb) #>> '{}')")
+        );
+        assert_eq!(
+            compare("hostname", Operator::Like, Value::from("h%")),
+            hostname("LIKE $1::jsonb #>> '{}'")
+        );
+        assert_eq!(
+            compare("syslogseverity", Operator::Le, Value::from(3)),
+            severity("<= ($1::jsonb #>> '{}')::smallint")
+        );
+        // out of the column type's range, compared without failing the query
+        assert_eq!(
+            compare("syslogseverity", Operator::Lt, Value::from(100000)),
+            severity("< ($1::jsonb #>> '{}')::numeric")
+        );
+        assert_eq!(
+            compare("syslogseverity", Operator::Gt, Value::from(-3000000000)),
+            severity("> ($1::jsonb #>> '{}')::numeric")
+        );
+        assert_eq!(
+            compare("syslogseverity", Operator::Gt, Value::from(2.5)),
+            severity("> ($1::jsonb #>> '{}')::numeric")
+        );
+        // equalities need the document for arrays and JSON types
+        for (id, value) in [
+            ("hostname", Value::from("host")),
+            ("syslogseverity", Value::from(3)),
+        ] {
+            assert_eq!(
+                compare(id, Operator::Eq, value.clone()),
+                Expression::Compare(id.into(), Operator::Eq, value)
+                    .to_sql_query(1)
+                    .0
+            );
+        }
+        assert_eq!(
+            compare("other", Operator::Gt, Value::from(1)),
+            "to_number_or_null(doc ->> 'other') > ($1::jsonb #>> '{}')::numeric"
+        );
+    }
+
+    #[test]
+    fn optimize_expression() {
+        let compare = |id: &'static str, value: Value<'static>| {
+            Box::new(Expression::Compare(id.into(), Operator::Eq, value))
+        };
+        let optimized = |expr: &Expression| {
+            crate::optimizer::optimize(expr, &Columns::new(), &[]).to_sql_query(&Columns::new(), 1)
+        };
+
+        let (query, params) = optimized(&Expression::And(
+            Box::new(Expression::And(
+                compare("hostname", Value::from(vec![Scalar::from("host")])),
+                Box::new(Expression::FullTextSearch("text".into())),
+            )),
+            compare("vars.port", Value::from(vec![Scalar::from(22)])),
+        ));
+        assert_eq!(
+            query,
+            "(doc @> $1::jsonb AND search @@ websearch_to_tsquery($2::jsonb #>> '{}'))"
+        );
+        assert_eq!(params[0], json!({"hostname": ["host"], "vars.port": [22]}));
+
+        // scalars also match arrays containing them
+        let (query, params) = optimized(&compare("tags", Value::from("a")));
+        assert_eq!(query, "(doc @> $1::jsonb OR doc @> $2::jsonb)");
+        assert_eq!(params, vec![json!({"tags": "a"}), json!({"tags": ["a"]})]);
+
+        // no IN on JSON values, `1` isn't `"1"`
+        let (query, params) = optimized(&Expression::Or(
+            compare("port", Value::from("1")),
+            compare("port", Value::from(1)),
+        ));
+        assert_eq!(
+            query,
+            "(doc @> $1::jsonb OR doc @> $2::jsonb OR doc @> $3::jsonb OR doc @> $4::jsonb)"
+        );
+        assert_eq!(
+            params,
+            vec![
+                json!({"port": "1"}),
+                json!({"port": ["1"]}),
+                json!({"port": 1}),
+                json!({"port": [1]})
+            ]
+        );
+
+        // same key, different values
+        let (query, params) = optimized(&Expression::And(
+            compare("tags", Value::from(vec![Scalar::from("a")])),
+            compare("tags", Value::from(vec![Scalar::from("b")])),
+        ));
+        assert_eq!(query, "(doc @> $1::jsonb AND doc @> $2::jsonb)");
+        assert_eq!(params, vec![json!({"tags": ["a"]}), json!({"tags": ["b"]})]);
+    }
+
+    #[test]
+    fn partition_keys() {
+        let compare = |id: &'static str, value: Value<'static>| {
+            Box::new(Expression::Compare(id.into(), Operator::Eq, value))
+        };
+        let keys = vec!["hostname".to_owned()];
+        let optimized = |expr: &Expression| {
+            crate::optimizer::optimize(expr, &Columns::new(), &keys)
+                .to_sql_query(&Columns::new(), 1)
+        };
+
+        let (query, params) = optimized(&Expression::And(
+            compare("hostname", Value::from("host")),
+            compare("programname", Value::from("sshd")),
+        ));
+        assert_eq!(
+            query,
+            "(doc ->> 'hostname' = $1::jsonb #>> '{}' AND (doc @> $2::jsonb OR doc @> $3::jsonb))"
+        );
+        assert_eq!(
+            params,
+            vec![
+                json!("host"),
+                json!({"programname": "sshd"}),
+                json!({"programname": ["sshd"]})
+            ]
+        );
+
+        let (query, params) = optimized(&Expression::Or(
+            compare("hostname", Value::from("a")),
+            compare("hostname", Value::from("b")),
+        ));
+        assert_eq!(
+            query,
+            "doc ->> 'hostname' IN ($1::jsonb #>> '{}', $2::jsonb #>> '{}')"
+        );
+        assert_eq!(params, vec![json!("a"), json!("b")]);
+
+        // NULL for events without the key, also when negated
+        let (query, params) = optimized(&Expression::Not(compare("hostname", Value::from(1))));
+        assert_eq!(query, "(NOT doc ->> 'hostname' = $1::jsonb #>> '{}')");
+        assert_eq!(params, vec![json!(1)]);
+
+        let (query, params) = optimized(&Expression::Compare(
+            "hostname".into(),
+            Operator::In,
+            Value::from(Vec::new()),
+        ));
+        assert_eq!(query, "false");
+        assert!(params.is_empty());
+
+        // promoted partition keys compare their column
+        let columns = [(
+            "programname".to_owned(),
+            Column {
+                name: "program".to_owned(),
+                kind: ColumnKind::Text,
+                sql_type: "text".to_owned(),
+            },
+        )]
+        .into_iter()
+        .collect::<Columns>();
+        let keys = vec!["programname".to_owned()];
+        let (query, _) = crate::optimizer::optimize(
+            &Expression::Or(
+                compare("programname", Value::from("a")),
+                compare("programname", Value::from("b")),
+            ),
+            &columns,
+            &keys,
+        )
+        .to_sql_query(&columns, 1);
+        assert_eq!(
+            query,
+            "((program IS NOT NULL AND program IN ($1::jsonb #>> '{}', $2::jsonb #>> '{}')) \
+             OR (program IS NULL AND doc ->> 'programname' IN ($1::jsonb #>> '{}', $2::jsonb #>> '{}')))"
+        );
+    }
+
     #[test]
     fn primitive_sql_value() {
         let (expr, params) = Value::from(123).to_sql_primitive_param(1);
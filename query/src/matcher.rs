@@ -0,0 +1,835 @@
+//! Evaluates expressions on event documents without a database
+//!
+//! A `Matcher` is compiled once from an `Expression` and gives the same answers as its SQL
+//! (`ExpressionParser::to_sql` with the same columns and partition keys) for comparisons:
+//!
+//! * `=` is JSON containment (`doc -> 'key' @> value`): equal scalars, numbers compared by value,
+//!   arrays containing the value or all of the list's values.
+//! * `like` and `in` compare the field's text (`doc ->> 'key'`), `like` patterns are parsed into
+//!   literal runs and wildcards beforehand and `in` lists are sorted for binary search. An empty
+//!   `in` list matches nothing, not even unknown values.
+//! * `<`, `<=`, `>`, `>=` compare fields holding integers (`to_number_or_null`), or the number
+//!   stuffimport stores for promoted numeric columns (`logstuff::columns`) if it fits the column.
+//!   The SQL compares the document where the column is NULL, so this gives the same answers for
+//!   events stored before the column was added.
+//! * Scalar equalities on partition keys compare the field's text, like `in`.
+//!
+//! Comparisons of missing keys, JSON nulls (except for `=`) and of fields without an integer
+//! (for `<` and friends) are unknown, like SQL's NULL. `not`, `and` and `or` follow SQL's three
+//! valued logic, so `not a = 1` doesn't match events without `a`, and only events known to
+//! match are matched.
+//!
+//! Full text searches match whole words of the event's search string (see
+//! `logstuff::event::Event::search_string_into`) case insensitively, like `websearch_to_tsquery`
+//! with `or` and `-word`, but without postgres' stemming and stop words. Quoted phrases need all
+//! of their words, in any order.
+use serde_json::Value as Json;
+use std::cmp::Ordering;
+
+use crate::ast::{Column, ColumnKind, Columns, Expression, Operator, Scalar, Value};
+
+/// Compiled expression, see the module documentation
+#[derive(Debug)]
+pub struct Matcher {
+    root: Node,
+}
+
+#[derive(Debug)]
+enum Node {
+    Constant(Option<bool>),
+    And(Box<Node>, Box<Node>),
+    Or(Box<Node>, Box<Node>),
+    Not(Box<Node>),
+    Contains(String, Json),
+    Like(String, Vec<LikePattern>),
+    In(String, Vec<String>),
+    /// Comparison of the field's number, from its column if it is promoted
+    Numeric(String, Operator, f64, Option<Column>),
+    Search(Vec<SearchGroup>),
+}
+
+/// Part of a LIKE pattern
+#[derive(Debug, PartialEq)]
+enum Token {
+    Literal(String),
+    /// `_`
+    AnyChar,
+    /// `%`
+    AnyString,
+}
+
+#[derive(Debug, PartialEq)]
+struct LikePattern {
+    tokens: Vec<Token>,
+}
+
+/// One alternative of a full text search (they are separated by `or`)
+#[derive(Debug, Default, PartialEq)]
+struct SearchGroup {
+    required: Vec<String>,
+    forbidden: Vec<String>,
+}
+
+/// Text of a JSON value as postgres' `->>` returns it, `None` for null
+fn text(value: &Json) -> Option<String> {
+    match value {
+        Json::Null => None,
+        Json::String(s) => Some(s.to_owned()),
+        other => Some(jsonb_text(other)),
+    }
+}
+
+/// JSON text in postgres' jsonb output format (`[1, 2]`, `{"a": 1}`), keys ordered like jsonb's
+fn jsonb_text(value: &Json) -> String {
+    match value {
+        Json::Array(values) => format!(
+            "[{}]",
+            values.iter().map(jsonb_text).collect::<Vec<_>>().join(", ")
+        ),
+        Json::Object(map) => {
+            let mut entries: Vec<_> = map.iter().collect();
+            entries.sort_by(|(a, _), (b, _)| a.len().cmp(&b.len()).then_with(|| a.cmp(b)));
+            format!(
+                "{{{}}}",
+                entries
+                    .into_iter()
+                    .map(|(key, value)| format!(
+                        "{}: {}",
+                        Json::from(key.as_str()),
+                        jsonb_text(value)
+                    ))
+                    .collect::<Vec<_>>()
+                    .join(", ")
+            )
+        }
+        other => other.to_string(),
+    }
+}
+
+/// Number of a field as its promoted numeric column holds it, see `logstuff::columns`
+fn column_number(column: &Column, value: &Json) -> Option<f64> {
+    match column.kind {
+        ColumnKind::Float => match value {
+            Json::Number(number) => number.as_f64(),
+            Json::String(s) => s.trim().parse().ok(),
+            _ => None,
+        },
+        _ => {
+            let integer = match value {
+                Json::Number(number) => number.as_i64().or_else(|| {
+                    number
+                        .as_f64()
+                        .filter(|f| {
+                            f.fract() == 0.0 && i64::MIN as f64 <= *f && *f <= i64::MAX as f64
+                        })
+                        .map(|f| f as i64)
+                }),
+                Json::String(s) => s.trim().parse().ok(),
+                _ => None,
+            }?;
+            column.holds(integer).then(|| integer as f64)
+        }
+    }
+}
+
+/// Text of a query value as `#>> '{}'` returns it
+fn scalar_text(scalar: &Scalar) -> String {
+    match scalar {
+        Scalar::Text(s) => s.to_string(),
+        other => other.as_json().to_string(),
+    }
+}
+
+fn scalar_eq(lhs: &Json, rhs: &Json) -> bool {
+    match (lhs, rhs) {
+        (Json::Number(a), Json::Number(b)) => a.as_f64() == b.as_f64(),
+        (a, b) => a == b,
+    }
+}
+
+/// `lhs @> rhs` for jsonb
+fn contains(lhs: &Json, rhs: &Json) -> bool {
+    match (lhs, rhs) {
+        (Json::Array(values), Json::Array(wanted)) => wanted
+            .iter()
+            .all(|wanted| values.iter().any(|value| contains(value, wanted))),
+        (Json::Array(values), Json::Object(_)) => values.iter().any(|value| contains(value, rhs)),
+        // an array contains a primitive value if one of its elements equals it
+        (Json::Array(values), wanted) => values.iter().any(|value| scalar_eq(value, wanted)),
+        (Json::Object(map), Json::Object(wanted)) => wanted
+            .iter()
+            .all(|(key, wanted)| map.get(key).map_or(false, |value| contains(value, wanted))),
+        (lhs, rhs) => scalar_eq(lhs, rhs),
+    }
+}
+
+impl LikePattern {
+    /// Parse a pattern with postgres' LIKE syntax, `\` escapes the next character
+    fn new(pattern: &str) -> Self {
+        let mut tokens = Vec::new();
+        let mut literal = String::new();
+        let mut chars = pattern.chars();
+        while let Some(c) = chars.next() {
+            let wildcard = match c {
+                '%' => Token::AnyString,
+                '_' => Token::AnyChar,
+                '\\' => {
+                    literal.extend(chars.next());
+                    continue;
+                }
+                c => {
+                    literal.push(c);
+                    continue;
+                }
+            };
+            if !literal.is_empty() {
+                tokens.push(Token::Literal(std::mem::take(&mut literal)));
+            }
+            // consecutive % are the same as one
+            if !(wildcard == Token::AnyString && tokens.last() == Some(&Token::AnyString)) {
+                tokens.push(wildcard);
+            }
+        }
+        if !literal.is_empty() {
+            tokens.push(Token::Literal(literal));
+        }
+        Self { tokens }
+    }
+
+    fn matches(&self, text: &str) -> bool {
+        match self.tokens.as_slice() {
+            [] => text.is_empty(),
+            [Token::Literal(literal)] => text == literal,
+            [Token::AnyString] => true,
+            [Token::Literal(prefix), Token::AnyString] => text.starts_with(prefix.as_str()),
+            [Token::AnyString, Token::Literal(suffix)] => text.ends_with(suffix.as_str()),
+            [Token::AnyString, Token::Literal(infix), Token::AnyString] => {
+                text.contains(infix.as_str())
+            }
+            tokens => matches_tokens(tokens, text),
+        }
+    }
+}
+
+/// General case: literals and `_` advance, `%` tries all positions from the shortest match on
+///
+/// Only the last `%` needs to be retried, earlier ones can't lead to matches the later one misses.
+fn matches_tokens(tokens: &[Token], text: &str) -> bool {
+    let mut token = 0;
+    let mut position = 0;
+    // token after the last %, position it was tried at
+    let mut backtrack: Option<(usize, usize)> = None;
+    loop {
+        let advanced = match tokens.get(token) {
+            None if position == text.len() => return true,
+            None => None,
+            Some(Token::AnyString) => {
+                backtrack = Some((token + 1, position));
+                Some(position)
+            }
+            Some(Token::AnyChar) => text[position..]
+                .chars()
+                .next()
+                .map(|c| position + c.len_utf8()),
+            Some(Token::Literal(literal)) => {
+                if text[position..].starts_with(literal.as_str()) {
+                    Some(position + literal.len())
+                } else {
+                    None
+                }
+            }
+        };
+        match (advanced, backtrack) {
+            (Some(next), _) => {
+                token += 1;
+                position = next;
+            }
+            (None, Some((after, tried))) => match text[tried..].chars().next() {
+                Some(c) => {
+                    token = after;
+                    position = tried + c.len_utf8();
+                    backtrack = Some((after, position));
+                }
+                None => return false,
+            },
+            (None, None) => return false,
+        }
+    }
+}
+
+impl SearchGroup {
+    fn matches(&self, search: &str) -> bool {
+        self.required.iter().all(|word| has_word(search, word))
+            && !self.forbidden.iter().any(|word| has_word(search, word))
+    }
+}
+
+/// Words of `text` for full text searches
+fn words(text: &str) -> impl Iterator<Item = &str> {
+    text.split(|c: char| !c.is_alphanumeric())
+        .filter(|word| !word.is_empty())
+}
+
+/// Whether `search` contains `word` (lower case) as a whole word, ignoring case
+fn has_word(search: &str, word: &str) -> bool {
+    words(search).any(|candidate| {
+        candidate
+            .chars()
+            .flat_map(char::to_lowercase)
+            .eq(word.chars())
+    })
+}
+
+/// Parse a `websearch_to_tsquery` style query into alternatives
+fn search_groups(query: &str) -> Vec<SearchGroup> {
+    let mut groups = vec![SearchGroup::default()];
+    for (index, part) in query.split('"').enumerate() {
+        // odd parts are quoted
+        if index % 2 == 1 {
+            let group = groups.last_mut().unwrap();
+            group.required.extend(words(part).map(str::to_lowercase));
+            continue;
+        }
+        for term in part.split_whitespace() {
+            if term.eq_ignore_ascii_case("or") {
+                groups.push(SearchGroup::default());
+                continue;
+            }
+            let group = groups.last_mut().unwrap();
+            let (target, term) = match term.strip_prefix('-') {
+                Some(term) => (&mut group.forbidden, term),
+                None => (&mut group.required, term),
+            };
+            target.extend(words(term).map(str::to_lowercase));
+        }
+    }
+    groups.retain(|group| !group.required.is_empty() || !group.forbidden.is_empty());
+    groups
+}
+
+/// Promoted fields and partition keys, which the SQL compares differently
+struct Fields<'f> {
+    columns: &'f Columns,
+    partition_keys: &'f [String],
+}
+
+impl Fields<'_> {
+    /// Whether equalities on `key` compare by text, see `optimizer`
+    fn is_partition_key(&self, key: &str) -> bool {
+        self.columns
+            .get(key)
+            .map_or(true, |column| column.kind == ColumnKind::Text)
+            && self.partition_keys.iter().any(|other| other == key)
+    }
+
+    /// Column `<` and friends compare instead of the document
+    fn numeric_column(&self, key: &str) -> Option<Column> {
+        self.columns
+            .get(key)
+            .filter(|column| column.kind != ColumnKind::Text)
+            .cloned()
+    }
+}
+
+fn compile(expr: &Expression, fields: &Fields) -> Node {
+    let compile = |expr| Box::new(compile(expr, fields));
+    match expr {
+        Expression::And(lhs, rhs) => Node::And(compile(lhs), compile(rhs)),
+        Expression::Or(lhs, rhs) => Node::Or(compile(lhs), compile(rhs)),
+        Expression::Not(expr) => Node::Not(compile(expr)),
+        Expression::FullTextSearch(query) => {
+            let groups = search_groups(query);
+            if groups.is_empty() {
+                // postgres finds nothing for queries without words
+                Node::Constant(Some(false))
+            } else {
+                Node::Search(groups)
+            }
+        }
+        Expression::Compare(id, op, value) => {
+            let key = id.name().to_owned();
+            let scalars = match value {
+                Value::Scalar(scalar) => std::slice::from_ref(scalar),
+                Value::List(list) => list.as_slice(),
+            };
+            match (op, value) {
+                (Operator::Eq, Value::Scalar(scalar)) if fields.is_partition_key(&key) => {
+                    Node::In(key, vec![scalar_text(scalar)])
+                }
+                (Operator::Eq, _) => {
+                    let wanted = match value {
+                        Value::Scalar(scalar) => scalar.as_json(),
+                        Value::List(list) => list.iter().map(Scalar::as_json).collect(),
+                    };
+                    Node::Contains(key, wanted)
+                }
+                (Operator::Like, _) => Node::Like(
+                    key,
+                    scalars
+                        .iter()
+                        .map(|scalar| LikePattern::new(&scalar_text(scalar)))
+                        .collect(),
+                ),
+                // an empty subselect, false even for NULL
+                (Operator::In, _) if scalars.is_empty() => Node::Constant(Some(false)),
+                (Operator::In, _) => {
+                    let mut values: Vec<_> = scalars.iter().map(scalar_text).collect();
+                    values.sort();
+                    values.dedup();
+                    Node::In(key, values)
+                }
+                (op, _) => {
+                    let number = match value {
+                        Value::Scalar(Scalar::Int(i)) => Some(*i as f64),
+                        Value::Scalar(Scalar::Float(f)) => Some(*f),
+                        Value::Scalar(Scalar::Text(s)) => s.trim().parse().ok(),
+                        Value::List(_) => None,
+                    };
+                    match number {
+                        Some(number) => {
+                            let column = fields.numeric_column(&key);
+                            Node::Numeric(key, op.clone(), number, column)
+                        }
+                        // postgres fails the query, nothing is known
+                        None => Node::Constant(None),
+                    }
+                }
+            }
+        }
+    }
+}
+
+impl Node {
+    /// Whether the event matches, `None` when unknown
+    fn matches(&self, doc: &Json, search: &str) -> Option<bool> {
+        match self {
+            Node::Constant(result) => *result,
+            Node::And(lhs, rhs) => match lhs.matches(doc, search) {
+                Some(false) => Some(false),
+                lhs => match rhs.matches(doc, search) {
+                    Some(false) => Some(false),
+                    rhs => lhs.and(rhs),
+                },
+            },
+            Node::Or(lhs, rhs) => match lhs.matches(doc, search) {
+                Some(true) => Some(true),
+                lhs => match rhs.matches(doc, search) {
+                    Some(true) => Some(true),
+                    rhs => lhs.and(rhs),
+                },
+            },
+            Node::Not(node) => node.matches(doc, search).map(|result| !result),
+            Node::Contains(key, wanted) => doc.get(key).map(|value| contains(value, wanted)),
+            Node::Like(key, patterns) => doc
+                .get(key)
+                .and_then(text)
+                .map(|text| patterns.iter().any(|p| p.matches(&text))),
+            Node::In(key, values) => doc.get(key).and_then(text).map(|text| {
+                values
+                    .binary_search_by(|value| value.as_str().cmp(&text))
+                    .is_ok()
+            }),
+            Node::Numeric(key, op, wanted, column) => {
+                let value = doc.get(key)?;
+                let number = match column.as_ref().and_then(|c| column_number(c, value)) {
+                    Some(number) => number,
+                    // where the column is NULL, to_number_or_null: integers only
+                    None => f64::from(text(value)?.trim().parse::<i32>().ok()?),
+                };
+                let ordering = number.partial_cmp(wanted);
+                Some(match op {
+                    Operator::Lt => ordering == Some(Ordering::Less),
+                    Operator::Le => matches!(ordering, Some(Ordering::Less | Ordering::Equal)),
+                    Operator::Gt => ordering == Some(Ordering::Greater),
+                    _ => matches!(ordering, Some(Ordering::Greater | Ordering::Equal)),
+                })
+            }
+            Node::Search(groups) => Some(groups.iter().any(|group| group.matches(search))),
+        }
+    }
+}
+
+impl Matcher {
+    pub fn new(expr: &Expression) -> Self {
+        Self::with_fields(expr, &Columns::new(), &[])
+    }
+
+    /// Like `new`, for SQL using `columns` and `partition_keys` (see `ExpressionParser`)
+    pub fn with_fields(expr: &Expression, columns: &Columns, partition_keys: &[String]) -> Self {
+        let fields = Fields {
+            columns,
+            partition_keys,
+        };
+        Self {
+            root: compile(expr, &fields),
+        }
+    }
+
+    /// Matches every event, as an empty query does
+    pub fn all() -> Self {
+        Self {
+            root: Node::Constant(Some(true)),
+        }
+    }
+
+    /// Whether an event with document `doc` and full text `search` matches
+    ///
+    /// Unknown results don't match, as in a `where` clause.
+    pub fn matches(&self, doc: &Json, search: &str) -> bool {
+        self.root.matches(doc, search) == Some(true)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::optimizer::{self, Node as Sql};
+    use serde_json::json;
+
+    fn matches(expr: Expression, doc: Json) -> bool {
+        Matcher::new(&expr).matches(&doc, "")
+    }
+
+    fn compare<'a>(id: &'a str, op: Operator, value: Value<'a>) -> Expression<'a> {
+        Expression::Compare(id.into(), op, value)
+    }
+
+    #[test]
+    fn equality_is_containment() {
+        let eq = |value: Value, doc| matches(compare("a", Operator::Eq, value), doc);
+        assert!(eq(Value::from("x"), json!({"a": "x"})));
+        assert!(eq(Value::from(1), json!({"a": 1.0})));
+        assert!(!eq(Value::from(1), json!({"a": "1"})));
+        assert!(eq(Value::from("x"), json!({"a": ["x", "y"]})));
+        assert!(!eq(Value::from("x"), json!({"b": "x"})));
+        let list = Value::from(vec![Scalar::from("x"), Scalar::from("y")]);
+        assert!(eq(list.clone(), json!({"a": ["y", "z", "x"]})));
+        assert!(!eq(list, json!({"a": ["x"]})));
+    }
+
+    #[test]
+    fn text_comparisons() {
+        let like = |pattern: &str, doc| matches(compare("a", Operator::Like, pattern.into()), doc);
+        assert!(like("ab%", json!({"a": "abc"})));
+        assert!(like("%b%", json!({"a": "abc"})));
+        assert!(like("a_c", json!({"a": "abc"})));
+        assert!(like("%b_d%e", json!({"a": "abxbcde"})));
+        assert!(!like("%b_d%e", json!({"a": "abxbcdf"})));
+        assert!(like("a\\%", json!({"a": "a%"})));
+        assert!(!like("a\\%", json!({"a": "ab"})));
+        assert!(like("1%", json!({"a": 12})));
+        assert!(!like("%", json!({"a": null})));
+        assert!(like("[1, %", json!({"a": [1, 2]})));
+
+        let values = Value::from(vec![Scalar::from("c"), Scalar::from("a"), Scalar::from(5)]);
+        let is_in = |doc| matches(compare("a", Operator::In, values.clone()), doc);
+        assert!(is_in(json!({"a": "a"})));
+        assert!(is_in(json!({"a": 5})));
+        assert!(!is_in(json!({"a": "b"})));
+    }
+
+    #[test]
+    fn numeric_comparisons() {
+        assert!(matches(
+            compare("port", Operator::Gt, Value::from(20)),
+            json!({"port": "22"})
+        ));
+        assert!(matches(
+            compare("port", Operator::Le, Value::from(22.5)),
+            json!({"port": 22})
+        ));
+        assert!(!matches(
+            compare("port", Operator::Lt, Value::from(30)),
+            json!({"port": 2.5})
+        ));
+        assert!(!matches(
+            compare("port", Operator::Ge, Value::from(0)),
+            json!({})
+        ));
+    }
+
+    #[test]
+    fn full_text_search() {
+        let search = |query: &str, text| {
+            Matcher::new(&Expression::FullTextSearch(query.into())).matches(&json!({}), text)
+        };
+        let text = "\"Failed password for root\" sshd[42]:";
+        assert!(search("failed ROOT", text));
+        assert!(!search("failed admin", text));
+        assert!(search("admin or sshd", text));
+        assert!(!search("password -root", text));
+        assert!(search("\"root password\"", text));
+        assert!(!search("", text));
+
+        let expr = Expression::Not(Box::new(Expression::And(
+            Box::new(Expression::FullTextSearch("failed".into())),
+            Box::new(compare("hostname", Operator::Eq, Value::from("web"))),
+        )));
+        let matcher = Matcher::new(&expr);
+        assert!(!matcher.matches(&json!({"hostname": "web"}), text));
+        assert!(matcher.matches(&json!({"hostname": "db"}), text));
+        assert!(Matcher::all().matches(&json!({}), ""));
+    }
+
+    #[test]
+    fn unknown_results() {
+        let not = |expr| Expression::Not(Box::new(expr));
+        let eq = || compare("a", Operator::Eq, Value::from("x"));
+        assert!(!matches(not(eq()), json!({})));
+        assert!(matches(not(eq()), json!({"a": "y"})));
+        // JSON null is a value for containment, but NULL for text
+        assert!(matches(not(eq()), json!({"a": null})));
+        let like = || compare("a", Operator::Like, "x%".into());
+        assert!(!matches(not(like()), json!({"a": null})));
+
+        let gt = || compare("port", Operator::Gt, Value::from(20));
+        assert!(!matches(not(gt()), json!({"port": "ssh"})));
+        assert!(!matches(not(gt()), json!({"port": 2.5})));
+        assert!(matches(not(gt()), json!({"port": 2})));
+        assert!(!matches(
+            not(compare("port", Operator::Gt, "ssh".into())),
+            json!({"port": 2})
+        ));
+
+        let or = || Expression::Or(Box::new(eq()), Box::new(gt()));
+        assert!(matches(or(), json!({"port": 22})));
+        assert!(!matches(not(or()), json!({"port": 2})));
+        assert!(matches(not(or()), json!({"a": "y", "port": 2})));
+        let and = Expression::And(Box::new(eq()), Box::new(gt()));
+        assert!(matches(not(and), json!({"port": 2})));
+    }
+
+    /// Result of the SQL `node` on a row with document `doc` and `columns` filled from it (NULL
+    /// unless `filled`, like rows stored before they were added), as postgres computes it
+    fn sql_result(node: &Sql, columns: &Columns, doc: &Json, filled: bool) -> Option<bool> {
+        let all = |nodes: &[Sql], and: bool| {
+            nodes.iter().fold(Some(and), |result, node| {
+                match (result, sql_result(node, columns, doc, filled)) {
+                    (Some(result), _) if result != and => Some(result),
+                    (_, Some(other)) if other != and => Some(other),
+                    (Some(_), Some(_)) => Some(and),
+                    _ => None,
+                }
+            })
+        };
+        match node {
+            Sql::And(nodes) => all(nodes, true),
+            Sql::Or(nodes) => all(nodes, false),
+            Sql::Not(node) => sql_result(node, columns, doc, filled).map(|result| !result),
+            // doc @> object
+            Sql::Contains(object) => Some(contains(doc, &Json::Object(object.clone()))),
+            Sql::Key(_, values) if values.is_empty() => Some(false),
+            Sql::Key(id, values) => doc
+                .get(id.name())
+                .and_then(text)
+                .map(|text| values.iter().any(|value| scalar_text(value) == text)),
+            Sql::Expression(expr) => expr_result(expr, columns, doc, filled),
+        }
+    }
+
+    fn expr_result(expr: &Expression, columns: &Columns, doc: &Json, filled: bool) -> Option<bool> {
+        match expr {
+            Expression::And(lhs, rhs) | Expression::Or(lhs, rhs) => {
+                let nodes = vec![
+                    Sql::Expression((**lhs).clone()),
+                    Sql::Expression((**rhs).clone()),
+                ];
+                let node = match expr {
+                    Expression::And(_, _) => Sql::And(nodes),
+                    _ => Sql::Or(nodes),
+                };
+                sql_result(&node, columns, doc, filled)
+            }
+            Expression::Not(inner) => {
+                expr_result(inner, columns, doc, filled).map(|result| !result)
+            }
+            Expression::FullTextSearch(_) => unimplemented!(),
+            Expression::Compare(id, op, value) => {
+                let field = doc.get(id.name()).filter(|value| !value.is_null());
+                let number = |value: &Value| match value {
+                    Value::Scalar(Scalar::Int(i)) => *i as f64,
+                    Value::Scalar(Scalar::Float(f)) => *f,
+                    _ => unimplemented!(),
+                };
+                let order = |lhs: f64, rhs: f64| match op {
+                    Operator::Lt => lhs < rhs,
+                    Operator::Le => lhs <= rhs,
+                    Operator::Gt => lhs > rhs,
+                    _ => lhs >= rhs,
+                };
+                match (op, columns.get(id.name())) {
+                    // doc -> 'key' @> value
+                    (Operator::Eq, _) => {
+                        let wanted = match value {
+                            Value::Scalar(scalar) => scalar.as_json(),
+                            Value::List(list) => list.iter().map(Scalar::as_json).collect(),
+                        };
+                        doc.get(id.name()).map(|value| contains(value, &wanted))
+                    }
+                    // text columns hold doc ->> 'key'
+                    (Operator::Like, _) => {
+                        let Value::Scalar(pattern) = value else {
+                            unimplemented!()
+                        };
+                        let pattern = LikePattern::new(&scalar_text(pattern));
+                        field.and_then(text).map(|text| pattern.matches(&text))
+                    }
+                    (Operator::In, _) => {
+                        let Value::List(list) = value else {
+                            unimplemented!()
+                        };
+                        if list.is_empty() {
+                            return Some(false);
+                        }
+                        field
+                            .and_then(text)
+                            .map(|text| list.iter().any(|value| scalar_text(value) == text))
+                    }
+                    // stuffimport's column values, if filled
+                    (_, Some(column)) if column.kind != ColumnKind::Text => {
+                        // only smallint integer columns here
+                        let stored = field.filter(|_| filled).and_then(|field| {
+                            Some(match (column.kind, field) {
+                                (ColumnKind::Float, Json::String(s)) => s.trim().parse().ok()?,
+                                (ColumnKind::Float, value) => value.as_f64()?,
+                                (_, Json::String(s)) => f64::from(s.trim().parse::<i16>().ok()?),
+                                (_, value) => value.as_f64().filter(|f| {
+                                    f.fract() == 0.0 && (-32768.0..=32767.0).contains(f)
+                                })?,
+                            })
+                        });
+                        let stored = match stored {
+                            Some(stored) => stored,
+                            // col IS NULL AND to_number_or_null(doc ->> 'key') ...
+                            None => f64::from(field.and_then(text)?.trim().parse::<i32>().ok()?),
+                        };
+                        Some(order(stored, number(value)))
+                    }
+                    // to_number_or_null(doc ->> 'key')
+                    _ => {
+                        let stored = field.and_then(text)?.trim().parse::<i32>().ok()?;
+                        Some(order(f64::from(stored), number(value)))
+                    }
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn same_results_as_sql() {
+        let column = |name: &str, kind, sql_type: &str| {
+            let column = Column {
+                name: name.to_owned(),
+                kind,
+                sql_type: sql_type.to_owned(),
+            };
+            (name.to_owned(), column)
+        };
+        let columns: Columns = [
+            column("hostname", ColumnKind::Text, "text"),
+            column("facility", ColumnKind::Text, "text"),
+            column("port", ColumnKind::Integer, "smallint"),
+            column("duration", ColumnKind::Float, "double precision"),
+        ]
+        .into_iter()
+        .collect();
+        let keys = vec!["programname".to_owned(), "facility".to_owned()];
+
+        let not = |expr| Expression::Not(Box::new(expr));
+        let and = |lhs, rhs| Expression::And(Box::new(lhs), Box::new(rhs));
+        let or = |lhs, rhs| Expression::Or(Box::new(lhs), Box::new(rhs));
+        let list = |values: Vec<Scalar<'static>>| Value::from(values);
+        let mut exprs = Vec::new();
+        for id in [
+            "a",
+            "hostname",
+            "programname",
+            "facility",
+            "port",
+            "duration",
+        ] {
+            let eq = |value| compare(id, Operator::Eq, value);
+            exprs.extend([
+                eq(Value::from("x")),
+                eq(Value::from(1)),
+                eq(list(vec![Scalar::from("x")])),
+                or(eq(Value::from("x")), eq(Value::from("y"))),
+                or(eq(Value::from("1")), eq(Value::from(1))),
+                and(eq(Value::from("x")), eq(list(vec![Scalar::from("y")]))),
+                compare(
+                    id,
+                    Operator::In,
+                    list(vec![Scalar::from("x"), Scalar::from(1)]),
+                ),
+                compare(id, Operator::In, list(Vec::new())),
+                compare(id, Operator::Like, Value::from("x%")),
+                compare(id, Operator::Gt, Value::from(1)),
+                compare(id, Operator::Le, Value::from(2.5)),
+            ]);
+        }
+        let count = exprs.len();
+        for index in 0..count {
+            let expr = exprs[index].clone();
+            let other = exprs[(index * 7 + 3) % count].clone();
+            exprs.extend([
+                not(expr.clone()),
+                not(not(expr.clone())),
+                not(and(expr.clone(), other.clone())),
+                not(or(expr, not(other))),
+            ]);
+        }
+
+        let values = [
+            json!("x"),
+            json!("y"),
+            json!("xy"),
+            json!(1),
+            json!(1.0),
+            json!("1"),
+            json!(2.5),
+            json!(" 2 "),
+            json!(70000),
+            json!(["x", 1]),
+            json!(["y"]),
+            json!({"x": 1}),
+            json!(null),
+        ];
+        let mut docs = vec![json!({})];
+        for id in [
+            "a",
+            "hostname",
+            "programname",
+            "facility",
+            "port",
+            "duration",
+        ] {
+            docs.extend(values.iter().map(|value| json!({ id: value })));
+        }
+
+        for expr in &exprs {
+            let sql = optimizer::optimize(expr, &columns, &keys);
+            let matcher = Matcher::with_fields(expr, &columns, &keys);
+            // events stored before the columns were promoted have them NULL and match as if
+            // there were no columns
+            let unpromoted = Matcher::with_fields(expr, &Columns::new(), &keys);
+            for doc in &docs {
+                assert_eq!(
+                    matcher.matches(doc, ""),
+                    sql_result(&sql, &columns, doc, true) == Some(true),
+                    "{:?} on {}, SQL {:?}",
+                    expr,
+                    doc,
+                    sql
+                );
+                assert_eq!(
+                    unpromoted.matches(doc, ""),
+                    sql_result(&sql, &columns, doc, false) == Some(true),
+                    "{:?} on {} stored before promotion, SQL {:?}",
+                    expr,
+                    doc,
+                    sql
+                );
+            }
+        }
+    }
+}
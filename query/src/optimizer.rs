@@ -0,0 +1,312 @@
+//! Rewrites expressions into SQL that postgres can answer using indexes
+//!
+//! * And/Or chains are flattened.
+//! * Equalities become containments a GIN index on `doc` (e.g. `jsonb_path_ops`) covers. A scalar
+//!   `key = value` is `doc @> '{"key": value}' OR doc @> '{"key": [value]}'`, which also matches
+//!   arrays containing the value, like `doc -> 'key' @> value` does. List equalities within an
+//!   And are merged into a single `doc @> '{...}'`.
+//! * Below an odd number of `not`, equalities stay `doc -> 'key' @> value`. It is NULL for events
+//!   without the key where the containment is false, so `not a = 1` would match them otherwise.
+//! * An Or of string equalities on the same partition key becomes `key in (...)`. Other keys keep
+//!   their equalities, in JSON `1` and `"1"` differ and an array isn't any of its elements.
+//! * Scalar equalities and `in` on partition keys (fields stuffimport's list or hash partitions
+//!   are keyed on) become `doc ->> 'key' = ...`, the partition key expression, which lets postgres
+//!   skip other partitions (or the key's text column, if promoted). Partition keys thus compare
+//!   by text, like their partitions do:
+//!   `hostname = 1` matches `"1"` too, arrays match none of their elements. An empty `in` is
+//!   `false`.
+//!
+//! Equalities on promoted columns compare the document like on other keys, other comparisons on
+//! them are left to the columns' predicates. Both fall back to the document for rows without
+//! the column's value (see `ast::Column`).
+use serde_json::Map;
+use std::fmt::Write;
+
+use crate::ast::{
+    self, ColumnKind, Columns, Expression, Identifier, Operator, QueryParams, Scalar, Value,
+};
+
+#[derive(Debug, PartialEq)]
+pub enum Node<'a> {
+    And(Vec<Node<'a>>),
+    Or(Vec<Node<'a>>),
+    Not(Box<Node<'a>>),
+    /// `doc @> object`
+    Contains(Map<String, serde_json::Value>),
+    /// `doc ->> 'key' = value` or `doc ->> 'key' IN (values...)` on a partition key (or its
+    /// column), `false` without values
+    Key(Identifier<'a>, Vec<Scalar<'a>>),
+    Expression(Expression<'a>),
+}
+
+fn flatten<'e, 'a>(expr: &'e Expression<'a>, and: bool, target: &mut Vec<&'e Expression<'a>>) {
+    match (expr, and) {
+        (Expression::And(lhs, rhs), true) | (Expression::Or(lhs, rhs), false) => {
+            flatten(lhs, and, target);
+            flatten(rhs, and, target);
+        }
+        _ => target.push(expr),
+    }
+}
+
+fn value_json(value: &Value) -> serde_json::Value {
+    match value {
+        Value::Scalar(scalar) => scalar.as_json(),
+        Value::List(list) => list.iter().map(Scalar::as_json).collect(),
+    }
+}
+
+fn single<'a>(mut nodes: Vec<Node<'a>>, combine: fn(Vec<Node<'a>>) -> Node<'a>) -> Node<'a> {
+    if nodes.len() == 1 {
+        nodes.pop().unwrap()
+    } else {
+        combine(nodes)
+    }
+}
+
+/// `doc -> 'key' @> value` as containments of the document
+fn equals(id: &Identifier, value: &Value) -> Node<'static> {
+    let contains = |value| {
+        let mut object = Map::new();
+        object.insert(id.name().to_owned(), value);
+        Node::Contains(object)
+    };
+    match value {
+        Value::Scalar(scalar) => Node::Or(vec![
+            contains(scalar.as_json()),
+            contains(serde_json::Value::Array(vec![scalar.as_json()])),
+        ]),
+        list => contains(value_json(list)),
+    }
+}
+
+fn optimize_and(children: Vec<Node>) -> Node {
+    // equal keys with different values need separate objects
+    let mut objects: Vec<Map<String, serde_json::Value>> = Vec::new();
+    let mut others = Vec::new();
+    let children = children.into_iter().flat_map(|child| match child {
+        Node::And(nodes) => nodes,
+        other => vec![other],
+    });
+    for child in children {
+        match child {
+            Node::Contains(object) => {
+                for (key, value) in object {
+                    match objects.iter_mut().find(|other| !other.contains_key(&key)) {
+                        Some(other) => {
+                            other.insert(key, value);
+                        }
+                        None => {
+                            let mut other = Map::new();
+                            other.insert(key, value);
+                            objects.push(other);
+                        }
+                    }
+                }
+            }
+            other => others.push(other),
+        }
+    }
+
+    let mut nodes: Vec<Node> = objects.into_iter().map(Node::Contains).collect();
+    nodes.extend(others);
+    single(nodes, Node::And)
+}
+
+fn optimize_or<'a>(
+    children: Vec<&Expression<'a>>,
+    columns: &Columns,
+    partition_keys: &[String],
+    negated: bool,
+) -> Node<'a> {
+    // position within `nodes` and values of string equalities by partition key
+    let mut groups: Vec<(&Identifier, usize, Vec<&Expression>)> = Vec::new();
+    let mut nodes = Vec::new();
+    for child in children {
+        match child {
+            Expression::Compare(id, Operator::Eq, Value::Scalar(Scalar::Text(_)))
+                if is_key(id, columns, partition_keys) =>
+            {
+                match groups.iter_mut().find(|(other, _, _)| *other == id) {
+                    Some((_, _, exprs)) => exprs.push(child),
+                    None => {
+                        groups.push((id, nodes.len(), vec![child]));
+                        // placeholder, replaced below
+                        nodes.push(Node::Or(Vec::new()));
+                    }
+                }
+            }
+            other => match optimize_below(other, columns, partition_keys, negated) {
+                Node::Or(children) => nodes.extend(children),
+                node => nodes.push(node),
+            },
+        }
+    }
+
+    for (id, index, exprs) in groups {
+        nodes[index] = if exprs.len() == 1 {
+            optimize_below(exprs[0], columns, partition_keys, negated)
+        } else {
+            let values = exprs
+                .into_iter()
+                .filter_map(|expr| match expr {
+                    Expression::Compare(_, _, Value::Scalar(scalar)) => Some(scalar.clone()),
+                    _ => None,
+                })
+                .collect();
+            Node::Key(id.clone(), values)
+        };
+    }
+    single(nodes, Node::Or)
+}
+
+/// Partition keys compare by text, on promoted ones their text column holds the key
+fn is_key(id: &Identifier, columns: &Columns, partition_keys: &[String]) -> bool {
+    columns
+        .get(id.name())
+        .map_or(true, |column| column.kind == ColumnKind::Text)
+        && partition_keys.iter().any(|key| key == id.name())
+}
+
+/// Rewrite `expr` for the SQL it compiles to
+pub fn optimize<'a>(
+    expr: &Expression<'a>,
+    columns: &Columns,
+    partition_keys: &[String],
+) -> Node<'a> {
+    optimize_below(expr, columns, partition_keys, false)
+}
+
+/// Rewrite `expr`, below an odd number of `not` if `negated`
+fn optimize_below<'a>(
+    expr: &Expression<'a>,
+    columns: &Columns,
+    partition_keys: &[String],
+    negated: bool,
+) -> Node<'a> {
+    match expr {
+        Expression::And(_, _) | Expression::Or(_, _) => {
+            let and = matches!(expr, Expression::And(_, _));
+            let mut flat = Vec::new();
+            flatten(expr, and, &mut flat);
+            if and {
+                optimize_and(
+                    flat.into_iter()
+                        .map(|child| optimize_below(child, columns, partition_keys, negated))
+                        .collect(),
+                )
+            } else {
+                optimize_or(flat, columns, partition_keys, negated)
+            }
+        }
+        Expression::Not(inner) => Node::Not(Box::new(optimize_below(
+            inner,
+            columns,
+            partition_keys,
+            !negated,
+        ))),
+        // NULL for missing keys, like the comparison on the document
+        Expression::Compare(id, Operator::Eq, Value::Scalar(scalar))
+            if is_key(id, columns, partition_keys) =>
+        {
+            Node::Key(id.clone(), vec![scalar.clone()])
+        }
+        // false instead of NULL for missing keys is the same in a where clause, but not negated
+        Expression::Compare(_, Operator::Eq, _) if negated => Node::Expression(expr.clone()),
+        Expression::Compare(id, Operator::Eq, value) => equals(id, value),
+        Expression::Compare(id, Operator::In, Value::List(values))
+            if is_key(id, columns, partition_keys) =>
+        {
+            Node::Key(id.clone(), values.clone())
+        }
+        other => Node::Expression(other.clone()),
+    }
+}
+
+impl Node<'_> {
+    fn write_joined(
+        nodes: &[Node],
+        separator: &str,
+        columns: &Columns,
+        sql: &mut String,
+        params: &mut QueryParams,
+        param_offset: usize,
+    ) {
+        sql.push('(');
+        for (index, node) in nodes.iter().enumerate() {
+            if index > 0 {
+                sql.push_str(separator);
+            }
+            node.write_sql(columns, sql, params, param_offset);
+        }
+        sql.push(')');
+    }
+
+    pub fn to_sql_query(&self, columns: &Columns, param_offset: usize) -> (String, QueryParams) {
+        ast::emit(|sql, params| self.write_sql(columns, sql, params, param_offset))
+    }
+
+    /// `= value` or `IN (values...)`
+    fn write_key_values(
+        values: &[Scalar],
+        sql: &mut String,
+        params: &mut QueryParams,
+        param_offset: usize,
+    ) {
+        if let [value] = values {
+            sql.push_str("= ");
+            value.write_primitive_param(sql, params, param_offset);
+            return;
+        }
+        sql.push_str("IN (");
+        for (index, value) in values.iter().enumerate() {
+            if index > 0 {
+                sql.push_str(", ");
+            }
+            value.write_primitive_param(sql, params, param_offset);
+        }
+        sql.push(')');
+    }
+
+    pub(crate) fn write_sql(
+        &self,
+        columns: &Columns,
+        sql: &mut String,
+        params: &mut QueryParams,
+        param_offset: usize,
+    ) {
+        match self {
+            Node::And(nodes) => {
+                Self::write_joined(nodes, " AND ", columns, sql, params, param_offset)
+            }
+            Node::Or(nodes) => {
+                Self::write_joined(nodes, " OR ", columns, sql, params, param_offset)
+            }
+            Node::Not(node) => {
+                sql.push_str("(NOT ");
+                node.write_sql(columns, sql, params, param_offset);
+                sql.push(')');
+            }
+            Node::Contains(object) => {
+                write!(sql, "doc @> ${}::jsonb", param_offset + params.len()).unwrap();
+                params.push(serde_json::Value::Object(object.clone()));
+            }
+            // `x IN ()` is a syntax error, an empty subselect is false even for NULL
+            Node::Key(_, values) if values.is_empty() => sql.push_str("false"),
+            // rows without the promoted column's value compare the document
+            Node::Key(id, values) => match columns.get(id.name()) {
+                Some(column) => {
+                    let mut predicate = String::new();
+                    Self::write_key_values(values, &mut predicate, params, param_offset);
+                    column.write_or_document(id, &predicate, sql, params, param_offset);
+                }
+                None => {
+                    id.write_string_getter(sql, params, param_offset);
+                    sql.push(' ');
+                    Self::write_key_values(values, sql, params, param_offset);
+                }
+            },
+            Node::Expression(expr) => expr.write_sql(columns, sql, params, param_offset),
+        }
+    }
+}
@@ -44,6 +44,10 @@ create index idx_search on logs.logs using GIN(search);
 -- create table logs.logs_2021_10 partition of logs.logs for values from ('2021-10-01') to ('2021-11-01');
 -- alter table logs.logs_2021_10 owner to write_logs;
 
+-- stuffimport creates its count rollup tables (see its "rollups" setting) on
+-- startup. The default privileges above don't apply to tables of stuffimport's
+-- role, so it makes them owned by write_logs and grants select to read_logs.
+
 CREATE FUNCTION logs.to_number_or_null(input text) RETURNS INTEGER AS $$
 DECLARE
 	result INTEGER DEFAULT NULL;
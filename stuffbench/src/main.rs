@@ -0,0 +1,629 @@
+//! End-to-end benchmark of stuffimport and stuffstream
+//!
+//! Creates a throwaway database, imports synthetic events (`logstuff::synthetic`) through
+//! stuffimport's rsyslog interface, then sends a fixed mix of /events and /counts requests to
+//! stuffstream. Reports imported events per second and the p50/p99 latencies of import
+//! confirmations and requests. Meant for a scratch postgres cluster: the database user has to be
+//! allowed to create databases (and the role "write_logs", unless it exists), both tools connect
+//! as this user as well.
+#[macro_use]
+extern crate clap;
+#[macro_use]
+extern crate log;
+
+use clap::{App, Arg};
+use postgres::NoTls;
+use std::fmt;
+use std::io::{self, BufRead, BufReader, Read, Write};
+use std::net::{SocketAddr, TcpStream};
+use std::path::{Path, PathBuf};
+use std::process::{Child, ChildStdout, Command, Stdio};
+use std::thread;
+use std::time::{Duration, Instant};
+use time::{format_description::well_known::Rfc3339, OffsetDateTime};
+
+use logstuff::synthetic::Generator;
+
+/// Production schema, its sequence and functions are set up in the benchmark database
+const SCHEMA: &str = include_str!("../../schema.sql");
+
+/// Run before schema.sql's sequence and functions, in place of its roles, users and grants that
+/// belong to the cluster
+const SETUP: &str = r#"
+    do $$ begin
+        if not exists (select from pg_roles where rolname = 'write_logs') then
+            create role write_logs with nologin;
+        end if;
+    end $$;
+
+    create schema logs;
+"#;
+
+/// Statements of `schema` (without comments) creating one of `kinds` of objects, e.g.
+/// `["sequence", "function"]`
+fn schema_statements(schema: &str, kinds: &[&str]) -> Vec<String> {
+    let mut statements = Vec::new();
+    let mut statement = String::new();
+    let mut quoted = false;
+    for line in schema.lines() {
+        let line = match line.find("--") {
+            Some(comment) if !quoted => &line[..comment],
+            _ => line,
+        };
+        statement.push_str(line);
+        statement.push('\n');
+        // function bodies are $$ quoted and contain semicolons
+        quoted ^= line.matches("$$").count() % 2 == 1;
+        if !quoted && line.trim_end().ends_with(';') {
+            statements.push(std::mem::take(&mut statement));
+        }
+    }
+    statements
+        .into_iter()
+        .filter(|statement| {
+            let words: Vec<_> = statement.split_whitespace().take(2).collect();
+            matches!(words.as_slice(), [create, kind]
+                if create.eq_ignore_ascii_case("create")
+                    && kinds.iter().any(|wanted| kind.eq_ignore_ascii_case(wanted)))
+        })
+        .collect()
+}
+
+const BEGIN_MARK: &str = "BEGIN TRANSACTION";
+const COMMIT_MARK: &str = "COMMIT TRANSACTION";
+
+/// Time range covered by the imported events, ending at the start of the import
+const SPAN: time::Duration = time::Duration::hours(24);
+
+#[derive(Debug)]
+enum Error {
+    Io(io::Error),
+    Db(postgres::Error),
+    Unexpected(String),
+}
+
+impl fmt::Display for Error {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        match self {
+            Self::Io(err) => write!(f, "IO error: {}", err),
+            Self::Db(err) => write!(f, "Database error: {}", err),
+            Self::Unexpected(msg) => write!(f, "{}", msg),
+        }
+    }
+}
+
+impl From<io::Error> for Error {
+    fn from(err: io::Error) -> Self {
+        Self::Io(err)
+    }
+}
+
+impl From<postgres::Error> for Error {
+    fn from(err: postgres::Error) -> Self {
+        Self::Db(err)
+    }
+}
+
+#[derive(Debug)]
+struct Settings {
+    db_config: String,
+    bin_dir: PathBuf,
+    events: usize,
+    transaction_size: usize,
+    pipeline: bool,
+    requests: usize,
+    clients: usize,
+    listen_address: SocketAddr,
+    keep_database: bool,
+}
+
+fn positive(val: &str) -> Result<(), String> {
+    match val.parse::<usize>() {
+        Ok(n) if n > 0 => Ok(()),
+        _ => Err("Not a positive integer".to_string()),
+    }
+}
+
+impl Settings {
+    fn from_cli_args() -> Self {
+        let default_db_config = "user=postgres host=localhost port=5432 dbname=postgres";
+        let matches = App::new(crate_name!())
+            .about("Benchmark stuffimport and stuffstream on a throwaway database.")
+            .version(crate_version!())
+            .arg(
+                Arg::new("db_connection")
+                    .short('d')
+                    .long("database")
+                    .value_name("CONFIG")
+                    .help("Database connect config of a user allowed to create databases (see https://docs.rs/postgres/0.19.2/postgres/config/struct.Config.html for options)")
+                    .takes_value(true)
+                    .default_value(default_db_config))
+            .arg(
+                Arg::new("bin_dir")
+                    .short('b')
+                    .long("bin-dir")
+                    .value_name("DIR")
+                    .help("Directory containing stuffimport and stuffstream (default: this program's directory)")
+                    .takes_value(true),
+            )
+            .arg(
+                Arg::new("events")
+                    .short('n')
+                    .long("events")
+                    .value_name("NUMBER")
+                    .help("Number of events to import")
+                    .takes_value(true)
+                    .default_value("100000")
+                    .validator(positive),
+            )
+            .arg(
+                Arg::new("transaction_size")
+                    .short('t')
+                    .long("transaction-size")
+                    .value_name("NUMBER")
+                    .help("Send events in rsyslog transactions of this size, imported with stuffimport's \"batch\" settings (default: single events)")
+                    .takes_value(true)
+                    .validator(positive),
+            )
+            .arg(
+                Arg::new("pipeline")
+                    .long("pipeline")
+                    .help("Import with stuffimport's \"pipeline\", requires --transaction-size")
+                    .requires("transaction_size")
+                    .takes_value(false),
+            )
+            .arg(
+                Arg::new("requests")
+                    .short('r')
+                    .long("requests")
+                    .value_name("NUMBER")
+                    .help("Number of requests of each kind sent to stuffstream")
+                    .takes_value(true)
+                    .default_value("100")
+                    .validator(positive),
+            )
+            .arg(
+                Arg::new("clients")
+                    .long("clients")
+                    .value_name("NUMBER")
+                    .help("Number of clients sending requests at the same time")
+                    .takes_value(true)
+                    .default_value("1")
+                    .validator(positive),
+            )
+            .arg(
+                Arg::new("listen_address")
+                    .short('l')
+                    .long("listen")
+                    .value_name("ADDRESS")
+                    .help("Address for stuffstream's HTTP server")
+                    .takes_value(true)
+                    .default_value("127.0.0.1:18080")
+                    .validator(|val| val.parse::<SocketAddr>().map(|_| ())),
+            )
+            .arg(
+                Arg::new("keep_database")
+                    .long("keep-database")
+                    .help("Keep the database after the benchmark, e.g. for looking at query plans")
+                    .takes_value(false),
+            )
+            .get_matches();
+
+        let bin_dir = match matches.value_of("bin_dir") {
+            Some(dir) => PathBuf::from(dir),
+            None => std::env::current_exe()
+                .unwrap()
+                .parent()
+                .unwrap()
+                .to_path_buf(),
+        };
+
+        Self {
+            db_config: matches
+                .value_of("db_connection")
+                .unwrap_or(default_db_config)
+                .to_string(),
+            bin_dir,
+            events: matches.value_of("events").unwrap().parse().unwrap(),
+            transaction_size: matches
+                .value_of("transaction_size")
+                .map_or(0, |size| size.parse().unwrap()),
+            pipeline: matches.is_present("pipeline"),
+            requests: matches.value_of("requests").unwrap().parse().unwrap(),
+            clients: matches.value_of("clients").unwrap().parse().unwrap(),
+            listen_address: matches.value_of("listen_address").unwrap().parse().unwrap(),
+            keep_database: matches.is_present("keep_database"),
+        }
+    }
+}
+
+/// Throwaway database, dropped again unless kept
+struct Database {
+    admin: postgres::Client,
+    name: String,
+    db_config: String,
+    keep: bool,
+}
+
+impl Database {
+    fn create(settings: &Settings) -> Result<Self, Error> {
+        let mut admin = postgres::Client::connect(&settings.db_config, NoTls)?;
+        let name = format!("stuffbench_{}", std::process::id());
+        admin.batch_execute(&format!("create database {}", name))?;
+        let database = Self {
+            admin,
+            // later options override earlier ones
+            db_config: format!("{} dbname={}", settings.db_config, name),
+            name,
+            keep: settings.keep_database,
+        };
+        let mut client = database.connect()?;
+        client.batch_execute(SETUP)?;
+        client.batch_execute(&schema_statements(SCHEMA, &["sequence", "function"]).concat())?;
+        // both tools find the schema's objects like with the roles of schema.sql
+        database.admin.batch_execute(&format!(
+            "alter database {} set search_path to logs",
+            database.name
+        ))?;
+        Ok(database)
+    }
+
+    fn connect(&self) -> Result<postgres::Client, Error> {
+        Ok(postgres::Client::connect(&self.db_config, NoTls)?)
+    }
+}
+
+impl Drop for Database {
+    fn drop(&mut self) {
+        if self.keep {
+            info!("keeping database {}", self.name);
+        } else if let Err(err) = self
+            .admin
+            .batch_execute(&format!("drop database {}", self.name))
+        {
+            error!("drop database {}: {}", self.name, err);
+        }
+    }
+}
+
+/// Child process, killed when dropped
+struct Process(Child);
+
+impl Process {
+    fn spawn(settings: &Settings, program: &str, config: &Path) -> Result<Self, Error> {
+        let path = settings.bin_dir.join(program);
+        let child = Command::new(&path)
+            .arg("--config")
+            .arg(config)
+            .stdin(Stdio::piped())
+            .stdout(Stdio::piped())
+            .spawn()
+            .map_err(|err| Error::Unexpected(format!("start {}: {}", path.display(), err)))?;
+        Ok(Self(child))
+    }
+}
+
+impl Drop for Process {
+    fn drop(&mut self) {
+        let _ = self.0.kill();
+        let _ = self.0.wait();
+    }
+}
+
+/// YAML string, the settings files are written without a YAML library
+fn quoted(value: &str) -> String {
+    format!("\"{}\"", value.replace('\\', "\\\\").replace('"', "\\\""))
+}
+
+fn import_config(settings: &Settings, database: &Database) -> String {
+    let mut config = format!(
+        r#"
+db_url: {}
+partitions:
+  - kind: root
+    table: logs
+    indexes:
+      - columns: id, tstamp
+      - method: gin
+        columns: search
+  - kind: timerange
+    name_template: logs_[year]_[month]_[day]
+    interval: Day
+"#,
+        quoted(&database.db_config)
+    );
+    if settings.transaction_size > 0 {
+        config.push_str(&format!(
+            "batch:\n  max_events: {}\n",
+            settings.transaction_size
+        ));
+    }
+    if settings.pipeline {
+        config.push_str("pipeline:\n  parsers: 2\n  writers: 2\n");
+    }
+    config
+}
+
+fn stream_config(settings: &Settings, database: &Database) -> String {
+    format!(
+        r#"
+http_settings:
+  listen_address: {}
+root_table_name: logs
+db_url: {}
+"#,
+        settings.listen_address,
+        quoted(&database.db_config)
+    )
+}
+
+fn ms(duration: Duration) -> f64 {
+    duration.as_secs_f64() * 1000.0
+}
+
+fn report(name: &str, mut latencies: Vec<Duration>) {
+    latencies.sort();
+    let at = |p: f64| latencies[((latencies.len() - 1) as f64 * p).round() as usize];
+    println!(
+        "{:<20} {:>8}  p50 {:>9.2} ms  p99 {:>9.2} ms",
+        name,
+        latencies.len(),
+        ms(at(0.5)),
+        ms(at(0.99))
+    );
+}
+
+/// Read stuffimport's next answer, which has to be `expected`
+fn expect(output: &mut BufReader<ChildStdout>, expected: &str) -> Result<(), Error> {
+    let mut line = String::new();
+    output.read_line(&mut line)?;
+    if line.trim() == expected {
+        Ok(())
+    } else if line.is_empty() {
+        Err(Error::Unexpected(format!(
+            "stuffimport stopped instead of answering {}",
+            expected
+        )))
+    } else {
+        Err(Error::Unexpected(format!(
+            "stuffimport answered {:?} instead of {}",
+            line.trim(),
+            expected
+        )))
+    }
+}
+
+/// Import `lines` like rsyslog's omprog does, waiting for each confirmation before going on
+fn import(settings: &Settings, config: &Path, lines: &[String]) -> Result<(), Error> {
+    let mut process = Process::spawn(settings, "stuffimport", config)?;
+    let mut input = process.0.stdin.take().unwrap();
+    let mut output = BufReader::new(process.0.stdout.take().unwrap());
+    expect(&mut output, "OK")?;
+
+    let mut latencies = Vec::new();
+    let started = Instant::now();
+    if settings.transaction_size == 0 {
+        for line in lines {
+            let sent = Instant::now();
+            writeln!(input, "{}", line)?;
+            expect(&mut output, "OK")?;
+            latencies.push(sent.elapsed());
+        }
+    } else {
+        for transaction in lines.chunks(settings.transaction_size) {
+            let sent = Instant::now();
+            writeln!(input, "{}", BEGIN_MARK)?;
+            expect(&mut output, "OK")?;
+            for line in transaction {
+                writeln!(input, "{}", line)?;
+                expect(&mut output, "DEFER_COMMIT")?;
+            }
+            writeln!(input, "{}", COMMIT_MARK)?;
+            expect(&mut output, "OK")?;
+            latencies.push(sent.elapsed());
+        }
+    }
+    let elapsed = started.elapsed();
+    drop(input);
+    process.0.wait()?;
+
+    println!(
+        "imported {} events in {:.2} s: {:.0} events/s",
+        lines.len(),
+        elapsed.as_secs_f64(),
+        lines.len() as f64 / elapsed.as_secs_f64()
+    );
+    let unit = if settings.transaction_size == 0 {
+        "event"
+    } else {
+        "transaction"
+    };
+    report(unit, latencies);
+    Ok(())
+}
+
+/// Percent-encode a query string value
+fn encode(value: &str) -> String {
+    value
+        .bytes()
+        .map(|byte| match byte {
+            b'A'..=b'Z' | b'a'..=b'z' | b'0'..=b'9' | b'-' | b'.' | b'_' | b'~' => {
+                (byte as char).to_string()
+            }
+            _ => format!("%{:02X}", byte),
+        })
+        .collect()
+}
+
+/// Send a GET request, returns the time until the whole response arrived
+fn get(address: &SocketAddr, path: &str) -> Result<Duration, Error> {
+    let started = Instant::now();
+    let mut stream = TcpStream::connect(address)?;
+    write!(
+        stream,
+        "GET {} HTTP/1.1\r\nHost: {}\r\nConnection: close\r\n\r\n",
+        path, address
+    )?;
+    let mut response = Vec::new();
+    stream.read_to_end(&mut response)?;
+    let elapsed = started.elapsed();
+
+    if response.starts_with(b"HTTP/1.1 200 ") {
+        Ok(elapsed)
+    } else {
+        let response = String::from_utf8_lossy(&response);
+        Err(Error::Unexpected(format!(
+            "GET {}: {}",
+            path,
+            response.lines().next().unwrap_or("no response")
+        )))
+    }
+}
+
+fn wait_until_ready(address: &SocketAddr) -> Result<(), Error> {
+    let deadline = Instant::now() + Duration::from_secs(10);
+    loop {
+        match get(address, "/stats") {
+            Ok(_) => return Ok(()),
+            Err(err) if Instant::now() > deadline => return Err(err),
+            Err(_) => thread::sleep(Duration::from_millis(100)),
+        }
+    }
+}
+
+fn requests(start: OffsetDateTime, end: OffsetDateTime) -> Vec<(&'static str, String)> {
+    let range = format!(
+        "start={}&end={}",
+        encode(&start.format(&Rfc3339).unwrap()),
+        encode(&end.format(&Rfc3339).unwrap())
+    );
+    let events = format!("/events?{}&limit_events=100", range);
+    let counts = format!("/counts?{}&max_buckets=96", range);
+    vec![
+        ("events", events.clone()),
+        (
+            "events_query",
+            format!(
+                "{}&query={}",
+                events,
+                encode(r#"programname = "sshd" and "Failed""#)
+            ),
+        ),
+        ("events_ndjson", format!("{}&format=ndjson", events)),
+        ("counts", counts.clone()),
+        ("counts_split", format!("{}&split_by=hostname", counts)),
+        (
+            "counts_query",
+            format!("{}&query={}", counts, encode("vars.http.status >= 500")),
+        ),
+    ]
+}
+
+/// Send each request `settings.requests` times, spread over `settings.clients` threads
+fn serve(
+    settings: &Settings,
+    config: &Path,
+    start: OffsetDateTime,
+    end: OffsetDateTime,
+) -> Result<(), Error> {
+    let _process = Process::spawn(settings, "stuffstream", config)?;
+    let address = &settings.listen_address;
+    wait_until_ready(address)?;
+
+    for (name, path) in requests(start, end) {
+        // first one without measuring, fills caches and prepares statements
+        get(address, &path)?;
+        let latencies = thread::scope(|scope| {
+            let clients: Vec<_> = (0..settings.clients)
+                .map(|client| {
+                    let path = &path;
+                    scope.spawn(move || {
+                        (client..settings.requests)
+                            .step_by(settings.clients)
+                            .map(|_| get(address, path))
+                            .collect::<Result<Vec<_>, _>>()
+                    })
+                })
+                .collect();
+            clients
+                .into_iter()
+                .map(|client| client.join().unwrap())
+                .collect::<Result<Vec<_>, _>>()
+        })?;
+        report(name, latencies.concat());
+    }
+    Ok(())
+}
+
+fn run(settings: &Settings) -> Result<(), Error> {
+    let end = OffsetDateTime::now_utc();
+    let start = end - SPAN;
+    let step = SPAN / settings.events as u32;
+    let lines: Vec<_> = Generator::new(42, start, step)
+        .take(settings.events)
+        .collect();
+
+    let database = Database::create(settings)?;
+    let dir = std::env::temp_dir().join(&database.name);
+    std::fs::create_dir_all(&dir)?;
+    let import_path = dir.join("stuffimport.yaml");
+    let stream_path = dir.join("stuffstream.yaml");
+    std::fs::write(&import_path, import_config(settings, &database))?;
+    std::fs::write(&stream_path, stream_config(settings, &database))?;
+
+    let result = import(settings, &import_path, &lines)
+        .and_then(|_| Ok(database.connect()?.batch_execute("analyze")?))
+        .and_then(|_| serve(settings, &stream_path, start, end));
+    let _ = std::fs::remove_dir_all(&dir);
+    result
+}
+
+fn main() {
+    env_logger::init();
+    let settings = Settings::from_cli_args();
+    if let Err(err) = run(&settings) {
+        error!("{}", err);
+        std::process::exit(1);
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use time::macros::datetime;
+
+    #[test]
+    fn schema_objects() {
+        let statements = schema_statements(SCHEMA, &["sequence", "function"]);
+        assert!(statements.len() >= 3);
+        assert!(statements[0]
+            .trim()
+            .starts_with("create sequence logs.logs_id"));
+        for name in ["logs.to_number_or_null(", "logs.count_estimate("] {
+            let function = statements
+                .iter()
+                .find(|statement| statement.contains(name))
+                .unwrap();
+            assert_eq!(function.matches("$$").count(), 2);
+            assert!(function.trim_end().ends_with(';'));
+        }
+        assert!(!statements
+            .iter()
+            .any(|statement| statement.contains("role")));
+    }
+
+    #[test]
+    fn request_paths() {
+        assert_eq!(encode("a-b_c.d~e"), "a-b_c.d~e");
+        assert_eq!(encode(r#"x = "1 2""#), "x%20%3D%20%221%202%22");
+
+        let paths = requests(
+            datetime!(2021-10-21 10:00 UTC),
+            datetime!(2021-10-22 10:00 UTC),
+        );
+        assert_eq!(
+            paths[0].1,
+            "/events?start=2021-10-21T10%3A00%3A00Z&end=2021-10-22T10%3A00%3A00Z&limit_events=100"
+        );
+    }
+}
@@ -1,24 +1,74 @@
 use lru_cache::LruCache;
+use postgres::types::ToSql;
 use postgres_native_tls::MakeTlsConnector;
 use std::io::Write as _;
+use std::sync::mpsc::{Receiver, RecvTimeoutError};
+use std::sync::Arc;
+use std::time::Duration;
 use std::{fmt, io};
 
+use logstuff::columns::Column;
 use logstuff::event::{Event, RsyslogdEvent};
+use logstuff::rollup::RollupSettings;
 use logstuff::tls;
 
 use crate::application::{Application, Stopping};
+use crate::batch::{self, Batch, BatchSettings};
 use crate::cli::Options;
+use crate::columns;
 use crate::config::Config;
-use crate::partition::{self, Partitioner};
+use crate::db::{self, Connect, Failure, ReconnectSettings};
+use crate::input;
+use crate::listen;
+use crate::metrics::{self, METRICS};
+use crate::notify;
+use crate::partition;
+use crate::pipeline::Pipeline;
+use crate::rollup;
 
 /// Core program logic
 ///
 /// Must implement the `Application` trait.
 pub struct App {
     client: postgres::Client,
-    partitions: Vec<Box<dyn partition::Partitioner>>,
+    connect: Connect,
+    reconnect_settings: ReconnectSettings,
+    partitions: partition::Chain,
     use_vars_msg: bool,
     prepared_inserts: LruCache<String, postgres::Statement>,
+    columns: Arc<Vec<Column>>,
+    rollups: Option<Arc<RollupSettings>>,
+    /// Channel notified about committed events
+    notify: Option<String>,
+    batching: Option<Batching>,
+    pipelined: Option<Pipelined>,
+    line: String,
+    search: String,
+}
+
+/// State of batched inserts
+///
+/// rsyslog sends the next message only after the previous one got confirmed. Batches are thus
+/// collected within rsyslog's transactions (omprog: useTransactions="on"), where each message is
+/// answered with "DEFER_COMMIT" and the final "OK" is sent after all events were committed.
+struct Batching {
+    settings: BatchSettings,
+    lines: Receiver<io::Result<String>>,
+    pending: Batch,
+    in_transaction: bool,
+}
+
+/// State of multi-threaded imports
+///
+/// Confirmations follow the same rules as for `Batching`, the events of a transaction are
+/// confirmed after all of them have been committed by any of the pipeline's writers.
+///
+/// When listening on sockets, events arrive on other threads and stdin is not used at all.
+struct Pipelined {
+    pipeline: Pipeline,
+    settings: BatchSettings,
+    in_transaction: bool,
+    listening: bool,
 }
 
 /// Error type for the core program logic
@@ -28,6 +78,7 @@ pub enum Error {
     Io(io::Error),
     Json(serde_json::Error),
     Partition(partition::Error),
+    Pipeline(String),
     Tls(tls::Error),
 }
 
@@ -37,27 +88,117 @@ impl Application for App {
     fn new(_opts: Options, config: Config) -> Result<Self, Self::Err> {
         env_logger::init();
         let connector = MakeTlsConnector::new(config.tls.connector()?);
-        let client = postgres::Client::connect(&config.db_url, connector)?;
+        let mut client = postgres::Client::connect(&config.db_url, connector.clone())?;
+        let partitions = partition::Chain::new(config.partitions)?;
+        if !config.columns.is_empty() {
+            let root = partition::ensure_root(&mut client, &partitions.parts())?;
+            columns::add_to_root(&mut client, &root, &config.columns)?;
+        }
+        let promoted = Arc::new(config.columns);
+        if let Some(rollups) = &config.rollups {
+            rollup::ensure_tables(&mut client, rollups)?;
+        }
+        let rollups = config.rollups.map(Arc::new);
+        let notify = config.notify.map(|settings| settings.channel);
 
-        // tell rsyslogd that we are ready
-        writeln!(io::stdout(), "OK")?;
+        if let Some(settings) = &config.metrics {
+            metrics::spawn(settings)?;
+        }
+
+        let db_url = config.db_url.to_owned();
+        let connect: Connect =
+            Arc::new(move || postgres::Client::connect(&db_url, connector.clone()));
+        if config.precreate.partitions > 0 {
+            let connect = connect.clone();
+            partition::spawn_precreation(partitions.shared(), config.precreate, move || connect());
+        }
+
+        // listening requires the pipeline, there is no single reader to confirm events to
+        let pipeline_settings = match (config.pipeline, &config.listen) {
+            (None, Some(_)) => Some(Default::default()),
+            (settings, _) => settings,
+        };
+        let (batch, pipelined) = match pipeline_settings {
+            Some(settings) => {
+                let batch_settings = config.batch.unwrap_or_default();
+                let pipeline = Pipeline::new(
+                    &settings,
+                    batch_settings.clone(),
+                    partition::Chain::from_shared(partitions.shared()),
+                    config.use_vars_msg,
+                    connect.clone(),
+                    config.reconnect.clone(),
+                    promoted.clone(),
+                    rollups.clone(),
+                    notify.clone(),
+                );
+                if let Some(listen_settings) = &config.listen {
+                    listen::spawn(listen_settings, &pipeline)?;
+                }
+                (
+                    None,
+                    Some(Pipelined {
+                        pipeline,
+                        settings: batch_settings,
+                        in_transaction: false,
+                        listening: config.listen.is_some(),
+                    }),
+                )
+            }
+            None => (config.batch, None),
+        };
+
+        let batching = match batch {
+            Some(settings) => {
+                batch::prepare_session(&mut client, &promoted)?;
+                Some(Batching {
+                    lines: input::stdin_lines(settings.max_events),
+                    settings,
+                    pending: Batch::default(),
+                    in_transaction: false,
+                })
+            }
+            None => None,
+        };
+
+        if config.listen.is_none() {
+            // tell rsyslogd that we are ready
+            writeln!(io::stdout(), "OK")?;
+        }
 
         Ok(App {
             client,
-            partitions: config.partitions,
+            connect,
+            reconnect_settings: config.reconnect,
+            partitions,
             use_vars_msg: config.use_vars_msg,
             prepared_inserts: LruCache::new(config.statement_cache_size),
+            columns: promoted,
+            rollups,
+            notify,
+            batching,
+            pipelined,
+            line: String::new(),
+            search: String::new(),
         })
     }
 
     fn run_once(&mut self) -> Result<Stopping, Self::Err> {
-        let mut line = String::new();
+        if self.batching.is_some() {
+            return self.run_batched();
+        } else if self.pipelined.is_some() {
+            return self.run_pipelined();
+        }
+
+        // reuse the line buffer, events borrow from it while being decoded
+        let mut line = std::mem::take(&mut self.line);
+        line.clear();
         let bytes = io::stdin().read_line(&mut line)?;
-        let line: &str = line.trim();
 
-        if !line.is_empty() {
-            self.handle_event(line)?;
+        if !line.trim().is_empty() {
+            self.handle_event(line.trim())?;
         }
+        self.line = line;
 
         if bytes == 0 {
             info!("input at EOF");
@@ -69,69 +210,350 @@ impl Application for App {
 }
 
 impl App {
-    fn insert_single_shot(&mut self, event: &Event, search: &str) -> Result<(), Error> {
-        let root_table = self.partitions[0].table_name(event)?;
-        if !self.prepared_inserts.contains_key(&root_table) {
-            info!("Preparing insert statement for root table {}", root_table);
-            self.prepared_inserts.insert(
-                root_table.to_owned(),
-                self.client.prepare(
-                    format!(
-                        "insert into {} (tstamp, doc, search) values ($1, $2, to_tsvector($3))",
-                        root_table
-                    )
-                    .as_str(),
-                )?,
-            );
-        }
-
-        self.client.execute(
-            self.prepared_inserts.get_mut(&root_table).unwrap(),
-            &[&event.timestamp, &event.doc, &search],
-        )?;
+    fn run_pipelined(&mut self) -> Result<Stopping, Error> {
+        if self.pipelined.as_ref().unwrap().listening {
+            // listener threads keep running until the pipeline fails
+            let pipeline = &self.pipelined.as_ref().unwrap().pipeline;
+            return Err(Error::Pipeline(pipeline.stopped()));
+        }
+
+        let mut line = String::new();
+        let bytes = io::stdin().read_line(&mut line)?;
+        let pipelined = self.pipelined.as_mut().unwrap();
+        let trimmed = line.trim();
+
+        if bytes == 0 {
+            pipelined.pipeline.commit().map_err(Error::Pipeline)?;
+            info!("input at EOF");
+            return Ok(Stopping::Yes);
+        } else if trimmed.is_empty() {
+            return Ok(Stopping::No);
+        } else if trimmed == pipelined.settings.begin_mark {
+            pipelined.in_transaction = true;
+        } else if trimmed == pipelined.settings.commit_mark {
+            pipelined.in_transaction = false;
+            pipelined.pipeline.commit().map_err(Error::Pipeline)?;
+        } else {
+            pipelined.pipeline.submit(line).map_err(Error::Pipeline)?;
+            if pipelined.in_transaction {
+                writeln!(io::stdout(), "DEFER_COMMIT")?;
+                return Ok(Stopping::No);
+            }
+            // confirmation can't be deferred outside of transactions
+            pipelined.pipeline.commit().map_err(Error::Pipeline)?;
+        }
+        writeln!(io::stdout(), "OK")?;
+        Ok(Stopping::No)
+    }
+
+    fn run_batched(&mut self) -> Result<Stopping, Error> {
+        let batching = self.batching.as_mut().unwrap();
+        // nothing to wait for if the batch is empty, just block until something arrives
+        let timeout = batching
+            .pending
+            .time_left(batching.settings.max_delay())
+            .unwrap_or(Duration::from_secs(3600));
+
+        match batching.lines.recv_timeout(timeout) {
+            Ok(line) => {
+                let line = line?;
+                self.handle_batched_line(line.trim())?;
+                Ok(Stopping::No)
+            }
+            Err(RecvTimeoutError::Timeout) => {
+                self.flush_batch()?;
+                Ok(Stopping::No)
+            }
+            Err(RecvTimeoutError::Disconnected) => {
+                // unconfirmed events will be resent by rsyslog, but there is no harm in storing
+                // them now
+                self.flush_batch()?;
+                info!("input at EOF");
+                Ok(Stopping::Yes)
+            }
+        }
+    }
+
+    fn handle_batched_line(&mut self, line: &str) -> Result<(), Error> {
+        let batching = self.batching.as_mut().unwrap();
+        if line.is_empty() {
+            return Ok(());
+        } else if line == batching.settings.begin_mark {
+            batching.in_transaction = true;
+            writeln!(io::stdout(), "OK")?;
+            return Ok(());
+        } else if line == batching.settings.commit_mark {
+            batching.in_transaction = false;
+            self.flush_batch()?;
+            writeln!(io::stdout(), "OK")?;
+            return Ok(());
+        } else if !batching.in_transaction {
+            // confirmation can't be deferred outside of transactions
+            return self.handle_event(line);
+        }
+
+        let parsing = METRICS.parse.start("parse");
+        match serde_json::from_str::<RsyslogdEvent>(line) {
+            Ok(rsyslog_event) => {
+                let mut event: Event = rsyslog_event.into();
+                self.apply_vars_msg(&mut event);
+                drop(parsing);
+                METRICS.events.inc();
+                let search = {
+                    let _timer = METRICS.search.start("search");
+                    event.search_string()
+                };
+                let leaf = {
+                    let _timer = METRICS.partition.start("partition");
+                    self.partitions.ensure(&mut self.client, &event)?
+                };
+                let batching = self.batching.as_mut().unwrap();
+                batching.pending.push(leaf, event, search);
+                if batching.pending.len() >= batching.settings.max_events {
+                    self.flush_batch()?;
+                }
+            }
+            // the message will not be resent, so it must not block the transaction
+            Err(error) => {
+                METRICS.parse_failures.inc();
+                error!("could not parse event: '{}': {}", line, error);
+            }
+        }
+        writeln!(io::stdout(), "DEFER_COMMIT")?;
         Ok(())
     }
 
-    fn insert_event(&mut self, event: &Event) -> Result<(), Error> {
-        let mut changed_event;
-        let event = if self.use_vars_msg && event.get_printable("vars.msg").is_some() {
-            changed_event = event.clone();
-            let old_msg = changed_event.get_printable("msg").unwrap();
-            changed_event.doc["msg"] = changed_event.get_printable("vars.msg").unwrap().into();
-            changed_event.doc["vars.msg"] = old_msg.into();
-            &changed_event
-        } else {
-            event
-        };
+    fn flush_batch(&mut self) -> Result<(), Error> {
+        let mut pending = std::mem::take(&mut self.batching.as_mut().unwrap().pending);
+        if pending.is_empty() {
+            return Ok(());
+        }
 
-        let search = event.search_string();
-        if self.insert_single_shot(event, &search).is_err() {
-            info!("Event insertion failed, trying to create missing partitions");
-            crate::partition::create_tables(
-                &mut self.client,
-                event,
-                &self
-                    .partitions
-                    .iter()
-                    .map(|boxed| (*boxed).as_ref() as &dyn Partitioner)
-                    .collect::<Vec<&dyn Partitioner>>(),
-            )?;
-            debug!("Partitions created, retrying event insertion");
-            self.insert_single_shot(event, &search)
-                .expect("event insertion still failed after creating partitions");
+        debug!("Writing batch of {} events", pending.len());
+        self.write_batch(&pending)?;
+        // keeps the allocations for the next batch
+        pending.clear();
+        self.batching.as_mut().unwrap().pending = pending;
+        Ok(())
+    }
+
+    /// Write `batch`, handling failures like `store_event`
+    ///
+    /// A batch the database refuses for its content is written event by event, so only the
+    /// refused events are dropped.
+    fn write_batch(&mut self, batch: &Batch) -> Result<(), Error> {
+        let mut created = false;
+        let mut reconnects = 0;
+        loop {
+            let rollups = self.rollups.as_deref();
+            let notify = self.notify.as_deref();
+            let err = match batch.write(&mut self.client, &self.columns, rollups, notify) {
+                Ok(()) => return Ok(()),
+                Err(err) => err,
+            };
+            match Failure::of(&err) {
+                Failure::MissingPartition if !created => {
+                    info!("Batch insertion failed, trying to create missing partitions");
+                    self.partitions.forget();
+                    let parts = self.partitions.parts();
+                    for event in batch.representatives() {
+                        partition::create_tables(&mut self.client, event, &parts)?;
+                    }
+                    debug!("Partitions created, retrying batch insertion");
+                    created = true;
+                }
+                Failure::Connection if reconnects < self.reconnect_settings.attempts => {
+                    warn!("Lost database connection: {}", err);
+                    self.reconnect()?;
+                    reconnects += 1;
+                }
+                Failure::Data if batch.len() > 1 => {
+                    warn!("Batch refused, writing its events one by one: {}", err);
+                    for single in batch.singles() {
+                        self.write_batch(&single)?;
+                    }
+                    return Ok(());
+                }
+                Failure::Data => {
+                    METRICS.refused.inc();
+                    for event in batch.representatives() {
+                        error!(
+                            "Dropping event the database refused: {}: {}",
+                            err, event.doc
+                        );
+                    }
+                    return Ok(());
+                }
+                _ => return Err(err.into()),
+            }
+        }
+    }
+
+    /// Replace a lost connection and re-prepare the cached statements
+    fn reconnect(&mut self) -> Result<(), Error> {
+        self.client = db::reconnect(&self.connect, &self.reconnect_settings)?;
+        if self.batching.is_some() {
+            batch::prepare_session(&mut self.client, &self.columns)?;
+        }
+
+        let tables = self
+            .prepared_inserts
+            .iter()
+            .map(|(table, _)| table.to_owned())
+            .collect::<Vec<String>>();
+        self.prepared_inserts.clear();
+        for table in tables {
+            self.prepare_insert(&table)?;
+        }
+        Ok(())
+    }
+
+    fn apply_vars_msg(&self, event: &mut Event) {
+        if self.use_vars_msg {
+            event.swap_printable("vars.msg", "msg");
         }
+    }
 
+    fn prepare_insert(&mut self, root_table: &str) -> Result<(), postgres::Error> {
+        if !self.prepared_inserts.contains_key(root_table) {
+            info!("Preparing insert statement for root table {}", root_table);
+            let placeholders: String = (0..self.columns.len())
+                .map(|index| format!(", ${}", index + 4))
+                .collect();
+            // notifications carry the new event's id
+            let returning = match self.notify {
+                Some(_) => " returning id::bigint",
+                None => "",
+            };
+            let statement = self.client.prepare(
+                format!(
+                    "insert into {} (tstamp, doc, search{}) values ($1, $2, to_tsvector($3){}){}",
+                    root_table,
+                    columns::name_list(&self.columns),
+                    placeholders,
+                    returning
+                )
+                .as_str(),
+            )?;
+            self.prepared_inserts
+                .insert(root_table.to_owned(), statement);
+        }
         Ok(())
     }
 
+    fn insert_single_shot(
+        &mut self,
+        root_table: &str,
+        event: &Event,
+        search: &str,
+    ) -> Result<(), postgres::Error> {
+        self.prepare_insert(root_table)?;
+        let values = self
+            .columns
+            .iter()
+            .map(|column| column.extract(&event.doc))
+            .collect::<Vec<_>>();
+        let mut params: Vec<&(dyn ToSql + Sync)> = vec![&event.timestamp, &event.doc, &search];
+        params.extend(values.iter().map(columns::sql_param));
+        let statement = self.prepared_inserts.get_mut(root_table).unwrap();
+        if self.rollups.is_none() && self.notify.is_none() {
+            return self.client.execute(statement, &params).map(|_| ());
+        }
+
+        let mut transaction = self.client.transaction()?;
+        match &self.notify {
+            Some(channel) => {
+                let row = transaction.query_one(&*statement, &params)?;
+                notify::send(&mut transaction, channel, root_table, row.get(0))?;
+            }
+            None => {
+                transaction.execute(&*statement, &params)?;
+            }
+        }
+        if let Some(rollups) = &self.rollups {
+            rollup::add(&mut transaction, rollups, std::iter::once(event))?;
+        }
+        transaction.commit()
+    }
+
+    fn insert_event(&mut self, event: &Event) -> Result<(), Error> {
+        let mut search = std::mem::take(&mut self.search);
+        search.clear();
+        {
+            let _timer = METRICS.search.start("search");
+            event.search_string_into(&mut search);
+        }
+        let result = self.store_event(event, &search);
+        self.search = search;
+        result
+    }
+
+    /// Insert `event`, handling failures according to their cause
+    ///
+    /// Missing partitions get created, lost connections replaced. Events the database refuses
+    /// for their content are logged and dropped, rsyslog would resend them forever.
+    fn store_event(&mut self, event: &Event, search: &str) -> Result<(), Error> {
+        let root_table = self.partitions.root_name(event)?;
+        let mut created = false;
+        let mut reconnects = 0;
+        loop {
+            let partition = METRICS.partition.start("partition");
+            let ensured = self.partitions.ensure(&mut self.client, event);
+            drop(partition);
+            let result = match ensured {
+                Ok(_) => {
+                    let _timer = METRICS.insert.start("insert");
+                    self.insert_single_shot(&root_table, event, search)
+                }
+                Err(partition::Error::Postgres(err)) => Err(err),
+                Err(err) => return Err(err.into()),
+            };
+            let err = match result {
+                Ok(()) => return Ok(()),
+                Err(err) => err,
+            };
+
+            match Failure::of(&err) {
+                Failure::MissingPartition if !created => {
+                    info!("Event insertion failed, trying to create missing partitions");
+                    self.partitions.forget();
+                    partition::create_tables(&mut self.client, event, &self.partitions.parts())?;
+                    debug!("Partitions created, retrying event insertion");
+                    created = true;
+                }
+                Failure::Connection if reconnects < self.reconnect_settings.attempts => {
+                    warn!("Lost database connection: {}", err);
+                    self.reconnect()?;
+                    reconnects += 1;
+                }
+                Failure::Data => {
+                    METRICS.refused.inc();
+                    error!(
+                        "Dropping event the database refused: {}: {}",
+                        err, event.doc
+                    );
+                    return Ok(());
+                }
+                _ => return Err(err.into()),
+            }
+        }
+    }
+
     fn handle_event(&mut self, line: &str) -> Result<(), Error> {
+        let parsing = METRICS.parse.start("parse");
         match serde_json::from_str::<RsyslogdEvent>(line) {
             Ok(rsyslog_event) => {
-                let stuff_event: Event = rsyslog_event.into();
+                let mut stuff_event: Event = rsyslog_event.into();
+                self.apply_vars_msg(&mut stuff_event);
+                drop(parsing);
+                METRICS.events.inc();
                 self.insert_event(&stuff_event)?;
                 writeln!(io::stdout(), "OK")?;
             }
-            Err(error) => error!("could not parse event: '{}': {}", line, error),
+            Err(error) => {
+                METRICS.parse_failures.inc();
+                error!("could not parse event: '{}': {}", line, error);
+            }
         }
         Ok(())
     }
@@ -177,6 +599,7 @@ impl fmt::Display for Error {
             Io(e) => write!(f, "I/O Error: {}", e),
             Json(e) => write!(f, "json de-/serialization failed: {}", e),
             Partition(e) => write!(f, "Could not create partitions: {}", e),
+            Pipeline(e) => write!(f, "Import pipeline failed: {}", e),
             Tls(e) => write!(f, "TLS Error: {}", e),
         }
     }
@@ -0,0 +1,243 @@
+use postgres_native_tls::MakeTlsConnector;
+use std::collections::HashMap;
+use std::fs::File;
+use std::io::{self, BufRead, BufReader, Read};
+use std::path::{Path, PathBuf};
+use std::sync::mpsc::{self, Receiver, SyncSender};
+use std::sync::{Arc, Mutex};
+use std::thread;
+
+use logstuff::event::{Event, RsyslogdEvent};
+
+use crate::app::Error;
+use crate::batch::Batch;
+use crate::cli::BackfillOptions;
+use crate::columns;
+use crate::config::Config;
+use crate::db::Connect;
+use crate::metrics::{self, METRICS};
+use crate::partition::{self, Chain, Partitioner};
+use crate::pipeline::Writer;
+use crate::rollup;
+
+/// Number of events per COPY if no batch settings are configured
+const CHUNK_SIZE: usize = 50000;
+
+/// Events of a single leaf partition
+struct Chunk {
+    leaf: String,
+    batch: Batch,
+}
+
+/// Import files of rsyslog events
+///
+/// `jobs` threads read and decode files, grouping events into chunks by leaf partition. The main
+/// thread creates a chunk's partitions before its first chunk gets loaded by one of `jobs`
+/// writers, each using its own connection. With `defer_indexes`, new leaf partitions are created
+/// detached and attached (building their indexes) after all files are loaded. Writers recover
+/// from failed chunks like the importer does: they reconnect, and write a chunk the database
+/// refuses event by event, dropping only the refused events.
+pub fn run(options: &BackfillOptions, config: Config) -> Result<(), Error> {
+    env_logger::init();
+    let connector = MakeTlsConnector::new(config.tls.connector()?);
+    let mut client = postgres::Client::connect(&config.db_url, connector.clone())?;
+    let chain = Chain::new(config.partitions)?;
+    if let Some(settings) = &config.metrics {
+        metrics::spawn(settings)?;
+    }
+    if !config.columns.is_empty() {
+        let root = partition::ensure_root(&mut client, &chain.parts())?;
+        columns::add_to_root(&mut client, &root, &config.columns)?;
+    }
+    let columns = Arc::new(config.columns);
+    if let Some(rollups) = &config.rollups {
+        rollup::ensure_tables(&mut client, rollups)?;
+    }
+    let rollups = config.rollups.map(Arc::new);
+    let chunk_size = config
+        .batch
+        .map(|settings| settings.max_events)
+        .unwrap_or(CHUNK_SIZE);
+    let jobs = options.jobs.max(1);
+
+    let files = Arc::new(Mutex::new(options.files.clone().into_iter()));
+    let (chunks, chunks_rx) = mpsc::sync_channel(jobs);
+    let readers = (0..jobs)
+        .map(|_| {
+            let files = files.clone();
+            let chunks = chunks.clone();
+            let chain = Chain::from_shared(chain.shared());
+            let use_vars_msg = config.use_vars_msg;
+            thread::spawn(move || read_files(files, chunks, chain, chunk_size, use_vars_msg))
+        })
+        .collect::<Vec<_>>();
+    drop(chunks);
+
+    let (loads, loads_rx) = mpsc::sync_channel::<Batch>(jobs);
+    let loads_rx = Arc::new(Mutex::new(loads_rx));
+    let db_url = config.db_url.to_owned();
+    let connect: Connect = Arc::new(move || postgres::Client::connect(&db_url, connector.clone()));
+    let writers = (0..jobs)
+        .map(|_| {
+            let loads_rx = loads_rx.clone();
+            let parts = chain.shared();
+            let connect = connect.clone();
+            let reconnect = config.reconnect.clone();
+            let columns = columns.clone();
+            let rollups = rollups.clone();
+            thread::spawn(move || -> Result<usize, Error> {
+                // old events, nothing for live tails
+                let writer = Writer::connect(connect, reconnect, columns, rollups, None)?;
+                load_chunks(writer, loads_rx, parts)
+            })
+        })
+        .collect::<Vec<_>>();
+
+    let parts = chain.parts();
+    let mut seen = HashMap::new();
+    for chunk in chunks_rx {
+        if !seen.contains_key(&chunk.leaf) {
+            let event = chunk.batch.representatives().next().unwrap();
+            let detached = if options.defer_indexes {
+                partition::create_detached_leaf(&mut client, event, &parts)?
+            } else {
+                partition::ensure_tables(&mut client, event, &parts)?;
+                false
+            };
+            seen.insert(chunk.leaf.to_owned(), detached.then(|| event.clone()));
+        }
+        if loads.send(chunk.batch).is_err() {
+            // all writers failed, their errors are reported below
+            break;
+        }
+    }
+    drop(loads);
+
+    let mut result = Ok(());
+    let mut events = 0;
+    for handle in readers {
+        events += handle.join().expect("reader thread panicked")?;
+    }
+    for handle in writers {
+        match handle.join().expect("writer thread panicked") {
+            Ok(_) => (),
+            Err(err) => {
+                error!("Loading events failed: {}", err);
+                result = Err(err);
+            }
+        }
+    }
+    result?;
+
+    for event in seen.values().flatten() {
+        partition::attach_leaf(&mut client, event, &parts)?;
+    }
+    info!("Imported {} events into {} partitions", events, seen.len());
+    Ok(())
+}
+
+/// Open an input file, decompressing it according to its extension
+fn open(path: &Path) -> io::Result<Box<dyn BufRead>> {
+    let file = File::open(path)?;
+    let reader: Box<dyn Read> = match path.extension().and_then(|ext| ext.to_str()) {
+        Some("gz") => Box::new(flate2::read::MultiGzDecoder::new(file)),
+        Some("zst") => Box::new(zstd::stream::read::Decoder::new(file)?),
+        _ => Box::new(file),
+    };
+    Ok(Box::new(BufReader::with_capacity(1 << 20, reader)))
+}
+
+/// Read files until none are left, returns the number of decoded events
+fn read_files(
+    files: Arc<Mutex<std::vec::IntoIter<PathBuf>>>,
+    chunks: SyncSender<Chunk>,
+    mut chain: Chain,
+    chunk_size: usize,
+    use_vars_msg: bool,
+) -> Result<usize, Error> {
+    let mut pending: HashMap<String, Batch> = HashMap::new();
+    let mut events = 0;
+    let mut line = String::new();
+    loop {
+        let next = files.lock().unwrap().next();
+        let path = match next {
+            Some(path) => path,
+            None => break,
+        };
+        info!("Reading {}", path.display());
+        let mut reader = open(&path)?;
+
+        loop {
+            line.clear();
+            if reader.read_line(&mut line)? == 0 {
+                break;
+            }
+            let trimmed = line.trim();
+            if trimmed.is_empty() {
+                continue;
+            }
+            let parsing = METRICS.parse.start("parse");
+            let mut event: Event = match serde_json::from_str::<RsyslogdEvent>(trimmed) {
+                Ok(rsyslog_event) => rsyslog_event.into(),
+                Err(error) => {
+                    METRICS.parse_failures.inc();
+                    error!("could not parse event in {}: {}", path.display(), error);
+                    continue;
+                }
+            };
+            if use_vars_msg {
+                event.swap_printable("vars.msg", "msg");
+            }
+            drop(parsing);
+            METRICS.events.inc();
+            let search = {
+                let _timer = METRICS.search.start("search");
+                event.search_string()
+            };
+            let leaf = {
+                let _timer = METRICS.partition.start("partition");
+                chain.leaf_name(&event)?
+            };
+            let batch = pending.entry(leaf.to_owned()).or_default();
+            batch.push(leaf.to_owned(), event, search);
+            events += 1;
+
+            if batch.len() >= chunk_size {
+                let batch = pending.remove(&leaf).unwrap();
+                if chunks.send(Chunk { leaf, batch }).is_err() {
+                    return Ok(events);
+                }
+            }
+        }
+    }
+
+    for (leaf, batch) in pending {
+        if chunks.send(Chunk { leaf, batch }).is_err() {
+            break;
+        }
+    }
+    Ok(events)
+}
+
+/// Write chunks until the channel closes, returns the number of loaded chunks
+fn load_chunks(
+    mut writer: Writer,
+    loads: Arc<Mutex<Receiver<Batch>>>,
+    parts: Arc<Vec<Box<dyn Partitioner>>>,
+) -> Result<usize, Error> {
+    let parts = parts
+        .iter()
+        .map(|boxed| boxed.as_ref() as &dyn Partitioner)
+        .collect::<Vec<&dyn Partitioner>>();
+    let mut count = 0;
+    loop {
+        let received = loads.lock().unwrap().recv();
+        let batch = match received {
+            Ok(batch) => batch,
+            Err(_) => return Ok(count),
+        };
+        debug!("Loading chunk of {} events", batch.len());
+        writer.write_batch(&batch, &parts)?;
+        count += 1;
+    }
+}
@@ -0,0 +1,199 @@
+use postgres::binary_copy::BinaryCopyInWriter;
+use postgres::types::{ToSql, Type};
+use std::collections::HashMap;
+use std::time::{Duration, Instant};
+
+use logstuff::columns::Column;
+use logstuff::event::Event;
+use logstuff::rollup::RollupSettings;
+
+use crate::columns;
+use crate::metrics::METRICS;
+use crate::notify;
+use crate::rollup;
+
+/// Name of the session local table used to stage COPY input
+const STAGING_TABLE: &str = "stuffimport_batch";
+
+/// Settings for batched inserts within rsyslog transactions
+#[derive(Clone, Debug, Deserialize, Serialize)]
+#[serde(deny_unknown_fields, default)]
+pub struct BatchSettings {
+    /// Write pending events to the database once this many are buffered
+    pub max_events: usize,
+
+    /// Write pending events to the database once the oldest one waited this long
+    pub max_delay_ms: u64,
+
+    /// Line rsyslog sends to start a transaction (omprog: beginTransactionMark)
+    pub begin_mark: String,
+
+    /// Line rsyslog sends to end a transaction (omprog: commitTransactionMark)
+    pub commit_mark: String,
+}
+
+impl Default for BatchSettings {
+    fn default() -> Self {
+        Self {
+            max_events: 5000,
+            max_delay_ms: 200,
+            begin_mark: "BEGIN TRANSACTION".into(),
+            commit_mark: "COMMIT TRANSACTION".into(),
+        }
+    }
+}
+
+impl BatchSettings {
+    pub fn max_delay(&self) -> Duration {
+        Duration::from_millis(self.max_delay_ms)
+    }
+}
+
+/// Events waiting for being written, grouped by leaf partition
+#[derive(Default)]
+pub struct Batch {
+    started: Option<Instant>,
+    len: usize,
+    partitions: HashMap<String, Vec<(Event, String)>>,
+}
+
+impl Batch {
+    pub fn push(&mut self, leaf: String, event: Event, search: String) {
+        self.started.get_or_insert_with(Instant::now);
+        self.partitions
+            .entry(leaf)
+            .or_default()
+            .push((event, search));
+        self.len += 1;
+    }
+
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    /// Time until this batch has to be written, `None` for empty batches
+    pub fn time_left(&self, max_delay: Duration) -> Option<Duration> {
+        self.started
+            .map(|started| max_delay.saturating_sub(started.elapsed()))
+    }
+
+    pub fn clear(&mut self) {
+        self.started = None;
+        self.len = 0;
+        self.partitions.clear();
+    }
+
+    /// One event of each leaf partition, enough to create all missing tables
+    pub fn representatives(&self) -> impl Iterator<Item = &Event> {
+        self.partitions
+            .values()
+            .filter_map(|events| events.first().map(|(event, _)| event))
+    }
+
+    /// Each event as a batch of its own, to find the ones the database refuses
+    pub fn singles(&self) -> impl Iterator<Item = Batch> + '_ {
+        self.partitions.iter().flat_map(|(leaf, events)| {
+            events.iter().map(move |(event, search)| {
+                let mut single = Batch::default();
+                single.push(leaf.to_owned(), event.clone(), search.to_owned());
+                single
+            })
+        })
+    }
+
+    /// Write all events within a single transaction
+    ///
+    /// Each leaf partition's events are sent with `COPY ... (format binary)` into a temporary
+    /// table and then moved to the leaf, converting the search string to a tsvector on the way.
+    /// COPY cannot apply `to_tsvector` by itself. Promoted `columns` are extracted from the events
+    /// and copied along, `rollups` get the batch's counts in the same transaction. Listeners of
+    /// the `notify` channel learn about each leaf's new events once they are committed.
+    pub fn write(
+        &self,
+        client: &mut postgres::Client,
+        columns: &[Column],
+        rollups: Option<&RollupSettings>,
+        notify: Option<&str>,
+    ) -> Result<(), postgres::Error> {
+        let _timer = METRICS.write.start("write");
+        let names = columns::name_list(columns);
+        let mut types = vec![Type::TIMESTAMPTZ, Type::JSONB, Type::TEXT];
+        types.extend(columns.iter().map(|column| columns::sql_type(column.kind)));
+
+        let mut transaction = client.transaction()?;
+        let mut written = Vec::new();
+        for (leaf, events) in &self.partitions {
+            let sink = transaction.copy_in(
+                format!(
+                    "copy {} (tstamp, doc, search{}) from stdin (format binary)",
+                    STAGING_TABLE, names
+                )
+                .as_str(),
+            )?;
+            let mut writer = BinaryCopyInWriter::new(sink, &types);
+            for (event, search) in events {
+                let values = columns
+                    .iter()
+                    .map(|column| column.extract(&event.doc))
+                    .collect::<Vec<_>>();
+                let mut row: Vec<&(dyn ToSql + Sync)> = vec![&event.timestamp, &event.doc, search];
+                row.extend(values.iter().map(columns::sql_param));
+                writer.write(&row)?;
+            }
+            writer.finish()?;
+
+            let insert = format!(
+                "insert into {} (tstamp, doc, search{}) select tstamp, doc, to_tsvector(search){} from {}",
+                leaf, names, names, STAGING_TABLE
+            );
+            if notify.is_some() {
+                let max_id = transaction.query_one(
+                    format!(
+                        "with inserted as ({} returning id) select max(id)::bigint from inserted",
+                        insert
+                    )
+                    .as_str(),
+                    &[],
+                )?;
+                written.push((leaf, max_id.get::<_, Option<i64>>(0)));
+            } else {
+                transaction.execute(insert.as_str(), &[])?;
+            }
+            transaction.batch_execute(format!("truncate {}", STAGING_TABLE).as_str())?;
+        }
+        if let Some(rollups) = rollups {
+            let events = self.partitions.values().flatten().map(|(event, _)| event);
+            rollup::add(&mut transaction, rollups, events)?;
+        }
+        if let Some(channel) = notify {
+            for (leaf, max_id) in written {
+                if let Some(max_id) = max_id {
+                    notify::send(&mut transaction, channel, leaf, max_id)?;
+                }
+            }
+        }
+        transaction.commit()
+    }
+}
+
+/// Create the staging table used by `Batch::write` for the current session
+pub fn prepare_session(
+    client: &mut postgres::Client,
+    columns: &[Column],
+) -> Result<(), postgres::Error> {
+    let promoted: String = columns
+        .iter()
+        .map(|column| format!(", {} {}", column.column_name(), column.kind.sql_type()))
+        .collect();
+    client.batch_execute(
+        format!(
+            "create temporary table if not exists {} (tstamp timestamp with time zone, doc jsonb, search text{})",
+            STAGING_TABLE, promoted
+        )
+        .as_str(),
+    )
+}
@@ -9,6 +9,21 @@ pub struct Options {
 
     /// Dump parsed config to stderr
     pub dump_config: bool,
+
+    /// Import files instead of running as rsyslog output (subcommand "backfill")
+    pub backfill: Option<BackfillOptions>,
+}
+
+#[derive(Debug)]
+pub struct BackfillOptions {
+    /// Files containing one JSON event per line, optionally compressed (.gz, .zst)
+    pub files: Vec<PathBuf>,
+
+    /// Number of files read and database connections written to in parallel
+    pub jobs: usize,
+
+    /// Build indexes of newly created partitions after loading them
+    pub defer_indexes: bool,
 }
 
 impl Options {
@@ -32,11 +47,56 @@ impl Options {
                     .help("Sets a custom config file")
                     .takes_value(true),
             )
+            .subcommand(
+                App::new("backfill")
+                    .about("Import files of rsyslog JSON events (e.g. archives) in parallel")
+                    .arg(
+                        Arg::new("jobs")
+                            .short('j')
+                            .long("jobs")
+                            .value_name("N")
+                            .help("Number of files and database connections used in parallel")
+                            .default_value("4")
+                            .validator(|value| value.parse::<usize>())
+                            .takes_value(true),
+                    )
+                    .arg(
+                        Arg::new("defer_indexes")
+                            .long("defer-indexes")
+                            .help("Build indexes of new partitions after loading them")
+                            .takes_value(false),
+                    )
+                    .arg(
+                        Arg::new("files")
+                            .value_name("FILE")
+                            .help("Input files, compressed ones need extension .gz or .zst")
+                            .required(true)
+                            .multiple_values(true)
+                            .takes_value(true),
+                    ),
+            )
             .get_matches();
 
+        let backfill = match matches.subcommand() {
+            Some(("backfill", backfill)) => Some(BackfillOptions {
+                files: backfill
+                    .values_of("files")
+                    .map(|files| files.map(PathBuf::from).collect())
+                    .unwrap_or_default(),
+                // checked by the validator
+                jobs: backfill
+                    .value_of("jobs")
+                    .and_then(|jobs| jobs.parse().ok())
+                    .unwrap_or(4),
+                defer_indexes: backfill.is_present("defer_indexes"),
+            }),
+            _ => None,
+        };
+
         Options {
             config_path: matches.value_of("config_file").map(PathBuf::from),
             dump_config: matches.is_present("dump_config"),
+            backfill,
         }
     }
 }
@@ -0,0 +1,63 @@
+use postgres::types::{ToSql, Type};
+
+use logstuff::columns::{Column, ColumnType, ColumnValue};
+
+pub fn sql_type(kind: ColumnType) -> Type {
+    match kind {
+        ColumnType::Smallint => Type::INT2,
+        ColumnType::Integer => Type::INT4,
+        ColumnType::Bigint => Type::INT8,
+        ColumnType::Double => Type::FLOAT8,
+        ColumnType::Text => Type::TEXT,
+    }
+}
+
+pub fn sql_param(value: &ColumnValue) -> &(dyn ToSql + Sync) {
+    match value {
+        ColumnValue::Smallint(v) => v,
+        ColumnValue::Integer(v) => v,
+        ColumnValue::Bigint(v) => v,
+        ColumnValue::Double(v) => v,
+        ColumnValue::Text(v) => v,
+    }
+}
+
+/// Column names to append to a list of columns, empty if there are no promoted columns
+pub fn name_list(columns: &[Column]) -> String {
+    columns
+        .iter()
+        .map(|column| format!(", {}", column.column_name()))
+        .collect()
+}
+
+/// Add missing promoted columns (and their indexes) to the root table
+///
+/// Partitions inherit columns and indexes from the root table, existing ones included.
+pub fn add_to_root(
+    client: &mut impl postgres::GenericClient,
+    root_table: &str,
+    columns: &[Column],
+) -> Result<(), postgres::Error> {
+    for column in columns {
+        let name = column.column_name();
+        client.batch_execute(
+            format!(
+                "alter table {} add column if not exists {} {}",
+                root_table,
+                name,
+                column.kind.sql_type()
+            )
+            .as_str(),
+        )?;
+        if column.index {
+            client.batch_execute(
+                format!(
+                    "create index if not exists {}_{}_idx on {} ({})",
+                    root_table, name, root_table, name
+                )
+                .as_str(),
+            )?;
+        }
+    }
+    Ok(())
+}
@@ -1,7 +1,15 @@
+use logstuff::columns::Column;
+use logstuff::rollup::RollupSettings;
 use logstuff::tls::TlsSettings;
 use std::fs::File;
 
-use crate::partition::{self, Partitioner};
+use crate::batch::BatchSettings;
+use crate::db::ReconnectSettings;
+use crate::listen::ListenSettings;
+use crate::metrics::MetricsSettings;
+use crate::notify::NotifySettings;
+use crate::partition::{self, Partitioner, PrecreateSettings};
+use crate::pipeline::PipelineSettings;
 
 #[derive(Debug, Deserialize, Serialize)]
 #[serde(deny_unknown_fields, default)]
@@ -11,6 +19,15 @@ pub struct Config {
     pub tls: TlsSettings,
     pub use_vars_msg: bool,
     pub statement_cache_size: usize,
+    pub batch: Option<BatchSettings>,
+    pub precreate: PrecreateSettings,
+    pub pipeline: Option<PipelineSettings>,
+    pub listen: Option<ListenSettings>,
+    pub reconnect: ReconnectSettings,
+    pub columns: Vec<Column>,
+    pub rollups: Option<RollupSettings>,
+    pub notify: Option<NotifySettings>,
+    pub metrics: Option<MetricsSettings>,
 }
 
 impl Default for Config {
@@ -24,6 +41,15 @@ impl Default for Config {
             tls: TlsSettings::default(),
             use_vars_msg: true,
             statement_cache_size: 3,
+            batch: None,
+            precreate: PrecreateSettings::default(),
+            pipeline: None,
+            listen: None,
+            reconnect: ReconnectSettings::default(),
+            columns: Vec::new(),
+            rollups: None,
+            notify: None,
+            metrics: None,
         }
     }
 }
@@ -33,7 +59,9 @@ impl Config {
     pub fn load(opts: &crate::cli::Options) -> Result<Config, Box<dyn ::std::error::Error>> {
         if let Some(path) = &opts.config_path {
             let reader = File::open(path)?;
-            Ok(serde_yaml::from_reader(reader)?)
+            let config: Config = serde_yaml::from_reader(reader)?;
+            logstuff::columns::check(&config.columns)?;
+            Ok(config)
         } else {
             Ok(Config::default())
         }
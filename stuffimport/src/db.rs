@@ -0,0 +1,132 @@
+use std::error::Error as _;
+use std::io;
+use std::sync::Arc;
+use std::thread;
+use std::time::Duration;
+
+/// Opens a new database connection
+pub type Connect = Arc<dyn Fn() -> Result<postgres::Client, postgres::Error> + Send + Sync>;
+
+/// What went wrong with a statement, decides how to go on
+#[derive(Debug, PartialEq)]
+pub enum Failure {
+    /// The target table or a partition for the row does not exist: create tables and retry
+    MissingPartition,
+
+    /// The connection is gone or the server can't accept writes (e.g. during failover):
+    /// reconnect and retry
+    Connection,
+
+    /// The event can't be stored, retrying won't help
+    Data,
+
+    /// Anything else
+    Other,
+}
+
+impl Failure {
+    pub fn of(error: &postgres::Error) -> Self {
+        if let Some(db_error) = error.as_db_error() {
+            Self::of_state(db_error.code().code(), db_error.message())
+        } else if error.is_closed()
+            || error
+                .source()
+                .map_or(false, |source| source.is::<io::Error>())
+        {
+            Failure::Connection
+        } else {
+            Failure::Other
+        }
+    }
+
+    fn of_state(code: &str, message: &str) -> Self {
+        match code {
+            "42P01" => Failure::MissingPartition,
+            // inserting into a partitioned table without a matching partition (check_violation)
+            "23514" if message.starts_with("no partition of relation") => Failure::MissingPartition,
+            // admin_shutdown, crash_shutdown, cannot_connect_now, read_only_sql_transaction
+            "57P01" | "57P02" | "57P03" | "25006" => Failure::Connection,
+            _ => match &code[..2.min(code.len())] {
+                "08" => Failure::Connection,
+                // data exception, integrity constraint violation, program limit exceeded
+                "22" | "23" | "54" => Failure::Data,
+                _ => Failure::Other,
+            },
+        }
+    }
+}
+
+/// Settings for reconnecting to the database after losing the connection
+#[derive(Clone, Debug, Deserialize, Serialize)]
+#[serde(deny_unknown_fields, default)]
+pub struct ReconnectSettings {
+    /// Delay before the first attempt, doubled after each failed one
+    pub initial_delay_ms: u64,
+
+    /// Upper limit for the delay between attempts
+    pub max_delay_ms: u64,
+
+    /// Give up after this many failed attempts, or after reconnecting this many times without
+    /// getting a single write through
+    pub attempts: u32,
+}
+
+impl Default for ReconnectSettings {
+    fn default() -> Self {
+        Self {
+            initial_delay_ms: 100,
+            max_delay_ms: 5000,
+            attempts: 10,
+        }
+    }
+}
+
+/// Connect to the database, retrying with exponential backoff
+pub fn reconnect(
+    connect: &Connect,
+    settings: &ReconnectSettings,
+) -> Result<postgres::Client, postgres::Error> {
+    let mut delay = Duration::from_millis(settings.initial_delay_ms);
+    let mut attempt = 1;
+    loop {
+        thread::sleep(delay);
+        match connect() {
+            Ok(client) => {
+                info!("Reconnected to database after {} attempt(s)", attempt);
+                return Ok(client);
+            }
+            Err(err) if attempt < settings.attempts => {
+                warn!("Reconnect attempt {} failed: {}", attempt, err);
+                delay = (delay * 2).min(Duration::from_millis(settings.max_delay_ms));
+                attempt += 1;
+            }
+            Err(err) => return Err(err),
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn classify_states() {
+        assert_eq!(
+            Failure::of_state("23514", "no partition of relation \"logs\" found for row"),
+            Failure::MissingPartition
+        );
+        assert_eq!(
+            Failure::of_state("42P01", "relation \"logs_2021_10\" does not exist"),
+            Failure::MissingPartition
+        );
+        assert_eq!(
+            Failure::of_state("23514", "new row violates check constraint"),
+            Failure::Data
+        );
+        assert_eq!(Failure::of_state("08006", ""), Failure::Connection);
+        assert_eq!(Failure::of_state("25006", ""), Failure::Connection);
+        assert_eq!(Failure::of_state("22P02", ""), Failure::Data);
+        assert_eq!(Failure::of_state("54000", ""), Failure::Data);
+        assert_eq!(Failure::of_state("42501", ""), Failure::Other);
+    }
+}
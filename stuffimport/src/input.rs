@@ -0,0 +1,21 @@
+use std::io::{self, BufRead};
+use std::sync::mpsc::{self, Receiver};
+use std::thread;
+
+/// Read lines from stdin in a separate thread
+///
+/// Allows the main loop to wait for input with a timeout. At most `capacity` lines are read ahead.
+/// The channel gets closed at EOF or after the first read error.
+pub fn stdin_lines(capacity: usize) -> Receiver<io::Result<String>> {
+    let (sender, receiver) = mpsc::sync_channel(capacity);
+    thread::spawn(move || {
+        let stdin = io::stdin();
+        for line in stdin.lock().lines() {
+            let failed = line.is_err();
+            if sender.send(line).is_err() || failed {
+                break;
+            }
+        }
+    });
+    receiver
+}
@@ -0,0 +1,201 @@
+use std::io::{self, BufRead, BufReader};
+use std::net::{TcpListener, TcpStream};
+use std::os::unix::fs::FileTypeExt;
+use std::os::unix::net::UnixDatagram;
+use std::path::{Path, PathBuf};
+use std::thread;
+use std::time::Duration;
+
+use crate::pipeline::Pipeline;
+
+/// Settings for receiving events on sockets instead of stdin
+#[derive(Debug, Deserialize, Serialize)]
+#[serde(deny_unknown_fields, default)]
+pub struct ListenSettings {
+    /// Addresses to accept TCP connections on, one JSON event per line (rsyslog: omfwd)
+    pub tcp: Vec<String>,
+
+    /// Paths of unix datagram sockets, one JSON event per datagram (rsyslog: omuxsock)
+    pub unix: Vec<PathBuf>,
+
+    /// Maximum size of a datagram received on unix sockets, larger ones get truncated
+    pub max_datagram_size: usize,
+}
+
+impl Default for ListenSettings {
+    fn default() -> Self {
+        Self {
+            tcp: Vec::new(),
+            unix: Vec::new(),
+            max_datagram_size: 65536,
+        }
+    }
+}
+
+/// Delay after a failed receive or accept, doubled while they keep failing
+const MIN_ERROR_DELAY: Duration = Duration::from_millis(10);
+const MAX_ERROR_DELAY: Duration = Duration::from_secs(1);
+
+/// Waits after socket errors, so persistent ones (e.g. out of file descriptors) don't spin
+struct Backoff {
+    delay: Duration,
+}
+
+impl Backoff {
+    fn new() -> Self {
+        Self {
+            delay: Duration::ZERO,
+        }
+    }
+
+    fn succeeded(&mut self) {
+        self.delay = Duration::ZERO;
+    }
+
+    fn failed(&mut self, err: &io::Error) {
+        if err.kind() == io::ErrorKind::Interrupted {
+            return;
+        }
+        self.delay = (self.delay * 2).clamp(MIN_ERROR_DELAY, MAX_ERROR_DELAY);
+        thread::sleep(self.delay);
+    }
+}
+
+/// Bind all configured sockets and feed received events into `pipeline`
+///
+/// Every socket and TCP connection gets its own thread. Threads block while the pipeline is full
+/// and stop reading from their socket, which makes senders queue events on their side.
+pub fn spawn(settings: &ListenSettings, pipeline: &Pipeline) -> io::Result<()> {
+    for address in &settings.tcp {
+        let listener = TcpListener::bind(address)?;
+        info!("Listening for events on tcp {}", address);
+        let pipeline = pipeline.clone();
+        thread::spawn(move || accept(listener, pipeline));
+    }
+
+    for path in &settings.unix {
+        remove_stale_socket(path)?;
+        let socket = UnixDatagram::bind(path)?;
+        info!("Listening for events on unix socket {}", path.display());
+        let pipeline = pipeline.clone();
+        let max_size = settings.max_datagram_size;
+        thread::spawn(move || receive_datagrams(socket, max_size, pipeline));
+    }
+    Ok(())
+}
+
+/// Remove the socket a previous instance left at `path`
+///
+/// Fails for anything else found there, like a file given by mistake, and for sockets another
+/// process is still receiving on (connecting to them succeeds).
+fn remove_stale_socket(path: &Path) -> io::Result<()> {
+    let metadata = match std::fs::symlink_metadata(path) {
+        Ok(metadata) => metadata,
+        Err(err) if err.kind() == io::ErrorKind::NotFound => return Ok(()),
+        Err(err) => return Err(err),
+    };
+    if !metadata.file_type().is_socket() {
+        return Err(io::Error::new(
+            io::ErrorKind::AlreadyExists,
+            format!("{} exists and is no socket", path.display()),
+        ));
+    }
+    if UnixDatagram::unbound()?.connect(path).is_ok() {
+        return Err(io::Error::new(
+            io::ErrorKind::AddrInUse,
+            format!("{} is in use by another process", path.display()),
+        ));
+    }
+    std::fs::remove_file(path)
+}
+
+fn accept(listener: TcpListener, pipeline: Pipeline) {
+    let mut backoff = Backoff::new();
+    for stream in listener.incoming() {
+        match stream {
+            Ok(stream) => {
+                backoff.succeeded();
+                let pipeline = pipeline.clone();
+                thread::spawn(move || receive_lines(stream, pipeline));
+            }
+            Err(err) => {
+                warn!("Could not accept connection: {}", err);
+                backoff.failed(&err);
+            }
+        }
+    }
+}
+
+fn receive_lines(stream: TcpStream, pipeline: Pipeline) {
+    let peer = stream
+        .peer_addr()
+        .map(|addr| addr.to_string())
+        .unwrap_or_else(|_| "unknown peer".into());
+    debug!("Accepted connection from {}", peer);
+
+    for line in BufReader::new(stream).lines() {
+        let line = match line {
+            Ok(line) => line,
+            Err(err) => {
+                warn!("Could not read from {}: {}", peer, err);
+                break;
+            }
+        };
+        if line.trim().is_empty() {
+            continue;
+        }
+        if pipeline.submit(line).is_err() {
+            // the main thread reports the error and terminates
+            return;
+        }
+    }
+    debug!("Connection from {} closed", peer);
+}
+
+fn receive_datagrams(socket: UnixDatagram, max_size: usize, pipeline: Pipeline) {
+    let mut buffer = vec![0; max_size];
+    let mut backoff = Backoff::new();
+    loop {
+        let size = match socket.recv(&mut buffer) {
+            Ok(size) => size,
+            Err(err) => {
+                warn!("Could not read from unix socket: {}", err);
+                backoff.failed(&err);
+                continue;
+            }
+        };
+        backoff.succeeded();
+        let line = String::from_utf8_lossy(&buffer[..size]);
+        if line.trim().is_empty() {
+            continue;
+        }
+        if pipeline.submit(line.into_owned()).is_err() {
+            return;
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn stale_sockets() {
+        let dir = std::env::temp_dir().join(format!("stuffimport-listen-{}", std::process::id()));
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("events.sock");
+        assert!(remove_stale_socket(&path).is_ok());
+
+        // a socket still bound is in use, once closed it is stale
+        let socket = UnixDatagram::bind(&path).unwrap();
+        assert!(remove_stale_socket(&path).is_err());
+        drop(socket);
+        assert!(remove_stale_socket(&path).is_ok());
+        assert!(!path.exists());
+
+        std::fs::write(&path, "not a socket").unwrap();
+        assert!(remove_stale_socket(&path).is_err());
+        assert!(path.exists());
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+}
@@ -11,9 +11,19 @@ use std::process::exit;
 
 mod app; // app stuff for *this* program
 mod application; // general app stuff
+mod backfill;
+mod batch;
 mod cli;
+mod columns;
 mod config;
+mod db;
+mod input;
+mod listen;
+mod metrics;
+mod notify;
 mod partition;
+mod pipeline;
+mod rollup;
 
 use app::App;
 use application::Application;
@@ -41,6 +51,11 @@ fn run<T: Application>() -> Result<(), Box<dyn ::std::error::Error>> {
         eprintln!("{}", serde_yaml::to_string(&config)?)
     }
 
+    if let Some(backfill) = &opts.backfill {
+        backfill::run(backfill, config)?;
+        return Ok(());
+    }
+
     // Initialize the application.
     application::run::<T>(opts, config)?;
     Ok(())
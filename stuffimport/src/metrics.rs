@@ -0,0 +1,208 @@
+//! Import metrics in Prometheus' text format, served over HTTP or written to a file
+//!
+//! Latencies are kept per stage of an event's way into the database:
+//! * parse: decoding the JSON line into an event
+//! * search: building its full text search string (`to_tsvector` runs within insert or write)
+//! * partition: finding its leaf partition, creating missing partitions
+//! * insert: inserting a single event, with rollups and notifications
+//! * write: writing a batch (COPY, insert, rollups, notifications and commit)
+use std::io::{self, Read, Write};
+use std::net::{SocketAddr, TcpListener, TcpStream};
+use std::path::{Path, PathBuf};
+use std::thread;
+use std::time::Duration;
+
+use logstuff::metrics::{Counter, Exposition, Histogram};
+
+/// Settings for exporting metrics
+#[derive(Debug, Deserialize, Serialize)]
+#[serde(deny_unknown_fields, default)]
+pub struct MetricsSettings {
+    /// Serve metrics to HTTP requests on this address (any path)
+    pub listen_address: Option<SocketAddr>,
+
+    /// Write metrics to this file periodically, e.g. for node_exporter's textfile collector
+    pub textfile: Option<PathBuf>,
+
+    /// Seconds between writes of the textfile
+    pub interval_sec: u64,
+}
+
+impl Default for MetricsSettings {
+    fn default() -> Self {
+        Self {
+            listen_address: None,
+            textfile: None,
+            interval_sec: 15,
+        }
+    }
+}
+
+pub struct Metrics {
+    pub events: Counter,
+    pub parse_failures: Counter,
+    /// Events the database refused for their content
+    pub refused: Counter,
+    /// Tables set up while creating partitions
+    pub partition_tables: Counter,
+    pub parse: Histogram,
+    pub search: Histogram,
+    pub partition: Histogram,
+    pub insert: Histogram,
+    pub write: Histogram,
+}
+
+/// Metrics of this process, shared by all threads
+pub static METRICS: Metrics = Metrics {
+    events: Counter::new(),
+    parse_failures: Counter::new(),
+    refused: Counter::new(),
+    partition_tables: Counter::new(),
+    parse: Histogram::new(),
+    search: Histogram::new(),
+    partition: Histogram::new(),
+    insert: Histogram::new(),
+    write: Histogram::new(),
+};
+
+impl Metrics {
+    pub fn render(&self) -> String {
+        let mut exposition = Exposition::new();
+        exposition.counter(
+            "stuffimport_events_total",
+            "Events decoded",
+            self.events.get(),
+        );
+        exposition.counter(
+            "stuffimport_parse_failures_total",
+            "Lines that could not be decoded",
+            self.parse_failures.get(),
+        );
+        exposition.counter(
+            "stuffimport_refused_events_total",
+            "Events dropped because the database refused their content",
+            self.refused.get(),
+        );
+        exposition.counter(
+            "stuffimport_partition_tables_total",
+            "Tables set up while creating partitions",
+            self.partition_tables.get(),
+        );
+
+        let name = "stuffimport_stage_duration_seconds";
+        exposition.header(name, "Time spent per event or batch and stage", "histogram");
+        for (stage, histogram) in [
+            ("parse", &self.parse),
+            ("search", &self.search),
+            ("partition", &self.partition),
+            ("insert", &self.insert),
+            ("write", &self.write),
+        ] {
+            exposition.histogram(name, &[("stage", stage)], histogram);
+        }
+        exposition.finish()
+    }
+}
+
+/// Start exporting metrics as configured
+pub fn spawn(settings: &MetricsSettings) -> io::Result<()> {
+    if let Some(address) = settings.listen_address {
+        let listener = TcpListener::bind(address)?;
+        info!("Serving metrics on http://{}/metrics", address);
+        thread::spawn(move || serve(listener));
+    }
+    if let Some(path) = &settings.textfile {
+        let path = path.to_owned();
+        let interval = Duration::from_secs(settings.interval_sec.max(1));
+        thread::spawn(move || loop {
+            if let Err(err) = write_textfile(&path) {
+                warn!("Could not write metrics to {}: {}", path.display(), err);
+            }
+            thread::sleep(interval);
+        });
+    }
+    Ok(())
+}
+
+/// Answer each connection in its own thread, a slow or idle client doesn't hold up others
+fn serve(listener: TcpListener) {
+    for stream in listener.incoming() {
+        let result = stream.and_then(|stream| {
+            thread::Builder::new()
+                .name("metrics".into())
+                .spawn(move || {
+                    if let Err(err) = respond(stream) {
+                        warn!("Could not serve metrics: {}", err);
+                    }
+                })
+                .map(drop)
+        });
+        if let Err(err) = result {
+            warn!("Could not serve metrics: {}", err);
+        }
+    }
+}
+
+/// Answer a single request, whatever it asks for
+fn respond(mut stream: TcpStream) -> io::Result<()> {
+    stream.set_read_timeout(Some(Duration::from_secs(5)))?;
+    let mut request = Vec::new();
+    let mut buffer = [0; 1024];
+    while !request.windows(4).any(|end| end == b"\r\n\r\n") {
+        let bytes = stream.read(&mut buffer)?;
+        if bytes == 0 || request.len() > 65536 {
+            break;
+        }
+        request.extend_from_slice(&buffer[..bytes]);
+    }
+
+    let body = METRICS.render();
+    write!(
+        stream,
+        "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: {}\r\nConnection: close\r\n\r\n{}",
+        body.len(),
+        body
+    )
+}
+
+/// Replace the file at once, collectors never see partial files
+fn write_textfile(path: &Path) -> io::Result<()> {
+    let mut temporary = path.as_os_str().to_owned();
+    temporary.push(".tmp");
+    std::fs::write(&temporary, METRICS.render())?;
+    std::fs::rename(&temporary, path)
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn render_stages() {
+        METRICS.events.inc();
+        drop(METRICS.write.start("write"));
+        let text = METRICS.render();
+        assert!(text.contains("\nstuffimport_events_total "));
+        assert!(text.contains("stuffimport_stage_duration_seconds_count{stage=\"parse\"} "));
+        assert!(text
+            .contains("stuffimport_stage_duration_seconds_bucket{stage=\"write\",le=\"+Inf\"} "));
+    }
+
+    #[test]
+    fn serve_while_idle() {
+        let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+        let address = listener.local_addr().unwrap();
+        thread::spawn(move || serve(listener));
+
+        // connected, but never sends its request
+        let _idle = TcpStream::connect(address).unwrap();
+        let mut stream = TcpStream::connect(address).unwrap();
+        stream
+            .set_read_timeout(Some(Duration::from_secs(2)))
+            .unwrap();
+        stream.write_all(b"GET /metrics HTTP/1.1\r\n\r\n").unwrap();
+        let mut response = String::new();
+        stream.read_to_string(&mut response).unwrap();
+        assert!(response.starts_with("HTTP/1.1 200 OK\r\n"));
+    }
+}
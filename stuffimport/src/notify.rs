@@ -0,0 +1,39 @@
+//! Notifications about committed events (see `logstuff::notify`)
+//!
+//! Live tails listen on the channel instead of polling the log tables. Notifications are sent
+//! within the writing transaction, postgres delivers them only if it commits.
+use postgres::GenericClient;
+
+use logstuff::notify::{Notification, DEFAULT_CHANNEL};
+
+/// Settings for notifying listeners of newly written events
+#[derive(Clone, Debug, Deserialize, Serialize)]
+#[serde(deny_unknown_fields, default)]
+pub struct NotifySettings {
+    /// Channel listeners subscribe to (`listen <channel>`)
+    pub channel: String,
+}
+
+impl Default for NotifySettings {
+    fn default() -> Self {
+        Self {
+            channel: DEFAULT_CHANNEL.into(),
+        }
+    }
+}
+
+/// Tell `channel`'s listeners about events up to `max_id` in `partition` once committed
+pub fn send(
+    client: &mut impl GenericClient,
+    channel: &str,
+    partition: &str,
+    max_id: i64,
+) -> Result<(), postgres::Error> {
+    let payload = serde_json::to_string(&Notification {
+        partition: partition.to_owned(),
+        max_id,
+    })
+    .expect("notifications serialize");
+    client.execute("select pg_notify($1, $2)", &[&channel, &payload])?;
+    Ok(())
+}
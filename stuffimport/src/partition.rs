@@ -1,18 +1,26 @@
 use serde::Deserialize;
-use std::{error, fmt};
+use serde_json::json;
+use std::collections::{BTreeMap, HashSet};
+use std::sync::Arc;
+use std::{error, fmt, thread};
 use time::error::{Format, InvalidFormatDescription};
+use time::format_description::OwnedFormatItem;
 use time::{
     format_description, Date, Duration, Month, OffsetDateTime, PrimitiveDateTime, Time, Weekday,
 };
 
+use logstuff::columns::jsonb_text;
 use logstuff::event::Event;
 
+use crate::metrics::METRICS;
+
 #[derive(Debug)]
 pub enum Error {
     Postgres(postgres::Error),
     NoPartition(String),
     InvalidDateTimeFormat(InvalidFormatDescription),
     DateTimeFormat(Format),
+    InvalidKey(String),
 }
 
 impl error::Error for Error {}
@@ -25,18 +33,88 @@ impl fmt::Display for Error {
             NoPartition(e) => write!(f, "No parition: {}", e),
             InvalidDateTimeFormat(e) => write!(f, "Invalid date and time format: {}", e),
             DateTimeFormat(e) => write!(f, "Could not format time stamp: {}", e),
+            InvalidKey(e) => write!(f, "Invalid partition key: {}", e),
         }
     }
 }
 
 #[typetag::serde(tag = "kind")]
-pub trait Partitioner: std::fmt::Debug {
+pub trait Partitioner: std::fmt::Debug + Send + Sync {
     fn table_name(&self, event: &Event) -> Result<String, Error>;
     fn partition_by(&self) -> String;
     fn bounds(&self, event: &Event) -> String;
     fn schema(&self) -> &str {
         unimplemented!()
     }
+
+    /// Prepare for repeated use, e.g. by parsing templates. Called once after loading the config.
+    fn compile(&mut self) -> Result<(), Error> {
+        Ok(())
+    }
+
+    /// Time range (lower bound inclusive, upper bound exclusive) of `event`'s partition
+    ///
+    /// Only partitions whose table name depends on nothing but the event's time stamp may return
+    /// a range.
+    fn time_range(&self, _event: &Event) -> Option<(OffsetDateTime, OffsetDateTime)> {
+        None
+    }
+
+    /// Indexes to create on each new table of this level
+    fn indexes(&self) -> &[IndexTemplate] {
+        &[]
+    }
+
+    /// Storage options for each new table of this level, used for leaf partitions only
+    fn storage(&self) -> Option<&StorageTemplate> {
+        None
+    }
+
+    /// Whether postgres decides which table of this level stores an event
+    ///
+    /// Such levels create all tables below their parent at once and events get written to the
+    /// parent. Only the last level may be routed.
+    fn routed(&self) -> bool {
+        false
+    }
+
+    /// Names and bounds of all tables below `event`'s parent table, for routed levels only
+    fn routed_partitions(&self, _event: &Event) -> Result<Vec<(String, String)>, Error> {
+        unreachable!()
+    }
+}
+
+/// Index created on new tables, in addition to those inherited from parent tables
+#[derive(Debug, Deserialize, Serialize)]
+#[serde(deny_unknown_fields)]
+pub struct IndexTemplate {
+    /// Index method, e.g. btree, brin or gin
+    #[serde(default = "IndexTemplate::default_method")]
+    pub method: String,
+
+    /// Indexed columns or expressions including operator classes, e.g. `doc jsonb_path_ops`
+    pub columns: String,
+
+    /// Storage parameters of the index, e.g. `pages_per_range = 64`
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub with: Option<String>,
+}
+
+impl IndexTemplate {
+    fn default_method() -> String {
+        "btree".into()
+    }
+}
+
+/// Storage options of new leaf partitions
+#[derive(Debug, Default, Deserialize, Serialize)]
+#[serde(deny_unknown_fields, default)]
+pub struct StorageTemplate {
+    /// Percentage of each table page filled by inserts
+    pub fillfactor: Option<u8>,
+
+    /// Compression of `doc` values stored out of line, e.g. lz4 (requires postgresql 14)
+    pub doc_compression: Option<String>,
 }
 
 impl From<postgres::Error> for Error {
@@ -63,6 +141,8 @@ impl From<Format> for Error {
 pub struct Root {
     pub table: String,
     pub schema: String,
+    pub indexes: Vec<IndexTemplate>,
+    pub storage: StorageTemplate,
 }
 
 impl Default for Root {
@@ -79,6 +159,8 @@ impl Default for Root {
                 ]
                 .join(" ")
             ),
+            indexes: Vec::new(),
+            storage: StorageTemplate::default(),
         }
     }
 }
@@ -100,6 +182,14 @@ impl Partitioner for Root {
     fn schema(&self) -> &str {
         &self.schema
     }
+
+    fn indexes(&self) -> &[IndexTemplate] {
+        &self.indexes
+    }
+
+    fn storage(&self) -> Option<&StorageTemplate> {
+        Some(&self.storage)
+    }
 }
 
 #[derive(Debug, Deserialize, Serialize)]
@@ -146,6 +236,8 @@ impl TimeTruncate {
     }
 
     pub fn upper_bound(&self, timestamp: &OffsetDateTime) -> OffsetDateTime {
+        // start from the lower bound, day 31 has no next month in general
+        let timestamp = &self.lower_bound(timestamp);
         let next = match self {
             Self::Year => timestamp.replace_date(
                 Date::from_calendar_date(timestamp.year() + 1, Month::January, 1).unwrap(),
@@ -198,6 +290,10 @@ impl TimeTruncate {
 pub struct Timerange {
     pub name_template: String,
     pub interval: TimeTruncate,
+    pub indexes: Vec<IndexTemplate>,
+    pub storage: StorageTemplate,
+    #[serde(skip)]
+    format: Option<OwnedFormatItem>,
 }
 
 impl Default for Timerange {
@@ -205,6 +301,9 @@ impl Default for Timerange {
         Self {
             name_template: "logs_%Y_%m".into(),
             interval: TimeTruncate::Month,
+            indexes: Vec::new(),
+            storage: StorageTemplate::default(),
+            format: None,
         }
     }
 }
@@ -212,14 +311,33 @@ impl Default for Timerange {
 #[typetag::serde(name = "timerange")]
 impl Partitioner for Timerange {
     fn table_name(&self, event: &Event) -> Result<String, Error> {
-        let format = format_description::parse(&self.name_template)?;
-        Ok(event.timestamp.format(&format)?)
+        format_name(&self.format, &self.name_template, event)
+    }
+
+    fn compile(&mut self) -> Result<(), Error> {
+        self.format = Some(format_description::parse_owned::<1>(&self.name_template)?);
+        Ok(())
+    }
+
+    fn time_range(&self, event: &Event) -> Option<(OffsetDateTime, OffsetDateTime)> {
+        Some((
+            self.interval.lower_bound(&event.timestamp),
+            self.interval.upper_bound(&event.timestamp),
+        ))
     }
 
     fn partition_by(&self) -> String {
         "range (tstamp)".into()
     }
 
+    fn indexes(&self) -> &[IndexTemplate] {
+        &self.indexes
+    }
+
+    fn storage(&self) -> Option<&StorageTemplate> {
+        Some(&self.storage)
+    }
+
     fn bounds(&self, event: &Event) -> String {
         let from = self.interval.lower_bound(&event.timestamp);
         let to = self.interval.upper_bound(&event.timestamp);
@@ -232,6 +350,242 @@ impl Partitioner for Timerange {
     }
 }
 
+fn format_name(
+    format: &Option<OwnedFormatItem>,
+    name_template: &str,
+    event: &Event,
+) -> Result<String, Error> {
+    match format {
+        Some(format) => Ok(event.timestamp.format(format)?),
+        None => {
+            let format = format_description::parse(name_template)?;
+            Ok(event.timestamp.format(&format)?)
+        }
+    }
+}
+
+/// Partition key expression of list and hash partitions
+///
+/// Uses the promoted column if there is one, `(doc ->> 'field')` otherwise. Queries need to
+/// compare the very same expression for postgres to skip partitions.
+fn key_expression(field: &str, column: &Option<String>) -> String {
+    match column {
+        Some(column) => column.to_owned(),
+        None => format!("(doc ->> '{}')", field),
+    }
+}
+
+/// Allow only fields that need no quoting, like logstuff query identifiers
+fn check_key(field: &str, column: &Option<String>) -> Result<(), Error> {
+    let valid_field = !field.is_empty()
+        && field
+            .chars()
+            .all(|c| c.is_ascii_alphanumeric() || matches!(c, '.' | '_' | '-'));
+    let valid_column = column.as_ref().map_or(true, |column| {
+        !column.is_empty()
+            && column
+                .chars()
+                .all(|c| c.is_ascii_alphanumeric() || c == '_')
+    });
+    if valid_field && valid_column {
+        Ok(())
+    } else {
+        Err(Error::InvalidKey(field.to_owned()))
+    }
+}
+
+/// Value of `field` as compared by the partition key, same as `doc ->> 'field'`
+pub(crate) fn key_value<'a>(event: &'a Event, field: &str) -> Option<std::borrow::Cow<'a, str>> {
+    match event.doc.get(field) {
+        None | Some(serde_json::Value::Null) => None,
+        Some(serde_json::Value::String(s)) => Some(s.into()),
+        Some(other) => Some(jsonb_text(other).into()),
+    }
+}
+
+/// FNV-1a, stable across builds unlike std's hashers
+fn fnv1a(value: &str) -> u32 {
+    value.bytes().fold(0x811c_9dc5, |hash, byte| {
+        (hash ^ u32::from(byte)).wrapping_mul(0x0100_0193)
+    })
+}
+
+/// Table name suffix for a list partition: the value's first alphanumeric characters and a hash
+/// of the whole value to keep names unique and short enough
+fn value_suffix(value: Option<&str>) -> String {
+    match value {
+        None => "null".into(),
+        Some(value) => {
+            let readable = value
+                .chars()
+                .filter(char::is_ascii_alphanumeric)
+                .map(|c| c.to_ascii_lowercase())
+                .take(24)
+                .collect::<String>();
+            format!("{}_{:08x}", readable, fnv1a(value))
+        }
+    }
+}
+
+/// partition parent table by an event field, one partition per value
+///
+/// Partitions are named after the (time formatted) name template, the value and its hash, e.g.
+/// `logs_2021_10_web01_1a2b3c4d`. Events without the field go to `<template>_null`.
+#[derive(Debug, Deserialize, Serialize)]
+#[serde(deny_unknown_fields, default)]
+pub struct List {
+    pub name_template: String,
+    pub field: String,
+    /// Partition by this promoted column instead of the document field
+    pub column: Option<String>,
+    pub indexes: Vec<IndexTemplate>,
+    pub storage: StorageTemplate,
+    #[serde(skip)]
+    format: Option<OwnedFormatItem>,
+}
+
+impl Default for List {
+    fn default() -> Self {
+        Self {
+            name_template: "logs_[year]_[month]".into(),
+            field: "hostname".into(),
+            column: None,
+            indexes: Vec::new(),
+            storage: StorageTemplate::default(),
+            format: None,
+        }
+    }
+}
+
+#[typetag::serde(name = "list")]
+impl Partitioner for List {
+    fn table_name(&self, event: &Event) -> Result<String, Error> {
+        let prefix = format_name(&self.format, &self.name_template, event)?;
+        let value = key_value(event, &self.field);
+        Ok(format!("{}_{}", prefix, value_suffix(value.as_deref())))
+    }
+
+    fn compile(&mut self) -> Result<(), Error> {
+        check_key(&self.field, &self.column)?;
+        self.format = Some(format_description::parse_owned::<1>(&self.name_template)?);
+        Ok(())
+    }
+
+    fn partition_by(&self) -> String {
+        format!("list ({})", key_expression(&self.field, &self.column))
+    }
+
+    fn bounds(&self, event: &Event) -> String {
+        match key_value(event, &self.field) {
+            Some(value) => format!("in ('{}')", value.replace('\'', "''")),
+            None => "in (null)".into(),
+        }
+    }
+
+    fn indexes(&self) -> &[IndexTemplate] {
+        &self.indexes
+    }
+
+    fn storage(&self) -> Option<&StorageTemplate> {
+        Some(&self.storage)
+    }
+}
+
+/// partition parent table into a fixed number of partitions by the hash of an event field
+///
+/// Postgres computes the hash, so all `modulus` partitions get created together (named
+/// `<template>_<remainder>`) and events are written to the parent table. Has to be the last
+/// level.
+#[derive(Debug, Deserialize, Serialize)]
+#[serde(deny_unknown_fields, default)]
+pub struct Hash {
+    pub name_template: String,
+    pub field: String,
+    /// Partition by this promoted column instead of the document field
+    pub column: Option<String>,
+    pub modulus: u32,
+    pub indexes: Vec<IndexTemplate>,
+    pub storage: StorageTemplate,
+    #[serde(skip)]
+    format: Option<OwnedFormatItem>,
+}
+
+impl Default for Hash {
+    fn default() -> Self {
+        Self {
+            name_template: "logs_[year]_[month]".into(),
+            field: "hostname".into(),
+            column: None,
+            modulus: 8,
+            indexes: Vec::new(),
+            storage: StorageTemplate::default(),
+            format: None,
+        }
+    }
+}
+
+impl Hash {
+    fn remainder_name(&self, event: &Event, remainder: u32) -> Result<String, Error> {
+        let prefix = format_name(&self.format, &self.name_template, event)?;
+        Ok(format!("{}_{}", prefix, remainder))
+    }
+
+    fn remainder_bounds(&self, remainder: u32) -> String {
+        format!("with (modulus {}, remainder {})", self.modulus, remainder)
+    }
+}
+
+#[typetag::serde(name = "hash")]
+impl Partitioner for Hash {
+    /// The last of this level's partitions, which gets created last
+    fn table_name(&self, event: &Event) -> Result<String, Error> {
+        self.remainder_name(event, self.modulus - 1)
+    }
+
+    fn compile(&mut self) -> Result<(), Error> {
+        check_key(&self.field, &self.column)?;
+        if self.modulus == 0 {
+            return Err(Error::InvalidKey(format!(
+                "{}: modulus has to be positive",
+                self.field
+            )));
+        }
+        self.format = Some(format_description::parse_owned::<1>(&self.name_template)?);
+        Ok(())
+    }
+
+    fn partition_by(&self) -> String {
+        format!("hash ({})", key_expression(&self.field, &self.column))
+    }
+
+    fn bounds(&self, _event: &Event) -> String {
+        self.remainder_bounds(self.modulus - 1)
+    }
+
+    fn indexes(&self) -> &[IndexTemplate] {
+        &self.indexes
+    }
+
+    fn storage(&self) -> Option<&StorageTemplate> {
+        Some(&self.storage)
+    }
+
+    fn routed(&self) -> bool {
+        true
+    }
+
+    fn routed_partitions(&self, event: &Event) -> Result<Vec<(String, String)>, Error> {
+        (0..self.modulus)
+            .map(|remainder| {
+                Ok((
+                    self.remainder_name(event, remainder)?,
+                    self.remainder_bounds(remainder),
+                ))
+            })
+            .collect()
+    }
+}
+
 fn single_create_statement(
     event: &Event,
     parent: Option<&dyn Partitioner>,
@@ -248,7 +602,8 @@ fn single_create_statement(
     };
     let child_stmt = match child {
         Some(part) => format!("partition by {}", part.partition_by()),
-        None => "".to_string(),
+        // partitioned tables have no storage of their own
+        None => leaf_storage(this),
     };
     Ok(format!(
         "create table if not exists {} {} {}",
@@ -258,12 +613,29 @@ fn single_create_statement(
     ))
 }
 
+fn leaf_storage(part: &dyn Partitioner) -> String {
+    match part.storage().and_then(|storage| storage.fillfactor) {
+        Some(fillfactor) => format!("with (fillfactor = {})", fillfactor),
+        None => "".to_string(),
+    }
+}
+
 pub fn create_tables(
     client: &mut impl postgres::GenericClient,
     event: &Event,
     parts: &[&dyn Partitioner],
 ) -> Result<(), Error> {
-    parts
+    create_levels(client, event, parts, parts.len())
+}
+
+/// Create the first `levels` tables of the partitioner chain `parts`
+fn create_levels(
+    client: &mut impl postgres::GenericClient,
+    event: &Event,
+    parts: &[&dyn Partitioner],
+    levels: usize,
+) -> Result<(), Error> {
+    parts[..levels]
         .iter()
         .enumerate()
         .try_for_each(|(index, part)| -> Result<(), Error> {
@@ -276,21 +648,698 @@ pub fn create_tables(
             } else {
                 Some(parts[index + 1])
             };
-            client.execute(
-                single_create_statement(event, parent, *part, child)?.as_str(),
-                &[],
-            )?;
+            if let (Some(parent), true) = (parent, part.routed()) {
+                let parent_table = parent.table_name(event)?;
+                for (table, bounds) in part.routed_partitions(event)? {
+                    client.execute(
+                        format!(
+                            "create table if not exists {} partition of {} for values {} {}",
+                            table,
+                            parent_table,
+                            bounds,
+                            leaf_storage(*part)
+                        )
+                        .as_str(),
+                        &[],
+                    )?;
+                    set_up_table(client, &table, *part, true)?;
+                }
+                return Ok(());
+            }
 
-            // TODO configurable owner
             client.execute(
-                format!(
-                    "alter table {} owner to write_logs",
-                    part.table_name(event)?
-                )
-                .as_str(),
+                single_create_statement(event, parent, *part, child)?.as_str(),
                 &[],
             )?;
-            Ok(())
+            set_up_table(client, &part.table_name(event)?, *part, child.is_none())
         })?;
     Ok(())
 }
+
+/// Owner, compression (leaves only) and indexes of a new table
+fn set_up_table(
+    client: &mut impl postgres::GenericClient,
+    table: &str,
+    part: &dyn Partitioner,
+    leaf: bool,
+) -> Result<(), Error> {
+    METRICS.partition_tables.inc();
+    // TODO configurable owner
+    client.execute(
+        format!("alter table {} owner to write_logs", table).as_str(),
+        &[],
+    )?;
+
+    if leaf {
+        set_compression(client, table, part)?;
+    }
+    create_indexes(client, table, part)
+}
+
+fn set_compression(
+    client: &mut impl postgres::GenericClient,
+    table: &str,
+    part: &dyn Partitioner,
+) -> Result<(), Error> {
+    if let Some(compression) = part
+        .storage()
+        .and_then(|storage| storage.doc_compression.as_ref())
+    {
+        client.batch_execute(
+            format!(
+                "alter table {} alter column doc set compression {}",
+                table, compression
+            )
+            .as_str(),
+        )?;
+    }
+    Ok(())
+}
+
+/// Create the indexes of `part`'s templates on `table`, named after the table and their position
+fn create_indexes(
+    client: &mut impl postgres::GenericClient,
+    table: &str,
+    part: &dyn Partitioner,
+) -> Result<(), Error> {
+    for (position, index) in part.indexes().iter().enumerate() {
+        let with = match &index.with {
+            Some(with) => format!(" with ({})", with),
+            None => "".to_string(),
+        };
+        client.batch_execute(
+            format!(
+                "create index if not exists {}_{}_{} on {} using {} ({}){}",
+                table, index.method, position, table, index.method, index.columns, with
+            )
+            .as_str(),
+        )?;
+    }
+    Ok(())
+}
+
+fn table_exists(client: &mut impl postgres::GenericClient, table: &str) -> Result<bool, Error> {
+    Ok(client
+        .query_one("select to_regclass($1) is not null", &[&table])?
+        .get(0))
+}
+
+/// Create all tables for `event` unless its leaf partition exists already
+///
+/// Returns whether tables had to be created. Concurrent creation by other processes is not an
+/// error. A leaf that is detached while a backfill loads it (see `create_detached_leaf`) is
+/// waited for until it got attached.
+pub fn ensure_tables(
+    client: &mut impl postgres::GenericClient,
+    event: &Event,
+    parts: &[&dyn Partitioner],
+) -> Result<bool, Error> {
+    let leaf = parts[parts.len() - 1].table_name(event)?;
+    let created = if table_exists(client, &leaf)? {
+        false
+    } else {
+        info!("Creating partitions for table {}", leaf);
+        if let Err(err) = create_tables(client, event, parts) {
+            if table_exists(client, &leaf)? {
+                debug!("Table {} was created concurrently", leaf);
+            } else {
+                return Err(err);
+            }
+        }
+        true
+    };
+    if detachable(parts) && is_detached(client, &leaf)? {
+        wait_for_attach(client, event, parts, &leaf)?;
+    }
+    Ok(created)
+}
+
+/// Whether the leaf partitions of `parts` can be detached, see `create_detached_leaf`
+fn detachable(parts: &[&dyn Partitioner]) -> bool {
+    parts.len() > 1 && !parts[parts.len() - 1].routed()
+}
+
+fn is_detached(client: &mut impl postgres::GenericClient, table: &str) -> Result<bool, Error> {
+    Ok(client
+        .query_one(
+            "select not relispartition from pg_class where oid = to_regclass($1)",
+            &[&table],
+        )?
+        .get(0))
+}
+
+/// Session lock held on a leaf while it is detached, taken by `create_detached_leaf`
+fn lock_leaf(client: &mut impl postgres::GenericClient, leaf: &str) -> Result<(), Error> {
+    client.execute("select pg_advisory_lock(hashtext($1))", &[&leaf])?;
+    Ok(())
+}
+
+fn unlock_leaf(client: &mut impl postgres::GenericClient, leaf: &str) -> Result<(), Error> {
+    client.execute("select pg_advisory_unlock(hashtext($1))", &[&leaf])?;
+    Ok(())
+}
+
+/// Wait until the backfill loading the detached `leaf` attached it
+///
+/// Events of the leaf's range can't be written before, they would find no partition. If the
+/// backfill ended without attaching the leaf (its lock is gone together with its connection),
+/// the leaf is attached here.
+fn wait_for_attach(
+    client: &mut impl postgres::GenericClient,
+    event: &Event,
+    parts: &[&dyn Partitioner],
+    leaf: &str,
+) -> Result<(), Error> {
+    info!(
+        "Partition {} is detached, waiting for it to be attached",
+        leaf
+    );
+    lock_leaf(client, leaf)?;
+    let attached = match is_detached(client, leaf) {
+        Ok(true) => attach(client, event, parts),
+        Ok(false) => Ok(()),
+        Err(err) => Err(err),
+    };
+    unlock_leaf(client, leaf)?;
+    attached
+}
+
+/// Create the root table unless it exists, returns its name
+pub fn ensure_root(
+    client: &mut impl postgres::GenericClient,
+    parts: &[&dyn Partitioner],
+) -> Result<String, Error> {
+    // the root table's name does not depend on events
+    let event = Event {
+        timestamp: OffsetDateTime::now_utc(),
+        doc: json!({}),
+    };
+    let root = parts[0].table_name(&event)?;
+    if !table_exists(client, &root)? {
+        info!("Creating root table {}", root);
+        create_levels(client, &event, parts, 1)?;
+    }
+    Ok(root)
+}
+
+/// Create the leaf table for `event` without attaching it to its parent
+///
+/// All other tables are created as usual. The leaf gets the parent's columns and defaults but
+/// none of its indexes, these get built by `attach_leaf`. Loading lots of events before building
+/// indexes is much faster than updating them for every row. Returns `false` if the leaf exists
+/// already or the chain has no partitions below the root table.
+///
+/// Until `attach_leaf`, `client` holds an advisory lock on the leaf. Other writers needing the
+/// leaf wait for it in `ensure_tables` instead of failing to find a partition or creating a
+/// competing one.
+pub fn create_detached_leaf(
+    client: &mut impl postgres::GenericClient,
+    event: &Event,
+    parts: &[&dyn Partitioner],
+) -> Result<bool, Error> {
+    if !detachable(parts) {
+        // hash partitioned events get written to the parent, which needs its partitions attached
+        ensure_tables(client, event, parts)?;
+        return Ok(false);
+    }
+    let this = parts[parts.len() - 1];
+    let leaf = this.table_name(event)?;
+    lock_leaf(client, &leaf)?;
+    match create_detached(client, event, parts, &leaf) {
+        Ok(true) => Ok(true),
+        created => {
+            unlock_leaf(client, &leaf)?;
+            created
+        }
+    }
+}
+
+fn create_detached(
+    client: &mut impl postgres::GenericClient,
+    event: &Event,
+    parts: &[&dyn Partitioner],
+    leaf: &str,
+) -> Result<bool, Error> {
+    let this = parts[parts.len() - 1];
+    if table_exists(client, leaf)? {
+        return Ok(false);
+    }
+
+    info!("Creating detached partition {}", leaf);
+    create_levels(client, event, parts, parts.len() - 1)?;
+    let parent = parts[parts.len() - 2].table_name(event)?;
+    let created = client.batch_execute(
+        format!(
+            "create table {} (like {} including defaults including constraints) {}; alter table {} owner to write_logs",
+            leaf, parent, leaf_storage(this), leaf
+        )
+        .as_str(),
+    );
+    if let Err(err) = created {
+        if table_exists(client, leaf)? {
+            // created (and attached) by a writer that didn't wait for the lock
+            debug!("Table {} was created concurrently", leaf);
+            return Ok(false);
+        }
+        return Err(err.into());
+    }
+    set_compression(client, leaf, this)?;
+    Ok(true)
+}
+
+/// Attach a leaf created by `create_detached_leaf`, building all indexes required by its parent
+/// and those of its templates, and release its lock
+pub fn attach_leaf(
+    client: &mut impl postgres::GenericClient,
+    event: &Event,
+    parts: &[&dyn Partitioner],
+) -> Result<(), Error> {
+    attach(client, event, parts)?;
+    unlock_leaf(client, &parts[parts.len() - 1].table_name(event)?)
+}
+
+fn attach(
+    client: &mut impl postgres::GenericClient,
+    event: &Event,
+    parts: &[&dyn Partitioner],
+) -> Result<(), Error> {
+    let this = parts[parts.len() - 1];
+    let parent = parts[parts.len() - 2];
+    info!("Attaching partition {}", this.table_name(event)?);
+    client.execute(
+        format!(
+            "alter table {} attach partition {} for values {}",
+            parent.table_name(event)?,
+            this.table_name(event)?,
+            this.bounds(event)
+        )
+        .as_str(),
+        &[],
+    )?;
+    create_indexes(client, &this.table_name(event)?, this)
+}
+
+/// Partitioner chain ordered from root to leaf
+///
+/// Remembers the names of time range partitions and which leaf partitions are known to exist.
+/// Most events thus neither format table names nor cause any DDL.
+pub struct Chain {
+    parts: Arc<Vec<Box<dyn Partitioner>>>,
+    names: BTreeMap<OffsetDateTime, (OffsetDateTime, String)>,
+    known: HashSet<String>,
+}
+
+impl Chain {
+    pub fn new(mut parts: Vec<Box<dyn Partitioner>>) -> Result<Self, Error> {
+        if parts.is_empty() {
+            return Err(Error::NoPartition("no partitions configured".into()));
+        }
+        parts.iter_mut().try_for_each(|part| part.compile())?;
+        if parts[..parts.len() - 1].iter().any(|part| part.routed()) {
+            return Err(Error::NoPartition(
+                "hash partitions have to be the last level".into(),
+            ));
+        }
+        Ok(Self {
+            parts: Arc::new(parts),
+            names: BTreeMap::new(),
+            known: HashSet::new(),
+        })
+    }
+
+    /// Another chain for the same, already compiled partitioners
+    pub fn from_shared(parts: Arc<Vec<Box<dyn Partitioner>>>) -> Self {
+        Self {
+            parts,
+            names: BTreeMap::new(),
+            known: HashSet::new(),
+        }
+    }
+
+    pub fn parts(&self) -> Vec<&dyn Partitioner> {
+        self.parts
+            .iter()
+            .map(|boxed| boxed.as_ref() as &dyn Partitioner)
+            .collect()
+    }
+
+    pub fn shared(&self) -> Arc<Vec<Box<dyn Partitioner>>> {
+        self.parts.clone()
+    }
+
+    pub fn root_name(&self, event: &Event) -> Result<String, Error> {
+        self.parts[0].table_name(event)
+    }
+
+    /// Name of the partition `event` will be stored in
+    ///
+    /// With hash partitions that's their parent, postgres routes the events.
+    pub fn leaf_name(&mut self, event: &Event) -> Result<String, Error> {
+        if let Some((_, (upper, name))) = self.names.range(..=event.timestamp).next_back() {
+            if event.timestamp < *upper {
+                return Ok(name.clone());
+            }
+        }
+
+        let mut target = self.parts.len() - 1;
+        if self.parts[target].routed() {
+            target -= 1;
+        }
+        let leaf = &self.parts[target];
+        let name = leaf.table_name(event)?;
+        if let Some((lower, upper)) = leaf.time_range(event) {
+            self.names.insert(lower, (upper, name.clone()));
+        }
+        Ok(name)
+    }
+
+    /// Make sure the partition for `event` exists and return its name
+    pub fn ensure(
+        &mut self,
+        client: &mut impl postgres::GenericClient,
+        event: &Event,
+    ) -> Result<String, Error> {
+        let leaf = self.leaf_name(event)?;
+        if !self.known.contains(&leaf) {
+            ensure_tables(client, event, &self.parts())?;
+            self.known.insert(leaf.clone());
+        }
+        Ok(leaf)
+    }
+
+    /// Forget about all known partitions, e.g. if some were dropped
+    pub fn forget(&mut self) {
+        self.known.clear();
+    }
+}
+
+/// Settings for creating partitions before they are needed
+#[derive(Debug, Deserialize, Serialize)]
+#[serde(deny_unknown_fields, default)]
+pub struct PrecreateSettings {
+    /// Number of upcoming leaf partitions to create (0 disables pre-creation)
+    pub partitions: usize,
+
+    /// Seconds between checks for missing partitions
+    pub interval_sec: u64,
+}
+
+impl Default for PrecreateSettings {
+    fn default() -> Self {
+        Self {
+            partitions: 1,
+            interval_sec: 600,
+        }
+    }
+}
+
+/// Dummy events for the current and the next `count` partitions of the finest time range
+fn upcoming_events(
+    parts: &[Box<dyn Partitioner>],
+    now: OffsetDateTime,
+    count: usize,
+) -> Vec<Event> {
+    let mut result = Vec::new();
+    let mut event = Event {
+        timestamp: now,
+        doc: json!({}),
+    };
+    for _ in 0..=count {
+        let next = parts.iter().rev().find_map(|part| part.time_range(&event));
+        let upper = match next {
+            Some((_, upper)) => upper,
+            None => break,
+        };
+        let timestamp = upper;
+        result.push(event);
+        event = Event {
+            timestamp,
+            doc: json!({}),
+        };
+    }
+    result
+}
+
+/// Number of leading levels of `parts` whose tables depend on nothing but the time stamp
+///
+/// Tables of later levels, e.g. lists, depend on the events' documents. Created for the dummy
+/// events of `upcoming_events`, they would only be the tables of missing values.
+fn precreated_levels(parts: &[&dyn Partitioner], event: &Event) -> usize {
+    parts
+        .iter()
+        .enumerate()
+        .take_while(|(index, part)| {
+            *index == 0 || part.time_range(event).is_some() || part.routed()
+        })
+        .count()
+}
+
+/// Create the tables of the time-based levels for the dummy `event`, see `precreated_levels`
+fn precreate(
+    client: &mut impl postgres::GenericClient,
+    event: &Event,
+    parts: &[&dyn Partitioner],
+) -> Result<(), Error> {
+    let levels = precreated_levels(parts, event);
+    if levels == parts.len() {
+        ensure_tables(client, event, parts)?;
+        return Ok(());
+    }
+    let table = parts[levels - 1].table_name(event)?;
+    if levels > 1 && !table_exists(client, &table)? {
+        info!("Creating partitions for table {}", table);
+        if let Err(err) = create_levels(client, event, parts, levels) {
+            if !table_exists(client, &table)? {
+                return Err(err);
+            }
+            debug!("Table {} was created concurrently", table);
+        }
+    }
+    Ok(())
+}
+
+/// Periodically create upcoming partitions in a background thread
+///
+/// Keeps DDL and its catalog locks out of the insert path at day or month rollover. Only the
+/// time-based levels get created, levels below them are left to the first events they store.
+/// `connect` is called for every check without a working connection.
+pub fn spawn_precreation<F>(
+    parts: Arc<Vec<Box<dyn Partitioner>>>,
+    settings: PrecreateSettings,
+    connect: F,
+) -> thread::JoinHandle<()>
+where
+    F: Fn() -> Result<postgres::Client, postgres::Error> + Send + 'static,
+{
+    thread::spawn(move || {
+        let mut client: Option<postgres::Client> = None;
+        let refs = parts
+            .iter()
+            .map(|boxed| boxed.as_ref() as &dyn Partitioner)
+            .collect::<Vec<&dyn Partitioner>>();
+        loop {
+            if client.as_ref().map_or(true, |c| c.is_closed()) {
+                client = connect()
+                    .map_err(|err| warn!("Partition pre-creation could not connect: {}", err))
+                    .ok();
+            }
+
+            if let Some(client) = client.as_mut() {
+                for event in upcoming_events(&parts, OffsetDateTime::now_utc(), settings.partitions)
+                {
+                    if let Err(err) = precreate(client, &event, &refs) {
+                        warn!("Could not pre-create partitions: {}", err);
+                        break;
+                    }
+                }
+            }
+            thread::sleep(std::time::Duration::from_secs(settings.interval_sec));
+        }
+    })
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use time::macros::datetime;
+
+    fn event(timestamp: OffsetDateTime) -> Event {
+        Event {
+            timestamp,
+            doc: json!({}),
+        }
+    }
+
+    fn monthly() -> Chain {
+        Chain::new(vec![
+            Box::new(Root::default()),
+            Box::new(Timerange {
+                name_template: "logs_[year]_[month]".into(),
+                ..Timerange::default()
+            }),
+        ])
+        .unwrap()
+    }
+
+    #[test]
+    fn leaf_storage() {
+        let root = Root::default();
+        let leaf = Timerange {
+            name_template: "logs_[year]_[month]".into(),
+            storage: StorageTemplate {
+                fillfactor: Some(100),
+                doc_compression: None,
+            },
+            ..Timerange::default()
+        };
+        let event = event(datetime!(2021-10-31 23:59:59 UTC));
+        assert_eq!(
+            single_create_statement(&event, Some(&root), &leaf, None).unwrap(),
+            "create table if not exists logs_2021_10 partition of logs for values from ('2021-10-01') to ('2021-11-01') with (fillfactor = 100)"
+        );
+        // the partitioned parent has no storage options
+        assert!(single_create_statement(&event, None, &root, Some(&leaf))
+            .unwrap()
+            .ends_with("partition by range (tstamp)"));
+    }
+
+    #[test]
+    fn leaf_names() {
+        let mut chain = monthly();
+        let ts = datetime!(2021-10-31 23:59:59 UTC);
+        assert_eq!(chain.leaf_name(&event(ts)).unwrap(), "logs_2021_10");
+        assert_eq!(chain.leaf_name(&event(ts)).unwrap(), "logs_2021_10");
+        assert_eq!(
+            chain
+                .leaf_name(&event(datetime!(2021-11-01 00:00:00 UTC)))
+                .unwrap(),
+            "logs_2021_11"
+        );
+        assert_eq!(
+            chain
+                .leaf_name(&event(datetime!(2021-10-01 00:00:00 UTC)))
+                .unwrap(),
+            "logs_2021_10"
+        );
+        assert_eq!(chain.names.len(), 2);
+    }
+
+    #[test]
+    fn list_partitions() {
+        let mut list = List {
+            name_template: "logs_[year]_[month]".into(),
+            ..List::default()
+        };
+        list.compile().unwrap();
+        let ts = datetime!(2021-10-31 23:59:59 UTC);
+        let host = Event {
+            timestamp: ts,
+            doc: json!({"hostname": "Web-01's"}),
+        };
+        assert_eq!(
+            list.table_name(&host).unwrap(),
+            format!("logs_2021_10_web01s_{:08x}", fnv1a("Web-01's"))
+        );
+        assert_eq!(list.bounds(&host), "in ('Web-01''s')");
+        assert_eq!(list.table_name(&event(ts)).unwrap(), "logs_2021_10_null");
+        assert_eq!(list.bounds(&event(ts)), "in (null)");
+        assert_eq!(list.partition_by(), "list ((doc ->> 'hostname'))");
+
+        let mut bad = List {
+            field: "host'name".into(),
+            ..List::default()
+        };
+        assert!(bad.compile().is_err());
+    }
+
+    #[test]
+    fn hash_partitions() {
+        let mut chain = Chain::new(vec![
+            Box::new(Root::default()),
+            Box::new(Timerange {
+                name_template: "logs_[year]_[month]".into(),
+                ..Timerange::default()
+            }),
+            Box::new(Hash {
+                name_template: "logs_[year]_[month]_h".into(),
+                column: Some("hostname".into()),
+                modulus: 2,
+                ..Hash::default()
+            }),
+        ])
+        .unwrap();
+        let event = event(datetime!(2021-10-31 23:59:59 UTC));
+        assert_eq!(chain.leaf_name(&event).unwrap(), "logs_2021_10");
+        assert_eq!(chain.parts[2].partition_by(), "hash (hostname)");
+        assert_eq!(
+            chain.parts[2].routed_partitions(&event).unwrap(),
+            vec![
+                (
+                    "logs_2021_10_h_0".to_owned(),
+                    "with (modulus 2, remainder 0)".to_owned()
+                ),
+                (
+                    "logs_2021_10_h_1".to_owned(),
+                    "with (modulus 2, remainder 1)".to_owned()
+                ),
+            ]
+        );
+
+        assert!(Chain::new(vec![
+            Box::new(Root::default()),
+            Box::new(Hash::default()),
+            Box::new(Timerange::default()),
+        ])
+        .is_err());
+    }
+
+    #[test]
+    fn upcoming() {
+        let chain = monthly();
+        let events = upcoming_events(&chain.parts, datetime!(2021-12-15 12:00:00 UTC), 2);
+        let names = events
+            .iter()
+            .map(|e| chain.parts[1].table_name(e).unwrap())
+            .collect::<Vec<String>>();
+        assert_eq!(names, vec!["logs_2021_12", "logs_2022_01", "logs_2022_02"]);
+
+        let events = upcoming_events(&chain.parts, datetime!(2022-01-31 12:00:00 UTC), 1);
+        assert_eq!(
+            chain.parts[1].table_name(&events[1]).unwrap(),
+            "logs_2022_02"
+        );
+
+        let root_only = Chain::new(vec![Box::new(Root::default())]).unwrap();
+        assert!(upcoming_events(&root_only.parts, OffsetDateTime::now_utc(), 2).is_empty());
+    }
+
+    #[test]
+    fn upcoming_lists() {
+        let chain = Chain::new(vec![
+            Box::new(Root::default()),
+            Box::new(Timerange {
+                name_template: "logs_[year]_[month]".into(),
+                ..Timerange::default()
+            }),
+            Box::new(List {
+                name_template: "logs_[year]_[month]".into(),
+                ..List::default()
+            }),
+        ])
+        .unwrap();
+        let parts = chain.parts();
+        let events = upcoming_events(&chain.parts, datetime!(2021-12-15 12:00:00 UTC), 1);
+        assert_eq!(parts[1].table_name(&events[1]).unwrap(), "logs_2022_01");
+        // only the month, not its list partition of events without hostname
+        assert_eq!(precreated_levels(&parts, &events[1]), 2);
+
+        let hashed = Chain::new(vec![
+            Box::new(Root::default()),
+            Box::new(Timerange::default()),
+            Box::new(Hash::default()),
+        ])
+        .unwrap();
+        assert_eq!(precreated_levels(&hashed.parts(), &events[1]), 3);
+        assert_eq!(precreated_levels(&monthly().parts(), &events[1]), 2);
+    }
+}
@@ -0,0 +1,557 @@
+use std::collections::{BTreeSet, HashMap};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::mpsc::{self, Receiver, RecvTimeoutError, SyncSender};
+use std::sync::{Arc, Condvar, Mutex};
+use std::thread;
+use std::time::Duration;
+
+use logstuff::columns::Column;
+use logstuff::event::{Event, RsyslogdEvent};
+use logstuff::rollup::RollupSettings;
+
+use crate::batch::{self, Batch, BatchSettings};
+use crate::db::{self, Connect, Failure, ReconnectSettings};
+use crate::metrics::METRICS;
+use crate::partition::{self, Chain, Partitioner};
+
+/// Settings for importing with multiple threads
+#[derive(Debug, Deserialize, Serialize)]
+#[serde(deny_unknown_fields, default)]
+pub struct PipelineSettings {
+    /// Number of threads decoding events
+    pub parsers: usize,
+
+    /// Number of threads (each with its own database connection) writing batches
+    pub writers: usize,
+
+    /// Number of events buffered between reading and decoding or decoding and routing
+    pub queue_size: usize,
+}
+
+impl Default for PipelineSettings {
+    fn default() -> Self {
+        Self {
+            parsers: 2,
+            writers: 2,
+            queue_size: 10000,
+        }
+    }
+}
+
+/// Events are numbered in the order they were read
+type Seq = u64;
+
+enum Routed {
+    Event(Seq, Option<(Event, String)>),
+    /// Write all events up to the given one as soon as all of them arrived
+    Flush(Seq),
+}
+
+/// Events of a single leaf partition
+#[derive(Default)]
+struct Job {
+    batch: Batch,
+    seqs: Vec<Seq>,
+}
+
+#[derive(Default)]
+struct State {
+    /// All events before this one are committed
+    committed: Seq,
+    done: BTreeSet<Seq>,
+    error: Option<String>,
+}
+
+/// Tracks which events are committed, possibly out of order
+#[derive(Default)]
+struct Progress {
+    state: Mutex<State>,
+    changed: Condvar,
+}
+
+impl Progress {
+    fn complete(&self, seqs: &[Seq]) {
+        let mut state = self.state.lock().unwrap();
+        let State {
+            committed, done, ..
+        } = &mut *state;
+        done.extend(seqs.iter().copied());
+        while done.remove(committed) {
+            *committed += 1;
+        }
+        drop(state);
+        self.changed.notify_all();
+    }
+
+    fn fail(&self, error: String) {
+        error!("import pipeline failed: {}", error);
+        self.state.lock().unwrap().error.get_or_insert(error);
+        self.changed.notify_all();
+    }
+
+    /// Block until the first `count` events are committed
+    fn wait(&self, count: Seq) -> Result<(), String> {
+        let mut state = self.state.lock().unwrap();
+        loop {
+            if let Some(error) = &state.error {
+                return Err(error.to_owned());
+            }
+            if state.committed >= count {
+                return Ok(());
+            }
+            state = self.changed.wait(state).unwrap();
+        }
+    }
+}
+
+/// Fails the pipeline when its thread panics, otherwise `commit` would wait for its events forever
+struct PanicGuard {
+    progress: Arc<Progress>,
+    thread: &'static str,
+}
+
+impl Drop for PanicGuard {
+    fn drop(&mut self) {
+        if thread::panicking() {
+            self.progress
+                .fail(format!("{} thread panicked", self.thread));
+        }
+    }
+}
+
+/// Tracks which events reached the router and whether a commit waits for them
+#[derive(Default)]
+struct Arrivals {
+    /// All events before this one arrived
+    next: Seq,
+    early: BTreeSet<Seq>,
+    /// A commit waits for all events up to this one
+    flush_through: Option<Seq>,
+}
+
+impl Arrivals {
+    fn arrived(&mut self, seq: Seq) {
+        self.early.insert(seq);
+        while self.early.remove(&self.next) {
+            self.next += 1;
+        }
+    }
+
+    fn flush(&mut self, through: Seq) {
+        self.flush_through = Some(self.flush_through.map_or(through, |t| t.max(through)));
+    }
+
+    /// Whether all events of a pending flush arrived, clearing it then
+    fn take_flush(&mut self) -> bool {
+        match self.flush_through {
+            Some(through) if self.next > through => {
+                self.flush_through = None;
+                true
+            }
+            _ => false,
+        }
+    }
+}
+
+/// Multi-threaded import: reading, decoding, routing to partitions and writing
+///
+/// Lines are decoded by a pool of parser threads. A single router groups the events by leaf
+/// partition and hands batches to a pool of writers, each with its own connection. Writers may
+/// commit in any order, `commit` waits for all events submitted so far. Clones share the same
+/// threads and may submit events concurrently.
+#[derive(Clone)]
+pub struct Pipeline {
+    lines: SyncSender<(Seq, String)>,
+    router: SyncSender<Routed>,
+    progress: Arc<Progress>,
+    next_seq: Arc<AtomicU64>,
+}
+
+impl Pipeline {
+    #[allow(clippy::too_many_arguments)]
+    pub fn new(
+        settings: &PipelineSettings,
+        batch: BatchSettings,
+        chain: Chain,
+        use_vars_msg: bool,
+        connect: Connect,
+        reconnect: ReconnectSettings,
+        columns: Arc<Vec<Column>>,
+        rollups: Option<Arc<RollupSettings>>,
+        notify: Option<String>,
+    ) -> Self {
+        let progress = Arc::new(Progress::default());
+        let (lines, lines_rx) = mpsc::sync_channel(settings.queue_size);
+        let (router, router_rx) = mpsc::sync_channel(settings.queue_size);
+        let (jobs, jobs_rx) = mpsc::sync_channel(settings.writers);
+
+        let lines_rx = Arc::new(Mutex::new(lines_rx));
+        for _ in 0..settings.parsers.max(1) {
+            let lines_rx = lines_rx.clone();
+            let router = router.clone();
+            let progress = progress.clone();
+            thread::spawn(move || parse(lines_rx, router, use_vars_msg, progress));
+        }
+
+        let jobs_rx = Arc::new(Mutex::new(jobs_rx));
+        for _ in 0..settings.writers.max(1) {
+            let jobs_rx = jobs_rx.clone();
+            let parts = chain.shared();
+            let connect = connect.clone();
+            let reconnect = reconnect.clone();
+            let columns = columns.clone();
+            let rollups = rollups.clone();
+            let notify = notify.clone();
+            let progress = progress.clone();
+            thread::spawn(move || {
+                write(
+                    jobs_rx, parts, connect, reconnect, columns, rollups, notify, progress,
+                )
+            });
+        }
+
+        let router_progress = progress.clone();
+        thread::spawn(move || route(router_rx, jobs, chain, batch, router_progress));
+
+        Self {
+            lines,
+            router,
+            progress,
+            next_seq: Arc::new(AtomicU64::new(0)),
+        }
+    }
+
+    /// Queue a line for import, blocks while the pipeline is full
+    pub fn submit(&self, line: String) -> Result<(), String> {
+        // a sequence number taken but not yet sent only delays confirmations, a flush covering it
+        // is handled when it arrives
+        let seq = self.next_seq.fetch_add(1, Ordering::SeqCst);
+        if self.lines.send((seq, line)).is_err() {
+            return Err(self.stopped());
+        }
+        Ok(())
+    }
+
+    /// Write all submitted events and wait until they are committed
+    pub fn commit(&self) -> Result<(), String> {
+        let next_seq = self.next_seq.load(Ordering::SeqCst);
+        if next_seq > 0 && self.router.send(Routed::Flush(next_seq - 1)).is_err() {
+            return Err(self.stopped());
+        }
+        self.progress.wait(next_seq)
+    }
+
+    /// Block until the pipeline failed, returns the reason
+    pub fn stopped(&self) -> String {
+        self.progress
+            .wait(Seq::MAX)
+            .err()
+            .unwrap_or_else(|| "import pipeline stopped".into())
+    }
+}
+
+fn parse(
+    lines: Arc<Mutex<Receiver<(Seq, String)>>>,
+    router: SyncSender<Routed>,
+    use_vars_msg: bool,
+    progress: Arc<Progress>,
+) {
+    let _guard = PanicGuard {
+        progress,
+        thread: "parser",
+    };
+    loop {
+        // the guard is dropped right after receiving
+        let received = lines.lock().unwrap().recv();
+        let (seq, line) = match received {
+            Ok(received) => received,
+            Err(_) => return,
+        };
+
+        let line = line.trim();
+        let parsing = METRICS.parse.start("parse");
+        let parsed = match serde_json::from_str::<RsyslogdEvent>(line) {
+            Ok(rsyslog_event) => {
+                let mut event: Event = rsyslog_event.into();
+                if use_vars_msg {
+                    event.swap_printable("vars.msg", "msg");
+                }
+                drop(parsing);
+                METRICS.events.inc();
+                let search = {
+                    let _timer = METRICS.search.start("search");
+                    event.search_string()
+                };
+                Some((event, search))
+            }
+            Err(error) => {
+                METRICS.parse_failures.inc();
+                error!("could not parse event: '{}': {}", line, error);
+                None
+            }
+        };
+        if router.send(Routed::Event(seq, parsed)).is_err() {
+            return;
+        }
+    }
+}
+
+fn route(
+    inbox: Receiver<Routed>,
+    jobs: SyncSender<Job>,
+    mut chain: Chain,
+    settings: BatchSettings,
+    progress: Arc<Progress>,
+) {
+    let _guard = PanicGuard {
+        progress: progress.clone(),
+        thread: "router",
+    };
+    let mut pending: HashMap<String, Job> = HashMap::new();
+    let mut arrivals = Arrivals::default();
+    loop {
+        let timeout = pending
+            .values()
+            .filter_map(|job| job.batch.time_left(settings.max_delay()))
+            .min()
+            .unwrap_or_else(|| Duration::from_secs(3600));
+
+        let received = inbox.recv_timeout(timeout);
+        if let Ok(Routed::Event(seq, _)) = &received {
+            arrivals.arrived(*seq);
+        }
+        let mut ready: Vec<String> = match received {
+            Ok(Routed::Event(seq, None)) => {
+                progress.complete(&[seq]);
+                Vec::new()
+            }
+            Ok(Routed::Event(seq, Some((event, search)))) => {
+                let routing = METRICS.partition.start("partition");
+                let leaf = chain.leaf_name(&event);
+                drop(routing);
+                let leaf = match leaf {
+                    Ok(leaf) => leaf,
+                    Err(err) => return progress.fail(err.to_string()),
+                };
+                let job = pending.entry(leaf.to_owned()).or_default();
+                job.batch.push(leaf.to_owned(), event, search);
+                job.seqs.push(seq);
+                if job.batch.len() >= settings.max_events {
+                    vec![leaf]
+                } else {
+                    Vec::new()
+                }
+            }
+            Ok(Routed::Flush(through)) => {
+                arrivals.flush(through);
+                Vec::new()
+            }
+            Err(RecvTimeoutError::Timeout) => pending
+                .iter()
+                .filter(|(_, job)| {
+                    job.batch.time_left(settings.max_delay()) == Some(Duration::ZERO)
+                })
+                .map(|(leaf, _)| leaf.to_owned())
+                .collect(),
+            Err(RecvTimeoutError::Disconnected) => {
+                pending.drain().for_each(|(_, job)| {
+                    let _ = jobs.send(job);
+                });
+                return;
+            }
+        };
+        // a commit's events may still be with the parsers when its flush arrives, the leaves
+        // are written once all of them are here
+        if arrivals.take_flush() {
+            ready = pending.keys().cloned().collect();
+        }
+
+        for leaf in ready {
+            if let Some(job) = pending.remove(&leaf) {
+                if jobs.send(job).is_err() {
+                    return;
+                }
+            }
+        }
+    }
+}
+
+/// Connection writing batches, recovering from failures like the single threaded import
+pub(crate) struct Writer {
+    client: postgres::Client,
+    connect: Connect,
+    reconnect: ReconnectSettings,
+    columns: Arc<Vec<Column>>,
+    rollups: Option<Arc<RollupSettings>>,
+    notify: Option<String>,
+}
+
+impl Writer {
+    pub(crate) fn connect(
+        connect: Connect,
+        reconnect: ReconnectSettings,
+        columns: Arc<Vec<Column>>,
+        rollups: Option<Arc<RollupSettings>>,
+        notify: Option<String>,
+    ) -> Result<Self, postgres::Error> {
+        let mut client = connect()?;
+        batch::prepare_session(&mut client, &columns)?;
+        Ok(Self {
+            client,
+            connect,
+            reconnect,
+            columns,
+            rollups,
+            notify,
+        })
+    }
+
+    /// Write `batch`, handling failures like the single threaded import
+    ///
+    /// A batch the database refuses for its content is written event by event, so only the
+    /// refused events are dropped.
+    pub(crate) fn write_batch(
+        &mut self,
+        batch: &Batch,
+        parts: &[&dyn Partitioner],
+    ) -> Result<(), partition::Error> {
+        let mut created = false;
+        let mut reconnects = 0;
+        loop {
+            let rollups = self.rollups.as_deref();
+            let notify = self.notify.as_deref();
+            let err = match batch.write(&mut self.client, &self.columns, rollups, notify) {
+                Ok(()) => return Ok(()),
+                Err(err) => err,
+            };
+            match Failure::of(&err) {
+                Failure::MissingPartition if !created => {
+                    info!("Batch insertion failed, trying to create missing partitions");
+                    for event in batch.representatives() {
+                        partition::ensure_tables(&mut self.client, event, parts)?;
+                    }
+                    created = true;
+                }
+                Failure::Connection if reconnects < self.reconnect.attempts => {
+                    warn!("Lost database connection: {}", err);
+                    self.client = db::reconnect(&self.connect, &self.reconnect)?;
+                    batch::prepare_session(&mut self.client, &self.columns)?;
+                    reconnects += 1;
+                }
+                Failure::Data if batch.len() > 1 => {
+                    warn!("Batch refused, writing its events one by one: {}", err);
+                    for single in batch.singles() {
+                        self.write_batch(&single, parts)?;
+                    }
+                    return Ok(());
+                }
+                Failure::Data => {
+                    METRICS.refused.inc();
+                    for event in batch.representatives() {
+                        error!(
+                            "Dropping event the database refused: {}: {}",
+                            err, event.doc
+                        );
+                    }
+                    return Ok(());
+                }
+                _ => return Err(err.into()),
+            }
+        }
+    }
+}
+
+#[allow(clippy::too_many_arguments)]
+fn write(
+    jobs: Arc<Mutex<Receiver<Job>>>,
+    parts: Arc<Vec<Box<dyn Partitioner>>>,
+    connect: Connect,
+    reconnect: ReconnectSettings,
+    columns: Arc<Vec<Column>>,
+    rollups: Option<Arc<RollupSettings>>,
+    notify: Option<String>,
+    progress: Arc<Progress>,
+) {
+    let _guard = PanicGuard {
+        progress: progress.clone(),
+        thread: "writer",
+    };
+    let mut writer = match Writer::connect(connect, reconnect, columns, rollups, notify) {
+        Ok(writer) => writer,
+        Err(err) => return progress.fail(err.to_string()),
+    };
+    let parts = parts
+        .iter()
+        .map(|boxed| boxed.as_ref() as &dyn Partitioner)
+        .collect::<Vec<&dyn Partitioner>>();
+
+    loop {
+        let received = jobs.lock().unwrap().recv();
+        let job = match received {
+            Ok(job) => job,
+            Err(_) => return,
+        };
+        debug!("Writing batch of {} events", job.batch.len());
+        if let Err(err) = writer.write_batch(&job.batch, &parts) {
+            return progress.fail(err.to_string());
+        }
+        progress.complete(&job.seqs);
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn progress_out_of_order() {
+        let progress = Progress::default();
+        progress.complete(&[1, 3]);
+        assert_eq!(progress.state.lock().unwrap().committed, 0);
+        progress.complete(&[0]);
+        assert_eq!(progress.state.lock().unwrap().committed, 2);
+        progress.complete(&[2]);
+        assert!(progress.wait(4).is_ok());
+        assert!(progress.state.lock().unwrap().done.is_empty());
+
+        progress.fail("broken".into());
+        assert_eq!(progress.wait(5), Err("broken".to_string()));
+    }
+
+    #[test]
+    fn fail_on_panic() {
+        let progress = Arc::new(Progress::default());
+        let guarded = progress.clone();
+        let _ = thread::spawn(move || {
+            let _guard = PanicGuard {
+                progress: guarded,
+                thread: "test",
+            };
+            panic!("broken");
+        })
+        .join();
+        assert_eq!(progress.wait(1), Err("test thread panicked".to_string()));
+    }
+
+    #[test]
+    fn flush_after_stragglers() {
+        let mut arrivals = Arrivals::default();
+        arrivals.arrived(1);
+        arrivals.flush(2);
+        assert!(!arrivals.take_flush());
+        arrivals.arrived(2);
+        arrivals.arrived(3);
+        assert!(!arrivals.take_flush());
+        arrivals.arrived(0);
+        assert!(arrivals.take_flush());
+        // cleared once taken
+        assert!(!arrivals.take_flush());
+
+        arrivals.flush(5);
+        arrivals.flush(4);
+        arrivals.arrived(4);
+        assert!(!arrivals.take_flush());
+        arrivals.arrived(5);
+        assert!(arrivals.take_flush());
+    }
+}
@@ -0,0 +1,373 @@
+//! Count rollups maintained while importing (see `logstuff::rollup`)
+//!
+//! Each batch's counts are added within the batch's transaction, so rolled up counts always match
+//! the stored events. stuffstream answers histograms without query expression from these tables
+//! instead of scanning the log tables.
+//!
+//! With `field_sketches`, the batch's top values and distinct values of each field are merged into
+//! the hourly sketches (see `logstuff::sketch`) in the same transaction.
+use postgres::GenericClient;
+use serde_json::Value;
+use std::collections::{BTreeMap, HashMap};
+use time::OffsetDateTime;
+
+use logstuff::event::Event;
+use logstuff::rollup::{RollupSettings, GRANULARITIES, MISSING};
+use logstuff::sketch::{Hll, TopK};
+
+use crate::partition::key_value;
+
+/// Counts by bucket start (unix timestamp), field and value
+type Counts = BTreeMap<(i64, String, String), i64>;
+
+/// Top values and distinct values by hour (unix timestamp) and field
+type Sketches = BTreeMap<(i64, String), (TopK, Hll)>;
+
+/// Counters kept per field and hour, stuffstream shows the top 5
+const TOP_VALUES: usize = 32;
+
+/// Create a missing rollup table with `columns`, owned like partitions and readable by stuffstream
+///
+/// Tables stuffimport creates aren't covered by the default privileges of schema.sql, which only
+/// apply to tables of the role that set them. Granting on every start also repairs tables created
+/// by versions that didn't. The roles are schema.sql's `write_logs` and `read_logs`, as for
+/// partitions.
+fn ensure_table(
+    client: &mut postgres::Client,
+    table: &str,
+    columns: &str,
+) -> Result<(), postgres::Error> {
+    client.batch_execute(
+        format!(
+            "create table if not exists {} ({});
+            alter table {} owner to write_logs;
+            grant select on {} to read_logs",
+            table, columns, table, table
+        )
+        .as_str(),
+    )
+}
+
+/// Create missing rollup tables, recording when counting started for new ones
+pub fn ensure_tables(
+    client: &mut postgres::Client,
+    settings: &RollupSettings,
+) -> Result<(), postgres::Error> {
+    let coverage = settings.coverage_table();
+    ensure_table(
+        client,
+        &coverage,
+        "single boolean primary key default true check (single),
+        since timestamp with time zone not null",
+    )?;
+    client.execute(
+        format!(
+            "insert into {} (since) values (now()) on conflict do nothing",
+            coverage
+        )
+        .as_str(),
+        &[],
+    )?;
+    for (_, suffix) in GRANULARITIES {
+        ensure_table(
+            client,
+            &settings.table_name(suffix),
+            "bucket timestamp with time zone not null,
+            field text not null,
+            value text not null,
+            count bigint not null,
+            primary key (bucket, field, value)",
+        )?;
+    }
+    if settings.field_sketches {
+        ensure_table(
+            client,
+            &settings.fields_table(),
+            "bucket timestamp with time zone not null,
+            field text not null,
+            top jsonb,
+            hll bytea,
+            primary key (bucket, field)",
+        )?;
+    }
+    Ok(())
+}
+
+fn count<'a>(
+    settings: &RollupSettings,
+    events: impl Iterator<Item = &'a Event>,
+    seconds: i64,
+) -> Counts {
+    let mut counts = Counts::new();
+    for event in events {
+        let timestamp = event.timestamp.unix_timestamp();
+        let bucket = timestamp - timestamp.rem_euclid(seconds);
+        *counts
+            .entry((bucket, String::new(), String::new()))
+            .or_default() += 1;
+        for field in &settings.split_fields {
+            let value = key_value(event, field).map_or(MISSING.into(), |value| value.into());
+            *counts.entry((bucket, field.to_owned(), value)).or_default() += 1;
+        }
+    }
+    counts
+}
+
+/// Add the counts of `events` to the rollup tables
+///
+/// Rows are upserted in key order, concurrent writers thus lock shared rows in the same order
+/// and don't deadlock each other.
+pub fn add<'a>(
+    client: &mut impl GenericClient,
+    settings: &RollupSettings,
+    events: impl Iterator<Item = &'a Event> + Clone,
+) -> Result<(), postgres::Error> {
+    for (seconds, suffix) in GRANULARITIES {
+        let counts = count(settings, events.clone(), *seconds);
+        let mut buckets = Vec::with_capacity(counts.len());
+        let mut fields = Vec::with_capacity(counts.len());
+        let mut values = Vec::with_capacity(counts.len());
+        let mut numbers = Vec::with_capacity(counts.len());
+        for ((bucket, field, value), count) in counts {
+            buckets.push(
+                OffsetDateTime::from_unix_timestamp(bucket).expect("bucket of a valid timestamp"),
+            );
+            fields.push(field);
+            values.push(value);
+            numbers.push(count);
+        }
+
+        let table = settings.table_name(suffix);
+        client.execute(
+            format!(
+                "insert into {} (bucket, field, value, count)
+                select * from unnest($1::timestamptz[], $2::text[], $3::text[], $4::bigint[])
+                on conflict (bucket, field, value) do update set count = {}.count + excluded.count",
+                table, table
+            )
+            .as_str(),
+            &[&buckets, &fields, &values, &numbers],
+        )?;
+    }
+    if settings.field_sketches {
+        add_sketches(client, settings, events)?;
+    }
+    Ok(())
+}
+
+/// Text of a top-level field's value as stuffstream's field statistics show it (`#>> '{}'`),
+/// arrays contribute each of their elements
+fn field_texts(value: &Value) -> Vec<String> {
+    let text = |value: &Value| match value {
+        Value::Null => String::new(),
+        Value::String(s) => s.to_owned(),
+        other => other.to_string(),
+    };
+    match value {
+        Value::Array(values) => values.iter().map(text).collect(),
+        other => vec![text(other)],
+    }
+}
+
+fn sketch<'a>(events: impl Iterator<Item = &'a Event>) -> Sketches {
+    let mut counts: BTreeMap<(i64, String), HashMap<String, u64>> = BTreeMap::new();
+    for event in events {
+        let timestamp = event.timestamp.unix_timestamp();
+        let bucket = timestamp - timestamp.rem_euclid(3600);
+        if let Value::Object(doc) = &event.doc {
+            for (key, value) in doc {
+                let values = counts.entry((bucket, key.to_owned())).or_default();
+                for text in field_texts(value) {
+                    *values.entry(text).or_default() += 1;
+                }
+            }
+        }
+    }
+
+    counts
+        .into_iter()
+        .map(|(key, values)| {
+            let mut hll = Hll::default();
+            for value in values.keys() {
+                hll.add(value);
+            }
+            // exact counts of the most frequent values, offering the others too would inflate
+            // the lowest counter by each of them
+            (key, (TopK::from_counts(TOP_VALUES, values), hll))
+        })
+        .collect()
+}
+
+/// Merge the sketches of `events` into the stored ones
+///
+/// Merging happens here, rows get created first and are then locked in key order until the
+/// transaction ends.
+fn add_sketches<'a>(
+    client: &mut impl GenericClient,
+    settings: &RollupSettings,
+    events: impl Iterator<Item = &'a Event>,
+) -> Result<(), postgres::Error> {
+    let mut sketches = sketch(events);
+    let (buckets, fields): (Vec<OffsetDateTime>, Vec<String>) = sketches
+        .keys()
+        .map(|(bucket, field)| {
+            let bucket =
+                OffsetDateTime::from_unix_timestamp(*bucket).expect("bucket of a valid timestamp");
+            (bucket, field.to_owned())
+        })
+        .unzip();
+
+    let table = settings.fields_table();
+    client.execute(
+        format!(
+            "insert into {} (bucket, field)
+            select * from unnest($1::timestamptz[], $2::text[])
+            on conflict (bucket, field) do nothing",
+            table
+        )
+        .as_str(),
+        &[&buckets, &fields],
+    )?;
+    let stored = client.query(
+        format!(
+            "select bucket, field, top, hll from {}
+            where (bucket, field) in (select * from unnest($1::timestamptz[], $2::text[]))
+            order by bucket, field
+            for update",
+            table
+        )
+        .as_str(),
+        &[&buckets, &fields],
+    )?;
+    for row in stored {
+        let bucket: OffsetDateTime = row.get("bucket");
+        let key = (bucket.unix_timestamp(), row.get::<_, String>("field"));
+        if let Some((top, hll)) = sketches.get_mut(&key) {
+            if let Some(stored_top) = row.get::<_, Option<Value>>("top") {
+                if let Ok(stored_top) = serde_json::from_value::<TopK>(stored_top) {
+                    top.merge(&stored_top);
+                }
+            }
+            if let Some(stored_hll) = row.get::<_, Option<Vec<u8>>>("hll") {
+                hll.merge(&Hll::from_bytes(stored_hll));
+            }
+        }
+    }
+
+    let mut tops = Vec::with_capacity(sketches.len());
+    let mut hlls = Vec::with_capacity(sketches.len());
+    for (top, hll) in sketches.values() {
+        tops.push(serde_json::to_value(top).expect("sketches serialize"));
+        hlls.push(hll.as_bytes().to_vec());
+    }
+    client.execute(
+        format!(
+            "update {} t set top = u.top, hll = u.hll
+            from unnest($1::timestamptz[], $2::text[], $3::jsonb[], $4::bytea[]) u(bucket, field, top, hll)
+            where t.bucket = u.bucket and t.field = u.field",
+            table
+        )
+        .as_str(),
+        &[&buckets, &fields, &tops, &hlls],
+    )?;
+    Ok(())
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use serde_json::json;
+
+    fn event(timestamp: i64, hostname: Option<&str>) -> Event {
+        Event {
+            timestamp: OffsetDateTime::from_unix_timestamp(timestamp).unwrap(),
+            doc: match hostname {
+                Some(hostname) => json!({ "hostname": hostname }),
+                None => json!({}),
+            },
+        }
+    }
+
+    #[test]
+    fn counts_by_bucket_and_field() {
+        let settings = RollupSettings {
+            split_fields: vec!["hostname".into()],
+            ..RollupSettings::default()
+        };
+        let events = vec![
+            event(3600 + 5, Some("a")),
+            event(3600 + 59, Some("b")),
+            event(3600 + 61, Some("a")),
+            event(3600 + 62, None),
+        ];
+
+        let counts: Vec<_> = count(&settings, events.iter(), 60).into_iter().collect();
+        let key = |bucket, field: &str, value: &str| (bucket, field.into(), value.into());
+        assert_eq!(
+            counts,
+            vec![
+                (key(3600, "", ""), 2),
+                (key(3600, "hostname", "a"), 1),
+                (key(3600, "hostname", "b"), 1),
+                (key(3660, "", ""), 2),
+                (key(3660, "hostname", "(null)"), 1),
+                (key(3660, "hostname", "a"), 1),
+            ]
+        );
+
+        let hourly = count(&settings, events.iter(), 3600);
+        assert_eq!(hourly.get(&key(3600, "", "")), Some(&4));
+        assert_eq!(hourly.len(), 4);
+    }
+
+    #[test]
+    fn count_values_as_text() {
+        let settings = RollupSettings {
+            split_fields: vec!["vars.net.tags".into(), "port".into()],
+            ..RollupSettings::default()
+        };
+        // rsyslog's message variables are flattened into top-level keys
+        let event = Event {
+            timestamp: OffsetDateTime::UNIX_EPOCH,
+            doc: json!({"vars.net.tags": ["a", "b"], "port": 22}),
+        };
+        let counts = count(&settings, std::iter::once(&event), 60);
+        let values: Vec<_> = counts.keys().map(|(_, _, value)| value.as_str()).collect();
+        // the same text as doc ->> 'field'
+        assert_eq!(values, ["", "22", r#"["a", "b"]"#]);
+    }
+
+    #[test]
+    fn field_sketches() {
+        let mut events = vec![event(3600, Some("a")), event(3601, Some("a"))];
+        events.push(Event {
+            timestamp: OffsetDateTime::from_unix_timestamp(3602).unwrap(),
+            doc: json!({ "hostname": "b", "tags": ["x", "y"], "pid": 1, "empty": null }),
+        });
+
+        let sketches = sketch(events.iter());
+        let (top, hll) = &sketches[&(3600, "hostname".to_string())];
+        let counters: Vec<_> = top.top(5).map(|c| (c.value.as_str(), c.count)).collect();
+        assert_eq!(counters, vec![("a", 2), ("b", 1)]);
+        assert_eq!(hll.estimate(), 2);
+        assert_eq!(sketches[&(3600, "tags".to_string())].1.estimate(), 2);
+        assert_eq!(field_texts(&json!(1)), vec!["1"]);
+        assert_eq!(field_texts(&json!(null)), vec![""]);
+    }
+
+    #[test]
+    fn sketch_distinct_values() {
+        // a request id per event, none occurs twice
+        let events = (0..5000)
+            .map(|i| Event {
+                timestamp: OffsetDateTime::from_unix_timestamp(3600 + i % 60).unwrap(),
+                doc: json!({ "request": format!("req-{}", i) }),
+            })
+            .collect::<Vec<_>>();
+        let sketches = sketch(events.iter());
+        let (top, hll) = &sketches[&(3600, "request".to_string())];
+        assert!(top.top(TOP_VALUES).all(|c| c.count == 1 && c.error == 0));
+        assert_eq!(top.guaranteed(5).len(), 5);
+        assert!((hll.estimate() as f64 - 5000.0).abs() < 500.0);
+    }
+}
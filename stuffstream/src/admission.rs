@@ -0,0 +1,124 @@
+//! Admission control for requests using database connections
+//!
+//! Each request reserves the connections it is going to use before it starts. While all of them
+//! are reserved, further requests wait in line, up to a limit and for a limited time. Requests
+//! that can't be admitted are shed (503) instead of waiting for the pool forever.
+use serde_derive::Serialize;
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::sync::Arc;
+use std::time::Duration;
+use tokio::sync::{OwnedSemaphorePermit, Semaphore};
+
+use crate::config::PoolSettings;
+
+pub struct Admission {
+    connections: Arc<Semaphore>,
+    max_size: u32,
+    request_connections: u32,
+    waiting: AtomicUsize,
+    max_waiting: usize,
+    timeout: Duration,
+    admitted: AtomicU64,
+    shed: AtomicU64,
+}
+
+#[derive(Debug, Serialize)]
+pub struct AdmissionStats {
+    pub available_connections: usize,
+    pub waiting: usize,
+    pub admitted: u64,
+    pub shed: u64,
+}
+
+/// The request was not admitted, answered with 503 Service Unavailable
+#[derive(Debug)]
+pub struct Overloaded;
+
+impl warp::reject::Reject for Overloaded {}
+
+impl Admission {
+    pub fn new(settings: &PoolSettings) -> Self {
+        let max_size = settings.max_size.max(1);
+        Self {
+            connections: Arc::new(Semaphore::new(max_size as usize)),
+            max_size,
+            request_connections: settings.request_connections.clamp(1, max_size),
+            waiting: AtomicUsize::new(0),
+            max_waiting: settings.max_waiting_requests,
+            timeout: Duration::from_millis(settings.queue_timeout_ms),
+            admitted: AtomicU64::new(0),
+            shed: AtomicU64::new(0),
+        }
+    }
+
+    /// Number of connections a request wanting `wanted` of them may use at the same time
+    pub fn connections_for(&self, wanted: u32) -> u32 {
+        wanted.clamp(1, self.request_connections)
+    }
+
+    /// Reserve `connections` database connections (see `connections_for`) until the permit drops
+    pub async fn admit(&self, connections: u32) -> Result<OwnedSemaphorePermit, Overloaded> {
+        let connections = connections.clamp(1, self.max_size);
+        if let Ok(permit) = self.connections.clone().try_acquire_many_owned(connections) {
+            self.admitted.fetch_add(1, Ordering::Relaxed);
+            return Ok(permit);
+        }
+
+        if self.waiting.fetch_add(1, Ordering::Relaxed) >= self.max_waiting {
+            self.waiting.fetch_sub(1, Ordering::Relaxed);
+            self.shed.fetch_add(1, Ordering::Relaxed);
+            warn!("Too many requests waiting for database connections, rejecting request");
+            return Err(Overloaded);
+        }
+        let result = tokio::time::timeout(
+            self.timeout,
+            self.connections.clone().acquire_many_owned(connections),
+        )
+        .await;
+        self.waiting.fetch_sub(1, Ordering::Relaxed);
+
+        match result {
+            Ok(Ok(permit)) => {
+                self.admitted.fetch_add(1, Ordering::Relaxed);
+                Ok(permit)
+            }
+            _ => {
+                self.shed.fetch_add(1, Ordering::Relaxed);
+                warn!("Request waited too long for database connections, rejecting it");
+                Err(Overloaded)
+            }
+        }
+    }
+
+    pub fn stats(&self) -> AdmissionStats {
+        AdmissionStats {
+            available_connections: self.connections.available_permits(),
+            waiting: self.waiting.load(Ordering::Relaxed),
+            admitted: self.admitted.load(Ordering::Relaxed),
+            shed: self.shed.load(Ordering::Relaxed),
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[tokio::test]
+    async fn sheds_when_saturated() {
+        let admission = Admission::new(&PoolSettings {
+            max_size: 2,
+            max_waiting_requests: 0,
+            ..PoolSettings::default()
+        });
+        assert_eq!(admission.connections_for(3), 2);
+
+        let first = admission.admit(2).await.unwrap();
+        assert!(admission.admit(1).await.is_err());
+        drop(first);
+        assert!(admission.admit(1).await.is_ok());
+
+        let stats = admission.stats();
+        assert_eq!((stats.admitted, stats.shed), (2, 1));
+    }
+}
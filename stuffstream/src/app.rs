@@ -1,24 +1,42 @@
 use bb8_postgres::tokio_postgres;
 use bb8_postgres::{bb8, PostgresConnectionManager};
-use futures::lock::Mutex;
+use futures::Stream;
 use rustls::client::ClientConfig;
 use std::convert::Infallible;
 use std::sync::Arc;
+use std::time::Duration;
 use std::{fmt, io};
 use tokio_postgres_rustls::MakeRustlsConnect;
-use warp::http::StatusCode;
+use warp::http::{self, StatusCode};
+use warp::hyper::Body;
 use warp::{reject, reply, Filter, Rejection, Reply};
 
+use logstuff::columns::{Column, ColumnType};
+use logstuff::metrics::Exposition;
+use logstuff::rollup::RollupSettings;
 use logstuff::tls;
-use logstuff_query::{ExpressionParser, IdentifierParser};
+use logstuff_query::{ColumnKind, Columns, ExpressionParser, IdentifierParser};
 
+use crate::admission::{Admission, Overloaded};
 use crate::application::{Application, Stopping};
 use crate::cli::Options;
-use crate::config::{Config, HttpSettings, TlsClientAuth};
+use crate::compression::{self, Encoding};
+use crate::config::{
+    Config, CountsCacheSettings, HttpSettings, PartitionWalkSettings, PoolSettings,
+    RequestSettings, TailSettings, TlsClientAuth,
+};
 use crate::counts;
+use crate::counts_cache::CountsCache;
+use crate::db::ConnectionManager;
+use crate::deadline::{Deadlines, Stopped};
 use crate::events;
+use crate::metrics::{self, METRICS};
+use crate::partitions::PartitionLayout;
+use crate::query_cache::QueryCompiler;
+use crate::rollups::Rollups;
+use crate::tail::{self, Tail};
 
-pub(crate) type DBPool = bb8::Pool<PostgresConnectionManager<MakeRustlsConnect>>;
+pub(crate) type DBPool = bb8::Pool<ConnectionManager>;
 
 /// Error type for the core program logic
 #[derive(Debug)]
@@ -26,7 +44,9 @@ pub enum Error {
     Logger(log::SetLoggerError),
     Io(io::Error),
     Db(tokio_postgres::Error),
+    Pool(bb8::RunError<tokio_postgres::Error>),
     Tls(tls::Error),
+    Stopped(Stopped),
 }
 
 /// Core program logic
@@ -38,6 +58,16 @@ pub struct App {
     postgres_tls: tls::ClientConfig,
     http_settings: HttpSettings,
     table_name: String,
+    columns: Columns,
+    partition_keys: Vec<String>,
+    rollups: Option<RollupSettings>,
+    query_cache_size: usize,
+    counts_cache: Option<CountsCacheSettings>,
+    partition_walk: Option<PartitionWalkSettings>,
+    tail: TailSettings,
+    statement_cache_size: usize,
+    pool: PoolSettings,
+    requests: RequestSettings,
 }
 
 impl Application for App {
@@ -51,6 +81,16 @@ impl Application for App {
             postgres_tls: config.postgres_tls.client_config()?,
             http_settings: config.http_settings,
             table_name: config.root_table_name,
+            columns: query_columns(&config.columns),
+            partition_keys: config.partition_keys,
+            rollups: config.rollups,
+            query_cache_size: config.query_cache_size,
+            counts_cache: config.counts_cache,
+            partition_walk: config.partition_walk,
+            tail: config.tail,
+            statement_cache_size: config.statement_cache_size,
+            pool: config.pool,
+            requests: config.requests,
         })
     }
 
@@ -64,6 +104,16 @@ impl Application for App {
                 &self.db_url,
                 &self.postgres_tls,
                 &self.table_name,
+                &self.columns,
+                &self.partition_keys,
+                &self.rollups,
+                self.query_cache_size,
+                &self.counts_cache,
+                &self.partition_walk,
+                &self.tail,
+                self.statement_cache_size,
+                &self.pool,
+                &self.requests,
             ))?;
 
         if self.auto_restart {
@@ -76,6 +126,28 @@ impl Application for App {
 
 impl App {}
 
+/// Promoted columns as used by the query compiler
+fn query_columns(columns: &[Column]) -> Columns {
+    columns
+        .iter()
+        .map(|column| {
+            let kind = match column.kind {
+                ColumnType::Text => ColumnKind::Text,
+                ColumnType::Double => ColumnKind::Float,
+                _ => ColumnKind::Integer,
+            };
+            (
+                column.field.to_owned(),
+                logstuff_query::Column {
+                    name: column.column_name(),
+                    kind,
+                    sql_type: column.kind.sql_type().into(),
+                },
+            )
+        })
+        .collect()
+}
+
 #[derive(Debug)]
 pub struct MalformedQuery;
 
@@ -86,6 +158,17 @@ async fn handle_rejection(err: Rejection) -> Result<impl Reply, Infallible> {
         Ok(reply::with_status("NOT_FOUND", StatusCode::NOT_FOUND))
     } else if err.find::<MalformedQuery>().is_some() {
         Ok(reply::with_status("BAD_REQUEST", StatusCode::BAD_REQUEST))
+    } else if err.find::<Overloaded>().is_some() {
+        Ok(reply::with_status(
+            "SERVICE_UNAVAILABLE",
+            StatusCode::SERVICE_UNAVAILABLE,
+        ))
+    } else if let Some(stopped) = err.find::<Stopped>() {
+        warn!("Request stopped: {}", stopped);
+        Ok(match stopped {
+            Stopped::TimedOut => reply::with_status("GATEWAY_TIMEOUT", StatusCode::GATEWAY_TIMEOUT),
+            Stopped::Superseded => reply::with_status("CONFLICT", StatusCode::CONFLICT),
+        })
     } else {
         error!("unhandled rejection: {:?}", err);
         Ok(reply::with_status(
@@ -100,44 +183,263 @@ async fn start_server(
     db_url: &str,
     postgres_tls: &ClientConfig,
     table_name: &str,
+    columns: &Columns,
+    partition_keys: &[String],
+    rollups: &Option<RollupSettings>,
+    query_cache_size: usize,
+    counts_cache: &Option<CountsCacheSettings>,
+    partition_walk: &Option<PartitionWalkSettings>,
+    tail_settings: &TailSettings,
+    statement_cache_size: usize,
+    pool: &PoolSettings,
+    requests: &RequestSettings,
 ) -> Result<(), Error> {
     let connector = MakeRustlsConnect::new(postgres_tls.clone());
-    let manager = PostgresConnectionManager::new_from_stringlike(db_url, connector)?;
+    let manager = ConnectionManager::new(
+        PostgresConnectionManager::new_from_stringlike(db_url, connector.clone())?,
+        connector.clone(),
+        statement_cache_size,
+        requests.deadline_ms,
+    );
     let dbpool = bb8::Pool::builder()
-        .max_size(3)
+        .max_size(pool.max_size.max(1))
+        .min_idle(pool.min_idle)
+        .connection_timeout(Duration::from_millis(pool.connection_timeout_ms))
         .build(manager)
-        .await
-        .unwrap();
+        .await?;
+    let admission = Arc::new(Admission::new(pool));
+    let deadlines = Arc::new(Deadlines::new(requests));
 
-    let expr_parser = Arc::new(Mutex::new(ExpressionParser::default()));
-    let id_parser = Arc::new(Mutex::new(IdentifierParser::default()));
+    let compiler = Arc::new(QueryCompiler::new(
+        ExpressionParser::default()
+            .with_columns(columns.clone())
+            .with_partition_keys(partition_keys.to_vec()),
+        query_cache_size,
+    ));
+    let id_parser = Arc::new(IdentifierParser::default());
 
-    let p = expr_parser.clone();
+    let rollups = rollups
+        .clone()
+        .map(|settings| Arc::new(Rollups::new(settings)));
+    let p = compiler.clone();
+    let r = rollups.clone();
+    let layout = partition_walk
+        .as_ref()
+        .map(|settings| Arc::new(PartitionLayout::new(table_name, settings)));
+    let a = admission.clone();
+    let d = deadlines.clone();
     let table = table_name.to_owned();
     let events = warp::get()
         .and(warp::path("events"))
         .and(warp::query::<events::Request>())
         .and(with_db(dbpool.clone()))
-        .and_then(move |params, dbpool| {
-            events::handler(p.clone(), table.to_owned(), params, dbpool)
+        .and(with_encoding())
+        .and_then(move |params, dbpool, encoding| {
+            events::handler(
+                p.clone(),
+                r.clone(),
+                layout.clone(),
+                a.clone(),
+                d.clone(),
+                table.to_owned(),
+                params,
+                dbpool,
+                encoding,
+            )
         });
 
     let table = table_name.to_owned();
+    let c = compiler.clone();
+    let r = rollups.clone();
+    let counts_cache = counts_cache
+        .as_ref()
+        .map(|settings| Arc::new(CountsCache::new(settings)));
+    let cc = counts_cache.clone();
+    let a = admission.clone();
+    let d = deadlines.clone();
     let counts = warp::get()
         .and(warp::path("counts"))
         .and(warp::query::<counts::Request>())
         .and(with_db(dbpool.clone()))
-        .and_then(move |params, dbpool| {
+        .and(with_encoding())
+        .and_then(move |params, dbpool, encoding| {
             counts::handler(
-                expr_parser.clone(),
+                c.clone(),
                 id_parser.clone(),
+                r.clone(),
+                cc.clone(),
+                a.clone(),
+                d.clone(),
                 table.to_owned(),
                 params,
                 dbpool,
+                encoding,
+            )
+        });
+
+    let tail = Arc::new(Tail::new(
+        table_name,
+        tail_settings,
+        dbpool.clone(),
+        admission.clone(),
+        db_url,
+        connector,
+    ));
+    let t = tail.clone();
+    let c = compiler.clone();
+    let live = warp::get()
+        .and(warp::path("tail"))
+        .and(warp::query::<tail::Request>())
+        .and_then(move |params| tail::handler(t.clone(), c.clone(), params));
+
+    let max_size = pool.max_size;
+    let c = compiler.clone();
+    let cc = counts_cache.clone();
+    let t = tail.clone();
+    let a = admission.clone();
+    let d = deadlines.clone();
+    let metrics = warp::get()
+        .and(warp::path("metrics"))
+        .and(with_db(dbpool.clone()))
+        .map(move |dbpool: DBPool| {
+            let mut exposition = Exposition::new();
+            let state = dbpool.state();
+            exposition.gauge(
+                "stuffstream_pool_connections",
+                "Open database connections",
+                state.connections,
+            );
+            exposition.gauge(
+                "stuffstream_pool_idle_connections",
+                "Idle database connections",
+                state.idle_connections,
+            );
+            exposition.gauge(
+                "stuffstream_pool_max_size",
+                "Maximum number of database connections",
+                max_size,
+            );
+            let admitted = a.stats();
+            exposition.gauge(
+                "stuffstream_admission_available_connections",
+                "Connections available to new requests",
+                admitted.available_connections,
+            );
+            exposition.gauge(
+                "stuffstream_admission_waiting",
+                "Requests waiting for admission",
+                admitted.waiting,
+            );
+            exposition.counter(
+                "stuffstream_admission_admitted_total",
+                "Requests admitted",
+                admitted.admitted,
+            );
+            exposition.counter(
+                "stuffstream_admission_shed_total",
+                "Requests answered with 503 Service Unavailable",
+                admitted.shed,
+            );
+            let stopped = d.stats();
+            exposition.gauge(
+                "stuffstream_keyed_requests",
+                "Running requests with a request_key",
+                stopped.keyed,
+            );
+            exposition.counter(
+                "stuffstream_timed_out_requests_total",
+                "Requests stopped at their deadline",
+                stopped.timed_out,
+            );
+            exposition.counter(
+                "stuffstream_superseded_requests_total",
+                "Requests stopped by a newer one with the same request_key",
+                stopped.superseded,
+            );
+            let cached = c.stats();
+            exposition.counter(
+                "stuffstream_query_cache_hits_total",
+                "Queries found compiled",
+                cached.hits,
+            );
+            exposition.counter(
+                "stuffstream_query_cache_misses_total",
+                "Queries compiled",
+                cached.misses,
+            );
+            exposition.gauge(
+                "stuffstream_query_cache_entries",
+                "Compiled queries kept",
+                cached.entries,
+            );
+            if let Some(cache) = &cc {
+                let cached = cache.stats();
+                exposition.counter(
+                    "stuffstream_counts_cache_cached_buckets_total",
+                    "Count buckets answered from the cache",
+                    cached.cached_buckets,
+                );
+                exposition.counter(
+                    "stuffstream_counts_cache_queried_buckets_total",
+                    "Count buckets queried from the database",
+                    cached.queried_buckets,
+                );
+                exposition.gauge(
+                    "stuffstream_counts_cache_histograms",
+                    "Histograms kept",
+                    cached.histograms,
+                );
+            }
+            let tailed = t.stats();
+            exposition.gauge(
+                "stuffstream_tail_clients",
+                "Connected tail clients",
+                tailed.clients,
+            );
+            exposition.counter(
+                "stuffstream_tail_fed_events_total",
+                "Events fetched for tail clients",
+                tailed.fed_events,
+            );
+            exposition.counter(
+                "stuffstream_tail_dropped_events_total",
+                "Events slow tail clients missed",
+                tailed.dropped_events,
+            );
+            METRICS.render(&mut exposition);
+            reply::with_header(
+                exposition.finish(),
+                "content-type",
+                "text/plain; version=0.0.4",
             )
         });
 
-    let routes = events.or(counts).recover(handle_rejection);
+    let stats = warp::get()
+        .and(warp::path("stats"))
+        .and(with_db(dbpool.clone()))
+        .map(move |dbpool: DBPool| {
+            let state = dbpool.state();
+            reply::json(&serde_json::json!({
+                "query_cache": compiler.stats(),
+                "counts_cache": counts_cache.as_ref().map(|cache| cache.stats()),
+                "tail": tail.stats(),
+                "pool": {
+                    "connections": state.connections,
+                    "idle_connections": state.idle_connections,
+                    "max_size": max_size,
+                },
+                "admission": admission.stats(),
+                "deadlines": deadlines.stats(),
+            }))
+        });
+
+    let routes = events
+        .or(counts)
+        .or(live)
+        .or(stats)
+        .or(metrics)
+        .recover(handle_rejection)
+        .with(warp::log::custom(observe_request));
     let server = warp::serve(routes);
     if http_settings.use_tls {
         let server = server
@@ -163,10 +465,40 @@ async fn start_server(
     Ok(())
 }
 
+fn observe_request(info: warp::log::Info) {
+    METRICS
+        .requests
+        .with(&[metrics::route(info.path()), info.status().as_str()])
+        .observe(info.elapsed());
+}
+
 fn with_db(db_pool: DBPool) -> impl Filter<Extract = (DBPool,), Error = Infallible> + Clone {
     warp::any().map(move || db_pool.clone())
 }
 
+/// Response encoding negotiated by the request's Accept-Encoding
+fn with_encoding() -> impl Filter<Extract = (Encoding,), Error = Rejection> + Clone {
+    warp::header::optional::<String>("accept-encoding")
+        .map(|accept: Option<String>| Encoding::negotiate(accept.as_deref()))
+}
+
+/// Response streaming `body` as `content_type`, compressed with `encoding`
+pub(crate) fn streamed<S>(content_type: &str, encoding: Encoding, body: S) -> http::Response<Body>
+where
+    S: Stream<Item = Result<String, Error>> + Send + 'static,
+{
+    let mut response = http::Response::builder()
+        .status(StatusCode::OK)
+        .header("Content-Type", content_type)
+        .header("Vary", "Accept-Encoding");
+    if let Some(content_encoding) = encoding.content_encoding() {
+        response = response.header("Content-Encoding", content_encoding);
+    }
+    response
+        .body(Body::wrap_stream(compression::compress(encoding, body)))
+        .unwrap()
+}
+
 impl std::error::Error for Error {}
 
 impl From<std::io::Error> for Error {
@@ -187,12 +519,24 @@ impl From<tokio_postgres::Error> for Error {
     }
 }
 
+impl From<bb8::RunError<tokio_postgres::Error>> for Error {
+    fn from(error: bb8::RunError<tokio_postgres::Error>) -> Self {
+        Self::Pool(error)
+    }
+}
+
 impl From<tls::Error> for Error {
     fn from(error: tls::Error) -> Self {
         Self::Tls(error)
     }
 }
 
+impl From<Stopped> for Error {
+    fn from(stopped: Stopped) -> Self {
+        Self::Stopped(stopped)
+    }
+}
+
 impl fmt::Display for Error {
     fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
         use self::Error::*;
@@ -200,7 +544,9 @@ impl fmt::Display for Error {
             Logger(e) => write!(f, "Could not set logger: {}", e),
             Io(e) => write!(f, "I/O Error: {}", e),
             Db(e) => write!(f, "Database connection error: {}", e),
+            Pool(e) => write!(f, "Could not get a database connection: {}", e),
             Tls(e) => write!(f, "TLS setup error: {}", e),
+            Stopped(e) => write!(f, "Request stopped: {}", e),
         }
     }
 }
@@ -0,0 +1,233 @@
+//! Response compression negotiated by the client's Accept-Encoding
+//!
+//! Bodies are compressed while they are streamed. Chunks that are ready at the same time are
+//! compressed together and flushed, so clients get ndjson lines as soon as they arrive, while
+//! the compressor keeps its dictionary across chunks.
+use flate2::write::GzEncoder;
+use futures::stream::{self, BoxStream};
+use futures::{Stream, StreamExt};
+use std::io::{self, Write};
+
+/// Chunks compressed together at most
+const BATCH_CHUNKS: usize = 64;
+
+const GZIP_LEVEL: u32 = 6;
+const ZSTD_LEVEL: i32 = 3;
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum Encoding {
+    Identity,
+    Gzip,
+    Zstd,
+}
+
+impl Encoding {
+    /// Encoding preferred by `accept_encoding`, zstd before gzip at the same quality
+    ///
+    /// Anything not mentioned, including `*`, is answered without compression, which is always
+    /// acceptable.
+    pub fn negotiate(accept_encoding: Option<&str>) -> Self {
+        let mut best = (Encoding::Identity, 0.0);
+        for coding in accept_encoding.unwrap_or("").split(',') {
+            let mut params = coding.split(';');
+            let encoding = match params.next().unwrap_or("").trim() {
+                name if name.eq_ignore_ascii_case("zstd") => Encoding::Zstd,
+                name if name.eq_ignore_ascii_case("gzip")
+                    || name.eq_ignore_ascii_case("x-gzip") =>
+                {
+                    Encoding::Gzip
+                }
+                _ => continue,
+            };
+            let quality = params
+                .find_map(|param| param.trim().strip_prefix("q="))
+                .map_or(1.0, |quality| quality.trim().parse().unwrap_or(0.0));
+            if quality > best.1 || (quality == best.1 && encoding == Encoding::Zstd) {
+                best = (encoding, quality);
+            }
+        }
+        if best.1 > 0.0 {
+            best.0
+        } else {
+            Encoding::Identity
+        }
+    }
+
+    /// Value of the Content-Encoding header, none for identity
+    pub fn content_encoding(self) -> Option<&'static str> {
+        match self {
+            Encoding::Identity => None,
+            Encoding::Gzip => Some("gzip"),
+            Encoding::Zstd => Some("zstd"),
+        }
+    }
+}
+
+enum Encoder {
+    Gzip(GzEncoder<Vec<u8>>),
+    Zstd(zstd::stream::write::Encoder<'static, Vec<u8>>),
+}
+
+impl Encoder {
+    fn new(encoding: Encoding) -> io::Result<Option<Self>> {
+        Ok(match encoding {
+            Encoding::Identity => None,
+            Encoding::Gzip => Some(Encoder::Gzip(GzEncoder::new(
+                Vec::new(),
+                flate2::Compression::new(GZIP_LEVEL),
+            ))),
+            Encoding::Zstd => Some(Encoder::Zstd(zstd::stream::write::Encoder::new(
+                Vec::new(),
+                ZSTD_LEVEL,
+            )?)),
+        })
+    }
+
+    fn write(&mut self, chunk: &[u8]) -> io::Result<()> {
+        match self {
+            Encoder::Gzip(encoder) => encoder.write_all(chunk),
+            Encoder::Zstd(encoder) => encoder.write_all(chunk),
+        }
+    }
+
+    /// Everything written so far, decodable by the client without waiting for more
+    fn flush(&mut self) -> io::Result<Vec<u8>> {
+        Ok(match self {
+            Encoder::Gzip(encoder) => {
+                encoder.flush()?;
+                std::mem::take(encoder.get_mut())
+            }
+            Encoder::Zstd(encoder) => {
+                encoder.flush()?;
+                std::mem::take(encoder.get_mut())
+            }
+        })
+    }
+
+    /// The remaining output, ending the compressed stream
+    fn finish(self) -> io::Result<Vec<u8>> {
+        match self {
+            Encoder::Gzip(encoder) => encoder.finish(),
+            Encoder::Zstd(encoder) => encoder.finish(),
+        }
+    }
+
+    /// Compress a batch of chunks, stopping at the first error of the body
+    fn batch<B, E>(&mut self, chunks: Vec<Result<B, E>>) -> Result<Vec<u8>, E>
+    where
+        B: Into<Vec<u8>>,
+        E: From<io::Error>,
+    {
+        for chunk in chunks {
+            self.write(&chunk?.into())?;
+        }
+        Ok(self.flush()?)
+    }
+}
+
+/// `body` encoded with `encoding`
+///
+/// The compressed stream ends with the first error of `body`, like the body would have.
+pub fn compress<S, B, E>(encoding: Encoding, body: S) -> BoxStream<'static, Result<Vec<u8>, E>>
+where
+    S: Stream<Item = Result<B, E>> + Send + 'static,
+    B: Into<Vec<u8>> + Send + 'static,
+    E: From<io::Error> + Send + 'static,
+{
+    let encoder = match Encoder::new(encoding) {
+        Ok(Some(encoder)) => encoder,
+        Ok(None) => return body.map(|chunk| chunk.map(Into::into)).boxed(),
+        Err(err) => return stream::once(async move { Err(err.into()) }).boxed(),
+    };
+    stream::unfold(
+        (body.ready_chunks(BATCH_CHUNKS).boxed(), Some(encoder)),
+        |(mut chunks, encoder)| async move {
+            let mut encoder = encoder?;
+            match chunks.next().await {
+                Some(batch) => match encoder.batch(batch) {
+                    Ok(compressed) => Some((Ok(compressed), (chunks, Some(encoder)))),
+                    Err(err) => Some((Err(err), (chunks, None))),
+                },
+                None => Some((encoder.finish().map_err(E::from), (chunks, None))),
+            }
+        },
+    )
+    .boxed()
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use std::io::Read;
+
+    #[test]
+    fn negotiate_encoding() {
+        assert_eq!(Encoding::negotiate(None), Encoding::Identity);
+        assert_eq!(Encoding::negotiate(Some("")), Encoding::Identity);
+        assert_eq!(Encoding::negotiate(Some("br, *")), Encoding::Identity);
+        assert_eq!(Encoding::negotiate(Some("gzip, deflate")), Encoding::Gzip);
+        assert_eq!(Encoding::negotiate(Some("gzip, zstd")), Encoding::Zstd);
+        assert_eq!(
+            Encoding::negotiate(Some("zstd;q=0.5, GZIP;q=0.8")),
+            Encoding::Gzip
+        );
+        assert_eq!(
+            Encoding::negotiate(Some("gzip;q=0, zstd; q=0")),
+            Encoding::Identity
+        );
+        assert_eq!(Encoding::negotiate(Some("x-gzip;q=1.0")), Encoding::Gzip);
+    }
+
+    fn compressed(encoding: Encoding, chunks: Vec<Result<String, io::Error>>) -> Vec<Vec<u8>> {
+        futures::executor::block_on(
+            compress(encoding, stream::iter(chunks))
+                .map(|chunk| chunk.unwrap())
+                .collect(),
+        )
+    }
+
+    #[test]
+    fn compress_stream() {
+        let chunks = || {
+            (0..100)
+                .map(|line| Ok(format!("{{\"line\":{}}}\n", line)))
+                .collect::<Vec<_>>()
+        };
+        let text = chunks().into_iter().map(Result::unwrap).collect::<String>();
+
+        assert_eq!(
+            compressed(Encoding::Identity, chunks()).concat(),
+            text.as_bytes()
+        );
+
+        let gzip = compressed(Encoding::Gzip, chunks()).concat();
+        let mut decoded = String::new();
+        flate2::read::GzDecoder::new(&gzip[..])
+            .read_to_string(&mut decoded)
+            .unwrap();
+        assert_eq!(decoded, text);
+
+        let zstd = compressed(Encoding::Zstd, chunks()).concat();
+        assert_eq!(zstd::decode_all(&zstd[..]).unwrap(), text.as_bytes());
+    }
+
+    #[test]
+    fn flush_batches() {
+        // the first batch is decodable before the stream ends
+        let batches = compressed(Encoding::Gzip, vec![Ok("first\n".into())]);
+        let mut decoder = flate2::write::GzDecoder::new(Vec::new());
+        decoder.write_all(&batches[0]).unwrap();
+        decoder.flush().unwrap();
+        assert_eq!(decoder.get_ref(), b"first\n");
+
+        // errors end the stream
+        let chunks = vec![
+            Ok("a".to_string()),
+            Err(io::Error::from(io::ErrorKind::Other)),
+        ];
+        let results: Vec<_> =
+            futures::executor::block_on(compress(Encoding::Zstd, stream::iter(chunks)).collect());
+        assert_eq!(results.len(), 1);
+        assert!(results[0].is_err());
+    }
+}
@@ -2,6 +2,8 @@ use serde_derive::{Deserialize, Serialize};
 use std::fs::File;
 use std::net::{IpAddr, Ipv4Addr, SocketAddr};
 
+use logstuff::columns::Column;
+use logstuff::rollup::RollupSettings;
 use logstuff::tls::TlsSettings;
 
 #[derive(Serialize, Deserialize, Debug)]
@@ -33,6 +35,132 @@ impl Default for HttpSettings {
     }
 }
 
+/// Database connection pool and admission of requests
+#[derive(Serialize, Deserialize, Debug)]
+#[serde(deny_unknown_fields, default)]
+pub struct PoolSettings {
+    /// Maximum number of database connections
+    pub max_size: u32,
+
+    /// Idle connections to keep open, none by default: connections are opened on demand
+    pub min_idle: Option<u32>,
+
+    /// Time to wait for a new connection
+    pub connection_timeout_ms: u64,
+
+    /// Connections used by a single request at the same time (at least 1)
+    pub request_connections: u32,
+
+    /// Requests waiting for connections, further ones get 503 Service Unavailable
+    pub max_waiting_requests: usize,
+
+    /// Time a request may wait for connections before it gets 503 Service Unavailable
+    pub queue_timeout_ms: u64,
+}
+
+impl Default for PoolSettings {
+    fn default() -> Self {
+        Self {
+            max_size: 10,
+            min_idle: None,
+            connection_timeout_ms: 10000,
+            request_connections: 2,
+            max_waiting_requests: 64,
+            queue_timeout_ms: 10000,
+        }
+    }
+}
+
+/// Limits of /events and /counts requests
+#[derive(Serialize, Deserialize, Debug)]
+#[serde(deny_unknown_fields, default)]
+pub struct RequestSettings {
+    /// Time a request may take until its response is sent (0 disables), also the database
+    /// connections' statement_timeout
+    pub deadline_ms: u64,
+}
+
+impl Default for RequestSettings {
+    fn default() -> Self {
+        Self { deadline_ms: 60000 }
+    }
+}
+
+/// Cache for closed /counts buckets
+#[derive(Serialize, Deserialize, Debug)]
+#[serde(deny_unknown_fields, default)]
+pub struct CountsCacheSettings {
+    /// Number of histograms (distinct query, value, aggregate, bucket length and start within a
+    /// bucket) to keep
+    pub histograms: usize,
+
+    /// Buckets ending less than this long ago are always queried again
+    pub late_events_sec: u64,
+}
+
+impl Default for CountsCacheSettings {
+    fn default() -> Self {
+        Self {
+            histograms: 100,
+            late_events_sec: 120,
+        }
+    }
+}
+
+/// Walking partitions newest first for limited /events requests
+#[derive(Serialize, Deserialize, Debug)]
+#[serde(deny_unknown_fields, default)]
+pub struct PartitionWalkSettings {
+    /// Time to keep the partitions' time ranges before reading them again
+    pub refresh_sec: u64,
+}
+
+impl Default for PartitionWalkSettings {
+    fn default() -> Self {
+        Self { refresh_sec: 300 }
+    }
+}
+
+/// Live tail of new events (/tail)
+#[derive(Clone, Serialize, Deserialize, Debug)]
+#[serde(deny_unknown_fields, default)]
+pub struct TailSettings {
+    /// Time between queries for new events
+    pub poll_interval_ms: u64,
+
+    /// Wait for notifications on this channel instead of polling
+    pub listen_channel: Option<String>,
+
+    /// Query anyway after waiting this long for a notification
+    pub listen_timeout_ms: u64,
+
+    /// Maximum age of fetched events (postgres interval)
+    pub max_age: String,
+
+    /// Events fetched per query
+    pub batch_size: i64,
+
+    /// Events buffered per client, slow clients lose the oldest ones
+    pub buffer_size: usize,
+
+    /// Fetch skipped ids this long, in case their events were not committed yet
+    pub gap_timeout_ms: u64,
+}
+
+impl Default for TailSettings {
+    fn default() -> Self {
+        Self {
+            poll_interval_ms: 500,
+            listen_channel: None,
+            listen_timeout_ms: 10000,
+            max_age: "1 minute".into(),
+            batch_size: 1000,
+            buffer_size: 1000,
+            gap_timeout_ms: 30000,
+        }
+    }
+}
+
 #[derive(Serialize, Deserialize, Debug)]
 #[serde(deny_unknown_fields, default)]
 pub struct Config {
@@ -41,6 +169,16 @@ pub struct Config {
     pub postgres_tls: TlsSettings,
     pub http_settings: HttpSettings,
     pub root_table_name: String,
+    pub columns: Vec<Column>,
+    pub partition_keys: Vec<String>,
+    pub rollups: Option<RollupSettings>,
+    pub query_cache_size: usize,
+    pub counts_cache: Option<CountsCacheSettings>,
+    pub partition_walk: Option<PartitionWalkSettings>,
+    pub tail: TailSettings,
+    pub statement_cache_size: usize,
+    pub pool: PoolSettings,
+    pub requests: RequestSettings,
 }
 
 impl Default for Config {
@@ -53,6 +191,16 @@ impl Default for Config {
             postgres_tls: TlsSettings::default(),
             http_settings: HttpSettings::default(),
             root_table_name: "logs".into(),
+            columns: Vec::new(),
+            partition_keys: Vec::new(),
+            rollups: None,
+            query_cache_size: 1000,
+            counts_cache: None,
+            partition_walk: None,
+            tail: TailSettings::default(),
+            statement_cache_size: 100,
+            pool: PoolSettings::default(),
+            requests: RequestSettings::default(),
         }
     }
 }
@@ -62,7 +210,9 @@ impl Config {
     pub fn load(opts: &crate::cli::Options) -> Result<Config, Box<dyn ::std::error::Error>> {
         if let Some(path) = &opts.config_path {
             let reader = File::open(path)?;
-            Ok(serde_yaml::from_reader(reader)?)
+            let config: Config = serde_yaml::from_reader(reader)?;
+            logstuff::columns::check(&config.columns)?;
+            Ok(config)
         } else {
             Ok(Config::default())
         }
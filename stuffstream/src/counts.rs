@@ -1,39 +1,67 @@
-use bb8_postgres::tokio_postgres::types::ToSql;
-use futures::lock::Mutex;
 use futures::stream;
-use futures::stream::StreamExt as _;
-use futures::stream::TryStreamExt as _;
+use futures::stream::{BoxStream, StreamExt as _};
 use serde_derive::{Deserialize, Serialize};
-use serde_json::Value;
+use serde_json::{json, Value};
 use std::sync::Arc;
 use time::OffsetDateTime;
-use warp::http;
 
+use logstuff::rollup::GRANULARITIES;
 use logstuff::serde::de::rfc3339;
-use logstuff_query::{ExpressionParser, IdentifierParser};
+use logstuff_query::IdentifierParser;
 
+use crate::admission::Admission;
+use crate::app::streamed;
 use crate::app::DBPool;
 use crate::app::Error;
 use crate::app::MalformedQuery;
+use crate::compression::Encoding;
+use crate::counts_cache::{CountsCache, SeriesKey};
+use crate::db::{self, Param};
+use crate::deadline::Deadlines;
 use crate::interval::CountsInterval;
+use crate::query_cache::QueryCompiler;
+use crate::rollups::Rollups;
 
 // const DEFAULT_SPLIT_BUCKETS: u16 = 5;
 
 pub(crate) async fn handler(
-    expr_parser: Arc<Mutex<ExpressionParser>>,
-    id_parser: Arc<Mutex<IdentifierParser>>,
+    compiler: Arc<QueryCompiler>,
+    id_parser: Arc<IdentifierParser>,
+    rollups: Option<Arc<Rollups>>,
+    counts_cache: Option<Arc<CountsCache>>,
+    admission: Arc<Admission>,
+    deadlines: Arc<Deadlines>,
     table_name: String,
     params: Request,
     db: DBPool,
+    encoding: Encoding,
 ) -> Result<impl warp::Reply, warp::Rejection> {
-    let response = Response::new(expr_parser, id_parser, &table_name, db.clone());
-    Ok(http::Response::builder()
-        .status(http::StatusCode::OK)
-        .header("Content-Type", "application/json")
-        .body(warp::hyper::Body::wrap_stream(
-            response.streams(params).await,
-        ))
-        .unwrap())
+    let mut deadline = deadlines.start(params.request_key.as_deref());
+    let response = Response::new(
+        compiler,
+        id_parser,
+        rollups,
+        counts_cache,
+        &table_name,
+        db.clone(),
+    );
+    let (permit, body) = deadline
+        .run(async {
+            let permit = admission.admit(1).await.map_err(warp::reject::custom)?;
+            let body = response
+                .streams(params)
+                .await
+                .map_err(warp::reject::custom)?;
+            Ok::<_, warp::Rejection>((permit, body))
+        })
+        .await
+        .map_err(warp::reject::custom)??;
+
+    let body = body.map(move |chunk| {
+        let _ = &permit;
+        chunk
+    });
+    Ok(streamed("application/json", encoding, deadline.bound(body)))
 }
 
 #[derive(Serialize, Deserialize, Debug, Clone)]
@@ -48,27 +76,99 @@ pub struct Request {
     value: Option<String>,
     aggregate: Option<String>,
     missing_value_is_zero: Option<bool>,
+    #[serde(default)]
+    format: Format,
+    /// A newer request with the same key stops this one, e.g. one key per dashboard panel
+    request_key: Option<String>,
+}
+
+#[derive(Serialize, Deserialize, Debug, Clone, Copy, PartialEq)]
+#[serde(rename_all = "lowercase")]
+pub enum Format {
+    /// Values by bucket (RFC 3339 timestamp) and series: `{"<bucket>": {"<series>": value}}`
+    Json,
+    /// One array of bucket starts (unix timestamps) and one array of values per series, in the
+    /// same order: `{"timestamps": [...], "series": {"<series>": [...]}}`
+    Columns,
 }
 
-type Param = (dyn ToSql + Sync);
+impl Default for Format {
+    fn default() -> Self {
+        Format::Json
+    }
+}
 
 pub struct Response {
-    expr_parser: Arc<Mutex<ExpressionParser>>,
-    id_parser: Arc<Mutex<IdentifierParser>>,
+    compiler: Arc<QueryCompiler>,
+    id_parser: Arc<IdentifierParser>,
+    rollups: Option<Arc<Rollups>>,
+    counts_cache: Option<Arc<CountsCache>>,
     table: String,
     db: DBPool,
 }
 
+/// Points `(tstamp, id, value)` of a histogram, see `split_counts_query`
+///
+/// There is one point every interval from parameter `series.0` to `series.1`, each counts the
+/// events of the interval before it, from parameter `events.0` to `events.1` only.
+fn points_query(
+    table: &str,
+    getter: &str,
+    split_subquery: &str,
+    expr: &str,
+    series: (usize, usize),
+    events: (usize, usize),
+    interval: &CountsInterval,
+    outer_value_getter: &str,
+    inner_value_getter: &str,
+) -> String {
+    format!(
+        r#"
+            select date_trunc('{}', gen_time) as tstamp, series.id as id, {}
+            from (select gen_time, id from 
+                    generate_series(${}, ${}, '{}'::interval) gen_time,
+                    ({}) split
+                ) series
+            left join (select date_trunc('{}', tstamp) as log_time, {}, {}
+                    from {}
+                    where {}
+                    and tstamp between ${} and ${}
+                    group by log_time, 2
+                ) l
+            on log_time between gen_time - '{}'::interval and gen_time
+            and series.id = l.id
+            group by tstamp, series.id
+            order by tstamp, series.id
+        "#,
+        &interval.truncate,
+        outer_value_getter,
+        series.0,
+        series.1,
+        &interval.interval,
+        split_subquery,
+        &interval.truncate,
+        getter,
+        inner_value_getter,
+        table,
+        expr,
+        events.0,
+        events.1,
+        &interval.interval
+    )
+}
+
 fn split_counts_query(
     table: &str,
     split_by: &Option<String>,
     expr: &str,
     start_id: usize,
     end_id: usize,
+    first_point_id: usize,
     interval: &CountsInterval,
     max_buckets_id: usize,
     outer_value_getter: &str,
     inner_value_getter: &str,
+    format: Format,
 ) -> String {
     let (getter, split_subquery) = if let Some(split_by) = split_by {
         let getter = format!("coalesce({}, '(null)') as id", split_by);
@@ -90,56 +190,113 @@ fn split_counts_query(
         let query = format!("select {} limit ${}", getter, max_buckets_id);
         (getter, query)
     };
-    format!(
-        r#"
-            select jsonb_object_agg(tstamp, points) as doc from (
-                select tstamp, jsonb_object_agg(id, value) as points from (
-                    select date_trunc('{}', gen_time) as tstamp, series.id as id, {}
-                    from (select gen_time, id from 
-                            generate_series(${}, ${}, '{}'::interval) gen_time,
-                            ({}) split
-                        ) series
-                    left join (select date_trunc('{}', tstamp) as log_time, {}, {}
-                            from {}
-                            where {}
-                            and tstamp between ${} and ${}
-                            group by log_time, 2
-                        ) l
-                    on log_time between gen_time - '{}'::interval and gen_time
-                    and series.id = l.id
-                    group by tstamp, series.id
-                    order by tstamp, series.id
-                ) p
-                group by tstamp
-            ) c
-        "#,
-        &interval.truncate,
+    let points = points_query(
+        table,
+        &getter,
+        &split_subquery,
+        expr,
+        (first_point_id, end_id),
+        (start_id, end_id),
+        interval,
         outer_value_getter,
-        start_id,
-        end_id,
-        &interval.interval,
-        split_subquery,
-        &interval.truncate,
-        getter,
         inner_value_getter,
+    );
+    match format {
+        Format::Json => format!(
+            r#"
+                select jsonb_object_agg(tstamp, points) as doc from (
+                    select tstamp, jsonb_object_agg(id, value) as points from ({}) p
+                    group by tstamp
+                ) c
+            "#,
+            points
+        ),
+        // every series has a value for every bucket, in the order of the timestamps
+        Format::Columns => format!(
+            r#"
+                with p as ({})
+                select jsonb_build_object(
+                    'timestamps', coalesce((
+                        select jsonb_agg(bucket order by bucket) from (
+                            select distinct extract(epoch from tstamp)::bigint as bucket from p
+                        ) b
+                    ), '[]'),
+                    'series', coalesce((
+                        select jsonb_object_agg(id, vals) from (
+                            select id, jsonb_agg(value order by tstamp) as vals from p group by id
+                        ) s
+                    ), '{{}}')
+                ) as doc
+            "#,
+            points
+        ),
+    }
+}
+
+/// Rollup rows of `field` (empty for total counts) as source for `split_counts_query`
+///
+/// Parameters: $1 field, $2 start, $3 end (and $4 maximum buckets, $5 first point of
+/// `split_counts_query`). Buckets are kept whole, the one containing `start` is moved to `start`
+/// to stay within the histogram's range.
+fn rollup_source(table: &str, granularity: &str) -> String {
+    format!(
+        r#"(
+            select greatest(bucket, $2) as tstamp, value as split_value, count
+            from {}
+            where field = $1
+            and bucket between date_trunc('{}', $2::timestamptz) and $3
+        ) rollup"#,
+        table, granularity
+    )
+}
+
+/// Points of a histogram without split as `[[<tstamp as text>, <tstamp as unix timestamp>,
+/// value], ...]`, the keys of `split_counts_query`'s formats
+///
+/// Parameters from `first_id` on: the first and last point, the first and last event.
+fn cached_points_query(
+    table: &str,
+    expr: &str,
+    first_id: usize,
+    interval: &CountsInterval,
+    outer_value_getter: &str,
+    inner_value_getter: &str,
+) -> String {
+    let points = points_query(
         table,
+        "'value' as id",
+        "select 'value' as id",
         expr,
-        start_id,
-        end_id,
-        &interval.interval
+        (first_id, first_id + 1),
+        (first_id + 2, first_id + 3),
+        interval,
+        outer_value_getter,
+        inner_value_getter,
+    );
+    format!(
+        r#"
+            select coalesce(jsonb_agg(jsonb_build_array(
+                tstamp::text, extract(epoch from tstamp)::bigint, value
+            ) order by tstamp), '[]') as doc from ({}) p
+        "#,
+        points
     )
 }
 
 impl Response {
     pub fn new(
-        expr_parser: Arc<Mutex<ExpressionParser>>,
-        id_parser: Arc<Mutex<IdentifierParser>>,
+        compiler: Arc<QueryCompiler>,
+        id_parser: Arc<IdentifierParser>,
+        rollups: Option<Arc<Rollups>>,
+        counts_cache: Option<Arc<CountsCache>>,
         table: &str,
         db: DBPool,
     ) -> Self {
         Self {
-            expr_parser,
+            compiler,
             id_parser,
+            rollups,
+            counts_cache,
             table: table.to_owned(),
             db,
         }
@@ -150,13 +307,13 @@ impl Response {
         query: &Option<String>,
         param_offset: usize,
     ) -> Result<(String, Vec<Value>), MalformedQuery> {
-        let p = self.expr_parser.lock().await;
         let (query, query_params) = if let Some(query) = query {
-            p.to_sql(query, param_offset).map_err(|_| MalformedQuery)?
+            self.compiler
+                .to_sql(query, param_offset)
+                .map_err(|_| MalformedQuery)?
         } else {
             ("1 = 1".into(), Vec::new())
         };
-        drop(p);
         Ok((query, query_params))
     }
 
@@ -165,9 +322,10 @@ impl Response {
         id: &str,
         param_offset: usize,
     ) -> Result<(String, Vec<Value>), MalformedQuery> {
-        let p = self.id_parser.lock().await;
-        let (expr, params) = p.sql_string(id, param_offset).map_err(|_| MalformedQuery)?;
-        drop(p);
+        let (expr, params) = self
+            .id_parser
+            .sql_string(id, param_offset)
+            .map_err(|_| MalformedQuery)?;
         Ok((expr, params))
     }
 
@@ -177,10 +335,10 @@ impl Response {
         param_offset: usize,
     ) -> Result<(String, String, Vec<Value>), MalformedQuery> {
         if let Some(value) = params.value {
-            if params.aggregate.is_none() {
-                return Err(MalformedQuery {}); // TODO query is not malformed, parameters don't make sense
-            }
-            let agg = params.aggregate.unwrap();
+            let agg = match params.aggregate {
+                Some(agg) => agg,
+                None => return Err(MalformedQuery {}), // TODO query is not malformed, parameters don't make sense
+            };
 
             let (expr, query_params) = self.parse_identifier(&value, param_offset).await?;
 
@@ -201,18 +359,225 @@ impl Response {
         }
     }
 
-    pub async fn streams(
-        self,
+    /// Rollup table and granularity answering `params`, if any
+    ///
+    /// Rollups only hold counts by time and split field, so there must be no query expression
+    /// and no value to aggregate. They must also cover the whole range, from the bucket
+    /// containing its start on. Histogram buckets of at least an hour use the hour table, which
+    /// assumes the database session's time zone is offset from UTC by whole hours.
+    async fn rollup_table(
+        &self,
+        params: &Request,
+        interval: &CountsInterval,
+    ) -> Option<(String, &'static str)> {
+        let rollups = self.rollups.as_ref()?;
+        let settings = &rollups.settings;
+        let no_query = params
+            .query
+            .as_deref()
+            .map_or(true, |query| query.trim().is_empty());
+        let split_ok = params.split_by.as_deref().map_or(true, |split_by| {
+            settings
+                .split_fields
+                .iter()
+                .any(|field| field == split_by.trim())
+        });
+        if !no_query || !split_ok || params.value.is_some() {
+            return None;
+        }
+        let (seconds, granularity) = GRANULARITIES
+            .iter()
+            .rev()
+            .find(|(seconds, _)| interval.seconds as i64 >= *seconds)?;
+        if !rollups.cover(&self.db, params.start, *seconds).await {
+            return None;
+        }
+        Some((settings.table_name(granularity), *granularity))
+    }
+
+    /// Counts from the rollup `table` of `granularity`
+    async fn rollup_counts(
+        &self,
+        params: &Request,
+        table: &str,
+        granularity: &str,
+        interval: &CountsInterval,
+    ) -> BoxStream<'static, Result<String, Error>> {
+        let split = params
+            .split_by
+            .as_deref()
+            .map(|split_by| split_by.trim().to_owned());
+        let query = split_counts_query(
+            &rollup_source(table, granularity),
+            &split.as_ref().map(|_| "split_value".to_string()),
+            "1 = 1",
+            2,
+            3,
+            5,
+            interval,
+            4,
+            "sum(coalesce(subvalue, 0)) as value",
+            "sum(count) as subvalue",
+            params.format,
+        );
+        let field = split.unwrap_or_default();
+        db::query_docs(
+            &self.db,
+            &query,
+            &[
+                &field as &Param,
+                &params.start,
+                &params.end,
+                &params.max_buckets,
+                &interval.first_point(params.start),
+            ],
+            true,
+            "counts",
+        )
+        .await
+    }
+
+    /// Points from `series.0` to `series.1` counting the events from `events.0` to `events.1`,
+    /// see `cached_points_query`
+    ///
+    /// `expr` and the value getters are compiled with `query_params` as their parameters.
+    async fn cached_points(
+        &self,
+        key: &SeriesKey,
+        getters: (&str, &str),
+        query_params: &[Value],
+        series: (i128, i128),
+        events: (i128, i128),
+        interval: &CountsInterval,
+    ) -> Result<Vec<Value>, Error> {
+        let param_offset = query_params.len() + 1;
+        let query = cached_points_query(
+            &self.table,
+            &key.sql,
+            param_offset,
+            interval,
+            getters.0,
+            getters.1,
+        );
+        let time = |nanos| OffsetDateTime::from_unix_timestamp_nanos(nanos).expect("within range");
+        let times = [series.0, series.1, events.0, events.1].map(time);
+        let docs = db::query_docs(
+            &self.db,
+            &query,
+            &query_params
+                .iter()
+                .map(|e| e as &Param)
+                .chain(times.iter().map(|time| time as &Param))
+                .collect::<Vec<&Param>>(),
+            true,
+            "cached counts",
+        )
+        .await;
+        // read to the end, dropping the rows before would cancel the query
+        let docs: Vec<_> = docs.collect().await;
+        match docs.into_iter().next() {
+            Some(Ok(doc)) => Ok(serde_json::from_str(&doc).unwrap_or_default()),
+            Some(Err(err)) => Err(err),
+            None => Ok(Vec::new()),
+        }
+    }
+
+    /// Counts like `raw_counts`, closed buckets from `cache`
+    async fn cached_counts(
+        &self,
+        cache: &CountsCache,
+        params: Request,
+        interval: &CountsInterval,
+    ) -> Result<BoxStream<'static, Result<String, Error>>, MalformedQuery> {
+        let (expr, mut query_params) = self.parse_query(&params.query, 1).await?;
+        let (outer_value_getter, inner_value_getter, value_params) = self
+            .value_getters(params.clone(), query_params.len() + 1)
+            .await?;
+        query_params.extend(value_params);
+        let getters = (outer_value_getter.as_str(), inner_value_getter.as_str());
+
+        let start = params.start.unix_timestamp_nanos();
+        let end = params.end.unix_timestamp_nanos();
+        let key = SeriesKey::new(
+            format!("{}\n{}\n{}", expr, outer_value_getter, inner_value_getter),
+            Value::from(query_params.clone()).to_string(),
+            interval.seconds as i64,
+        );
+        let first_point = interval.first_point(params.start).unix_timestamp_nanos();
+        let first = key.index(first_point);
+        let last = key.index(end);
+
+        // the first bucket only counts events from `start` on, it is never shared
+        let cached = cache.cached(&key, first + 1, last);
+        let from = first + 1 + cached.len() as i64;
+        let now = OffsetDateTime::now_utc().unix_timestamp_nanos();
+        let points = |series, events| {
+            self.cached_points(&key, getters, &query_params, series, events, interval)
+        };
+        let fresh: Result<Vec<Value>, Error> = async {
+            if cached.is_empty() {
+                return points((first_point, end), (start, end)).await;
+            }
+            let mut fresh = points((first_point, first_point), (start, first_point)).await?;
+            if from <= last {
+                // the interval before the first fresh bucket is counted by it
+                fresh.extend(points((key.start(from), end), (key.start(from - 1), end)).await?);
+            }
+            Ok(fresh)
+        }
+        .await;
+        let fresh = match fresh {
+            Ok(fresh) => fresh,
+            Err(err) => return Ok(stream::once(async move { Err(err) }).boxed()),
+        };
+
+        let mut buckets = Vec::with_capacity(fresh.len() + cached.len());
+        let mut fresh = fresh.into_iter();
+        buckets.extend(fresh.next().map(|point| (first, point)));
+        buckets.extend(cached);
+        let queried: Vec<_> = (from..).zip(fresh).collect();
+        cache.store(key, &queried, end, now);
+        buckets.extend(queried);
+
+        let points = buckets.into_iter().filter_map(|(_, point)| match point {
+            Value::Array(point) if point.len() == 3 => Some(point),
+            _ => None,
+        });
+        let counts = match params.format {
+            Format::Json => Value::Object(
+                points
+                    .filter_map(|mut point| {
+                        let value = point.pop()?;
+                        match point.swap_remove(0) {
+                            Value::String(tstamp) => Some((tstamp, json!({ "value": value }))),
+                            _ => None,
+                        }
+                    })
+                    .collect(),
+            ),
+            Format::Columns => {
+                let (timestamps, values): (Vec<_>, Vec<_>) = points
+                    .map(|mut point| (point[1].take(), point[2].take()))
+                    .unzip();
+                json!({ "timestamps": timestamps, "series": { "value": values } })
+            }
+        };
+        Ok(stream::once(async move { Ok(counts.to_string()) }).boxed())
+    }
+
+    /// Counts from the log tables
+    async fn raw_counts(
+        &self,
         params: Request,
-    ) -> impl futures::Stream<Item = Result<impl Into<warp::hyper::body::Bytes>, Error>> {
+        interval: &CountsInterval,
+    ) -> Result<BoxStream<'static, Result<String, Error>>, MalformedQuery> {
         let params_clone = params.clone();
 
-        let (expr, mut query_params) = self.parse_query(&params.query, 1).await.unwrap();
+        let (expr, mut query_params) = self.parse_query(&params.query, 1).await?;
         let getter = if let Some(split_by) = params.split_by {
             let (getter, getter_params) = self
                 .parse_identifier(&split_by, query_params.len() + 1)
-                .await
-                .unwrap();
+                .await?;
             query_params.extend(getter_params);
             Some(getter)
         } else {
@@ -221,13 +586,10 @@ impl Response {
 
         let (outer_value_getter, inner_value_getter, value_params) = self
             .value_getters(params_clone, query_params.len() + 1)
-            .await
-            .unwrap();
+            .await?;
         query_params.extend(value_params);
         let param_offset = query_params.len() + 1;
-
-        let db = self.db.get().await.unwrap();
-        let interval = CountsInterval::from(params.end - params.start);
+        let first_point = interval.first_point(params.start);
 
         let query = split_counts_query(
             &self.table,
@@ -235,39 +597,62 @@ impl Response {
             &expr,
             param_offset,
             param_offset + 1,
-            &interval,
+            param_offset + 3,
+            interval,
             param_offset + 2,
             &outer_value_getter,
             &inner_value_getter,
+            params.format,
         );
-        let counts = db
-            .query_raw(
-                query.as_str(),
-                query_params
-                    .iter()
-                    .map(|e| e as &Param)
-                    .chain(std::iter::once::<&Param>(&params.start.to_owned()))
-                    .chain(std::iter::once::<&Param>(&params.end.to_owned()))
-                    .chain(std::iter::once::<&Param>(&params.max_buckets.to_owned()))
-                    .collect::<Vec<&Param>>(),
-            )
-            .await;
-
-        stream::once(async move {
+        Ok(db::query_docs(
+            &self.db,
+            &query,
+            &query_params
+                .iter()
+                .map(|e| e as &Param)
+                .chain(std::iter::once::<&Param>(&params.start))
+                .chain(std::iter::once::<&Param>(&params.end))
+                .chain(std::iter::once::<&Param>(&params.max_buckets))
+                .chain(std::iter::once::<&Param>(&first_point))
+                .collect::<Vec<&Param>>(),
+            true,
+            "counts",
+        )
+        .await)
+    }
+
+    pub async fn streams(
+        self,
+        params: Request,
+    ) -> Result<impl futures::Stream<Item = Result<String, Error>>, MalformedQuery> {
+        let interval = CountsInterval::from(params.end - params.start);
+        let counts = match self.rollup_table(&params, &interval).await {
+            Some((table, granularity)) => {
+                self.rollup_counts(&params, &table, granularity, &interval)
+                    .await
+            }
+            None => match &self.counts_cache {
+                // buckets of days and longer vary in length with daylight saving time, the
+                // single series of unsplit histograms is only limited by max_buckets below 1
+                Some(cache)
+                    if params.split_by.is_none()
+                        && params.max_buckets.map_or(true, |max| max >= 1)
+                        && interval.seconds < 24 * 3600
+                        && params.start <= params.end =>
+                {
+                    self.cached_counts(cache, params, &interval).await?
+                }
+                _ => self.raw_counts(params, &interval).await?,
+            },
+        };
+
+        Ok(stream::once(async move {
             Ok(format!(
                 r#"{{"metadata":{{"counts_interval_sec": {}}},"counts":"#,
                 interval.seconds
             ))
         })
-        .chain(
-            counts
-                .unwrap()
-                .map_ok(|row| {
-                    let value: Option<Value> = row.get("doc");
-                    value.unwrap_or(Value::Null).to_string()
-                })
-                .map_err(Error::from),
-        )
-        .chain(stream::once(async { Ok(r#"}"#.to_string()) }))
+        .chain(counts)
+        .chain(stream::once(async { Ok(r#"}"#.to_string()) })))
     }
 }
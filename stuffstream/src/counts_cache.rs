@@ -0,0 +1,194 @@
+//! Closed histogram buckets of /counts, shared by all requests
+//!
+//! Dashboards refresh the same histograms over sliding windows, where all but the newest buckets
+//! have been answered before. A histogram's buckets lie on multiples of the bucket length since
+//! the epoch (see `CountsInterval::first_point`), all requests with the same query and bucket
+//! length share them, whatever their starts. Buckets never change once closed: their events end
+//! before the requested range does and longer ago than events may arrive late. A refresh only
+//! queries the buckets from the first one not cached on, and the first one, which only counts
+//! events from the requested start on.
+use lru_cache::LruCache;
+use serde_derive::Serialize;
+use serde_json::Value;
+use std::collections::BTreeMap;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Mutex;
+
+use crate::config::CountsCacheSettings;
+
+/// Buckets kept per histogram, older ones are dropped first
+const MAX_BUCKETS: usize = 1000;
+
+/// Histograms differing in any of these have their own buckets
+#[derive(Clone, Debug, Hash, PartialEq, Eq)]
+pub struct SeriesKey {
+    /// Compiled query expression and value getters
+    pub sql: String,
+    /// Their parameters as JSON
+    pub params: String,
+    /// Bucket length
+    pub seconds: i64,
+}
+
+/// Buckets by their index (see `SeriesKey::index`), values as queried from the database
+type Series = BTreeMap<i64, Value>;
+
+pub struct CountsCache {
+    series: Mutex<LruCache<SeriesKey, Series>>,
+    late_events_sec: i64,
+    cached: AtomicU64,
+    queried: AtomicU64,
+}
+
+#[derive(Debug, Serialize)]
+pub struct CountsCacheStats {
+    /// Buckets answered from the cache
+    pub cached_buckets: u64,
+    /// Buckets queried from the database
+    pub queried_buckets: u64,
+    pub histograms: usize,
+}
+
+const NANOS: i128 = 1_000_000_000;
+
+impl SeriesKey {
+    /// Key of the histogram with buckets of `seconds`
+    pub fn new(sql: String, params: String, seconds: i64) -> Self {
+        Self {
+            sql,
+            params,
+            seconds,
+        }
+    }
+
+    fn length(&self) -> i128 {
+        i128::from(self.seconds) * NANOS
+    }
+
+    /// Index of the last bucket starting at or before `time` (unix nanoseconds)
+    pub fn index(&self, time: i128) -> i64 {
+        time.div_euclid(self.length()) as i64
+    }
+
+    /// Start of bucket `index` (unix nanoseconds)
+    pub fn start(&self, index: i64) -> i128 {
+        i128::from(index) * self.length()
+    }
+}
+
+impl CountsCache {
+    pub fn new(settings: &CountsCacheSettings) -> Self {
+        Self {
+            series: Mutex::new(LruCache::new(settings.histograms.max(1))),
+            late_events_sec: settings.late_events_sec as i64,
+            cached: AtomicU64::new(0),
+            queried: AtomicU64::new(0),
+        }
+    }
+
+    /// Cached buckets from `first` on, up to the first one missing or `last`
+    pub fn cached(&self, key: &SeriesKey, first: i64, last: i64) -> Vec<(i64, Value)> {
+        let mut buckets = Vec::new();
+        if let Some(series) = self.series.lock().unwrap().get_mut(key) {
+            let mut bucket = first;
+            while bucket <= last {
+                match series.get(&bucket) {
+                    Some(value) => buckets.push((bucket, value.clone())),
+                    None => break,
+                }
+                bucket += 1;
+            }
+        }
+        self.cached
+            .fetch_add(buckets.len() as u64, Ordering::Relaxed);
+        buckets
+    }
+
+    /// Remember the closed ones of `buckets`, queried for a range ending at `end` at time `now`
+    /// (unix nanoseconds)
+    ///
+    /// A bucket's events end before the next bucket starts.
+    pub fn store(&self, key: SeriesKey, buckets: &[(i64, Value)], end: i128, now: i128) {
+        self.queried
+            .fetch_add(buckets.len() as u64, Ordering::Relaxed);
+        let closed_before = end.min(now - i128::from(self.late_events_sec) * NANOS);
+        let mut closed = buckets
+            .iter()
+            .filter(|(bucket, _)| key.start(bucket + 1) <= closed_before)
+            .peekable();
+        if closed.peek().is_none() {
+            return;
+        }
+
+        let mut cache = self.series.lock().unwrap();
+        if !cache.contains_key(&key) {
+            cache.insert(key.clone(), Series::new());
+        }
+        let series = cache.get_mut(&key).unwrap();
+        series.extend(closed.cloned());
+        while series.len() > MAX_BUCKETS {
+            let oldest = *series.keys().next().unwrap();
+            series.remove(&oldest);
+        }
+    }
+
+    pub fn stats(&self) -> CountsCacheStats {
+        CountsCacheStats {
+            cached_buckets: self.cached.load(Ordering::Relaxed),
+            queried_buckets: self.queried.load(Ordering::Relaxed),
+            histograms: self.series.lock().unwrap().len(),
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use serde_json::json;
+
+    #[test]
+    fn closed_buckets_only() {
+        let cache = CountsCache::new(&CountsCacheSettings {
+            late_events_sec: 60,
+            ..CountsCacheSettings::default()
+        });
+        let key = SeriesKey::new("1 = 1".into(), "[]".into(), 60);
+        assert_eq!(key.index(660 * NANOS), 11);
+        assert_eq!(key.index(660 * NANOS - 1), 10);
+        assert_eq!(key.start(11), 660 * NANOS);
+
+        let buckets: Vec<_> = (10..15).map(|i| (i, json!(i))).collect();
+        assert!(cache.cached(&key, 10, 14).is_empty());
+        // the last bucket is still open, the range ends within it and late events may arrive
+        cache.store(key.clone(), &buckets, 890 * NANOS, 960 * NANOS);
+        assert_eq!(cache.cached(&key, 10, 14), buckets[..4].to_vec());
+        assert_eq!(cache.cached(&key, 11, 14), buckets[1..4].to_vec());
+
+        let stats = cache.stats();
+        assert_eq!((stats.cached_buckets, stats.queried_buckets), (7, 5));
+    }
+
+    #[test]
+    fn sliding_window() {
+        let cache = CountsCache::new(&CountsCacheSettings {
+            late_events_sec: 60,
+            ..CountsCacheSettings::default()
+        });
+        let key = SeriesKey::new("1 = 1".into(), "[]".into(), 60);
+        // "last hour" by minutes from 10:10.5, refreshed 4.5 seconds later: the first points of
+        // both are at 11:00, the next minute
+        let end = 4210 * NANOS + NANOS / 2;
+        let first = key.index(660 * NANOS);
+        let buckets: Vec<_> = (first + 1..=key.index(end))
+            .map(|i| (i, json!(i)))
+            .collect();
+        cache.store(key.clone(), &buckets, end, end + 120 * NANOS);
+
+        // the refresh only misses the bucket still open at the first one's end
+        let refreshed = SeriesKey::new("1 = 1".into(), "[]".into(), 60);
+        let last = refreshed.index(end + 4 * NANOS + NANOS / 2);
+        let cached = cache.cached(&refreshed, first + 1, last);
+        assert_eq!(cached, buckets[..buckets.len() - 1].to_vec());
+        assert_eq!(first + 1 + cached.len() as i64, last);
+    }
+}
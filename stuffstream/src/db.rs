@@ -0,0 +1,260 @@
+//! Pooled database connections with their own prepared statement cache
+//!
+//! Generated queries only differ in their bind parameters for requests with the same query
+//! structure. Preparing them once per connection saves postgres from parsing and planning the
+//! large aggregate queries again for every request.
+//!
+//! Streamed rows keep their connection until the last one arrived, queries whose rows are dropped
+//! before are cancelled (see `QueryRows`).
+use async_trait::async_trait;
+use bb8_postgres::bb8::{self, ManageConnection};
+use bb8_postgres::tokio_postgres::types::{BorrowToSql, ToSql};
+use bb8_postgres::tokio_postgres::{self, Client, Row, RowStream, Statement};
+use bb8_postgres::PostgresConnectionManager;
+use futures::stream::{self, BoxStream, Stream, StreamExt, TryStreamExt};
+use futures::{ready, task};
+use lru_cache::LruCache;
+use serde_json::Value;
+use std::ops::Deref;
+use std::pin::Pin;
+use tokio_postgres_rustls::MakeRustlsConnect;
+
+use logstuff::metrics::Timer;
+
+use crate::app::{DBPool, Error};
+use crate::metrics::{self, METRICS};
+
+pub type Param = dyn ToSql + Sync;
+pub type PoolError = bb8::RunError<tokio_postgres::Error>;
+
+pub struct Connection {
+    client: Client,
+    statements: LruCache<String, Statement>,
+    /// For cancel requests
+    connector: MakeRustlsConnect,
+}
+
+impl Connection {
+    /// Prepared statement for `sql`, prepared on first use
+    ///
+    /// Without a cache (size 0) every call prepares `sql` again.
+    pub async fn prepare_cached(&mut self, sql: &str) -> Result<Statement, tokio_postgres::Error> {
+        if self.statements.capacity() == 0 {
+            return self.client.prepare(sql).await;
+        }
+        if let Some(statement) = self.statements.get_mut(sql) {
+            return Ok(statement.clone());
+        }
+        let statement = self.client.prepare(sql).await?;
+        debug!("prepared query {}: {}", metrics::shape(sql), sql);
+        self.statements.insert(sql.to_owned(), statement.clone());
+        Ok(statement)
+    }
+
+    /// Like `Client::query_raw`, using a cached prepared statement
+    pub async fn query_cached<P, I>(
+        &mut self,
+        sql: &str,
+        params: I,
+    ) -> Result<RowStream, tokio_postgres::Error>
+    where
+        P: BorrowToSql,
+        I: IntoIterator<Item = P>,
+        I::IntoIter: ExactSizeIterator,
+    {
+        let _timer = Timer::new(
+            METRICS.queries.with(&[metrics::shape(sql).as_str()]),
+            "query",
+        );
+        let statement = self.prepare_cached(sql).await?;
+        self.client.query_raw(&statement, params).await
+    }
+}
+
+impl Deref for Connection {
+    type Target = Client;
+
+    fn deref(&self) -> &Client {
+        &self.client
+    }
+}
+
+/// Rows of a query, keeping the connection it runs on until the last one
+///
+/// Dropped before (the client went away, the request ran out of time or was superseded), the
+/// query is cancelled. The connection goes back to the pool once postgres is done with it: the
+/// remaining rows are drained first, so the cancel request can't hit the next query on it.
+pub struct QueryRows {
+    running: Option<(
+        bb8::PooledConnection<'static, ConnectionManager>,
+        Pin<Box<RowStream>>,
+    )>,
+}
+
+impl QueryRows {
+    pub fn new(conn: bb8::PooledConnection<'static, ConnectionManager>, rows: RowStream) -> Self {
+        Self {
+            running: Some((conn, Box::pin(rows))),
+        }
+    }
+}
+
+impl Stream for QueryRows {
+    type Item = Result<Row, tokio_postgres::Error>;
+
+    fn poll_next(
+        mut self: Pin<&mut Self>,
+        cx: &mut task::Context<'_>,
+    ) -> task::Poll<Option<Self::Item>> {
+        let item = match &mut self.running {
+            Some((_, rows)) => ready!(rows.as_mut().poll_next(cx)),
+            None => return task::Poll::Ready(None),
+        };
+        if !matches!(item, Some(Ok(_))) {
+            // the query is over, errors end it, too
+            self.running = None;
+        }
+        task::Poll::Ready(item)
+    }
+}
+
+impl Drop for QueryRows {
+    fn drop(&mut self) {
+        let (conn, rows) = match self.running.take() {
+            Some(running) => running,
+            None => return,
+        };
+        // dropped outside of the runtime while shutting down
+        let runtime = match tokio::runtime::Handle::try_current() {
+            Ok(runtime) => runtime,
+            Err(_) => return,
+        };
+        METRICS.cancelled_queries.inc();
+        let token = conn.client.cancel_token();
+        let connector = conn.connector.clone();
+        runtime.spawn(async move {
+            if let Err(err) = token.cancel_query(connector).await {
+                warn!("Could not cancel query: {}", err);
+            }
+            rows.for_each(|_| async {}).await;
+            drop(conn);
+        });
+    }
+}
+
+/// Pooled connection, waiting for it counts as pool wait
+pub async fn get(db: &DBPool) -> Result<bb8::PooledConnection<'_, ConnectionManager>, PoolError> {
+    let _timer = METRICS.pool_wait.start("pool wait");
+    db.get().await
+}
+
+/// Like `get`, for connections outliving the borrow of the pool (e.g. streamed rows)
+pub async fn get_owned(
+    db: &DBPool,
+) -> Result<bb8::PooledConnection<'static, ConnectionManager>, PoolError> {
+    let _timer = METRICS.pool_wait.start("pool wait");
+    db.get_owned().await
+}
+
+pub struct ConnectionManager {
+    inner: PostgresConnectionManager<MakeRustlsConnect>,
+    connector: MakeRustlsConnect,
+    statement_cache_size: usize,
+    statement_timeout_ms: u64,
+}
+
+impl ConnectionManager {
+    /// Connections set up with `statement_timeout_ms` as their statement_timeout, unless it is 0,
+    /// caching up to `statement_cache_size` prepared statements (0 disables caching)
+    pub fn new(
+        inner: PostgresConnectionManager<MakeRustlsConnect>,
+        connector: MakeRustlsConnect,
+        statement_cache_size: usize,
+        statement_timeout_ms: u64,
+    ) -> Self {
+        Self {
+            inner,
+            connector,
+            statement_cache_size,
+            statement_timeout_ms,
+        }
+    }
+}
+
+#[async_trait]
+impl ManageConnection for ConnectionManager {
+    type Connection = Connection;
+    type Error = tokio_postgres::Error;
+
+    async fn connect(&self) -> Result<Self::Connection, Self::Error> {
+        let client = self.inner.connect().await?;
+        if self.statement_timeout_ms > 0 {
+            client
+                .batch_execute(&format!(
+                    "set statement_timeout = {}",
+                    self.statement_timeout_ms
+                ))
+                .await?;
+        }
+        Ok(Connection {
+            client,
+            statements: LruCache::new(self.statement_cache_size),
+            connector: self.connector.clone(),
+        })
+    }
+
+    async fn is_valid(
+        &self,
+        conn: &mut bb8::PooledConnection<'_, Self>,
+    ) -> Result<(), Self::Error> {
+        conn.client.simple_query("").await.map(|_| ())
+    }
+
+    fn has_broken(&self, conn: &mut Self::Connection) -> bool {
+        conn.client.is_closed()
+    }
+}
+
+/// Documents in column `doc` of `sql`'s result rows
+///
+/// Waits for a pooled connection, which is kept until the last row (see `QueryRows`). Failing to
+/// get one or to run the query ends the stream with an error instead of failing the whole request.
+pub async fn query_docs(
+    db: &DBPool,
+    sql: &str,
+    params: &[&Param],
+    prepare: bool,
+    what: &'static str,
+) -> BoxStream<'static, Result<String, Error>> {
+    let rows = match get_owned(db).await {
+        Ok(mut conn) => {
+            let params = params.iter().copied();
+            let rows = if prepare {
+                conn.query_cached(sql, params).await
+            } else {
+                let _timer = Timer::new(METRICS.queries.with(&[what]), what);
+                conn.query_raw(sql, params).await
+            };
+            rows.map(|rows| QueryRows::new(conn, rows))
+                .map_err(Error::from)
+        }
+        Err(err) => Err(Error::from(err)),
+    };
+
+    match rows {
+        Ok(rows) => rows
+            .map_ok(|row| {
+                let value: Option<Value> = row.get("doc");
+                value.unwrap_or(Value::Null).to_string()
+            })
+            .map_err(move |err| {
+                error!("fetch {}: {:?}", what, err);
+                Error::from(err)
+            })
+            .boxed(),
+        Err(err) => {
+            error!("fetch {}: {}", what, err);
+            stream::once(async move { Err(err) }).boxed()
+        }
+    }
+}
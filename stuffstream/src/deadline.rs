@@ -0,0 +1,229 @@
+//! Deadlines of /events and /counts requests
+//!
+//! A request stops at its deadline, or as soon as a newer request with the same key arrives (e.g.
+//! a dashboard panel refreshed before its previous results came in). Its response is aborted
+//! then, dropping the body cancels the queries still running for it (see `db::QueryRows`).
+use futures::future;
+use futures::stream::{self, BoxStream, Stream, StreamExt};
+use serde_derive::Serialize;
+use std::collections::HashMap;
+use std::fmt;
+use std::future::Future;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::Duration;
+use tokio::sync::oneshot;
+use tokio::time::Instant;
+
+use crate::config::RequestSettings;
+
+pub struct Deadlines {
+    timeout: Option<Duration>,
+    /// Running requests by key: their number and a sender, dropped to supersede them
+    keys: Mutex<HashMap<String, (u64, oneshot::Sender<()>)>>,
+    started: AtomicU64,
+    timed_out: AtomicU64,
+    superseded: AtomicU64,
+}
+
+#[derive(Debug, Serialize)]
+pub struct DeadlineStats {
+    /// Running requests with a key
+    pub keyed: usize,
+    pub timed_out: u64,
+    pub superseded: u64,
+}
+
+/// Why a request stopped before it was done
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum Stopped {
+    /// Answered with 504 Gateway Timeout if no response was sent yet
+    TimedOut,
+    /// Answered with 409 Conflict if no response was sent yet
+    Superseded,
+}
+
+impl warp::reject::Reject for Stopped {}
+
+/// Deadline of a single request, see `Deadlines::start`
+pub struct Deadline {
+    deadlines: Arc<Deadlines>,
+    at: Option<Instant>,
+    superseded: Option<oneshot::Receiver<()>>,
+    key: Option<(String, u64)>,
+}
+
+impl Deadlines {
+    pub fn new(settings: &RequestSettings) -> Self {
+        Self {
+            timeout: Some(Duration::from_millis(settings.deadline_ms))
+                .filter(|timeout| !timeout.is_zero()),
+            keys: Mutex::new(HashMap::new()),
+            started: AtomicU64::new(0),
+            timed_out: AtomicU64::new(0),
+            superseded: AtomicU64::new(0),
+        }
+    }
+
+    /// Deadline of a request starting now, superseding the running one with the same `key`
+    pub fn start(self: &Arc<Self>, key: Option<&str>) -> Deadline {
+        let number = self.started.fetch_add(1, Ordering::Relaxed);
+        let (superseded, key) = match key.map(str::trim).filter(|key| !key.is_empty()) {
+            Some(key) => {
+                let (sender, receiver) = oneshot::channel();
+                // dropping the previous sender stops its request
+                self.keys
+                    .lock()
+                    .unwrap()
+                    .insert(key.to_owned(), (number, sender));
+                (Some(receiver), Some((key.to_owned(), number)))
+            }
+            None => (None, None),
+        };
+        Deadline {
+            deadlines: self.clone(),
+            at: self.timeout.map(|timeout| Instant::now() + timeout),
+            superseded,
+            key,
+        }
+    }
+
+    pub fn stats(&self) -> DeadlineStats {
+        DeadlineStats {
+            keyed: self.keys.lock().unwrap().len(),
+            timed_out: self.timed_out.load(Ordering::Relaxed),
+            superseded: self.superseded.load(Ordering::Relaxed),
+        }
+    }
+}
+
+impl Deadline {
+    /// Resolves once the request has to stop
+    async fn reached(&mut self) -> Stopped {
+        let at = self.at;
+        let timeout = async move {
+            match at {
+                Some(at) => tokio::time::sleep_until(at).await,
+                None => future::pending().await,
+            }
+        };
+        let superseded = async {
+            match &mut self.superseded {
+                Some(receiver) => drop(receiver.await),
+                None => future::pending().await,
+            }
+        };
+        let (stopped, counter) = tokio::select! {
+            _ = timeout => (Stopped::TimedOut, &self.deadlines.timed_out),
+            _ = superseded => (Stopped::Superseded, &self.deadlines.superseded),
+        };
+        counter.fetch_add(1, Ordering::Relaxed);
+        stopped
+    }
+
+    /// Run `future`, the part of a request before its response, unless the request stops first
+    pub async fn run<F: Future>(&mut self, future: F) -> Result<F::Output, Stopped> {
+        tokio::select! {
+            output = future => Ok(output),
+            stopped = self.reached() => Err(stopped),
+        }
+    }
+
+    /// `body` until the request stops, ending with an error then
+    pub fn bound<S, T, E>(self, body: S) -> BoxStream<'static, Result<T, E>>
+    where
+        S: Stream<Item = Result<T, E>> + Send + 'static,
+        T: Send + 'static,
+        E: From<Stopped> + Send + 'static,
+    {
+        stream::unfold(Some((body.boxed(), self)), |state| async move {
+            let (mut body, mut deadline) = state?;
+            tokio::select! {
+                item = body.next() => item.map(|item| (item, Some((body, deadline)))),
+                stopped = deadline.reached() => {
+                    warn!("Response aborted: {}", stopped);
+                    // drops the body
+                    Some((Err(E::from(stopped)), None))
+                }
+            }
+        })
+        .boxed()
+    }
+}
+
+impl Drop for Deadline {
+    fn drop(&mut self) {
+        if let Some((key, number)) = &self.key {
+            let mut keys = self.deadlines.keys.lock().unwrap();
+            if keys
+                .get(key)
+                .map_or(false, |(running, _)| running == number)
+            {
+                keys.remove(key);
+            }
+        }
+    }
+}
+
+impl fmt::Display for Stopped {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        match self {
+            Stopped::TimedOut => write!(f, "deadline exceeded"),
+            Stopped::Superseded => write!(f, "superseded by a newer request"),
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn deadlines(deadline_ms: u64) -> Arc<Deadlines> {
+        Arc::new(Deadlines::new(&RequestSettings { deadline_ms }))
+    }
+
+    #[tokio::test]
+    async fn stop_at_deadline() {
+        let deadlines = deadlines(20);
+        let mut deadline = deadlines.start(None);
+        assert_eq!(deadline.run(async { 1 }).await, Ok(1));
+        assert_eq!(
+            deadline.run(future::pending::<()>()).await,
+            Err(Stopped::TimedOut)
+        );
+
+        let body = stream::iter([Ok("a"), Ok("b")]).chain(stream::pending());
+        let chunks: Vec<Result<_, Stopped>> = deadlines.start(None).bound(body).collect().await;
+        assert_eq!(chunks, [Ok("a"), Ok("b"), Err(Stopped::TimedOut)]);
+        assert_eq!(deadlines.stats().timed_out, 2);
+
+        // no deadline
+        let deadlines = self::deadlines(0);
+        let body = stream::iter([Ok::<_, Stopped>(1)]);
+        assert_eq!(
+            deadlines.start(None).bound(body).collect::<Vec<_>>().await,
+            [Ok(1)]
+        );
+    }
+
+    #[tokio::test]
+    async fn supersede_by_key() {
+        let deadlines = deadlines(0);
+        let mut first = deadlines.start(Some("panel"));
+        let mut other = deadlines.start(Some("other panel"));
+        let second = deadlines.start(Some(" panel "));
+        assert_eq!(
+            first.run(future::pending::<()>()).await,
+            Err(Stopped::Superseded)
+        );
+        assert_eq!(deadlines.stats().keyed, 2);
+
+        // the superseded request doesn't remove its successor
+        drop(first);
+        assert_eq!(deadlines.stats().keyed, 2);
+        drop(second);
+        assert_eq!(deadlines.stats().keyed, 1);
+        assert_eq!(other.run(async { 2 }).await, Ok(2));
+        assert_eq!(deadlines.stats().superseded, 1);
+    }
+}
@@ -1,39 +1,92 @@
-use bb8_postgres::tokio_postgres;
-use bb8_postgres::tokio_postgres::types::ToSql;
-use futures::lock::Mutex;
-use futures::stream;
-use futures::{StreamExt, TryStreamExt};
+use futures::stream::{self, BoxStream};
+use futures::StreamExt;
 use serde_derive::{Deserialize, Serialize};
-use serde_json::Value;
-use std::iter::Iterator;
+use serde_json::{json, Value};
 use std::sync::Arc;
 use time::{format_description::well_known::Rfc3339, OffsetDateTime};
-use warp::http;
 
-use logstuff::serde::de::rfc3339;
-use logstuff_query::ExpressionParser;
+use logstuff::rollup::RollupSettings;
+use logstuff::serde::de::{rfc3339, rfc3339_option};
 
+use crate::admission::Admission;
+use crate::app::streamed;
 use crate::app::DBPool;
 use crate::app::Error;
 use crate::app::MalformedQuery;
+use crate::compression::Encoding;
+use crate::db::{self, Param, QueryRows};
+use crate::deadline::Deadlines;
+use crate::field_stats;
 use crate::interval::CountsInterval;
-
-type Param = (dyn ToSql + Sync);
+use crate::partitions::{self, PartitionLayout};
+use crate::query_cache::QueryCompiler;
+use crate::rollups::Rollups;
 
 pub(crate) async fn handler(
-    parser: Arc<Mutex<ExpressionParser>>,
+    compiler: Arc<QueryCompiler>,
+    rollups: Option<Arc<Rollups>>,
+    layout: Option<Arc<PartitionLayout>>,
+    admission: Arc<Admission>,
+    deadlines: Arc<Deadlines>,
     table_name: String,
     params: Request,
     db: DBPool,
+    encoding: Encoding,
 ) -> Result<impl warp::Reply, warp::Rejection> {
-    let response = Response::new(parser, &table_name, db.clone());
-    Ok(http::Response::builder()
-        .status(http::StatusCode::OK)
-        .header("Content-Type", "application/json")
-        .body(warp::hyper::Body::wrap_stream(
-            response.streams(params).await,
-        ))
-        .unwrap())
+    let ndjson = params.format == Format::Ndjson;
+    // events with fields and metadata run two queries
+    let connections = if ndjson {
+        1
+    } else {
+        admission.connections_for(2)
+    };
+    let mut deadline = deadlines.start(params.request_key.as_deref());
+    let response = Response::new(compiler, rollups, layout, &table_name, db.clone());
+    let (permit, body) = deadline
+        .run(async {
+            let permit = admission
+                .admit(connections)
+                .await
+                .map_err(warp::reject::custom)?;
+            let body = if ndjson {
+                response.event_lines(params).await
+            } else {
+                response
+                    .streams(params, connections as usize)
+                    .await
+                    .map(StreamExt::boxed)
+            };
+            Ok::<_, warp::Rejection>((permit, body.map_err(warp::reject::custom)?))
+        })
+        .await
+        .map_err(warp::reject::custom)??;
+
+    // keep the connections reserved until the response is sent
+    let body = body.map(move |chunk| {
+        let _ = &permit;
+        chunk
+    });
+    let content_type = if ndjson {
+        "application/x-ndjson"
+    } else {
+        "application/json"
+    };
+    Ok(streamed(content_type, encoding, deadline.bound(body)))
+}
+
+#[derive(Serialize, Deserialize, Debug, Clone, Copy, PartialEq)]
+#[serde(rename_all = "lowercase")]
+pub enum Format {
+    /// A single JSON object with events, field statistics and metadata
+    Json,
+    /// One line per event, streamed while rows arrive, and a last line with the cursor
+    Ndjson,
+}
+
+impl Default for Format {
+    fn default() -> Self {
+        Format::Json
+    }
 }
 
 #[derive(Serialize, Deserialize, Debug)]
@@ -44,23 +97,132 @@ pub struct Request {
     end: OffsetDateTime,
     query: Option<String>,
     limit_events: Option<i64>,
+    #[serde(default)]
+    format: Format,
+    /// Cursor (ndjson only): events older than `before`, or as old with an id below `before_id`
+    #[serde(default, deserialize_with = "rfc3339_option")]
+    before: Option<OffsetDateTime>,
+    before_id: Option<i64>,
+    /// A newer request with the same key stops this one, e.g. one key per dashboard panel
+    request_key: Option<String>,
 }
 
 pub struct Response {
-    parser: Arc<Mutex<ExpressionParser>>,
+    compiler: Arc<QueryCompiler>,
+    rollups: Option<Arc<Rollups>>,
+    layout: Option<Arc<PartitionLayout>>,
     table: String,
     db: DBPool,
 }
 
-fn fetch_doc(
-    rows: tokio_postgres::RowStream,
-) -> impl stream::Stream<Item = Result<String, tokio_postgres::Error>> {
-    rows.map_ok(|row| {
-        let value: Option<Value> = row.get("doc");
-        value.unwrap_or(Value::Null).to_string()
-    })
+/// Events one by one, newest first, starting below the keyset cursor if `cursor_id` is given
+///
+/// Returns `doc`, `tstamp` and `cursor_id`, the latter two for the next page's cursor.
+fn event_rows_query(
+    table: &str,
+    expr: &str,
+    start_id: usize,
+    end_id: usize,
+    limit_id: usize,
+    cursor_id: Option<usize>,
+) -> String {
+    let keyset = match cursor_id {
+        Some(id) => format!("and (tstamp, id) < (${}, ${}::bigint)", id, id + 1),
+        None => "".to_string(),
+    };
+    format!(
+        r#"
+            select jsonb_build_object('timestamp', tstamp, 'id', id, 'source', doc) as doc,
+                tstamp, id::bigint as cursor_id
+            from {}
+            where {}
+            and tstamp between ${} and ${}
+            {}
+            order by tstamp desc, id desc
+            limit ${}
+        "#,
+        table, expr, start_id, end_id, keyset, limit_id,
+    )
+}
+
+/// Number of matching events between two timestamps (at most `limit_id` of them) and the oldest
+/// of them, below the keyset cursor if `cursor_id` is given
+fn probe_query(
+    table: &str,
+    expr: &str,
+    start_id: usize,
+    end_id: usize,
+    limit_id: usize,
+    cursor_id: Option<usize>,
+) -> String {
+    let keyset = match cursor_id {
+        Some(id) => format!("and (tstamp, id) < (${}, ${}::bigint)", id, id + 1),
+        None => "".to_string(),
+    };
+    format!(
+        r#"
+            select count(*) as count, min(tstamp) as oldest from (
+                select tstamp
+                from {}
+                where {}
+                and tstamp between ${} and ${}
+                {}
+                order by tstamp desc
+                limit ${}
+            ) p
+        "#,
+        table, expr, start_id, end_id, keyset, limit_id,
+    )
+}
+
+/// State of an NDJSON response, owns its connection until all rows are sent
+struct EventLines {
+    rows: QueryRows,
+    last: Option<(OffsetDateTime, i64)>,
+    count: i64,
+    limit: Option<i64>,
+    done: bool,
+}
+
+impl EventLines {
+    /// Last line: the cursor for the next page, null if there are no more events
+    fn cursor_line(&self) -> String {
+        let cursor = match (self.last, self.limit) {
+            (Some((tstamp, id)), Some(limit)) if self.count >= limit => json!({
+                "before": tstamp.format(&Rfc3339).unwrap(),
+                "before_id": id,
+            }),
+            _ => Value::Null,
+        };
+        format!("{}\n", json!({ "cursor": cursor }))
+    }
+
+    async fn next_line(mut self) -> Option<(Result<String, Error>, Self)> {
+        if self.done {
+            return None;
+        }
+        let line = match self.rows.next().await {
+            Some(Ok(row)) => {
+                let doc: Value = row.get("doc");
+                self.last = Some((row.get("tstamp"), row.get("cursor_id")));
+                self.count += 1;
+                Ok(format!("{}\n", doc))
+            }
+            Some(Err(err)) => {
+                error!("fetch events: {:?}", err);
+                self.done = true;
+                Err(Error::from(err))
+            }
+            None => {
+                self.done = true;
+                Ok(self.cursor_line())
+            }
+        };
+        Some((line, self))
+    }
 }
 
+/// Latest events (at most `limit_id` of them, unlimited if the parameter is null) in a single row
 fn events_query(
     table: &str,
     expr: &str,
@@ -76,48 +238,91 @@ fn events_query(
                 where {}
                 and tstamp between ${} and ${}
                 order by tstamp desc
-                limit ${}
+                limit ${}::bigint
             ) e
         "#,
         table, expr, start_id, end_id, limit_id,
     )
 }
 
-fn fields_query(table: &str, expr: &str, start_id: usize, end_id: usize) -> String {
+/// Number of latest events the field statistics are computed from
+const FIELDS_SAMPLE: usize = 500;
+
+/// Events and field statistics from a single scan of the matching rows
+///
+/// Returns two rows ordered by `part`: the events (at most `limit_id` of them, unlimited if the
+/// parameter is null) and the top 5 values of each field within the latest `FIELDS_SAMPLE`
+/// events. Both are taken from the same, materialized set of rows.
+fn events_and_fields_query(
+    table: &str,
+    expr: &str,
+    start_id: usize,
+    end_id: usize,
+    limit_id: usize,
+) -> String {
     format!(
         r#"
-            select jsonb_object_agg(key, values) as doc from (
-                select key::varchar, jsonb_object_agg(coalesce(value::text, ''), count::integer) as values from (
-                    select row_number() over (
-                            partition by key
-                            order by count desc
-                        ) as row_number, count, key, value
-                    from (
-                        select count(*), key, jsonb_array_elements(
-                            case
-                                when jsonb_typeof(value) = 'array' then value
-                                else jsonb_build_array(value)
-                            end) #>> '{{}}' as value
-                        from (
-                            select doc
-                            from {}
-                            where {}
-                            and tstamp between ${} and ${}
-                            order by tstamp desc
-                            limit 500
-                        ) limited_logs, jsonb_each(doc)
-                        group by key, value
-                        order by key, count desc
-                    ) counted
-                ) ranked
-                where row_number <= 5
-                group by key
-            ) f
+            with matching as materialized (
+                select id, tstamp, doc
+                from {table}
+                where {expr}
+                and tstamp between ${start_id} and ${end_id}
+                order by tstamp desc
+                limit (case
+                    when ${limit_id}::bigint is null then null
+                    else greatest(${limit_id}::bigint, {sample})
+                end)
+            )
+            select doc from (
+                select 1 as part, (
+                    select jsonb_agg(doc) from (
+                        select jsonb_build_object('timestamp', tstamp, 'id', id, 'source', doc) as doc
+                        from matching
+                        order by tstamp desc
+                        limit ${limit_id}::bigint
+                    ) e
+                ) as doc
+                union all
+                select 2 as part, (
+                    select jsonb_object_agg(key, values) from (
+                        select key::varchar, jsonb_object_agg(coalesce(value::text, ''), count::integer) as values from (
+                            select row_number() over (
+                                    partition by key
+                                    order by count desc
+                                ) as row_number, count, key, value
+                            from (
+                                select count(*), key, jsonb_array_elements(
+                                    case
+                                        when jsonb_typeof(value) = 'array' then value
+                                        else jsonb_build_array(value)
+                                    end) #>> '{{}}' as value
+                                from (
+                                    select doc
+                                    from matching
+                                    order by tstamp desc
+                                    limit {sample}
+                                ) limited_logs, jsonb_each(doc)
+                                group by key, value
+                                order by key, count desc
+                            ) counted
+                        ) ranked
+                        where row_number <= 5
+                        group by key
+                    ) f
+                ) as doc
+            ) parts
+            order by part
         "#,
-        table, expr, start_id, end_id
+        table = table,
+        expr = expr,
+        start_id = start_id,
+        end_id = end_id,
+        limit_id = limit_id,
+        sample = FIELDS_SAMPLE,
     )
 }
 
+/// Metadata with the planner's estimate of the number of events, if there are no rollups
 fn metadata_query(table: &str, start: &OffsetDateTime, end: &OffsetDateTime) -> String {
     let interval = CountsInterval::from(*end - *start);
     format!(
@@ -135,103 +340,60 @@ fn metadata_query(table: &str, start: &OffsetDateTime, end: &OffsetDateTime) ->
     )
 }
 
-async fn metadata(
-    db: DBPool,
-    table: Arc<String>,
+/// Metadata with the number of events between $1 and $2 from the rollups' total counts
+///
+/// Whole hours within the range are taken from the hourly rollup, the rest from the minute one.
+/// Exact but for the minutes at start and end, which are counted as a whole.
+fn rollup_metadata_query(
+    rollups: &RollupSettings,
     start: &OffsetDateTime,
     end: &OffsetDateTime,
-) -> impl stream::Stream<Item = Result<String, Error>> {
-    let db = db.get().await.unwrap();
-    let empty_params: Vec<&str> = Vec::new();
-    fetch_doc(
-        db.query_raw(
-            metadata_query(table.as_ref(), start, end).as_str(),
-            empty_params,
-        )
-        .await
-        .unwrap(),
-    )
-    .map_err(|err| {
-        error!("fetch metadata: {:?}", err);
-        Error::from(err)
-    })
-}
-
-async fn fields(
-    db: DBPool,
-    table: Arc<String>,
-    expr: Arc<String>,
-    params: Arc<Vec<Value>>,
-    start: &OffsetDateTime,
-    end: &OffsetDateTime,
-) -> impl stream::Stream<Item = Result<String, Error>> {
-    let db = db.get().await.unwrap();
-    fetch_doc(
-        db.query_raw(
-            fields_query(
-                table.as_ref(),
-                expr.as_ref(),
-                params.len() + 1,
-                params.len() + 2,
+) -> String {
+    let interval = CountsInterval::from(*end - *start);
+    format!(
+        r#"
+            with range as (
+                select date_trunc('minute', $1::timestamptz) as first_minute,
+                    $2::timestamptz as last,
+                    date_trunc('hour', $1::timestamptz - '1 microsecond'::interval) + '1 hour'::interval as full_start,
+                    date_trunc('hour', $2::timestamptz) as full_end
             )
-            .as_str(),
-            params
-                .iter()
-                .map(|e| e as &Param)
-                .chain(std::iter::once::<&Param>(&start.to_owned()))
-                .chain(std::iter::once::<&Param>(&end.to_owned()))
-                .collect::<Vec<&Param>>(),
-        )
-        .await
-        .unwrap(),
+            select jsonb_build_object('event_count', coalesce(sum(count), 0), 'counts_interval_sec', {}) as doc
+            from (
+                select h.count from {} h, range r
+                where h.field = '' and h.bucket >= r.full_start and h.bucket < r.full_end
+                union all
+                select m.count from {} m, range r
+                where m.field = '' and m.bucket between r.first_minute and r.last
+                and (m.bucket < r.full_start or m.bucket >= r.full_end)
+            ) c
+        "#,
+        &interval.seconds,
+        rollups.table_name("hour"),
+        rollups.table_name("minute"),
     )
-    .map_err(|err| {
-        error!("fetch fields: {:?}", err);
-        Error::from(err)
-    })
 }
 
-async fn events(
-    db: DBPool,
-    table: Arc<String>,
-    expr: Arc<String>,
-    params: Arc<Vec<Value>>,
-    start: &OffsetDateTime,
-    end: &OffsetDateTime,
-    limit: &Option<i64>,
-) -> impl stream::Stream<Item = Result<String, Error>> {
-    let db = db.get().await.unwrap();
-    fetch_doc(
-        db.query_raw(
-            events_query(
-                table.as_ref(),
-                expr.as_ref(),
-                params.len() + 1,
-                params.len() + 2,
-                params.len() + 3,
-            )
-            .as_str(),
-            params
-                .iter()
-                .map(|e| e as &Param)
-                .chain(std::iter::once::<&Param>(&start.to_owned()))
-                .chain(std::iter::once::<&Param>(&end.to_owned()))
-                .chain(std::iter::once::<&Param>(&limit.to_owned()))
-                .collect::<Vec<&Param>>(),
-        )
-        .await
-        .unwrap(),
-    )
-    .map_err(|err| {
-        error!("fetch events: {:?}", err);
-        Error::from(err)
-    })
+fn with_params<'a>(query_params: &'a [Value], extra: &[&'a Param]) -> Vec<&'a Param> {
+    query_params
+        .iter()
+        .map(|e| e as &Param)
+        .chain(extra.iter().copied())
+        .collect()
 }
 
 impl Response {
-    pub fn new(parser: Arc<Mutex<ExpressionParser>>, table: &str, db: DBPool) -> Self {
+    pub fn new(
+        compiler: Arc<QueryCompiler>,
+        rollups: Option<Arc<Rollups>>,
+        layout: Option<Arc<PartitionLayout>>,
+        table: &str,
+        db: DBPool,
+    ) -> Self {
         Self {
-            parser,
+            compiler,
+            rollups,
+            layout,
             table: table.to_owned(),
             db,
         }
@@ -241,52 +403,261 @@ impl Response {
         &self,
         query: &Option<String>,
     ) -> Result<(String, Vec<Value>), MalformedQuery> {
-        let p = self.parser.lock().await;
         let (query, query_params) = if let Some(query) = query {
-            p.to_sql(query, 1).map_err(|_| MalformedQuery)?
+            self.compiler.to_sql(query, 1).map_err(|_| MalformedQuery)?
         } else {
             ("1 = 1".into(), Vec::new())
         };
-        drop(p);
         Ok((query, query_params))
     }
 
+    /// Start of the range narrowed to the newest `wanted` events matching `expr`
+    ///
+    /// Walks the partitions' time ranges newest first until the remaining events are found.
+    /// Queries on the narrowed range return the same events, but postgres leaves out the older
+    /// partitions instead of sorting all their matching rows. The requested start if there is no
+    /// partition layout, the range lies within a single partition or there are fewer events.
+    async fn walked_start(
+        &self,
+        expr: &str,
+        query_params: &[Value],
+        start: OffsetDateTime,
+        end: OffsetDateTime,
+        cursor: Option<&(OffsetDateTime, i64)>,
+        wanted: i64,
+    ) -> OffsetDateTime {
+        let layout = match &self.layout {
+            Some(layout) => layout,
+            None => return start,
+        };
+        let end = cursor.map_or(end, |(before, _)| end.min(*before));
+        let windows = layout.windows(&self.db).await;
+        let windows: Vec<_> = partitions::walk(&windows, start, end).collect();
+        if windows.len() < 2 {
+            return start;
+        }
+
+        match self
+            .walk_partitions(expr, query_params, &windows, cursor, wanted)
+            .await
+        {
+            Ok(oldest) => oldest.unwrap_or(start),
+            Err(err) => {
+                error!("walk partitions: {}", err);
+                start
+            }
+        }
+    }
+
+    async fn walk_partitions(
+        &self,
+        expr: &str,
+        query_params: &[Value],
+        windows: &[(OffsetDateTime, OffsetDateTime)],
+        cursor: Option<&(OffsetDateTime, i64)>,
+        wanted: i64,
+    ) -> Result<Option<OffsetDateTime>, Error> {
+        let offset = query_params.len();
+        let sql = probe_query(
+            &self.table,
+            expr,
+            offset + 1,
+            offset + 2,
+            offset + 3,
+            cursor.map(|_| offset + 4),
+        );
+        let mut conn = db::get(&self.db).await?;
+        let statement = conn.prepare_cached(&sql).await?;
+        let mut remaining = wanted;
+        for (from, to) in windows {
+            let mut sql_params = with_params(query_params, &[from, to, &remaining]);
+            if let Some((before, before_id)) = cursor {
+                sql_params.push(before);
+                sql_params.push(before_id);
+            }
+            let row = conn.query_one(&statement, &sql_params).await?;
+            let count: i64 = row.get("count");
+            if count >= remaining {
+                return Ok(row.get("oldest"));
+            }
+            remaining -= count;
+        }
+        Ok(None)
+    }
+
+    /// Events as NDJSON, while they arrive from the database
+    ///
+    /// Keeps its connection for the whole response: other queries on it would have to wait for
+    /// the client to read all rows.
+    pub async fn event_lines(
+        self,
+        params: Request,
+    ) -> Result<BoxStream<'static, Result<String, Error>>, MalformedQuery> {
+        let (expr, query_params) = self.parse_query(&params.query).await?;
+        let offset = query_params.len();
+        let cursor = params
+            .before
+            .map(|before| (before, params.before_id.unwrap_or(i64::MAX)));
+        let start = match params.limit_events {
+            Some(limit) => {
+                self.walked_start(
+                    &expr,
+                    &query_params,
+                    params.start,
+                    params.end,
+                    cursor.as_ref(),
+                    limit,
+                )
+                .await
+            }
+            None => params.start,
+        };
+        let sql = event_rows_query(
+            &self.table,
+            &expr,
+            offset + 1,
+            offset + 2,
+            offset + 3,
+            cursor.map(|_| offset + 4),
+        );
+        let mut sql_params =
+            with_params(&query_params, &[&start, &params.end, &params.limit_events]);
+        if let Some((before, before_id)) = &cursor {
+            sql_params.push(before);
+            sql_params.push(before_id);
+        }
+
+        let rows = match db::get_owned(&self.db).await {
+            Ok(mut conn) => match conn.query_cached(&sql, sql_params.iter().copied()).await {
+                Ok(rows) => Ok((conn, rows)),
+                Err(err) => Err(Error::from(err)),
+            },
+            Err(err) => Err(Error::from(err)),
+        };
+        Ok(match rows {
+            Ok((conn, rows)) => stream::unfold(
+                EventLines {
+                    rows: QueryRows::new(conn, rows),
+                    last: None,
+                    count: 0,
+                    limit: params.limit_events,
+                    done: false,
+                },
+                EventLines::next_line,
+            )
+            .boxed(),
+            Err(err) => {
+                error!("fetch events: {}", err);
+                stream::once(async move { Err(err) }).boxed()
+            }
+        })
+    }
+
     pub async fn streams(
         self,
         params: Request,
-    ) -> impl futures::Stream<Item = Result<impl Into<warp::hyper::body::Bytes>, Error>> {
-        let (expr, query_params) = self.parse_query(&params.query).await.unwrap();
-        let expr = Arc::new(expr);
-        let query_params = Arc::new(query_params);
-        let table = Arc::new(self.table.to_owned());
+        connections: usize,
+    ) -> Result<impl futures::Stream<Item = Result<String, Error>>, MalformedQuery> {
+        let (expr, query_params) = self.parse_query(&params.query).await?;
+        let offset = query_params.len();
+        let end: &Param = &params.end;
+        let limit: &Param = &params.limit_events;
 
-        let (e, f, m) = futures::join!(
-            events(
-                self.db.clone(),
-                table.clone(),
-                expr.clone(),
-                query_params.clone(),
-                &params.start,
-                &params.end,
-                &params.limit_events,
+        // unfiltered requests get their field statistics from the sketches instead of a sample
+        let unfiltered = params
+            .query
+            .as_deref()
+            .map_or(true, |query| query.trim().is_empty());
+        // as long as the sketches cover the range from its first hour on
+        let sketched = match &self.rollups {
+            Some(rollups) if rollups.settings.field_sketches && unfiltered => {
+                rollups.cover(&self.db, params.start, 3600).await
+            }
+            _ => false,
+        };
+        let sketches = match &self.rollups {
+            Some(rollups) if sketched => Some(
+                field_stats::from_sketches(&self.db, &rollups.settings, &params.start, &params.end)
+                    .await,
             ),
-            fields(
-                self.db.clone(),
-                table.clone(),
-                expr.clone(),
-                query_params.clone(),
-                &params.start,
-                &params.end,
+            _ => None,
+        };
+        let events_sql = match sketches {
+            Some(_) => events_query(&self.table, &expr, offset + 1, offset + 2, offset + 3),
+            None => events_and_fields_query(&self.table, &expr, offset + 1, offset + 2, offset + 3),
+        };
+        // the field statistics' sample has to be within the narrowed range, too
+        let events_start = match params.limit_events {
+            Some(limit) => {
+                let wanted = match sketches {
+                    Some(_) => limit,
+                    None => limit.max(FIELDS_SAMPLE as i64),
+                };
+                self.walked_start(&expr, &query_params, params.start, params.end, None, wanted)
+                    .await
+            }
+            None => params.start,
+        };
+
+        let events_params = with_params(&query_params, &[&events_start, end, limit]);
+        let events = db::query_docs(&self.db, &events_sql, &events_params, true, "events");
+        // before the rollups' coverage the count has to be estimated from the log tables
+        let covered = match &self.rollups {
+            Some(rollups) => rollups.cover(&self.db, params.start, 60).await,
+            None => false,
+        };
+        let (metadata_sql, metadata_params, prepare) = match &self.rollups {
+            Some(rollups) if covered => (
+                rollup_metadata_query(&rollups.settings, &params.start, &params.end),
+                vec![params.start, params.end],
+                true,
             ),
-            metadata(self.db, table, &params.start, &params.end),
-        );
+            // the time range is part of the text, preparing it would not pay off
+            _ => (
+                metadata_query(&self.table, &params.start, &params.end),
+                Vec::new(),
+                false,
+            ),
+        };
+        let db = self.db.clone();
+        let metadata = async move {
+            let params: Vec<&Param> = metadata_params.iter().map(|p| p as &Param).collect();
+            db::query_docs(&db, &metadata_sql, &params, prepare, "metadata").await
+        };
+
+        // each query keeps its connection until its rows are read, with a single one the
+        // metadata query waits for the events to be sent
+        let (events, metadata) = if connections > 1 {
+            futures::join!(events, metadata)
+        } else {
+            (events.await, stream::once(metadata).flatten().boxed())
+        };
+        let events_and_fields = events.enumerate().map(|(part, doc)| {
+            doc.map(|doc| match part {
+                0 => doc,
+                _ => format!(r#", "fields":{}"#, doc),
+            })
+        });
+        let sketched_fields = match sketches {
+            Some(Ok((fields, distinct))) => stream::once(async move {
+                Ok(format!(
+                    r#", "fields":{}, "distinct_values":{}"#,
+                    fields, distinct
+                ))
+            })
+            .boxed(),
+            Some(Err(err)) => {
+                error!("fetch field sketches: {}", err);
+                stream::once(async move { Err(err) }).boxed()
+            }
+            None => stream::empty().boxed(),
+        };
 
-        stream::once(async { Ok(r#"{"events":"#.to_string()) })
-            .chain(e)
-            .chain(stream::once(async { Ok(r#", "fields":"#.to_string()) }))
-            .chain(f)
+        Ok(stream::once(async { Ok(r#"{"events":"#.to_string()) })
+            .chain(events_and_fields)
+            .chain(sketched_fields)
             .chain(stream::once(async { Ok(r#", "metadata":"#.to_string()) }))
-            .chain(m)
-            .chain(stream::once(async { Ok("}".to_string()) }))
+            .chain(metadata)
+            .chain(stream::once(async { Ok("}".to_string()) })))
     }
 }
@@ -0,0 +1,69 @@
+//! Field statistics of unfiltered /events requests from stuffimport's hourly field sketches
+//!
+//! Merging the sketches of the requested hours covers all events of the range, where the sampled
+//! statistics only see the newest few hundred. Filtered requests still need the sample, sketches
+//! don't know which events matched.
+use futures::TryStreamExt;
+use serde_json::{Map, Value};
+use std::collections::BTreeMap;
+use time::OffsetDateTime;
+
+use logstuff::rollup::RollupSettings;
+use logstuff::sketch::{Hll, TopK};
+
+use crate::app::{DBPool, Error};
+use crate::db::{self, Param};
+
+/// Values per field shown in the field statistics
+const TOP_VALUES: usize = 5;
+
+/// Top values (`{field: {value: count}}`) and distinct value counts (`{field: count}`) of all
+/// events between `start` and `end`, counting the first and last hour as a whole
+pub async fn from_sketches(
+    db: &DBPool,
+    rollups: &RollupSettings,
+    start: &OffsetDateTime,
+    end: &OffsetDateTime,
+) -> Result<(Value, Value), Error> {
+    let query = format!(
+        "select field, top, hll from {}
+        where bucket between date_trunc('hour', $1::timestamptz) and $2",
+        rollups.fields_table()
+    );
+    let mut conn = db::get(db).await?;
+    let params: [&Param; 2] = [start, end];
+    let rows = conn.query_cached(&query, params).await?;
+
+    let mut merged: BTreeMap<String, (TopK, Hll)> = BTreeMap::new();
+    let mut rows = Box::pin(rows);
+    while let Some(row) = rows.try_next().await? {
+        let field: String = row.get("field");
+        let top = row
+            .get::<_, Option<Value>>("top")
+            .and_then(|top| serde_json::from_value::<TopK>(top).ok());
+        let hll = row.get::<_, Option<Vec<u8>>>("hll").map(Hll::from_bytes);
+        let (merged_top, merged_hll) = merged
+            .entry(field)
+            .or_insert_with(|| (TopK::new(1), Hll::default()));
+        if let Some(top) = top {
+            merged_top.merge(&top);
+        }
+        if let Some(hll) = hll {
+            merged_hll.merge(&hll);
+        }
+    }
+
+    let mut fields = Map::new();
+    let mut distinct = Map::new();
+    for (field, (top, hll)) in merged {
+        // counts are upper bounds, the guaranteed ones don't show values that occurred rarely
+        let values = top
+            .guaranteed(TOP_VALUES)
+            .into_iter()
+            .map(|(value, count)| (value.to_owned(), Value::from(count)))
+            .collect::<Map<String, Value>>();
+        fields.insert(field.to_owned(), Value::Object(values));
+        distinct.insert(field, Value::from(hll.estimate()));
+    }
+    Ok((Value::Object(fields), Value::Object(distinct)))
+}
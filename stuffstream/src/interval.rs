@@ -1,4 +1,4 @@
-use time::Duration;
+use time::{Duration, OffsetDateTime};
 
 const INTERVALS: &[(u64, &str, &str)] = &[
     (1, "1 seconds", "second"),
@@ -60,6 +60,25 @@ impl From<Duration> for CountsInterval {
     }
 }
 
+impl CountsInterval {
+    /// First histogram point from `start` on, each point counts the events of the interval
+    /// before it
+    ///
+    /// Points of buckets shorter than a day lie on multiples of the bucket length since the epoch,
+    /// so sliding windows share their buckets (see `counts_cache`) and the first point only
+    /// counts the events from `start` on. Longer buckets vary in length with daylight saving
+    /// time, their points start at `start`.
+    pub fn first_point(&self, start: OffsetDateTime) -> OffsetDateTime {
+        if self.seconds >= 24 * 3600 {
+            return start;
+        }
+        let length = i128::from(self.seconds) * 1_000_000_000;
+        let nanos = start.unix_timestamp_nanos();
+        OffsetDateTime::from_unix_timestamp_nanos(nanos + (-nanos).rem_euclid(length))
+            .unwrap_or(start)
+    }
+}
+
 #[cfg(test)]
 mod test {
     use super::*;
@@ -72,4 +91,22 @@ mod test {
         let i = CountsInterval::from(Duration::hours(4));
         assert_eq!(i.interval, "5 minutes");
     }
+
+    #[test]
+    fn first_points() {
+        let minute = CountsInterval::from(Duration::hours(1));
+        assert_eq!(minute.seconds, 60);
+        let at = |seconds| OffsetDateTime::from_unix_timestamp(seconds).unwrap();
+        // refreshes a few seconds apart share the points after the first one
+        assert_eq!(
+            minute.first_point(at(610) + Duration::milliseconds(500)),
+            at(660)
+        );
+        assert_eq!(minute.first_point(at(615)), at(660));
+        assert_eq!(minute.first_point(at(660)), at(660));
+        assert_eq!(minute.first_point(at(-30)), at(0));
+
+        let day = CountsInterval::from(Duration::days(100));
+        assert_eq!(day.first_point(at(615)), at(615));
+    }
 }
@@ -2,13 +2,24 @@
 extern crate log;
 use std::process::exit;
 
+mod admission;
 mod app;
 mod application;
 mod cli;
+mod compression;
 mod config;
 mod counts;
+mod counts_cache;
+mod db;
+mod deadline;
 mod events;
+mod field_stats;
 mod interval;
+mod metrics;
+mod partitions;
+mod query_cache;
+mod rollups;
+mod tail;
 
 use app::App;
 use application::Application;
@@ -0,0 +1,113 @@
+//! Request, connection pool and query metrics in Prometheus' text format, served on /metrics
+//!
+//! * requests: time until the response headers are sent, by route and status. Streamed bodies
+//!   (events, tail) continue afterwards.
+//! * pool wait: time spent waiting for a pooled connection
+//! * queries: time until postgres starts sending rows, by query shape. Prepared statements are
+//!   identified by a hash of their SQL, logged at debug level when first prepared on a
+//!   connection. Unprepared queries are labelled with what they fetch.
+//! * cancelled queries: queries whose rows were dropped before the last one, see `db::QueryRows`
+use std::collections::hash_map::DefaultHasher;
+use std::hash::{Hash, Hasher};
+
+use logstuff::metrics::{Counter, Exposition, Histogram, HistogramVec, OTHER};
+
+/// Routes labelled by name, anything else is "other"
+const ROUTES: [&str; 5] = ["events", "counts", "tail", "stats", "metrics"];
+
+pub struct Metrics {
+    pub requests: HistogramVec,
+    pub pool_wait: Histogram,
+    pub queries: HistogramVec,
+    pub cancelled_queries: Counter,
+}
+
+/// Metrics of this process, shared by all requests
+pub static METRICS: Metrics = Metrics {
+    requests: HistogramVec::new(64),
+    pool_wait: Histogram::new(),
+    queries: HistogramVec::new(256),
+    cancelled_queries: Counter::new(),
+};
+
+/// Route label of a request path: its first segment if that is a known route
+pub fn route(path: &str) -> &'static str {
+    let segment = path.trim_start_matches('/').split('/').next().unwrap_or("");
+    ROUTES
+        .iter()
+        .find(|route| **route == segment)
+        .copied()
+        .unwrap_or(OTHER)
+}
+
+/// Shape label of a prepared statement
+pub fn shape(sql: &str) -> String {
+    let mut hasher = DefaultHasher::new();
+    sql.hash(&mut hasher);
+    format!("{:016x}", hasher.finish())
+}
+
+impl Metrics {
+    /// Append the histograms and counters to `exposition`
+    pub fn render(&self, exposition: &mut Exposition) {
+        exposition.histograms(
+            "stuffstream_request_duration_seconds",
+            "Time until the response headers of a request were sent",
+            &["route", "status"],
+            &self.requests,
+        );
+        let name = "stuffstream_pool_wait_seconds";
+        exposition.header(
+            name,
+            "Time spent waiting for a pooled connection",
+            "histogram",
+        );
+        exposition.histogram(name, &[], &self.pool_wait);
+        exposition.histograms(
+            "stuffstream_query_duration_seconds",
+            "Time until postgres started sending rows, by query shape",
+            &["shape"],
+            &self.queries,
+        );
+        exposition.counter(
+            "stuffstream_cancelled_queries_total",
+            "Queries cancelled because their rows were no longer needed",
+            self.cancelled_queries.get(),
+        );
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use std::time::Duration;
+
+    #[test]
+    fn labels() {
+        assert_eq!(route("/events"), "events");
+        assert_eq!(route("/counts/"), "counts");
+        assert_eq!(route("/"), OTHER);
+        assert_eq!(route("/favicon.ico"), OTHER);
+        assert_eq!(shape("select 1"), shape("select 1"));
+        assert_ne!(shape("select 1"), shape("select 2"));
+        assert_eq!(shape("select 1").len(), 16);
+    }
+
+    #[test]
+    fn render_histograms() {
+        METRICS
+            .requests
+            .with(&["events", "200"])
+            .observe(Duration::from_millis(5));
+        drop(METRICS.pool_wait.start("pool wait"));
+        let mut exposition = Exposition::new();
+        METRICS.render(&mut exposition);
+        let text = exposition.finish();
+        assert!(text.contains(
+            "stuffstream_request_duration_seconds_count{route=\"events\",status=\"200\"} "
+        ));
+        assert!(text.contains("\nstuffstream_pool_wait_seconds_count "));
+        assert!(text.contains("# TYPE stuffstream_query_duration_seconds histogram\n"));
+        assert!(text.contains("\nstuffstream_cancelled_queries_total 0\n"));
+    }
+}
@@ -0,0 +1,192 @@
+//! Time ranges of the log table's partitions, walked newest first by limited /events requests
+//!
+//! A query for the latest events of a long range has postgres sort the matching rows of all
+//! partitions within it, although the newest partition alone often holds enough of them. The
+//! ranges are read from the catalog (bounds of all range partitions on tstamp, at any level of the
+//! partition tree) and read again periodically, as stuffimport keeps creating new partitions.
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+use time::{format_description::well_known::Rfc3339, OffsetDateTime};
+
+use crate::app::{DBPool, Error};
+use crate::config::PartitionWalkSettings;
+use crate::db;
+
+/// Time range of partitions, from inclusive, to exclusive
+pub type Window = (OffsetDateTime, OffsetDateTime);
+
+/// Bounds of range partitions on tstamp below table $1, as JSON pairs of timestamps
+///
+/// Bounds without timestamps (DEFAULT, MINVALUE, MAXVALUE) become null.
+const BOUNDS_QUERY: &str = r#"
+    with recursive tree(oid) as (
+        select to_regclass($1)::oid
+        union all
+        select i.inhrelid from pg_inherits i join tree t on i.inhparent = t.oid
+    ),
+    bounds as (
+        select pg_get_expr(c.relpartbound, c.oid) as bound
+        from tree t
+        join pg_class c on c.oid = t.oid
+        join pg_inherits i on i.inhrelid = c.oid
+        where pg_get_partkeydef(i.inhparent) = 'RANGE (tstamp)'
+    )
+    select jsonb_agg(distinct jsonb_build_array(
+        substring(bound from $$FROM \('([^']*)'\)$$)::timestamptz,
+        substring(bound from $$TO \('([^']*)'\)$$)::timestamptz
+    )) as doc
+    from bounds
+"#;
+
+pub struct PartitionLayout {
+    table: String,
+    refresh: Duration,
+    windows: Mutex<Option<(Instant, Arc<Vec<Window>>)>>,
+}
+
+/// Disjoint windows between consecutive bounds, newest first, gaps left out
+///
+/// Partitions of different list or hash partitions may have different time ranges.
+fn disjoint_windows(bounds: &[Window]) -> Vec<Window> {
+    let mut points: Vec<_> = bounds.iter().flat_map(|(from, to)| [*from, *to]).collect();
+    points.sort();
+    points.dedup();
+    points
+        .windows(2)
+        .rev()
+        .map(|pair| (pair[0], pair[1]))
+        .filter(|(from, to)| {
+            bounds
+                .iter()
+                .any(|bound| bound.0 <= *from && *to <= bound.1)
+        })
+        .collect()
+}
+
+fn parse_bounds(doc: Option<serde_json::Value>) -> Option<Vec<Window>> {
+    let timestamp = |value: &serde_json::Value| {
+        value
+            .as_str()
+            .and_then(|text| OffsetDateTime::parse(text, &Rfc3339).ok())
+    };
+    doc.map_or(Some(Vec::new()), |doc| {
+        doc.as_array()?
+            .iter()
+            .map(|pair| Some((timestamp(pair.get(0)?)?, timestamp(pair.get(1)?)?)))
+            .collect()
+    })
+}
+
+/// Parts of `windows` within start and end (both inclusive), newest first
+pub fn walk(
+    windows: &[Window],
+    start: OffsetDateTime,
+    end: OffsetDateTime,
+) -> impl Iterator<Item = (OffsetDateTime, OffsetDateTime)> + '_ {
+    let before_end = time::Duration::microseconds(1);
+    windows
+        .iter()
+        .filter(move |(from, to)| *from <= end && *to > start)
+        .map(move |(from, to)| ((*from).max(start), (*to - before_end).min(end)))
+}
+
+impl PartitionLayout {
+    pub fn new(table: &str, settings: &PartitionWalkSettings) -> Self {
+        Self {
+            table: table.to_owned(),
+            refresh: Duration::from_secs(settings.refresh_sec),
+            windows: Mutex::new(None),
+        }
+    }
+
+    async fn load(&self, db: &DBPool) -> Result<Vec<Window>, Error> {
+        let conn = db::get(db).await?;
+        let row = conn.query_one(BOUNDS_QUERY, &[&self.table]).await?;
+        Ok(parse_bounds(row.get("doc")).map_or_else(
+            || {
+                warn!(
+                    "partitions of {} without time range, not walking them",
+                    self.table
+                );
+                Vec::new()
+            },
+            |bounds| disjoint_windows(&bounds),
+        ))
+    }
+
+    /// Partition windows, newest first, empty if unknown
+    pub async fn windows(&self, db: &DBPool) -> Arc<Vec<Window>> {
+        if let Some((loaded, windows)) = &*self.windows.lock().unwrap() {
+            if loaded.elapsed() < self.refresh {
+                return windows.clone();
+            }
+        }
+
+        let windows = Arc::new(self.load(db).await.unwrap_or_else(|err| {
+            error!("read partitions of {}: {}", self.table, err);
+            Vec::new()
+        }));
+        *self.windows.lock().unwrap() = Some((Instant::now(), windows.clone()));
+        windows
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use serde_json::json;
+    use time::macros::datetime;
+
+    #[test]
+    fn windows_newest_first() {
+        let bounds = parse_bounds(Some(json!([
+            ["2021-10-01T00:00:00+00:00", "2021-11-01T00:00:00+00:00"],
+            ["2021-11-01T00:00:00+00:00", "2021-12-01T00:00:00+00:00"],
+            ["2022-01-01T00:00:00+00:00", "2022-02-01T00:00:00+00:00"],
+        ])))
+        .unwrap();
+        let windows = disjoint_windows(&bounds);
+        assert_eq!(
+            windows,
+            vec![
+                (
+                    datetime!(2022-01-01 0:00 UTC),
+                    datetime!(2022-02-01 0:00 UTC)
+                ),
+                (
+                    datetime!(2021-11-01 0:00 UTC),
+                    datetime!(2021-12-01 0:00 UTC)
+                ),
+                (
+                    datetime!(2021-10-01 0:00 UTC),
+                    datetime!(2021-11-01 0:00 UTC)
+                ),
+            ]
+        );
+
+        let walked: Vec<_> = walk(
+            &windows,
+            datetime!(2021-10-15 0:00 UTC),
+            datetime!(2022-01-10 0:00 UTC),
+        )
+        .collect();
+        assert_eq!(walked.len(), 3);
+        assert_eq!(
+            walked[0],
+            (
+                datetime!(2022-01-01 0:00 UTC),
+                datetime!(2022-01-10 0:00 UTC)
+            )
+        );
+        assert_eq!(
+            walked[1],
+            (
+                datetime!(2021-11-01 0:00 UTC),
+                datetime!(2021-11-30 23:59:59.999999 UTC)
+            )
+        );
+
+        assert_eq!(parse_bounds(Some(json!([[null, null]]))), None);
+        assert_eq!(parse_bounds(None), Some(Vec::new()));
+    }
+}
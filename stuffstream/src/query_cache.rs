@@ -0,0 +1,96 @@
+//! Compiled logstuff queries shared by all requests
+//!
+//! Parsers take `&self` and are shared without locks. Dashboards send the same queries over and
+//! over, so recently compiled ones are kept and skip the parser entirely.
+use lru_cache::LruCache;
+use serde_derive::Serialize;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Mutex;
+
+use logstuff_query::{ExpressionParser, Matcher, ParseError, QueryParams};
+
+type Compiled = (String, QueryParams);
+
+pub struct QueryCompiler {
+    parser: ExpressionParser,
+    /// Compiled queries by query text and parameter offset
+    cache: Mutex<LruCache<(String, usize), Compiled>>,
+    capacity: usize,
+    hits: AtomicU64,
+    misses: AtomicU64,
+}
+
+#[derive(Debug, Serialize)]
+pub struct CacheStats {
+    pub hits: u64,
+    pub misses: u64,
+    pub entries: usize,
+    pub capacity: usize,
+}
+
+impl QueryCompiler {
+    /// Keep up to `capacity` compiled queries, 0 disables caching
+    pub fn new(parser: ExpressionParser, capacity: usize) -> Self {
+        Self {
+            parser,
+            cache: Mutex::new(LruCache::new(capacity.max(1))),
+            capacity,
+            hits: AtomicU64::new(0),
+            misses: AtomicU64::new(0),
+        }
+    }
+
+    pub fn to_sql(&self, text: &str, param_offset: usize) -> Result<Compiled, ParseError> {
+        if self.capacity == 0 {
+            return self.parser.to_sql(text, param_offset);
+        }
+
+        let key = (text.to_owned(), param_offset);
+        if let Some(compiled) = self.cache.lock().unwrap().get_mut(&key) {
+            self.hits.fetch_add(1, Ordering::Relaxed);
+            return Ok(compiled.clone());
+        }
+
+        // parse without holding the lock, concurrent misses for the same query are harmless
+        self.misses.fetch_add(1, Ordering::Relaxed);
+        let compiled = self.parser.to_sql(text, param_offset)?;
+        self.cache.lock().unwrap().insert(key, compiled.clone());
+        Ok(compiled)
+    }
+
+    /// Matcher for in-process evaluation, not cached: its users keep it for a long time
+    pub fn to_matcher(&self, text: &str) -> Result<Matcher, ParseError> {
+        self.parser.to_matcher(text)
+    }
+
+    pub fn stats(&self) -> CacheStats {
+        CacheStats {
+            hits: self.hits.load(Ordering::Relaxed),
+            misses: self.misses.load(Ordering::Relaxed),
+            entries: if self.capacity == 0 {
+                0
+            } else {
+                self.cache.lock().unwrap().len()
+            },
+            capacity: self.capacity,
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn hits_and_misses() {
+        let compiler = QueryCompiler::new(ExpressionParser::default(), 1);
+        let first = compiler.to_sql(r#"hostname = "a""#, 1).unwrap();
+        assert_eq!(compiler.to_sql(r#"hostname = "a""#, 1).unwrap(), first);
+        // another offset compiles to other placeholders, replacing the only entry
+        assert_ne!(compiler.to_sql(r#"hostname = "a""#, 3).unwrap(), first);
+        assert!(compiler.to_sql("(", 1).is_err());
+
+        let stats = compiler.stats();
+        assert_eq!((stats.hits, stats.misses, stats.entries), (1, 3, 1));
+    }
+}
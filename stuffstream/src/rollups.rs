@@ -0,0 +1,87 @@
+//! Rollup settings with the time range the rollups cover (see `logstuff::rollup`)
+//!
+//! Rollups only count the events imported while stuffimport maintained them, which it records as
+//! `since` in the coverage table when creating them. Requests for earlier ranges are answered
+//! from the log tables instead. `since` is read again periodically, it may be moved past events
+//! the rollups miss or count wrongly.
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
+use time::OffsetDateTime;
+
+use logstuff::rollup::RollupSettings;
+
+use crate::app::{DBPool, Error};
+use crate::db;
+
+/// How long `since` is used before reading it again
+const REFRESH: Duration = Duration::from_secs(60);
+
+pub struct Rollups {
+    pub settings: RollupSettings,
+    since: Mutex<Option<(Instant, Option<OffsetDateTime>)>>,
+}
+
+/// Whether the bucket of `seconds` containing `start` begins at or after `since`
+fn covers(since: OffsetDateTime, start: OffsetDateTime, seconds: i64) -> bool {
+    let bucket = start.unix_timestamp() - start.unix_timestamp().rem_euclid(seconds);
+    since.unix_timestamp_nanos() <= i128::from(bucket) * 1_000_000_000
+}
+
+impl Rollups {
+    pub fn new(settings: RollupSettings) -> Self {
+        Self {
+            settings,
+            since: Mutex::new(None),
+        }
+    }
+
+    async fn load(&self, db: &DBPool) -> Result<Option<OffsetDateTime>, Error> {
+        let conn = db::get(db).await?;
+        let query = format!("select since from {}", self.settings.coverage_table());
+        let row = conn.query_opt(query.as_str(), &[]).await?;
+        Ok(row.map(|row| row.get("since")))
+    }
+
+    /// Start of the rollups' coverage, none if unknown (e.g. stuffimport didn't record it)
+    async fn since(&self, db: &DBPool) -> Option<OffsetDateTime> {
+        if let Some((loaded, since)) = &*self.since.lock().unwrap() {
+            if loaded.elapsed() < REFRESH {
+                return *since;
+            }
+        }
+
+        let since = self.load(db).await.unwrap_or_else(|err| {
+            warn!(
+                "read coverage of rollups {}, not using them: {}",
+                self.settings.table, err
+            );
+            None
+        });
+        *self.since.lock().unwrap() = Some((Instant::now(), since));
+        since
+    }
+
+    /// Whether the rollup buckets of `seconds` from the one containing `start` on hold all of
+    /// their events
+    pub async fn cover(&self, db: &DBPool, start: OffsetDateTime, seconds: i64) -> bool {
+        self.since(db)
+            .await
+            .map_or(false, |since| covers(since, start, seconds))
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use time::macros::datetime;
+
+    #[test]
+    fn covered_buckets() {
+        let since = datetime!(2021-10-05 12:00:30 UTC);
+        assert!(!covers(since, datetime!(2021-10-05 12:00:45 UTC), 60));
+        assert!(covers(since, datetime!(2021-10-05 12:01:00 UTC), 60));
+        assert!(!covers(since, datetime!(2021-10-05 13:30:00 UTC), 3600 * 2));
+        assert!(covers(since, datetime!(2021-10-05 13:30:00 UTC), 3600));
+        assert!(!covers(since, datetime!(2021-10-01 00:00:00 UTC), 60));
+    }
+}
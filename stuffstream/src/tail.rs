@@ -0,0 +1,377 @@
+//! Live tail of new events as server-sent events, one database reader for all clients
+//!
+//! A single feed fetches events newer than the last one it has seen and broadcasts them, while at
+//! least one client is connected. Each client evaluates its own query on the shared events
+//! (`logstuff_query::Matcher`) instead of polling the database itself. With `listen_channel`, the
+//! feed waits for stuffimport's notifications (see `logstuff::notify`) instead of polling. Ids
+//! skipped because they were not committed yet are fetched again later (see `logstuff::cursor`).
+//!
+//! Every client has a bounded buffer. Clients reading slower than events arrive lose the oldest
+//! ones and get a `dropped` event with their number instead.
+use bb8_postgres::tokio_postgres::{self, AsyncMessage, Client};
+use futures::stream::{self, StreamExt};
+use serde_derive::{Deserialize, Serialize};
+use serde_json::json;
+use std::convert::Infallible;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+use time::format_description::well_known::Rfc3339;
+use tokio::sync::{broadcast, mpsc};
+use tokio_postgres_rustls::MakeRustlsConnect;
+use warp::sse;
+
+use logstuff::cursor::Cursor;
+use logstuff::event::Event;
+use logstuff_query::Matcher;
+
+use crate::admission::Admission;
+use crate::app::{DBPool, Error, MalformedQuery};
+use crate::config::TailSettings;
+use crate::db;
+use crate::query_cache::QueryCompiler;
+
+#[derive(Serialize, Deserialize, Debug)]
+pub struct Request {
+    query: Option<String>,
+}
+
+/// A new event, shared by all clients
+struct TailEvent {
+    doc: serde_json::Value,
+    search: String,
+    /// Line sent to matching clients, as /events returns events
+    line: String,
+    id: i64,
+}
+
+impl TailEvent {
+    fn new(id: i64, event: Event) -> Self {
+        let mut search = String::new();
+        if event.doc.is_object() {
+            event.search_string_into(&mut search);
+        }
+        let line = json!({
+            "timestamp": event.timestamp.format(&Rfc3339).unwrap(),
+            "id": id,
+            "source": &event.doc,
+        })
+        .to_string();
+        Self {
+            doc: event.doc,
+            search,
+            line,
+            id,
+        }
+    }
+
+    fn matches(&self, matcher: &Matcher) -> bool {
+        matcher.matches(&self.doc, &self.search)
+    }
+}
+
+pub struct Tail {
+    table: String,
+    settings: TailSettings,
+    db: DBPool,
+    admission: Arc<Admission>,
+    db_url: String,
+    tls: MakeRustlsConnect,
+    sender: broadcast::Sender<Arc<TailEvent>>,
+    running: AtomicBool,
+    cursor: Mutex<Cursor>,
+    fed: AtomicU64,
+    dropped: AtomicU64,
+}
+
+#[derive(Debug, Serialize)]
+pub struct TailStats {
+    pub clients: usize,
+    /// Events fetched by the feed
+    pub fed_events: u64,
+    /// Events slow clients missed
+    pub dropped_events: u64,
+}
+
+/// Events newer than $1, at most $2 old (postgres interval), $3 at most
+fn feed_query(table: &str) -> String {
+    format!(
+        r#"
+            select id::bigint as id, tstamp, doc from {}
+            where id > $1::bigint
+            and tstamp > now() - cast($2::varchar as interval)
+            order by id
+            limit $3
+        "#,
+        table
+    )
+}
+
+/// Events within the gaps from $1 to $2 (arrays of first and last ids), at most $3 old
+fn gaps_query(table: &str) -> String {
+    format!(
+        r#"
+            select t.id::bigint as id, t.tstamp, t.doc from {} t
+            join unnest($1::bigint[], $2::bigint[]) as gap(first, last)
+            on t.id between gap.first and gap.last
+            where t.tstamp > now() - cast($3::varchar as interval)
+            order by t.id
+        "#,
+        table
+    )
+}
+
+impl Tail {
+    pub fn new(
+        table: &str,
+        settings: &TailSettings,
+        db: DBPool,
+        admission: Arc<Admission>,
+        db_url: &str,
+        tls: MakeRustlsConnect,
+    ) -> Self {
+        let (sender, _) = broadcast::channel(settings.buffer_size.max(1));
+        Self {
+            table: table.to_owned(),
+            settings: settings.clone(),
+            db,
+            admission,
+            db_url: db_url.to_owned(),
+            tls,
+            sender,
+            running: AtomicBool::new(false),
+            cursor: Mutex::new(Cursor::new(Duration::from_millis(settings.gap_timeout_ms))),
+            fed: AtomicU64::new(0),
+            dropped: AtomicU64::new(0),
+        }
+    }
+
+    pub fn stats(&self) -> TailStats {
+        TailStats {
+            clients: self.sender.receiver_count(),
+            fed_events: self.fed.load(Ordering::Relaxed),
+            dropped_events: self.dropped.load(Ordering::Relaxed),
+        }
+    }
+
+    /// Receive new events, starting the feed for the first client
+    fn subscribe(self: &Arc<Self>) -> broadcast::Receiver<Arc<TailEvent>> {
+        let events = self.sender.subscribe();
+        if !self.running.swap(true, Ordering::SeqCst) {
+            tokio::spawn(self.clone().feed());
+        }
+        events
+    }
+
+    async fn feed(self: Arc<Self>) {
+        let mut listening = self.listen().await;
+        loop {
+            if self.sender.receiver_count() == 0 {
+                self.running.store(false, Ordering::SeqCst);
+                // unless a client subscribed meanwhile and found the feed still running
+                if self.sender.receiver_count() == 0 || self.running.swap(true, Ordering::SeqCst) {
+                    return;
+                }
+            }
+
+            let fetched = self.fetch().await.unwrap_or_else(|err| {
+                error!("fetch tail events: {}", err);
+                0
+            });
+            if fetched < self.settings.batch_size {
+                self.wait(&mut listening).await;
+            }
+        }
+    }
+
+    /// Connection listening on `listen_channel`, and a receiver woken by its notifications
+    async fn listen(&self) -> Option<(Client, mpsc::Receiver<()>)> {
+        let channel = self.settings.listen_channel.as_ref()?;
+        let (client, mut connection) =
+            match tokio_postgres::connect(&self.db_url, self.tls.clone()).await {
+                Ok(connected) => connected,
+                Err(err) => {
+                    error!("listen for events: {}, polling instead", err);
+                    return None;
+                }
+            };
+
+        // notifications arriving while the feed is busy only need to wake it once
+        let (notify, notified) = mpsc::channel(1);
+        tokio::spawn(async move {
+            let mut messages = stream::poll_fn(move |cx| connection.poll_message(cx));
+            while let Some(message) = messages.next().await {
+                match message {
+                    Ok(AsyncMessage::Notification(_)) => {
+                        let _ = notify.try_send(());
+                    }
+                    Ok(_) => {}
+                    Err(err) => {
+                        error!("listen for events: {}, polling instead", err);
+                        break;
+                    }
+                }
+            }
+        });
+
+        match client.batch_execute(&format!("listen {}", channel)).await {
+            Ok(()) => Some((client, notified)),
+            Err(err) => {
+                error!("listen for events: {}, polling instead", err);
+                None
+            }
+        }
+    }
+
+    async fn wait(&self, listening: &mut Option<(Client, mpsc::Receiver<()>)>) {
+        let lost = match listening {
+            Some((_, notified)) => {
+                let timeout = Duration::from_millis(self.settings.listen_timeout_ms);
+                tokio::select! {
+                    received = notified.recv() => received.is_none(),
+                    _ = tokio::time::sleep(timeout) => false,
+                }
+            }
+            None => {
+                tokio::time::sleep(Duration::from_millis(self.settings.poll_interval_ms)).await;
+                false
+            }
+        };
+        if lost {
+            warn!("lost the connection listening for events, polling instead");
+            *listening = None;
+        }
+    }
+
+    /// Broadcast the next new events and those of gaps, returns the number of new ones
+    async fn fetch(&self) -> Result<i64, Error> {
+        let _permit = match self.admission.admit(1).await {
+            Ok(permit) => permit,
+            // try again next time
+            Err(_) => return Ok(0),
+        };
+        let mut conn = db::get(&self.db).await?;
+        let (last_id, (firsts, lasts)) = {
+            let mut cursor = self.cursor.lock().unwrap();
+            cursor.expire(Instant::now());
+            (cursor.last(), cursor.gaps())
+        };
+        let mut rows = Vec::new();
+        if !firsts.is_empty() {
+            let statement = conn.prepare_cached(&gaps_query(&self.table)).await?;
+            rows = conn
+                .query(&statement, &[&firsts, &lasts, &self.settings.max_age])
+                .await?;
+        }
+        let statement = conn.prepare_cached(&feed_query(&self.table)).await?;
+        let new = conn
+            .query(
+                &statement,
+                &[&last_id, &self.settings.max_age, &self.settings.batch_size],
+            )
+            .await?;
+        let fetched = new.len() as i64;
+        rows.extend(new);
+
+        let now = Instant::now();
+        let mut cursor = self.cursor.lock().unwrap();
+        for row in &rows {
+            let id: i64 = row.get("id");
+            if !cursor.fetched(id, now) {
+                continue;
+            }
+            let event = Event {
+                timestamp: row.get("tstamp"),
+                doc: row.get("doc"),
+            };
+            // without clients, nobody misses these
+            let _ = self.sender.send(Arc::new(TailEvent::new(id, event)));
+            self.fed.fetch_add(1, Ordering::Relaxed);
+        }
+        Ok(fetched)
+    }
+}
+
+/// Matching events of a single client
+struct Subscription {
+    tail: Arc<Tail>,
+    events: broadcast::Receiver<Arc<TailEvent>>,
+    matcher: Matcher,
+}
+
+impl Subscription {
+    async fn next_event(mut self) -> Option<(Result<sse::Event, Infallible>, Self)> {
+        loop {
+            let event = match self.events.recv().await {
+                Ok(event) if event.matches(&self.matcher) => sse::Event::default()
+                    .id(event.id.to_string())
+                    .event("event")
+                    .data(&event.line),
+                Ok(_) => continue,
+                Err(broadcast::error::RecvError::Lagged(missed)) => {
+                    self.tail.dropped.fetch_add(missed, Ordering::Relaxed);
+                    sse::Event::default()
+                        .event("dropped")
+                        .data(missed.to_string())
+                }
+                Err(broadcast::error::RecvError::Closed) => return None,
+            };
+            return Some((Ok(event), self));
+        }
+    }
+}
+
+pub(crate) async fn handler(
+    tail: Arc<Tail>,
+    compiler: Arc<QueryCompiler>,
+    params: Request,
+) -> Result<impl warp::Reply, warp::Rejection> {
+    let matcher = compiler
+        .to_matcher(params.query.as_deref().unwrap_or("").trim())
+        .map_err(|_| warp::reject::custom(MalformedQuery))?;
+    let subscription = Subscription {
+        events: tail.subscribe(),
+        tail,
+        matcher,
+    };
+    let events = stream::unfold(subscription, Subscription::next_event);
+    Ok(sse::reply(sse::keep_alive().stream(events)))
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use logstuff_query::ExpressionParser;
+    use time::OffsetDateTime;
+
+    fn event(id: i64, doc: serde_json::Value) -> TailEvent {
+        TailEvent::new(
+            id,
+            Event {
+                timestamp: OffsetDateTime::UNIX_EPOCH,
+                doc,
+            },
+        )
+    }
+
+    #[test]
+    fn negated_query() {
+        let matcher = ExpressionParser::default()
+            .to_matcher(r#"not hostname = "web" and not port > 1024"#)
+            .unwrap();
+        let events = [
+            event(1, json!({"hostname": "db", "port": 22})),
+            event(2, json!({"hostname": "web", "port": 22})),
+            // unknown comparisons don't match, negated or not
+            event(3, json!({"port": 22})),
+            event(4, json!({"hostname": "db", "port": "ssh"})),
+            event(5, json!({"hostname": "db", "port": 8080})),
+        ];
+        let matching: Vec<_> = events
+            .iter()
+            .filter(|event| event.matches(&matcher))
+            .map(|event| event.id)
+            .collect();
+        assert_eq!(matching, [1]);
+    }
+}
@@ -2,31 +2,26 @@
 extern crate clap;
 
 use clap::{App, Arg};
+use postgres::fallible_iterator::FallibleIterator;
 use postgres::types::ToSql;
 use postgres_native_tls::MakeTlsConnector;
 use std::thread;
+use std::time::{Duration, Instant};
 use time::macros::format_description;
 
+use logstuff::cursor::{Cursor, DEFAULT_GAP_TIMEOUT};
 use logstuff::event::Event;
+use logstuff::notify::Notification;
 use logstuff::tls::TlsSettings;
 use logstuff_query::{ExpressionParser, QueryParams};
 
-fn max<T>(a: T, b: T) -> T
-where
-    T: PartialOrd,
-{
-    if a > b {
-        a
-    } else {
-        b
-    }
-}
-
 #[derive(Default, Debug)]
 struct Settings {
     max_age: String,
     max_lines: i64,
     poll_interval_ms: u64,
+    listen_channel: Option<String>,
+    listen_timeout_ms: u64,
     query_expr: String,
     query_params: QueryParams,
     fields: Vec<String>,
@@ -84,6 +79,25 @@ impl Settings {
                         Err(_) => Err("Not a positive integer".to_string()),
                     }),
             )
+            .arg(
+                Arg::new("listen")
+                    .long("listen")
+                    .value_name("CHANNEL")
+                    .help("Wait for stuffimport's notifications on this channel instead of polling (see stuffimport's \"notify\" setting)")
+                    .takes_value(true),
+            )
+            .arg(
+                Arg::new("listen_timeout_ms")
+                    .long("listen-timeout")
+                    .value_name("MSEC")
+                    .help("Poll anyway after waiting this long for a notification")
+                    .takes_value(true)
+                    .default_value("10000")
+                    .validator(|val| match val.parse::<usize>() {
+                        Ok(_) => Ok(()),
+                        Err(_) => Err("Not a positive integer".to_string()),
+                    }),
+            )
             .arg(
                 Arg::new("query")
                     .short('q')
@@ -148,6 +162,12 @@ impl Settings {
                 .unwrap_or("500")
                 .parse()
                 .unwrap(),
+            listen_channel: matches.value_of("listen").map(|e| e.to_string()),
+            listen_timeout_ms: matches
+                .value_of("listen_timeout_ms")
+                .unwrap_or("10000")
+                .parse()
+                .unwrap(),
             query_expr,
             query_params,
             fields,
@@ -160,16 +180,27 @@ impl Settings {
     }
 }
 
+/// Newest events looked at per poll, older ones are skipped
+const MAX_EVENTS_PER_POLL: i64 = 100_000;
+
+/// The query for new events and the one for events within gaps (see `logstuff::cursor`)
+///
+/// Both return all events and `doc` only for those matching the query (NULL for the others). The
+/// cursor needs every id, ids missing from a filtered result would be kept as gaps and queried
+/// again until they expire.
 fn prepare_query<'a>(
     client: &'_ mut postgres::Client,
     settings: &'a Settings,
-) -> (postgres::Statement, Vec<&'a (dyn ToSql + Sync)>) {
+) -> (
+    postgres::Statement,
+    postgres::Statement,
+    Vec<&'a (dyn ToSql + Sync)>,
+) {
     let next_param = settings.query_params.len() + 1;
     let query = format!(
         r#"
-        select id, tstamp, doc from logs
-        where {}
-        and id > ${}
+        select id, tstamp, case when {} then doc end as doc from logs
+        where id > ${}
         and tstamp > now() - cast(${}::varchar as interval)
         order by id desc
         limit ${}
@@ -186,8 +217,52 @@ fn prepare_query<'a>(
         .map(|e| e as &(dyn ToSql + Sync))
         .collect::<Vec<&(dyn ToSql + Sync)>>();
 
+    let gaps_query = format!(
+        r#"
+        select id, tstamp, case when {} then doc end as doc from logs
+        join unnest(${}::bigint[], ${}::bigint[]) as gap(first, last)
+        on id between gap.first and gap.last
+        where tstamp > now() - cast(${}::varchar as interval)
+        order by id
+        "#,
+        settings.query_expr,
+        next_param,
+        next_param + 1,
+        next_param + 2
+    );
+
     let stmt = client.prepare(query.as_str()).unwrap();
-    (stmt, our_params)
+    let gaps_stmt = client.prepare(gaps_query.as_str()).unwrap();
+    (stmt, gaps_stmt, our_params)
+}
+
+/// Block until a notification announces events newer than `cursor` or some within its gaps, or
+/// `timeout` passed
+///
+/// Notifications that arrived meanwhile are consumed as well, the next query fetches all of their
+/// events.
+fn wait_for_events(client: &mut postgres::Client, cursor: &Cursor, timeout: Duration) {
+    let deadline = Instant::now() + timeout;
+    loop {
+        let remaining = deadline.saturating_duration_since(Instant::now());
+        if remaining.is_zero() {
+            return;
+        }
+        let mut notifications = client.notifications();
+        let notification = match notifications.timeout_iter(remaining).next().unwrap() {
+            Some(notification) => notification,
+            None => return,
+        };
+        let news = serde_json::from_str::<Notification>(notification.payload())
+            .map_or(true, |announced| {
+                announced.max_id > cursor.last() || cursor.has_gaps()
+            });
+        if news {
+            let mut pending = notifications.iter();
+            while pending.next().unwrap().is_some() {}
+            return;
+        }
+    }
 }
 
 fn main() {
@@ -196,28 +271,64 @@ fn main() {
     let connector = MakeTlsConnector::new(settings.tls.connector().unwrap());
     let mut client = postgres::Client::connect(&settings.db_config, connector).unwrap();
 
-    let (stmt, our_params) = prepare_query(&mut client, &settings);
-    let mut last_id = 0;
+    let (stmt, gaps_stmt, our_params) = prepare_query(&mut client, &settings);
+    if let Some(channel) = &settings.listen_channel {
+        client
+            .batch_execute(format!("listen {}", channel).as_str())
+            .unwrap();
+    }
+    let mut cursor = Cursor::new(DEFAULT_GAP_TIMEOUT);
     loop {
+        cursor.expire(Instant::now());
+        let mut rows = Vec::new();
+        if cursor.has_gaps() {
+            let (firsts, lasts) = cursor.gaps();
+            let mut query_params = our_params[..].to_vec();
+            query_params.push(&firsts);
+            query_params.push(&lasts);
+            query_params.push(&settings.max_age);
+            rows = client.query(&gaps_stmt, &query_params).unwrap();
+        }
+        let last_id = i32::try_from(cursor.last()).unwrap();
         let mut query_params = our_params[..].to_vec();
         query_params.push(&last_id);
         query_params.push(&settings.max_age);
-        query_params.push(&settings.max_lines);
-        client
-            .query(&stmt, &query_params)
-            .unwrap()
-            .iter()
-            .rev()
-            .for_each(|row| {
-                let event = Event {
+        query_params.push(&MAX_EVENTS_PER_POLL);
+        let newest = client.query(&stmt, &query_params).unwrap();
+        // a full page dropped the older events, they are no gaps to print later
+        if newest.len() as i64 == MAX_EVENTS_PER_POLL {
+            if let Some(oldest) = newest.last() {
+                cursor.skip_to(i64::from(oldest.get::<_, i32>("id")) - 1);
+            }
+        }
+        rows.extend(newest.into_iter().rev());
+
+        let now = Instant::now();
+        let mut matching = Vec::new();
+        for row in rows {
+            let id: i32 = row.get("id");
+            // events not matching the query come without their document
+            let doc: Option<serde_json::Value> = row.get("doc");
+            if let (true, Some(doc)) = (cursor.fetched(i64::from(id), now), doc) {
+                matching.push(Event {
                     timestamp: row.get("tstamp"),
-                    doc: row.get("doc"),
-                };
-                print_event(event, &settings);
-                let id: i32 = row.get("id");
-                last_id = max(last_id, id);
-            });
-        thread::sleep(std::time::Duration::from_millis(settings.poll_interval_ms));
+                    doc,
+                });
+            }
+        }
+        // only the newest lines, the older ones are dropped
+        let dropped = matching.len().saturating_sub(settings.max_lines as usize);
+        for event in matching.into_iter().skip(dropped) {
+            print_event(event, &settings);
+        }
+        match settings.listen_channel {
+            Some(_) => wait_for_events(
+                &mut client,
+                &cursor,
+                Duration::from_millis(settings.listen_timeout_ms),
+            ),
+            None => thread::sleep(Duration::from_millis(settings.poll_interval_ms)),
+        }
     }
 }
 